@@ -0,0 +1,61 @@
+//
+//  NTJsonBenchmark.h
+//  NTJsonStoreBenchmark
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "NTJsonStore.h"
+
+
+/// Runs a repeatable set of benchmarks against synthetic collections. Documents are generated from a seeded random number
+/// generator, so two runs with the same settings write exactly the same data.
+@interface NTJsonBenchmark : NSObject
+
+/// Directory the benchmark stores are created in. Stores are deleted before each use. Default: a temporary directory.
+@property (nonatomic) NSString *path;
+
+/// Number of documents in each generated collection. Default: 10000.
+@property (nonatomic) int documentCount;
+
+/// Number of documents written one at a time by the insert and update benchmarks. Default: 1000.
+@property (nonatomic) int writeCount;
+
+/// Number of top-level fields in each document, in addition to the fixed fields used by the queries. Default: 10.
+@property (nonatomic) int fieldCount;
+
+/// Depth of the nested objects in each document. 0 for flat documents. Default: 2.
+@property (nonatomic) int nestingDepth;
+
+/// Length of generated string values. Default: 16.
+@property (nonatomic) int stringLength;
+
+/// Number of times each benchmark is repeated. Results report the min, median and max of all iterations. Default: 5.
+@property (nonatomic) int iterations;
+
+/// Seed for the document generator. Default: 1.
+@property (nonatomic) uint64_t seed;
+
+/// Document format of the generated collections. Default: NTJsonDocumentFormatText.
+@property (nonatomic) NTJsonDocumentFormat documentFormat;
+
+/// Names of the benchmarks to run, nil for all of them. See +benchmarkNames.
+@property (nonatomic) NSArray *benchmarkNames;
+
+/// The name of every available benchmark, in the order they are run.
++(NSArray *)benchmarkNames;
+
+/// Runs the benchmarks and returns the results as a JSON compatible dictionary with "config", "platform" and "results" keys.
+/// Each result includes iterations, operations, min, median and max (seconds per iteration) and opsPerSecond (based on the
+/// median.) Must not be called on the main queue, materialization progress is reported there.
+-(NSDictionary *)run;
+
+/// Compares results with a baseline produced by a previous run. Returns a dictionary with "comparison" (the change in median
+/// time for each benchmark, 0.1 is 10% slower), "regressions" (names of benchmarks that are slower by more than tolerance) and
+/// "missing" (names of benchmarks that ran but aren't in the baseline, so they can't be compared.)
++(NSDictionary *)compareResults:(NSDictionary *)results withBaseline:(NSDictionary *)baseline tolerance:(double)tolerance;
+
+@end
@@ -0,0 +1,704 @@
+//
+//  NTJsonBenchmark.m
+//  NTJsonStoreBenchmark
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import <time.h>
+
+#import "NTJsonBenchmark.h"
+#import "NTJsonCollection.h"
+
+
+static const int CATEGORY_COUNT = 10;
+
+
+static double NTJsonBenchmark_now()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1.0e9;
+}
+
+
+@interface NTJsonBenchmark ()
+{
+    uint64_t _randomState;
+    NSArray *_documents;
+    int _storeCount;
+}
+
+@end
+
+
+@implementation NTJsonBenchmark
+
+
++(NSArray *)benchmarkNames
+{
+    return @[@"storeOpen", @"insert", @"insertGroupCommit", @"insertBatch", @"bulkInsert", @"update", @"findWhereCold", @"findWhereWarm", @"countWhere", @"removeWhere", @"materialization", @"readScaling"];
+}
+
+
+-(id)init
+{
+    self = [super init];
+    
+    if ( self )
+    {
+        _path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"NTJsonStoreBenchmark"];
+        _documentCount = 10000;
+        _writeCount = 1000;
+        _fieldCount = 10;
+        _nestingDepth = 2;
+        _stringLength = 16;
+        _iterations = 5;
+        _seed = 1;
+        _documentFormat = NTJsonDocumentFormatText;
+    }
+    
+    return self;
+}
+
+
+#pragma mark - document generation
+
+
+-(uint64_t)nextRandom
+{
+    // xorshift64* - we need the same sequence on every platform, so no arc4random or rand()...
+    
+    _randomState ^= _randomState >> 12;
+    _randomState ^= _randomState << 25;
+    _randomState ^= _randomState >> 27;
+    
+    return _randomState * 2685821657736338717ULL;
+}
+
+
+-(int)randomIntWithLimit:(int)limit
+{
+    return (int)([self nextRandom] % (uint64_t)limit);
+}
+
+
+-(NSString *)randomString
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    
+    NSMutableString *string = [NSMutableString stringWithCapacity:self.stringLength];
+    
+    for(int index=0; index<self.stringLength; index++)
+        [string appendFormat:@"%c", chars[[self randomIntWithLimit:(int)sizeof(chars)-1]]];
+    
+    return string;
+}
+
+
+-(id)randomValueForField:(int)field
+{
+    switch(field % 4)
+    {
+        case 0: return @([self randomIntWithLimit:1000000]);
+        case 1: return @((double)[self randomIntWithLimit:1000000] / 100.0);
+        case 2: return @([self randomIntWithLimit:2] == 1);
+        default: return [self randomString];
+    }
+}
+
+
+-(NSDictionary *)randomObjectWithDepth:(int)depth
+{
+    NSMutableDictionary *object = [NSMutableDictionary dictionary];
+    int fieldCount = (depth == self.nestingDepth) ? self.fieldCount : MAX(self.fieldCount / 2, 1);
+    
+    for(int field=0; field<fieldCount; field++)
+        object[[NSString stringWithFormat:@"f%d", field]] = [self randomValueForField:field];
+    
+    if ( depth > 0 )
+        object[@"detail"] = [self randomObjectWithDepth:depth-1];
+    
+    return object;
+}
+
+
+-(NSDictionary *)documentWithUid:(int)uid
+{
+    NSMutableDictionary *document = [NSMutableDictionary dictionaryWithDictionary:[self randomObjectWithDepth:self.nestingDepth]];
+    
+    document[@"uid"] = @(uid);
+    document[@"category"] = @([self randomIntWithLimit:CATEGORY_COUNT]);
+    document[@"score"] = @([self randomIntWithLimit:1000]);
+    document[@"extra"] = @([self randomIntWithLimit:1000]);
+    document[@"name"] = [self randomString];
+    document[@"tags"] = @[[self randomString], [self randomString], [self randomString]];
+    
+    return document;
+}
+
+
+-(NSArray *)documents
+{
+    if ( !_documents )
+    {
+        _randomState = (self.seed) ? self.seed : 1;
+        
+        NSMutableArray *documents = [NSMutableArray arrayWithCapacity:self.documentCount];
+        
+        for(int uid=1; uid<=self.documentCount; uid++)
+            [documents addObject:[self documentWithUid:uid]];
+        
+        _documents = [documents copy];
+    }
+    
+    return _documents;
+}
+
+
+#pragma mark - helpers
+
+
+-(NTJsonStore *)openStoreWithName:(NSString *)name
+{
+    return [[NTJsonStore alloc] initWithPath:self.path name:[NSString stringWithFormat:@"%@.db", name]];
+}
+
+
+-(NTJsonStore *)createStore
+{
+    NTJsonStore *store = [self openStoreWithName:[NSString stringWithFormat:@"benchmark-%d", ++_storeCount]];
+    
+    for(NSString *suffix in @[@"", @"-wal", @"-shm"])
+        [[NSFileManager defaultManager] removeItemAtPath:[store.storeFilename stringByAppendingString:suffix] error:nil];
+    
+    return store;
+}
+
+
+-(NTJsonCollection *)createCollectionInStore:(NTJsonStore *)store populate:(BOOL)populate
+{
+    NTJsonCollection *collection = [store collectionWithName:@"documents"];
+    
+    collection.documentFormat = self.documentFormat;
+    
+    // fields used by the queries are added while the collection is empty so they are never materialized...
+    
+    [collection addQueryableFields:@"[uid],[category],[score]"];
+    
+    if ( populate )
+    {
+        [collection insertBatch:self.documents];
+        [collection sync];
+    }
+    
+    return collection;
+}
+
+
+-(void)removeStore:(NTJsonStore *)store
+{
+    NSString *filename = store.storeFilename;
+    
+    [store close];
+    
+    for(NSString *suffix in @[@"", @"-wal", @"-shm"])
+        [[NSFileManager defaultManager] removeItemAtPath:[filename stringByAppendingString:suffix] error:nil];
+}
+
+
+-(NSDictionary *)measureWithOperations:(int)operations block:(double (^)(int iteration))block
+{
+    NSMutableArray *times = [NSMutableArray arrayWithCapacity:self.iterations];
+    
+    for(int iteration=0; iteration<self.iterations; iteration++)
+    {
+        @autoreleasepool
+        {
+            [times addObject:@(block(iteration))];
+        }
+    }
+    
+    [times sortUsingSelector:@selector(compare:)];
+    
+    double median = [times[times.count / 2] doubleValue];
+    
+    if ( times.count % 2 == 0 )
+        median = (median + [times[times.count / 2 - 1] doubleValue]) / 2.0;
+    
+    return @{
+             @"iterations": @(times.count),
+             @"operations": @(operations),
+             @"min": times.firstObject,
+             @"median": @(median),
+             @"max": times.lastObject,
+             @"opsPerSecond": @((median > 0) ? operations / median : 0),
+             };
+}
+
+
+#pragma mark - benchmarks
+
+
+-(NSDictionary *)benchmark_storeOpen
+{
+    NTJsonStore *store = [self createStore];
+    NSString *name = [store.storeName stringByDeletingPathExtension];
+    
+    [self createCollectionInStore:store populate:YES];
+    [store close];
+    
+    NSDictionary *result = [self measureWithOperations:1 block:^double(int iteration) {
+        double startedAt = NTJsonBenchmark_now();
+        
+        NTJsonStore *openedStore = [self openStoreWithName:name];
+        [[openedStore collectionWithName:@"documents"] count];
+        
+        double time = NTJsonBenchmark_now() - startedAt;
+        
+        [openedStore close];
+        
+        return time;
+    }];
+    
+    [self removeStore:[self openStoreWithName:name]];
+    
+    return result;
+}
+
+
+-(NSDictionary *)benchmark_insert
+{
+    int count = MIN(self.writeCount, self.documentCount);
+    
+    return [self measureWithOperations:count block:^double(int iteration) {
+        NTJsonStore *store = [self createStore];
+        NTJsonCollection *collection = [self createCollectionInStore:store populate:NO];
+        [collection count];  // make sure the schema is ready
+        
+        double startedAt = NTJsonBenchmark_now();
+        
+        for(int index=0; index<count; index++)
+            [collection insert:self.documents[index]];
+        
+        double time = NTJsonBenchmark_now() - startedAt;
+        
+        [self removeStore:store];
+        
+        return time;
+    }];
+}
+
+
+-(NSDictionary *)benchmark_insertGroupCommit
+{
+    // the same writes as insert, made asynchronously so they share commits...
+    
+    int count = MIN(self.writeCount, self.documentCount);
+    
+    return [self measureWithOperations:count block:^double(int iteration) {
+        NTJsonStore *store = [self createStore];
+        store.groupCommitInterval = 0.01;
+        NTJsonCollection *collection = [self createCollectionInStore:store populate:NO];
+        [collection count];
+        
+        double startedAt = NTJsonBenchmark_now();
+        
+        for(int index=0; index<count; index++)
+            [collection beginInsert:self.documents[index] completionHandler:^(NTJsonRowId rowid, NSError *error) { }];
+        
+        [collection sync];
+        
+        double time = NTJsonBenchmark_now() - startedAt;
+        
+        [self removeStore:store];
+        
+        return time;
+    }];
+}
+
+
+-(NSDictionary *)benchmark_insertBatch
+{
+    return [self measureWithOperations:self.documentCount block:^double(int iteration) {
+        NTJsonStore *store = [self createStore];
+        NTJsonCollection *collection = [self createCollectionInStore:store populate:NO];
+        [collection count];
+        
+        double startedAt = NTJsonBenchmark_now();
+        
+        [collection insertBatch:self.documents];
+        
+        double time = NTJsonBenchmark_now() - startedAt;
+        
+        [self removeStore:store];
+        
+        return time;
+    }];
+}
+
+
+-(NSDictionary *)benchmark_bulkInsert
+{
+    // bulkInsert against inserting the same documents one at a time in a single transaction, which is what insertBatch used to
+    // do. "speedup" is the ratio of the two...
+    
+    NSDictionary *(^measureInsert)(BOOL) = ^NSDictionary *(BOOL bulk) {
+        return [self measureWithOperations:self.documentCount block:^double(int iteration) {
+            NTJsonStore *store = [self createStore];
+            NTJsonCollection *collection = [self createCollectionInStore:store populate:NO];
+            [collection count];
+            
+            double startedAt = NTJsonBenchmark_now();
+            
+            if ( bulk )
+                [collection bulkInsert:self.documents];
+            
+            else
+            {
+                [store performTransaction:^BOOL{
+                    for(NSDictionary *document in self.documents)
+                        [collection insert:document];
+                    
+                    return YES;
+                }];
+            }
+            
+            double time = NTJsonBenchmark_now() - startedAt;
+            
+            [self removeStore:store];
+            
+            return time;
+        }];
+    };
+    
+    NSDictionary *rowResult = measureInsert(NO);
+    NSMutableDictionary *result = [measureInsert(YES) mutableCopy];
+    double rowOpsPerSecond = [rowResult[@"opsPerSecond"] doubleValue];
+    
+    result[@"rowInsertOpsPerSecond"] = @(rowOpsPerSecond);
+    result[@"speedup"] = @((rowOpsPerSecond > 0) ? [result[@"opsPerSecond"] doubleValue] / rowOpsPerSecond : 0);
+    
+    return result;
+}
+
+
+-(NSDictionary *)benchmark_update
+{
+    NTJsonStore *store = [self createStore];
+    NTJsonCollection *collection = [self createCollectionInStore:store populate:YES];
+    int count = MIN(self.writeCount, self.documentCount);
+    
+    NSDictionary *result = [self measureWithOperations:count block:^double(int iteration) {
+        NSArray *items = [collection findWhere:@"[uid] <= ?" args:@[@(count)] orderBy:@"[uid]"];
+        NSMutableArray *updates = [NSMutableArray arrayWithCapacity:items.count];
+        
+        for(NSDictionary *item in items)
+        {
+            NSMutableDictionary *update = [item mutableCopy];
+            update[@"score"] = @(([item[@"score"] intValue] + 1) % 1000);
+            [updates addObject:update];
+        }
+        
+        double startedAt = NTJsonBenchmark_now();
+        
+        for(NSDictionary *update in updates)
+            [collection update:update];
+        
+        return NTJsonBenchmark_now() - startedAt;
+    }];
+    
+    [self removeStore:store];
+    
+    return result;
+}
+
+
+-(NSDictionary *)benchmark_findWhereWithWarmCache:(BOOL)warmCache
+{
+    NTJsonStore *store = [self createStore];
+    NTJsonCollection *collection = [self createCollectionInStore:store populate:YES];
+    
+    NSDictionary *result = [self measureWithOperations:1 block:^double(int iteration) {
+        NSArray *args = @[@(iteration % CATEGORY_COUNT)];
+        NSArray *warmItems = nil;
+        
+        [collection flushCache];
+        
+        if ( warmCache )
+            warmItems = [collection findWhere:@"[category] = ?" args:args orderBy:nil];  // hold on to the items so they stay cached
+        
+        double startedAt = NTJsonBenchmark_now();
+        
+        NSArray *items = [collection findWhere:@"[category] = ?" args:args orderBy:nil];
+        
+        double time = NTJsonBenchmark_now() - startedAt;
+        
+        items = nil;
+        warmItems = nil;
+        
+        return time;
+    }];
+    
+    [self removeStore:store];
+    
+    return result;
+}
+
+
+-(NSDictionary *)benchmark_findWhereCold
+{
+    return [self benchmark_findWhereWithWarmCache:NO];
+}
+
+
+-(NSDictionary *)benchmark_findWhereWarm
+{
+    return [self benchmark_findWhereWithWarmCache:YES];
+}
+
+
+-(NSDictionary *)benchmark_countWhere
+{
+    static const int COUNTS_PER_ITERATION = 10;
+    
+    NTJsonStore *store = [self createStore];
+    NTJsonCollection *collection = [self createCollectionInStore:store populate:YES];
+    
+    NSDictionary *result = [self measureWithOperations:COUNTS_PER_ITERATION block:^double(int iteration) {
+        double startedAt = NTJsonBenchmark_now();
+        
+        for(int index=0; index<COUNTS_PER_ITERATION; index++)
+            [collection countWhere:@"[score] > ?" args:@[@(index * 100)]];
+        
+        return NTJsonBenchmark_now() - startedAt;
+    }];
+    
+    [self removeStore:store];
+    
+    return result;
+}
+
+
+-(NSDictionary *)benchmark_removeWhere
+{
+    return [self measureWithOperations:1 block:^double(int iteration) {
+        NTJsonStore *store = [self createStore];
+        NTJsonCollection *collection = [self createCollectionInStore:store populate:YES];
+        
+        double startedAt = NTJsonBenchmark_now();
+        
+        [collection removeWhere:@"[category] = ?" args:@[@0]];
+        
+        double time = NTJsonBenchmark_now() - startedAt;
+        
+        [self removeStore:store];
+        
+        return time;
+    }];
+}
+
+
+-(NSDictionary *)benchmark_materialization
+{
+    return [self measureWithOperations:self.documentCount block:^double(int iteration) {
+        NTJsonStore *store = [self createStore];
+        NTJsonCollection *collection = [self createCollectionInStore:store populate:YES];
+        dispatch_semaphore_t finished = dispatch_semaphore_create(0);
+        
+        collection.materializationProgressHandler = ^(NSArray *columnNames, float progress) {
+            if ( progress >= 1.0 )
+                dispatch_semaphore_signal(finished);
+        };
+        
+        double startedAt = NTJsonBenchmark_now();
+        
+        [collection addQueryableFields:@"[extra]"];
+        
+        dispatch_semaphore_wait(finished, DISPATCH_TIME_FOREVER);
+        
+        double time = NTJsonBenchmark_now() - startedAt;
+        
+        collection.materializationProgressHandler = nil;
+        [self removeStore:store];
+        
+        return time;
+    }];
+}
+
+
+-(NSDictionary *)benchmark_readScaling
+{
+    // The same finds from 1, 2, 4 and 8 threads, with a read connection for each. The result is the 8 thread run, "scaling"
+    // is the throughput of each thread count relative to a single thread...
+    
+    static const int MAX_THREADS = 8;
+    static const int FINDS_PER_THREAD = 10;
+    
+    NTJsonStore *store = [self createStore];
+    store.readConnectionCount = MAX_THREADS;
+    NTJsonCollection *collection = [self createCollectionInStore:store populate:YES];
+    
+    NSMutableDictionary *scaling = [NSMutableDictionary dictionary];
+    NSDictionary *result = nil;
+    double singleThreadOpsPerSecond = 0;
+    
+    for(int threadCount=1; threadCount<=MAX_THREADS; threadCount*=2)
+    {
+        result = [self measureWithOperations:threadCount * FINDS_PER_THREAD block:^double(int iteration) {
+            [collection flushCache];
+            
+            double startedAt = NTJsonBenchmark_now();
+            
+            dispatch_apply(threadCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t thread) {
+                for(int index=0; index<FINDS_PER_THREAD; index++)
+                {
+                    @autoreleasepool
+                    {
+                        [collection findWhere:@"[category] = ?" args:@[@((thread + index) % CATEGORY_COUNT)] orderBy:nil];
+                    }
+                }
+            });
+            
+            return NTJsonBenchmark_now() - startedAt;
+        }];
+        
+        double opsPerSecond = [result[@"opsPerSecond"] doubleValue];
+        
+        if ( threadCount == 1 )
+            singleThreadOpsPerSecond = opsPerSecond;
+        
+        scaling[[NSString stringWithFormat:@"%d", threadCount]] = @((singleThreadOpsPerSecond > 0) ? opsPerSecond / singleThreadOpsPerSecond : 0);
+    }
+    
+    [self removeStore:store];
+    
+    NSMutableDictionary *scaledResult = [result mutableCopy];
+    
+    scaledResult[@"scaling"] = scaling;
+    
+    return scaledResult;
+}
+
+
+
+#pragma mark - run
+
+
+-(NSDictionary *)config
+{
+    return @{
+             @"documentCount": @(self.documentCount),
+             @"writeCount": @(self.writeCount),
+             @"fieldCount": @(self.fieldCount),
+             @"nestingDepth": @(self.nestingDepth),
+             @"stringLength": @(self.stringLength),
+             @"iterations": @(self.iterations),
+             @"seed": @(self.seed),
+             @"documentFormat": (self.documentFormat == NTJsonDocumentFormatBinary) ? @"binary" : @"text",
+             };
+}
+
+
+-(NSDictionary *)platform
+{
+    NSProcessInfo *processInfo = [NSProcessInfo processInfo];
+    
+    return @{
+             @"operatingSystem": processInfo.operatingSystemVersionString ?: @"",
+             @"processorCount": @(processInfo.activeProcessorCount),
+             };
+}
+
+
+-(NSDictionary *)run
+{
+    [[NSFileManager defaultManager] createDirectoryAtPath:self.path withIntermediateDirectories:YES attributes:nil error:nil];
+    
+    [self documents];   // generate them up front so it's not part of any timing
+    
+    NSMutableDictionary *results = [NSMutableDictionary dictionary];
+    
+    for(NSString *name in [self.class benchmarkNames])
+    {
+        if ( self.benchmarkNames && ![self.benchmarkNames containsObject:name] )
+            continue;
+        
+        NSLog(@"Running %@...", name);
+        
+        SEL selector = NSSelectorFromString([NSString stringWithFormat:@"benchmark_%@", name]);
+        NSDictionary *(*benchmark)(id, SEL) = (void *)[self methodForSelector:selector];
+        
+        @autoreleasepool
+        {
+            NSDictionary *result = benchmark(self, selector);
+            
+            NSLog(@"  %@: median %.4fs, %.0f ops/sec", name, [result[@"median"] doubleValue], [result[@"opsPerSecond"] doubleValue]);
+            
+            results[name] = result;
+        }
+    }
+    
+    NSDateFormatter *dateFormatter = [[NSDateFormatter alloc] init];
+    
+    dateFormatter.locale = [[NSLocale alloc] initWithLocaleIdentifier:@"en_US_POSIX"];
+    dateFormatter.dateFormat = @"yyyy-MM-dd'T'HH:mm:ssZ";
+    
+    return @{
+             @"version": @1,
+             @"date": [dateFormatter stringFromDate:[NSDate date]],
+             @"config": [self config],
+             @"platform": [self platform],
+             @"results": results,
+             };
+}
+
+
++(NSDictionary *)compareResults:(NSDictionary *)results withBaseline:(NSDictionary *)baseline tolerance:(double)tolerance
+{
+    NSMutableDictionary *comparison = [NSMutableDictionary dictionary];
+    NSMutableArray *regressions = [NSMutableArray array];
+    NSMutableArray *missing = [NSMutableArray array];
+    
+    if ( ![baseline[@"config"] isEqual:results[@"config"]] )
+        NSLog(@"Warning: baseline was recorded with a different config, comparison may not be meaningful.");
+    
+    for(NSString *name in [self benchmarkNames])
+    {
+        double median = [results[@"results"][name][@"median"] doubleValue];
+        double baselineMedian = [baseline[@"results"][name][@"median"] doubleValue];
+        
+        if ( median <= 0 )
+            continue;   // not run this time
+        
+        if ( baselineMedian <= 0 )
+        {
+            [missing addObject:name];   // added since the baseline was recorded (or it wasn't run then)
+            continue;
+        }
+        
+        double change = median / baselineMedian - 1.0;
+        
+        comparison[name] = @{
+                             @"baseline": @(baselineMedian),
+                             @"median": @(median),
+                             @"change": @(change),
+                             };
+        
+        if ( change > tolerance )
+            [regressions addObject:name];
+    }
+    
+    return @{
+             @"tolerance": @(tolerance),
+             @"comparison": comparison,
+             @"regressions": regressions,
+             @"missing": missing,
+             };
+}
+
+
+@end
@@ -0,0 +1,202 @@
+//
+//  main.m
+//  NTJsonStoreBenchmark
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "NTJsonBenchmark.h"
+
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: ntjsonstore-bench [options]\n"
+            "  --documents N     documents per collection (default 10000)\n"
+            "  --writes N        documents written one at a time by insert and update (default 1000)\n"
+            "  --fields N        top-level fields per document (default 10)\n"
+            "  --depth N         nesting depth of each document (default 2)\n"
+            "  --strings N       length of string values (default 16)\n"
+            "  --iterations N    times each benchmark is repeated (default 5)\n"
+            "  --seed N          document generator seed (default 1)\n"
+            "  --format F        document format, text or binary (default text)\n"
+            "  --only A,B,...    benchmarks to run (%s)\n"
+            "  --path DIR        directory for the benchmark stores (default: temporary directory)\n"
+            "  --output FILE     write the JSON results to FILE instead of stdout\n"
+            "  --baseline FILE   compare with the results of a previous run, exits with 1 on a regression\n"
+            "  --tolerance T     allowed slowdown before a benchmark is a regression (default 0.10)\n",
+            [[[NTJsonBenchmark benchmarkNames] componentsJoinedByString:@", "] UTF8String]);
+}
+
+
+static int run(NSArray *arguments)
+{
+    NTJsonBenchmark *benchmark = [[NTJsonBenchmark alloc] init];
+    NSString *outputFilename = nil;
+    NSString *baselineFilename = nil;
+    double tolerance = 0.10;
+    
+    for(NSUInteger index=1; index<arguments.count; index++)
+    {
+        NSString *option = arguments[index];
+        
+        if ( [option isEqualToString:@"--help"] )
+        {
+            usage();
+            return 0;
+        }
+        
+        if ( index + 1 >= arguments.count )
+        {
+            usage();
+            return 2;
+        }
+        
+        NSString *value = arguments[++index];
+        
+        if ( [option isEqualToString:@"--documents"] )
+            benchmark.documentCount = MAX([value intValue], 1);
+        
+        else if ( [option isEqualToString:@"--writes"] )
+            benchmark.writeCount = MAX([value intValue], 1);
+        
+        else if ( [option isEqualToString:@"--fields"] )
+            benchmark.fieldCount = MAX([value intValue], 0);
+        
+        else if ( [option isEqualToString:@"--depth"] )
+            benchmark.nestingDepth = MAX([value intValue], 0);
+        
+        else if ( [option isEqualToString:@"--strings"] )
+            benchmark.stringLength = MAX([value intValue], 1);
+        
+        else if ( [option isEqualToString:@"--iterations"] )
+            benchmark.iterations = MAX([value intValue], 1);
+        
+        else if ( [option isEqualToString:@"--seed"] )
+            benchmark.seed = (uint64_t)[value longLongValue];
+        
+        else if ( [option isEqualToString:@"--format"] && [value isEqualToString:@"text"] )
+            benchmark.documentFormat = NTJsonDocumentFormatText;
+        
+        else if ( [option isEqualToString:@"--format"] && [value isEqualToString:@"binary"] )
+            benchmark.documentFormat = NTJsonDocumentFormatBinary;
+        
+        else if ( [option isEqualToString:@"--only"] )
+        {
+            benchmark.benchmarkNames = [value componentsSeparatedByString:@","];
+            
+            for(NSString *name in benchmark.benchmarkNames)
+            {
+                if ( ![[NTJsonBenchmark benchmarkNames] containsObject:name] )
+                {
+                    fprintf(stderr, "Unknown benchmark: %s\n", [name UTF8String]);
+                    return 2;
+                }
+            }
+        }
+        
+        else if ( [option isEqualToString:@"--path"] )
+            benchmark.path = value;
+        
+        else if ( [option isEqualToString:@"--output"] )
+            outputFilename = value;
+        
+        else if ( [option isEqualToString:@"--baseline"] )
+            baselineFilename = value;
+        
+        else if ( [option isEqualToString:@"--tolerance"] )
+            tolerance = [value doubleValue];
+        
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+    
+    NSDictionary *baseline = nil;
+    
+    if ( baselineFilename )
+    {
+        NSData *baselineData = [NSData dataWithContentsOfFile:baselineFilename];
+        
+        baseline = (baselineData) ? [NSJSONSerialization JSONObjectWithData:baselineData options:0 error:nil] : nil;
+        
+        if ( ![baseline isKindOfClass:[NSDictionary class]] )
+        {
+            fprintf(stderr, "Unable to read baseline: %s\n", [baselineFilename UTF8String]);
+            return 2;
+        }
+    }
+    
+    NSMutableDictionary *results = [[benchmark run] mutableCopy];
+    NSArray *regressions = nil;
+    
+    if ( baseline )
+    {
+        NSDictionary *comparison = [NTJsonBenchmark compareResults:results withBaseline:baseline tolerance:tolerance];
+        
+        results[@"baseline"] = comparison;
+        regressions = comparison[@"regressions"];
+        
+        for(NSString *name in comparison[@"missing"])
+            NSLog(@"Warning: %@ is not in the baseline, it was not compared", name);
+        
+        for(NSString *name in regressions)
+            NSLog(@"Regression: %@ is %.1f%% slower than the baseline", name, [comparison[@"comparison"][name][@"change"] doubleValue] * 100.0);
+    }
+    
+    NSError *error;
+    NSData *json = [NSJSONSerialization dataWithJSONObject:results options:NSJSONWritingPrettyPrinted error:&error];
+    
+    if ( !json )
+    {
+        fprintf(stderr, "Unable to serialize results: %s\n", [error.localizedDescription UTF8String]);
+        return 2;
+    }
+    
+    if ( outputFilename )
+    {
+        if ( ![json writeToFile:outputFilename atomically:YES] )
+        {
+            fprintf(stderr, "Unable to write results: %s\n", [outputFilename UTF8String]);
+            return 2;
+        }
+    }
+    
+    else
+    {
+        fwrite(json.bytes, 1, json.length, stdout);
+        fputc('\n', stdout);
+        fflush(stdout);
+    }
+    
+    return (regressions.count) ? 1 : 0;
+}
+
+
+int main(int argc, const char * argv[])
+{
+    @autoreleasepool
+    {
+        NSArray *arguments = [[NSProcessInfo processInfo] arguments];
+        
+        // The benchmarks run in the background so the main queue is free to deliver materialization progress...
+        
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            int status;
+            
+            @autoreleasepool
+            {
+                status = run(arguments);
+            }
+            
+            exit(status);
+        });
+    }
+    
+    dispatch_main();
+}
@@ -11,5 +11,6 @@
 @interface NSDictionary (NTJsonStorePrivate)
 
 -(id)NTJsonStore_objectForKeyPath:(NSString *)keyPath;
+-(NSDictionary *)NTJsonStore_dictionaryWithPatch:(NSDictionary *)patch;   // JSON merge patch, NSNull removes a key
 
 @end
@@ -39,4 +39,33 @@
 }
 
 
+-(NSDictionary *)NTJsonStore_dictionaryWithPatch:(NSDictionary *)patch
+{
+    // This is a JSON merge patch (RFC 7396, the same as SQLITE's json_patch): NSNull removes a key, dictionaries are
+    // merged recursively and any other value replaces what was there...
+    
+    NSMutableDictionary *result = [self mutableCopy];
+    
+    for(NSString *key in patch)
+    {
+        id value = patch[key];
+        
+        if ( value == [NSNull null] )
+            [result removeObjectForKey:key];
+        
+        else if ( [value isKindOfClass:[NSDictionary class]] )
+        {
+            NSDictionary *existing = ([result[key] isKindOfClass:[NSDictionary class]]) ? result[key] : @{};
+            
+            result[key] = [existing NTJsonStore_dictionaryWithPatch:value];  // recursive
+        }
+        
+        else
+            result[key] = value;
+    }
+    
+    return [result copy];
+}
+
+
 @end
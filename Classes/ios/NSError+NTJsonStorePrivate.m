@@ -26,6 +26,15 @@ static NSString *descriptionForCode(NTJsonStoreErrorCode code)
         case NTJsonStoreErrorInvalidSqlResult:
             return @"Unexpected sqlite result type.";
             
+        case NTJsonStoreErrorInvalidDocumentFormat:
+            return @"Invalid document format.";
+            
+        case NTJsonStoreErrorInvalidTransaction:
+            return @"Transactions cannot be started from a collection or store queue.";
+            
+        case NTJsonStoreErrorNotFound:
+            return @"Item not found.";
+            
         default:
             return [NSString stringWithFormat:@"NTJsonStore Error %d", (int)code];
     }
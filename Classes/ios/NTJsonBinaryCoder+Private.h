@@ -0,0 +1,42 @@
+//
+//  NTJsonBinaryCoder+Private.h
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+@class NTJsonKeyDictionary;
+
+
+/// Encodes and decodes the compact binary document format. Documents start with a 4 byte header: 0x00 'N' 'J' <version>. Text JSON
+/// can never start with a 0x00, so both formats may live in the same table. Each value is a one byte tag followed by its data:
+///
+///     null, false, true       no data
+///     integer                 zigzag varint
+///     double                  8 bytes, little endian
+///     string                  varint byte length + UTF-8
+///     array                   uint32 byte length + varint count + values
+///     object                  uint32 byte length + varint count + (varint key id + value) pairs
+///
+/// Object keys are ids into the collection's NTJsonKeyDictionary. Since strings and containers are length-prefixed, readers can
+/// skip anything they aren't interested in without decoding it. All methods are thread safe.
+@interface NTJsonBinaryCoder : NSObject
+
++(BOOL)isBinaryBytes:(const void *)bytes length:(NSUInteger)length;
+
++(NSData *)dataWithJson:(NSDictionary *)json keyDictionary:(NTJsonKeyDictionary *)keyDictionary error:(NSError **)error;
+
+/// keys is a snapshot from NTJsonKeyDictionary.keys
++(id)jsonWithBytes:(const void *)bytes length:(NSUInteger)length keys:(NSArray *)keys error:(NSError **)error;
+
+/// Reads a single value without decoding the rest of the document. Returns nil if the key path doesn't exist.
++(id)valueForKeyPath:(NSString *)keyPath inBytes:(const void *)bytes length:(NSUInteger)length keyDictionary:(NTJsonKeyDictionary *)keyDictionary;
+
+/// Reads a single top-level value without decoding the rest of the document. Returns nil if the key doesn't exist.
++(id)valueForKey:(NSString *)key inBytes:(const void *)bytes length:(NSUInteger)length keyDictionary:(NTJsonKeyDictionary *)keyDictionary;
+
+@end
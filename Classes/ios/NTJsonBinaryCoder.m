@@ -0,0 +1,523 @@
+//
+//  NTJsonBinaryCoder.m
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import "NTJsonStore+Private.h"
+
+
+#define BINARY_FORMAT_VERSION   1
+#define BINARY_HEADER_LENGTH    4
+
+
+typedef enum
+{
+    NTJsonBinaryTagNull = 0,
+    NTJsonBinaryTagFalse = 1,
+    NTJsonBinaryTagTrue = 2,
+    NTJsonBinaryTagInteger = 3,
+    NTJsonBinaryTagDouble = 4,
+    NTJsonBinaryTagString = 5,
+    NTJsonBinaryTagArray = 6,
+    NTJsonBinaryTagObject = 7,
+} NTJsonBinaryTag;
+
+
+static const uint8_t BINARY_HEADER[BINARY_HEADER_LENGTH] = { 0x00, 'N', 'J', BINARY_FORMAT_VERSION };
+
+
+typedef struct
+{
+    const uint8_t *pos;
+    const uint8_t *end;
+} NTJsonBinaryReader;
+
+
+#pragma mark - writing
+
+
+static void writeByte(NSMutableData *data, uint8_t value)
+{
+    [data appendBytes:&value length:1];
+}
+
+
+static void writeVarint(NSMutableData *data, uint64_t value)
+{
+    uint8_t buffer[10];
+    NSUInteger len = 0;
+
+    while ( value >= 0x80 )
+    {
+        buffer[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+
+    buffer[len++] = (uint8_t)value;
+
+    [data appendBytes:buffer length:len];
+}
+
+
+static BOOL writeValue(NSMutableData *data, id value, NTJsonKeyDictionary *keyDictionary, NSError **error);
+
+
+static BOOL writeContainer(NSMutableData *data, NTJsonBinaryTag tag, NSUInteger count, BOOL (^writeItems)())
+{
+    // the byte length is patched in once we know it...
+
+    writeByte(data, tag);
+
+    NSUInteger lengthPos = data.length;
+    uint32_t length = 0;
+
+    [data appendBytes:&length length:sizeof(length)];
+
+    writeVarint(data, count);
+
+    if ( !writeItems() )
+        return NO;
+
+    length = CFSwapInt32HostToLittle((uint32_t)(data.length - lengthPos - sizeof(length)));
+
+    [data replaceBytesInRange:NSMakeRange(lengthPos, sizeof(length)) withBytes:&length];
+
+    return YES;
+}
+
+
+static BOOL writeValue(NSMutableData *data, id value, NTJsonKeyDictionary *keyDictionary, NSError **error)
+{
+    if ( !value || value == [NSNull null] )
+    {
+        writeByte(data, NTJsonBinaryTagNull);
+        return YES;
+    }
+
+    if ( [value isKindOfClass:[NSString class]] )
+    {
+        NSString *string = value;
+        NSUInteger len = [string lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+
+        writeByte(data, NTJsonBinaryTagString);
+        writeVarint(data, len);
+
+        NSUInteger pos = data.length;
+
+        [data increaseLengthBy:len];
+        [string getBytes:(uint8_t *)data.mutableBytes + pos maxLength:len usedLength:NULL encoding:NSUTF8StringEncoding options:0 range:NSMakeRange(0, string.length) remainingRange:NULL];
+
+        return YES;
+    }
+
+    if ( [value isKindOfClass:[NSNumber class]] )
+    {
+        if ( CFGetTypeID((__bridge CFTypeRef)value) == CFBooleanGetTypeID() )
+        {
+            writeByte(data, [value boolValue] ? NTJsonBinaryTagTrue : NTJsonBinaryTagFalse);
+            return YES;
+        }
+
+        const char *numType = [value objCType];
+
+        BOOL isDouble = (strcmp(numType, @encode(float)) == 0 || strcmp(numType, @encode(double)) == 0
+                         || (strcmp(numType, @encode(unsigned long long)) == 0 && [value unsignedLongLongValue] > INT64_MAX));
+
+        if ( isDouble )
+        {
+            double doubleValue = [value doubleValue];
+            uint64_t bits;
+
+            memcpy(&bits, &doubleValue, sizeof(bits));
+            bits = CFSwapInt64HostToLittle(bits);
+
+            writeByte(data, NTJsonBinaryTagDouble);
+            [data appendBytes:&bits length:sizeof(bits)];
+        }
+
+        else
+        {
+            int64_t intValue = [value longLongValue];
+
+            writeByte(data, NTJsonBinaryTagInteger);
+            writeVarint(data, ((uint64_t)intValue << 1) ^ (uint64_t)(intValue >> 63));   // zigzag keeps small negative numbers small
+        }
+
+        return YES;
+    }
+
+    if ( [value isKindOfClass:[NSArray class]] )
+    {
+        NSArray *array = value;
+
+        return writeContainer(data, NTJsonBinaryTagArray, array.count, ^BOOL{
+            for(id item in array)
+            {
+                if ( !writeValue(data, item, keyDictionary, error) )
+                    return NO;
+            }
+
+            return YES;
+        });
+    }
+
+    if ( [value isKindOfClass:[NSDictionary class]] )
+    {
+        NSDictionary *dictionary = value;
+
+        return writeContainer(data, NTJsonBinaryTagObject, dictionary.count, ^BOOL{
+            __block BOOL success = YES;
+
+            [dictionary enumerateKeysAndObjectsUsingBlock:^(id key, id item, BOOL *stop) {
+                if ( ![key isKindOfClass:[NSString class]] )
+                {
+                    if ( error )
+                        *error = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidDocumentFormat format:@"Invalid JSON key: %@", key];
+                    success = NO;
+                    *stop = YES;
+                    return ;
+                }
+
+                writeVarint(data, [keyDictionary idForKey:key]);
+
+                if ( !writeValue(data, item, keyDictionary, error) )
+                {
+                    success = NO;
+                    *stop = YES;
+                }
+            }];
+
+            return success;
+        });
+    }
+
+    if ( error )
+        *error = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidDocumentFormat format:@"Invalid type in JSON: %@", NSStringFromClass([value class])];
+
+    return NO;
+}
+
+
+#pragma mark - reading
+
+
+static BOOL readVarint(NTJsonBinaryReader *reader, uint64_t *value)
+{
+    uint64_t result = 0;
+    int shift = 0;
+
+    while ( reader->pos < reader->end && shift < 64 )
+    {
+        uint8_t byte = *reader->pos++;
+
+        result |= (uint64_t)(byte & 0x7F) << shift;
+
+        if ( !(byte & 0x80) )
+        {
+            *value = result;
+            return YES;
+        }
+
+        shift += 7;
+    }
+
+    return NO;  // truncated or corrupt
+}
+
+
+static BOOL readLength(NTJsonBinaryReader *reader, uint32_t *length)
+{
+    if ( reader->end - reader->pos < sizeof(*length) )
+        return NO;
+
+    memcpy(length, reader->pos, sizeof(*length));
+    *length = CFSwapInt32LittleToHost(*length);
+    reader->pos += sizeof(*length);
+
+    return (reader->end - reader->pos >= *length) ? YES : NO;
+}
+
+
+static BOOL skipValue(NTJsonBinaryReader *reader)
+{
+    if ( reader->pos >= reader->end )
+        return NO;
+
+    NTJsonBinaryTag tag = *reader->pos++;
+
+    switch(tag)
+    {
+        case NTJsonBinaryTagNull:
+        case NTJsonBinaryTagFalse:
+        case NTJsonBinaryTagTrue:
+            return YES;
+
+        case NTJsonBinaryTagInteger:
+        {
+            uint64_t value;
+            return readVarint(reader, &value);
+        }
+
+        case NTJsonBinaryTagDouble:
+            if ( reader->end - reader->pos < sizeof(uint64_t) )
+                return NO;
+            reader->pos += sizeof(uint64_t);
+            return YES;
+
+        case NTJsonBinaryTagString:
+        {
+            uint64_t len;
+            if ( !readVarint(reader, &len) || reader->end - reader->pos < len )
+                return NO;
+            reader->pos += len;
+            return YES;
+        }
+
+        case NTJsonBinaryTagArray:
+        case NTJsonBinaryTagObject:
+        {
+            uint32_t length;
+            if ( !readLength(reader, &length) )
+                return NO;
+            reader->pos += length;
+            return YES;
+        }
+
+        default:
+            return NO;
+    }
+}
+
+
+static id readValue(NTJsonBinaryReader *reader, NSArray *keys)
+{
+    if ( reader->pos >= reader->end )
+        return nil;
+
+    NTJsonBinaryTag tag = *reader->pos++;
+
+    switch(tag)
+    {
+        case NTJsonBinaryTagNull:
+            return [NSNull null];
+
+        case NTJsonBinaryTagFalse:
+            return @NO;
+
+        case NTJsonBinaryTagTrue:
+            return @YES;
+
+        case NTJsonBinaryTagInteger:
+        {
+            uint64_t value;
+
+            if ( !readVarint(reader, &value) )
+                return nil;
+
+            return @((int64_t)(value >> 1) ^ -(int64_t)(value & 1));
+        }
+
+        case NTJsonBinaryTagDouble:
+        {
+            uint64_t bits;
+            double value;
+
+            if ( reader->end - reader->pos < sizeof(bits) )
+                return nil;
+
+            memcpy(&bits, reader->pos, sizeof(bits));
+            reader->pos += sizeof(bits);
+
+            bits = CFSwapInt64LittleToHost(bits);
+            memcpy(&value, &bits, sizeof(value));
+
+            return @(value);
+        }
+
+        case NTJsonBinaryTagString:
+        {
+            uint64_t len;
+
+            if ( !readVarint(reader, &len) || reader->end - reader->pos < len )
+                return nil;
+
+            NSString *string = [[NSString alloc] initWithBytes:reader->pos length:(NSUInteger)len encoding:NSUTF8StringEncoding];
+
+            reader->pos += len;
+
+            return string;
+        }
+
+        case NTJsonBinaryTagArray:
+        {
+            uint32_t length;
+            uint64_t count;
+
+            if ( !readLength(reader, &length) || !readVarint(reader, &count) || count > length )
+                return nil;
+
+            NSMutableArray *array = [NSMutableArray arrayWithCapacity:(NSUInteger)count];
+
+            for(uint64_t index=0; index<count; index++)
+            {
+                id item = readValue(reader, keys);
+
+                if ( !item )
+                    return nil;
+
+                [array addObject:item];
+            }
+
+            return [array copy];    // decoded documents are shared through the object cache, so they must be immutable
+        }
+
+        case NTJsonBinaryTagObject:
+        {
+            uint32_t length;
+            uint64_t count;
+
+            if ( !readLength(reader, &length) || !readVarint(reader, &count) || count > length )
+                return nil;
+
+            NSMutableDictionary *dictionary = [NSMutableDictionary dictionaryWithCapacity:(NSUInteger)count];
+
+            for(uint64_t index=0; index<count; index++)
+            {
+                uint64_t keyId;
+
+                if ( !readVarint(reader, &keyId) || keyId >= keys.count )
+                    return nil;
+
+                id item = readValue(reader, keys);
+
+                if ( !item )
+                    return nil;
+
+                dictionary[keys[(NSUInteger)keyId]] = item;
+            }
+
+            return [dictionary copy];
+        }
+
+        default:
+            return nil;
+    }
+}
+
+
+static BOOL seekKey(NTJsonBinaryReader *reader, NSString *key, NTJsonKeyDictionary *keyDictionary)
+{
+    // positions reader at the value for key in the current object, returns NO if it doesn't exist...
+
+    NSUInteger targetId = [keyDictionary existingIdForKey:key];
+
+    if ( targetId == NSNotFound )
+        return NO;  // no document has this key
+
+    uint32_t objectLength;
+    uint64_t count;
+
+    if ( reader->pos >= reader->end || *reader->pos++ != NTJsonBinaryTagObject )
+        return NO;  // not an object, so the key doesn't exist
+
+    if ( !readLength(reader, &objectLength) || !readVarint(reader, &count) )
+        return NO;
+
+    for(uint64_t index=0; index<count; index++)
+    {
+        uint64_t keyId;
+
+        if ( !readVarint(reader, &keyId) )
+            return NO;
+
+        if ( keyId == targetId )
+            return YES;
+
+        if ( !skipValue(reader) )
+            return NO;
+    }
+
+    return NO;
+}
+
+
+@implementation NTJsonBinaryCoder
+
+
++(BOOL)isBinaryBytes:(const void *)bytes length:(NSUInteger)length
+{
+    // The version is checked when decoding, any document with our prefix is binary...
+
+    return (length >= BINARY_HEADER_LENGTH && memcmp(bytes, BINARY_HEADER, BINARY_HEADER_LENGTH-1) == 0) ? YES : NO;
+}
+
+
++(NSData *)dataWithJson:(NSDictionary *)json keyDictionary:(NTJsonKeyDictionary *)keyDictionary error:(NSError **)error
+{
+    NSMutableData *data = [NSMutableData dataWithCapacity:256];
+
+    [data appendBytes:BINARY_HEADER length:BINARY_HEADER_LENGTH];
+
+    if ( !writeValue(data, json, keyDictionary, error) )
+        return nil;
+
+    return data;
+}
+
+
++(id)jsonWithBytes:(const void *)bytes length:(NSUInteger)length keys:(NSArray *)keys error:(NSError **)error
+{
+    if ( ![self isBinaryBytes:bytes length:length] || ((const uint8_t *)bytes)[BINARY_HEADER_LENGTH-1] != BINARY_FORMAT_VERSION )
+    {
+        if ( error )
+            *error = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidDocumentFormat message:@"Unsupported binary document version."];
+
+        return nil;
+    }
+
+    NTJsonBinaryReader reader = { (const uint8_t *)bytes + BINARY_HEADER_LENGTH, (const uint8_t *)bytes + length };
+
+    id json = readValue(&reader, keys);
+
+    if ( !json && error )
+        *error = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidDocumentFormat];
+
+    return json;
+}
+
+
++(id)valueForKeyPath:(NSString *)keyPath inBytes:(const void *)bytes length:(NSUInteger)length keyDictionary:(NTJsonKeyDictionary *)keyDictionary
+{
+    if ( ![self isBinaryBytes:bytes length:length] || ((const uint8_t *)bytes)[BINARY_HEADER_LENGTH-1] != BINARY_FORMAT_VERSION )
+        return nil;
+
+    NTJsonBinaryReader reader = { (const uint8_t *)bytes + BINARY_HEADER_LENGTH, (const uint8_t *)bytes + length };
+
+    for(NSString *key in [keyPath componentsSeparatedByString:@"."])
+    {
+        if ( !seekKey(&reader, key, keyDictionary) )
+            return nil;
+    }
+
+    return readValue(&reader, keyDictionary.keys);
+}
+
+
++(id)valueForKey:(NSString *)key inBytes:(const void *)bytes length:(NSUInteger)length keyDictionary:(NTJsonKeyDictionary *)keyDictionary
+{
+    if ( ![self isBinaryBytes:bytes length:length] || ((const uint8_t *)bytes)[BINARY_HEADER_LENGTH-1] != BINARY_FORMAT_VERSION )
+        return nil;
+
+    NTJsonBinaryReader reader = { (const uint8_t *)bytes + BINARY_HEADER_LENGTH, (const uint8_t *)bytes + length };
+
+    if ( !seekKey(&reader, key, keyDictionary) )
+        return nil;
+
+    return readValue(&reader, keyDictionary.keys);
+}
+
+
+@end
@@ -0,0 +1,34 @@
+//
+//  NTJsonChanges+Private.h
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import "NTJsonChanges.h"
+
+
+@interface NTJsonChanges (Private)
+
+-(id)initWithCollection:(NTJsonCollection *)collection insertedRowIds:(NSSet *)insertedRowIds updatedRowIds:(NSSet *)updatedRowIds removedRowIds:(NSSet *)removedRowIds;
+
+@end
+
+
+/// Collects changes until they are delivered. Must only be accessed on the collection queue.
+@interface NTJsonPendingChanges : NSObject
+
+@property (nonatomic,readonly) BOOL isEmpty;
+
+-(void)addInsertedRowId:(NTJsonRowId)rowid;
+-(void)addUpdatedRowId:(NTJsonRowId)rowid;
+-(void)addRemovedRowId:(NTJsonRowId)rowid;
+
+/// adds changes that happened after the ones collected so far.
+-(void)addChanges:(NTJsonPendingChanges *)changes;
+
+/// returns the changes collected so far and starts over.
+-(NTJsonChanges *)takeChangesWithCollection:(NTJsonCollection *)collection;
+
+@end
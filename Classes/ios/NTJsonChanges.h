@@ -0,0 +1,36 @@
+//
+//  NTJsonChanges.h
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "NTJsonStoreTypes.h"
+
+
+@class NTJsonCollection;
+
+
+/// A batch of changes to a collection, delivered to change observers and live queries. Changes made in quick succession are
+/// coalesced, so each rowid appears in at most one set: an item inserted and then updated is only inserted, an item inserted
+/// and then removed doesn't appear at all.
+@interface NTJsonChanges : NSObject
+
+@property (nonatomic,readonly) NTJsonCollection *collection;
+
+/// rowids (NSNumbers) of items that were inserted.
+@property (nonatomic,readonly) NSSet *insertedRowIds;
+
+/// rowids (NSNumbers) of existing items that were updated.
+@property (nonatomic,readonly) NSSet *updatedRowIds;
+
+/// rowids (NSNumbers) of items that were removed.
+@property (nonatomic,readonly) NSSet *removedRowIds;
+
+/// YES if there are no changes.
+@property (nonatomic,readonly) BOOL isEmpty;
+
+@end
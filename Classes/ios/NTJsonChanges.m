@@ -0,0 +1,140 @@
+//
+//  NTJsonChanges.m
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import "NTJsonStore+Private.h"
+
+
+#pragma mark - NTJsonChanges
+
+
+@implementation NTJsonChanges
+
+
+-(id)initWithCollection:(NTJsonCollection *)collection insertedRowIds:(NSSet *)insertedRowIds updatedRowIds:(NSSet *)updatedRowIds removedRowIds:(NSSet *)removedRowIds
+{
+    self = [super init];
+    
+    if ( self )
+    {
+        _collection = collection;
+        _insertedRowIds = [insertedRowIds copy] ?: [NSSet set];
+        _updatedRowIds = [updatedRowIds copy] ?: [NSSet set];
+        _removedRowIds = [removedRowIds copy] ?: [NSSet set];
+    }
+    
+    return self;
+}
+
+
+-(BOOL)isEmpty
+{
+    return (!_insertedRowIds.count && !_updatedRowIds.count && !_removedRowIds.count) ? YES : NO;
+}
+
+
+-(NSString *)description
+{
+    return [NSString stringWithFormat:@"<NTJsonChanges %@: %d inserted, %d updated, %d removed>", _collection.name, (int)_insertedRowIds.count, (int)_updatedRowIds.count, (int)_removedRowIds.count];
+}
+
+
+@end
+
+
+#pragma mark - NTJsonPendingChanges
+
+
+@interface NTJsonPendingChanges ()
+{
+    NSMutableSet *_inserted;
+    NSMutableSet *_updated;
+    NSMutableSet *_removed;
+}
+
+@end
+
+
+@implementation NTJsonPendingChanges
+
+
+-(id)init
+{
+    self = [super init];
+    
+    if ( self )
+    {
+        _inserted = [NSMutableSet set];
+        _updated = [NSMutableSet set];
+        _removed = [NSMutableSet set];
+    }
+    
+    return self;
+}
+
+
+-(BOOL)isEmpty
+{
+    return (!_inserted.count && !_updated.count && !_removed.count) ? YES : NO;
+}
+
+
+-(void)addInsertedRowId:(NTJsonRowId)rowid
+{
+    [_inserted addObject:@(rowid)];
+}
+
+
+-(void)addUpdatedRowId:(NTJsonRowId)rowid
+{
+    NSNumber *key = @(rowid);
+    
+    if ( ![_inserted containsObject:key] )  // still an insert as far as observers are concerned
+        [_updated addObject:key];
+}
+
+
+-(void)addRemovedRowId:(NTJsonRowId)rowid
+{
+    NSNumber *key = @(rowid);
+    
+    [_updated removeObject:key];
+    
+    if ( [_inserted containsObject:key] )
+        [_inserted removeObject:key];   // never seen, nothing to report (rowids are never reused)
+    
+    else
+        [_removed addObject:key];
+}
+
+
+-(void)addChanges:(NTJsonPendingChanges *)changes
+{
+    for(NSNumber *rowid in changes->_inserted)
+        [self addInsertedRowId:rowid.longLongValue];
+    
+    for(NSNumber *rowid in changes->_updated)
+        [self addUpdatedRowId:rowid.longLongValue];
+    
+    for(NSNumber *rowid in changes->_removed)
+        [self addRemovedRowId:rowid.longLongValue];
+}
+
+
+-(NTJsonChanges *)takeChangesWithCollection:(NTJsonCollection *)collection
+{
+    NTJsonChanges *changes = [[NTJsonChanges alloc] initWithCollection:collection insertedRowIds:_inserted updatedRowIds:_updated removedRowIds:_removed];
+    
+    [_inserted removeAllObjects];
+    [_updated removeAllObjects];
+    [_removed removeAllObjects];
+    
+    return changes;
+}
+
+
+@end
@@ -24,4 +24,32 @@
 
 -(void)close;
 
+/// returns the next limit items after continuation for NTJsonCursor. keys receives the continuation for each item.
+-(NSArray *)findBatchWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy continuation:(NSArray *)continuation limit:(int)limit keys:(NSArray **)keys error:(NSError **)error;
+
+/// the same as findBatchWhere, for NTJsonLiveQuery. Must be called on the collection queue. A limit of 0 returns all items.
+-(NSArray *)_findBatchWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy continuation:(NSArray *)continuation limit:(int)limit keys:(NSArray **)keys error:(NSError **)error;
+
+/// splits an ORDER BY into @[expression, @(isDescending)] terms.
++(NSArray *)orderByTermsInSql:(NSString *)orderBy;
+
+-(void)dispatchCompletionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)())completionHandler;
+
+-(void)removeLiveQuery:(NTJsonLiveQuery *)liveQuery;
+
+/// adds everything queued for this collection so far (including parallel reads) to the group.
+-(void)addPendingOperationsToGroup:(dispatch_group_t)group;
+
+/// Store transactions (see -[NTJsonStore performTransaction:error:].) beginStoreTransaction suspends our queue and switches to the
+/// store connection, it's called from outside the collection queue. The others are called on the store queue in the transaction.
+-(void)beginStoreTransaction;
+-(void)storeTransactionDidRollbackSavepoint;
+-(void)endStoreTransactionWithCommit:(BOOL)commit;
+
+/// changes the PRAGMA synchronous level of our connection (see -[NTJsonStore synchronous].)
+-(void)applySynchronous:(NTJsonSynchronous)synchronous;
+
+/// saves any unsaved statistics. Must be called outside of the store queue, saving writes to the metadata table.
+-(void)saveStatistics;
+
 @end
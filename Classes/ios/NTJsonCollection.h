@@ -9,6 +9,8 @@
 #import <Foundation/Foundation.h>
 
 #import "NTJsonStoreTypes.h"
+#import "NTJsonCursor.h"
+#import "NTJsonLiveQuery.h"
 
 
 @class NTJsonStore;
@@ -40,6 +42,90 @@
 /// same instance.) Set to -1 to disable ALL caching - in this configuration a new NSDictionary will be deserialized and returned for each request. Default: 50.
 @property (nonatomic) int cacheSize;
 
+/// the approximate maximum size in bytes of the items cached internally (the size of the stored documents.) The oldest items are removed once either
+/// cacheSize or cacheByteLimit is exceeded. Set to 0 to limit the cache by cacheSize only. Items in use are not counted. Default: 4MB.
+@property (nonatomic) int cacheByteLimit;
+
+/// When YES, the collection records performance metrics. May be changed at any time. Default: the store's metricsEnabled.
+@property (nonatomic) BOOL metricsEnabled;
+
+/// Queries slower than this (in seconds) are added to the slow query log while metrics are enabled. 0 disables the log.
+/// Default: the store's slowQueryThreshold.
+@property (nonatomic) double slowQueryThreshold;
+
+/// A snapshot of the collected metrics. All times are in seconds:
+///     operations - for each operation ("find", "count", "insert", etc.) count, totalTime, averageTime, maxTime, p50, p95, p99 and
+///                  histogram (bucket n counts operations that took under 2^n microseconds.) Times start when the operation
+///                  begins running.
+///     queueWait - the same statistics for the time operations waited for the collection queue.
+///     prepareTime, stepTime, decodeTime, encodeTime, materializationTime - total time spent preparing statements, stepping
+///                  through results, decoding and encoding documents and materializing columns or converting documents.
+///     rowsScanned, rowsReturned - rows visited by full table scans and rows returned by finds.
+///     objectCache, queryCache, statementCache - hits and misses (statementCache also has cachedCount, prepared statements kept.)
+///     slowQueries - the most recent slow queries with sql, expandedSql, queryPlan, time and date.
+@property (nonatomic,readonly) NSDictionary *metrics;
+
+/// Statistics maintained as the collection is changed:
+///     rowCount - the number of items, countWhere with no where clause returns this without a query.
+///     columns - for each materialized column nullCount and distinctCount. distinctCount is an estimate (within a few percent) and
+///                  both are approximate while isExact is NO (after changes that couldn't be tracked) until the next rebuild.
+///     changesSinceAnalyze, analyzedDate - ANALYZE is run in the background once enough of the collection has changed.
+@property (nonatomic,readonly) NSDictionary *statistics;
+
+/// The number of find and count results to cache. Results are cached as lists of rowids (items come from the item cache) and are
+/// invalidated by writes to this collection; updates only invalidate queries that use a field that changed. Writes made outside of
+/// this collection (another process, for instance) are only detected when the store's detectExternalChanges is enabled. Set to 0 to
+/// disable. Default: 0.
+@property (nonatomic) int queryCacheSize;
+
+/// find results with more items than this are not cached. Default: 1000.
+@property (nonatomic) int queryCacheMaxRows;
+
+/// Changes are collected for this long (in seconds) before they are delivered to change observers and live queries, so bursts of
+/// writes are delivered as a single batch. With 0, changes are delivered once the writes already queued have run. Default: 0.05.
+@property (nonatomic) NSTimeInterval changeDeliveryInterval;
+
+/// The number of find and count requests answered from the query cache.
+@property (nonatomic,readonly) int queryCacheHits;
+
+/// The number of find and count requests that were not in the query cache.
+@property (nonatomic,readonly) int queryCacheMisses;
+
+/// When YES, found items keep the raw document and decode it on demand. Top-level string and integer fields that are queryable fields are
+/// answered straight from the query results, other fields decode only what they need (binary documents) or the whole document (text
+/// documents) the first time they are accessed. Useful for lists that show a few fields from large documents. Requires caching (cacheSize >= 0.) Default: NO.
+@property (nonatomic) BOOL lazyDecoding;
+
+/// When YES, each single field unique index ("[uid]") is mirrored in memory as a map from value to rowid. findWhere: and findOneWhere:
+/// calls of the form "[uid] = ?" are then answered from the map and the item cache without touching SQLite. Maps are loaded in the
+/// background the first time they are needed, until then lookups use SQLite as usual. Writes made outside of this collection are not
+/// detected. Default: NO.
+@property (nonatomic) BOOL uniqueKeyLookup;
+
+/// How queryable fields and indexes are stored. NTJsonColumnModeMaterialized (the default) copies each field into a real column which must be
+/// written on every insert and update. NTJsonColumnModeVirtual uses generated columns and NTJsonColumnModeExpression uses json_extract() expressions,
+/// both are free to add on large collections and add no cost to writes but are slower to query on unindexed fields. Changing the mode on an existing
+/// collection rebuilds the table the next time the schema is updated. This value is persisted.
+@property (nonatomic) NTJsonColumnMode columnMode;
+
+/// How documents are stored. NTJsonDocumentFormatBinary uses a compact binary encoding with a shared list of keys for the collection, it is
+/// smaller and much faster to decode than JSON text. Binary documents require NTJsonColumnModeMaterialized. Changing the format on an existing
+/// collection converts existing rows in the background, both formats may be read in the meantime. This value is persisted. Default: NTJsonDocumentFormatText.
+@property (nonatomic) NTJsonDocumentFormat documentFormat;
+
+/// The number of items serialized or extracted per worker thread by bulkInsert, insertBatch and upsertBatch. Larger chunks mean less
+/// overhead but fewer workers for small batches. This only splits up the work done before writing, every batch is still written in a
+/// single transaction. Default: 500.
+@property (nonatomic) int serializationChunkSize;
+
+/// The number of rows updated per transaction when a new queryable field is being populated or documents are being converted to a new
+/// documentFormat in the background. Default: 1000.
+@property (nonatomic) int materializationBatchSize;
+
+/// Called on the main thread after each batch of rows is populated for new queryable fields. progress ranges from 0 to 1, 1 indicates
+/// the fields are ready. Until then, queries on these fields are answered by reading the JSON directly (slower, but no waiting.)
+@property (nonatomic,copy) void (^materializationProgressHandler)(NSArray *columnNames, float progress);
+
 /// Add a unique index with the key string if it doesn't already exist. Calling this has no effect if the index already exists.
 /// @param keys a comma-separated list of JSON paths paths to index on.
 -(void)addIndexWithKeys:(NSString *)keys;
@@ -63,6 +149,9 @@
  */
 -(void)flushCache;
 
+/// Clears all collected metrics.
+-(void)resetMetrics;
+
 /// ensure all pending schema changes this collection have been committed to the data store. Changes to indexes, queryable fields and
 /// defaults will all be written when this call completes.
 /// @param completionQueue the queue to execute the completion handler in. Passing nil will cause a default to be selected for you. See notes.
@@ -161,6 +250,101 @@
  */
 -(BOOL)insertBatch:(NSArray *)items;
 
+/**
+ *  Insert a group of items into the collection, returning the new rowids. This is a transactional operation -- either all items are inserted or none are.
+ *  JSON serialization starts immediately on worker threads (before the request reaches the collection queue, binary documents are encoded
+ *  once it gets there) and all rows are written using a single prepared statement, making this the fastest way to load large numbers of items.
+ *
+ *  @param items             the items to insert
+ *  @param completionQueue   the queue to execute the completion handler in. Passing nil will cause a default to be selected for you. See notes.
+ *  @param completionHandler the completionHandler to run on completion. May not be nil. rowids is an array of NSNumbers in the same order as items
+ *                           or nil on failure.
+ *  @note completionQueue may be a speficic queue, nil or the special queue 'NTJsonStoreSerialQueue'. NTJsonStoreSerialQueue is an alias for the internal
+ *      serial queue used for collection operations.
+ *      Passing nil will cause the system to select the correct queue for you:
+ *      if running on the UI thread then the completion handler will run on the UI thread,
+ *      otherwise the completionHandler will run on a background thread.
+ */
+-(void)beginBulkInsert:(NSArray *)items completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *rowids, NSError *error))completionHandler;
+
+/**
+ *  Insert a group of items into the collection, returning the new rowids. This is a transactional operation -- either all items are inserted or none are.
+ *
+ *  @param items             the items to insert
+ *  @param completionHandler completionHandler the completionHandler to run on completion. May not be nil. The completionHandler is run on
+ *                           the UI thread if the call is made from the UI thread, otherwise the call is made from a background thread.
+ */
+-(void)beginBulkInsert:(NSArray *)items completionHandler:(void (^)(NSArray *rowids, NSError *error))completionHandler;
+
+/**
+ *  Insert a group of items into the collection, returning the new rowids. This is a transactional operation -- either all items are inserted or none are.
+ *
+ *  @param items             the items to insert
+ *  @param error             a pointer to the error which is set on failure (nil is returned). May be nil.
+ *  @return                  an array of NSNumber rowids in the same order as items or nil on failure (error is set)
+ */
+-(NSArray *)bulkInsert:(NSArray *)items error:(NSError **)error;
+
+/**
+ *  Insert a group of items into the collection, returning the new rowids. This is a transactional operation -- either all items are inserted or none are.
+ *
+ *  @param items             the items to insert
+ *  @return                  an array of NSNumber rowids in the same order as items or nil on failure (self.lastError is set)
+ */
+-(NSArray *)bulkInsert:(NSArray *)items;
+
+/**
+ *  Insert or update a group of items, matching existing items on a unique index (see addUniqueIndexWithKeys:.) Existing items are updated
+ *  in place, keeping their __rowid__, new items are inserted. This is a transactional operation -- either all items are written or none are.
+ *  Requires SQLite 3.35 or later.
+ *
+ *  @param items             the items to write, __rowid__ is ignored
+ *  @param keys              the keys of a unique index, for instance @"[uid]" or @"[accountId], [uid]"
+ *  @param completionQueue   the queue to execute the completion handler in. Passing nil will cause a default to be selected for you. See notes.
+ *  @param completionHandler the completionHandler to run on completion. May not be nil. The counts are 0 on failure.
+ *  @note completionQueue may be a speficic queue, nil or the special queue 'NTJsonStoreSerialQueue'. NTJsonStoreSerialQueue is an alias for the internal
+ *        serial queue used for collection operations.
+ *        Passing nil will cause the system to select the correct queue for you:
+ *        if running on the UI thread then the completion handler will run on the UI thread,
+ *        otherwise the completionHandler will run on a background thread.
+ */
+-(void)beginUpsertBatch:(NSArray *)items onKeys:(NSString *)keys completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(int insertedCount, int updatedCount, NSError *error))completionHandler;
+
+/**
+ *  Insert or update a group of items, matching existing items on a unique index (see addUniqueIndexWithKeys:.) Existing items are updated
+ *  in place, keeping their __rowid__, new items are inserted. This is a transactional operation -- either all items are written or none are.
+ *
+ *  @param items             the items to write, __rowid__ is ignored
+ *  @param keys              the keys of a unique index, for instance @"[uid]" or @"[accountId], [uid]"
+ *  @param completionHandler completionHandler the completionHandler to run on completion. May not be nil. The completionHandler is run on
+ *                           the UI thread if the call is made from the UI thread, otherwise the call is made from a background thread.
+ */
+-(void)beginUpsertBatch:(NSArray *)items onKeys:(NSString *)keys completionHandler:(void (^)(int insertedCount, int updatedCount, NSError *error))completionHandler;
+
+/**
+ *  Insert or update a group of items, matching existing items on a unique index (see addUniqueIndexWithKeys:.) Existing items are updated
+ *  in place, keeping their __rowid__, new items are inserted. This is a transactional operation -- either all items are written or none are.
+ *
+ *  @param items             the items to write, __rowid__ is ignored
+ *  @param keys              the keys of a unique index, for instance @"[uid]" or @"[accountId], [uid]"
+ *  @param insertedCount     set to the number of items inserted. May be NULL.
+ *  @param updatedCount      set to the number of existing items updated. May be NULL.
+ *  @param error             a pointer to the error which is set on failure (NTJsonStoreErrorInvalidSqlArgument if there is no unique index
+ *                           on keys.) May be nil.
+ *  @return                  YES on success or NO on failure (error is set)
+ */
+-(BOOL)upsertBatch:(NSArray *)items onKeys:(NSString *)keys insertedCount:(int *)insertedCount updatedCount:(int *)updatedCount error:(NSError **)error;
+
+/**
+ *  Insert or update a group of items, matching existing items on a unique index (see addUniqueIndexWithKeys:.) Existing items are updated
+ *  in place, keeping their __rowid__, new items are inserted. This is a transactional operation -- either all items are written or none are.
+ *
+ *  @param items             the items to write, __rowid__ is ignored
+ *  @param keys              the keys of a unique index, for instance @"[uid]" or @"[accountId], [uid]"
+ *  @return                  YES on success or NO on failure (self.lastError is set)
+ */
+-(BOOL)upsertBatch:(NSArray *)items onKeys:(NSString *)keys;
+
 /**
  *  Update an existing item in the collection. The item *must* have a property with the __rowid__ set, which is returned with any
  *  item returned by the collection API.
@@ -205,6 +389,122 @@
  */
 -(BOOL)update:(NSDictionary *)json;
 
+/**
+ *  Merge fields into an existing item (a JSON merge patch - NSNull removes a field and dictionaries are merged recursively.) Only
+ *  the queryable fields whose values changed are rewritten, and nothing is written at all if the item doesn't change.
+ *
+ *  @param fields            the fields to change, __rowid__ is ignored
+ *  @param rowid             the __rowid__ of the item to update
+ *  @param completionQueue   the queue to execute the completion handler in. Passing nil will cause a default to be selected for you. See notes.
+ *  @param completionHandler the completionHandler to run on completion. May not be nil.
+ *  @note completionQueue may be a speficic queue, nil or the special queue 'NTJsonStoreSerialQueue'. NTJsonStoreSerialQueue is an alias for the internal
+ *        serial queue used for collection operations.
+ *        Passing nil will cause the system to select the correct queue for you:
+ *        if running on the UI thread then the completion handler will run on the UI thread,
+ *        otherwise the completionHandler will run on a background thread.
+ */
+-(void)beginUpdateFields:(NSDictionary *)fields forRowId:(NTJsonRowId)rowid completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSError *error))completionHandler;
+
+/**
+ *  Merge fields into an existing item (a JSON merge patch - NSNull removes a field and dictionaries are merged recursively.) Only
+ *  the queryable fields whose values changed are rewritten, and nothing is written at all if the item doesn't change.
+ *
+ *  @param fields            the fields to change, __rowid__ is ignored
+ *  @param rowid             the __rowid__ of the item to update
+ *  @param completionHandler completionHandler the completionHandler to run on completion. May not be nil. The completionHandler is run on
+ *                           the UI thread if the call is made from the UI thread, otherwise the call is made from a background thread.
+ */
+-(void)beginUpdateFields:(NSDictionary *)fields forRowId:(NTJsonRowId)rowid completionHandler:(void (^)(NSError *error))completionHandler;
+
+/**
+ *  Merge fields into an existing item (a JSON merge patch - NSNull removes a field and dictionaries are merged recursively.) Only
+ *  the queryable fields whose values changed are rewritten, and nothing is written at all if the item doesn't change.
+ *
+ *  @param fields            the fields to change, __rowid__ is ignored
+ *  @param rowid             the __rowid__ of the item to update
+ *  @param error             a pointer to the error which is set on failure (NTJsonStoreErrorNotFound if the item doesn't exist.) May be nil.
+ *  @return                  YES on success or NO on failure (error is set)
+ */
+-(BOOL)updateFields:(NSDictionary *)fields forRowId:(NTJsonRowId)rowid error:(NSError **)error;
+
+/**
+ *  Merge fields into an existing item (a JSON merge patch - NSNull removes a field and dictionaries are merged recursively.) Only
+ *  the queryable fields whose values changed are rewritten, and nothing is written at all if the item doesn't change.
+ *
+ *  @param fields            the fields to change, __rowid__ is ignored
+ *  @param rowid             the __rowid__ of the item to update
+ *  @return                  YES on success or NO on failure (self.error is set)
+ */
+-(BOOL)updateFields:(NSDictionary *)fields forRowId:(NTJsonRowId)rowid;
+
+/**
+ *  Merge fields into all items matching the where clause (a JSON merge patch, see updateFields:forRowId:.) The patch is applied with
+ *  json_patch() inside SQLITE, along with any queryable fields it changes, so documents aren't read into memory. (Binary documents
+ *  are patched one at a time in a single transaction.) Requires SQLite 3.35 or later.
+ *
+ *  @param where             the SQLITE WHERE clause to execute. may be nil. See notes.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param fields            the fields to change, __rowid__ is ignored
+ *  @param completionQueue   the queue to execute the completion handler in. Passing nil will cause a default to be selected for you. See notes.
+ *  @param completionHandler the completionHandler to run on completion. May not be nil.
+ *  @note completionQueue may be a speficic queue, nil or the special queue 'NTJsonStoreSerialQueue'. NTJsonStoreSerialQueue is an alias for the internal
+ *        serial queue used for collection operations.
+ *        Passing nil will cause the system to select the correct queue for you:
+ *        if running on the UI thread then the completion handler will run on the UI thread,
+ *        otherwise the completionHandler will run on a background thread.
+ *  @note Query strings are a subset of the SQLITE WHERE clause where JSON fields are enclosed in square braces. Values may be used by inserting a ?
+ *        in the query string and adding the value in the `args` array. (Parameterized SQL.) All JSON fields must be enclosed in square braces.
+ *        Nested JSON fields are allowed using "." notation.
+ */
+-(void)beginUpdateWhere:(NSString *)where args:(NSArray *)args set:(NSDictionary *)fields completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(int count, NSError *error))completionHandler;
+
+/**
+ *  Merge fields into all items matching the where clause (a JSON merge patch, see updateFields:forRowId:.) The patch is applied with
+ *  json_patch() inside SQLITE, along with any queryable fields it changes, so documents aren't read into memory. (Binary documents
+ *  are patched one at a time in a single transaction.) Requires SQLite 3.35 or later.
+ *
+ *  @param where             the SQLITE WHERE clause to execute. may be nil. See notes.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param fields            the fields to change, __rowid__ is ignored
+ *  @param completionHandler completionHandler the completionHandler to run on completion. May not be nil. The completionHandler is run on
+ *                           the UI thread if the call is made from the UI thread, otherwise the call is made from a background thread.
+ *  @note Query strings are a subset of the SQLITE WHERE clause where JSON fields are enclosed in square braces. Values may be used by inserting a ?
+ *        in the query string and adding the value in the `args` array. (Parameterized SQL.) All JSON fields must be enclosed in square braces.
+ *        Nested JSON fields are allowed using "." notation.
+ */
+-(void)beginUpdateWhere:(NSString *)where args:(NSArray *)args set:(NSDictionary *)fields completionHandler:(void (^)(int count, NSError *error))completionHandler;
+
+/**
+ *  Merge fields into all items matching the where clause (a JSON merge patch, see updateFields:forRowId:.) The patch is applied with
+ *  json_patch() inside SQLITE, along with any queryable fields it changes, so documents aren't read into memory. (Binary documents
+ *  are patched one at a time in a single transaction.) Requires SQLite 3.35 or later.
+ *
+ *  @param where             the SQLITE WHERE clause to execute. may be nil. See notes.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param fields            the fields to change, __rowid__ is ignored
+ *  @param error             a pointer to the error which is set on failure (-1 is returned). May be nil.
+ *  @return                  the number of items updated or -1 on error (error will be set)
+ *  @note Query strings are a subset of the SQLITE WHERE clause where JSON fields are enclosed in square braces. Values may be used by inserting a ?
+ *        in the query string and adding the value in the `args` array. (Parameterized SQL.) All JSON fields must be enclosed in square braces.
+ *        Nested JSON fields are allowed using "." notation.
+ */
+-(int)updateWhere:(NSString *)where args:(NSArray *)args set:(NSDictionary *)fields error:(NSError **)error;
+
+/**
+ *  Merge fields into all items matching the where clause (a JSON merge patch, see updateFields:forRowId:.) The patch is applied with
+ *  json_patch() inside SQLITE, along with any queryable fields it changes, so documents aren't read into memory. (Binary documents
+ *  are patched one at a time in a single transaction.) Requires SQLite 3.35 or later.
+ *
+ *  @param where             the SQLITE WHERE clause to execute. may be nil. See notes.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param fields            the fields to change, __rowid__ is ignored
+ *  @return                  the number of items updated or -1 on error (self.error will be set)
+ *  @note Query strings are a subset of the SQLITE WHERE clause where JSON fields are enclosed in square braces. Values may be used by inserting a ?
+ *        in the query string and adding the value in the `args` array. (Parameterized SQL.) All JSON fields must be enclosed in square braces.
+ *        Nested JSON fields are allowed using "." notation.
+ */
+-(int)updateWhere:(NSString *)where args:(NSArray *)args set:(NSDictionary *)fields;
+
 /**
  *  Remove an existing item in the collection. The item *must* have a property with the __rowid__ set, which is returned with any
  *  item returned by the collection API.
@@ -264,6 +564,8 @@
  *  @note Query strings are a subset of the SQLITE WHERE clause where JSON fields are enclosed in square braces. Values may be used by inserting a ? 
  *        in the query string and adding the value in the `args` array. (Parameterized SQL.) All JSON fields must be enclosed in square braces.
  *        Nested JSON fields are allowed using "." notation.
+ *  @note When the store has read connections (see NTJsonStore.readConnectionCount) the count runs in parallel with later operations, so
+ *        the completionHandler may run after theirs.
  */
 -(void)beginCountWhere:(NSString *)where args:(NSArray *)args completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(int count, NSError *error))completionHandler;
 
@@ -342,6 +644,65 @@
  */
 -(int)count;
 
+/**
+ *  Calculates aggregate values (SUM, AVG, MIN, MAX, COUNT, etc.) for the items matching the query string, optionally grouped.
+ *
+ *  @param aggregates        a dictionary of result keys to SQLITE aggregate expressions, for instance @{@"total": @"SUM([amount])",
+ *                           @"customers": @"COUNT(DISTINCT [customer.id])"}. JSON fields must be enclosed in square braces.
+ *  @param where             the SQLITE WHERE clause to execute. may be nil. See notes.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param groupBy           A comma-separated list of JSON field names to group the results by, may be nil. All JSON field names must
+ *                           be enclosed in square braces.
+ *  @param completionQueue   the queue to execute the completion handler in. Passing nil will cause a default to be selected for you. See notes.
+ *  @param completionHandler the completionHandler to run on completion. May not be nil. results is an array of dictionaries, one per group
+ *                           in groupBy order (a single dictionary if groupBy is nil.) Each group by field is included using its field name.
+ *  @note completionQueue may be a speficic queue, nil or the special queue 'NTJsonStoreSerialQueue'. NTJsonStoreSerialQueue is an alias for the internal
+ *        serial queue used for collection operations.
+ *        Passing nil will cause the system to select the correct queue for you:
+ *        if running on the UI thread then the completion handler will run on the UI thread,
+ *        otherwise the completionHandler will run on a background thread.
+ *  @note Aggregates are calculated by SQLITE from the queryable field columns, no documents are read. NULL values are left out of the
+ *        result dictionaries. Results are not cached.
+ *  @note When the store has read connections (see NTJsonStore.readConnectionCount) the query runs in parallel with later operations, so
+ *        the completionHandler may run after theirs.
+ */
+-(void)beginAggregate:(NSDictionary *)aggregates where:(NSString *)where args:(NSArray *)args groupBy:(NSString *)groupBy completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *results, NSError *error))completionHandler;
+
+/**
+ *  Calculates aggregate values (SUM, AVG, MIN, MAX, COUNT, etc.) for the items matching the query string, optionally grouped.
+ *
+ *  @param aggregates        a dictionary of result keys to SQLITE aggregate expressions, for instance @{@"total": @"SUM([amount])"}.
+ *  @param where             the SQLITE WHERE clause to execute. may be nil.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param groupBy           A comma-separated list of JSON field names to group the results by, may be nil.
+ *  @param completionHandler completionHandler the completionHandler to run on completion. May not be nil. The completionHandler is run on
+ *                           the UI thread if the call is made from the UI thread, otherwise the call is made from a background thread.
+ */
+-(void)beginAggregate:(NSDictionary *)aggregates where:(NSString *)where args:(NSArray *)args groupBy:(NSString *)groupBy completionHandler:(void (^)(NSArray *results, NSError *error))completionHandler;
+
+/**
+ *  Calculates aggregate values (SUM, AVG, MIN, MAX, COUNT, etc.) for the items matching the query string, optionally grouped.
+ *
+ *  @param aggregates        a dictionary of result keys to SQLITE aggregate expressions, for instance @{@"total": @"SUM([amount])"}.
+ *  @param where             the SQLITE WHERE clause to execute. may be nil.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param groupBy           A comma-separated list of JSON field names to group the results by, may be nil.
+ *  @param error             a pointer to the error which is set on failure (nil is returned). May be nil.
+ *  @return                  an array of dictionaries, one per group, or nil on error (error is set)
+ */
+-(NSArray *)aggregate:(NSDictionary *)aggregates where:(NSString *)where args:(NSArray *)args groupBy:(NSString *)groupBy error:(NSError **)error;
+
+/**
+ *  Calculates aggregate values (SUM, AVG, MIN, MAX, COUNT, etc.) for the items matching the query string, optionally grouped.
+ *
+ *  @param aggregates        a dictionary of result keys to SQLITE aggregate expressions, for instance @{@"total": @"SUM([amount])"}.
+ *  @param where             the SQLITE WHERE clause to execute. may be nil.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param groupBy           A comma-separated list of JSON field names to group the results by, may be nil.
+ *  @return                  an array of dictionaries, one per group, or nil on error (self.error is set)
+ */
+-(NSArray *)aggregate:(NSDictionary *)aggregates where:(NSString *)where args:(NSArray *)args groupBy:(NSString *)groupBy;
+
 /**
  *  Returns at most limit items matching the where clause, ordered by the orderBy clause.
  *
@@ -360,6 +721,8 @@
  *  @note Query strings are a subset of the SQLITE WHERE clause where JSON fields are enclosed in square braces. Values may be used by inserting a ?
  *        in the query string and adding the value in the `args` array. (Parameterized SQL.) All JSON fields must be enclosed in square braces.
  *        Nested JSON fields are allowed using "." notation.
+ *  @note When the store has read connections (see NTJsonStore.readConnectionCount) the query runs in parallel with later operations, so
+ *        the completionHandler may run after theirs. The results always include every write requested before the find.
  */
 -(void)beginFindWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *items, NSError *error))completionHandler;
 
@@ -530,6 +893,186 @@
  */
 -(NSDictionary *)findOneWhere:(NSString *)where args:(NSArray *)args;
 
+/**
+ *  Returns selected fields of at most limit items matching the where clause, ordered by the orderBy clause.
+ *
+ *  @param fields            A comma-separated list of JSON field names to return. All JSON field names must be enclosed in square braces.
+ *  @param where             the SQLITE WHERE clause to execute. may be nil. See notes.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param orderBy           A comma-separated list of JSON field names to order the results by. All JSON field names must be enclosed
+ *                           in square braces. may be nil.
+ *  @param limit             the maximum number of items to return or 0 to return all items.
+ *  @param completionQueue   the queue to execute the completion handler in. Passing nil will cause a default to be selected for you. See notes.
+ *  @param completionHandler the completionHandler to run on completion. May not be nil. rows is an array of dictionaries containing
+ *                           __rowid__ and each field (by field name, nested fields are not expanded, so "[user.name]" is returned as "user.name".)
+ *  @note completionQueue may be a speficic queue, nil or the special queue 'NTJsonStoreSerialQueue'. NTJsonStoreSerialQueue is an alias for the internal
+ *        serial queue used for collection operations.
+ *        Passing nil will cause the system to select the correct queue for you:
+ *        if running on the UI thread then the completion handler will run on the UI thread,
+ *        otherwise the completionHandler will run on a background thread.
+ *  @note Queryable fields are read from their columns without loading the document. Other fields are extracted from the document
+ *        by SQLITE (they are not added as queryable fields.) Rows are plain dictionaries and are not cached. Objects, arrays and
+ *        booleans are returned as they are in the document (their JSON type is read from the document.) Missing or NULL values are left out.
+ *  @note When the store has read connections (see NTJsonStore.readConnectionCount) the query runs in parallel with later operations, so
+ *        the completionHandler may run after theirs.
+ */
+-(void)beginFindFields:(NSString *)fields where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *rows, NSError *error))completionHandler;
+
+/**
+ *  Returns selected fields of at most limit items matching the where clause, ordered by the orderBy clause.
+ *
+ *  @param fields            A comma-separated list of JSON field names to return. All JSON field names must be enclosed in square braces.
+ *  @param where             the SQLITE WHERE clause to execute. may be nil.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param orderBy           A comma-separated list of JSON field names to order the results by. may be nil.
+ *  @param limit             the maximum number of items to return or 0 to return all items.
+ *  @param completionHandler completionHandler the completionHandler to run on completion. May not be nil. The completionHandler is run on
+ *                           the UI thread if the call is made from the UI thread, otherwise the call is made from a background thread.
+ */
+-(void)beginFindFields:(NSString *)fields where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionHandler:(void (^)(NSArray *rows, NSError *error))completionHandler;
+
+/**
+ *  Returns selected fields of at most limit items matching the where clause, ordered by the orderBy clause.
+ *
+ *  @param fields            A comma-separated list of JSON field names to return. All JSON field names must be enclosed in square braces.
+ *  @param where             the SQLITE WHERE clause to execute. may be nil.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param orderBy           A comma-separated list of JSON field names to order the results by. may be nil.
+ *  @param limit             the maximum number of items to return or 0 to return all items.
+ *  @param error             a pointer to the error which is set on failure (nil is returned). May be nil.
+ *  @return                  an array of dictionaries containing __rowid__ and each field, or nil on error (error is set)
+ */
+-(NSArray *)findFields:(NSString *)fields where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit error:(NSError **)error;
+
+/**
+ *  Returns selected fields of at most limit items matching the where clause, ordered by the orderBy clause.
+ *
+ *  @param fields            A comma-separated list of JSON field names to return. All JSON field names must be enclosed in square braces.
+ *  @param where             the SQLITE WHERE clause to execute. may be nil.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param orderBy           A comma-separated list of JSON field names to order the results by. may be nil.
+ *  @param limit             the maximum number of items to return or 0 to return all items.
+ *  @return                  an array of dictionaries containing __rowid__ and each field, or nil on error (self.error is set)
+ */
+-(NSArray *)findFields:(NSString *)fields where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit;
+
+/**
+ *  Returns a cursor that reads the items matching the where clause in batches. Use this instead of findWhere: for large result
+ *  sets - only one batch is held in memory at a time and the first items are available as soon as the first batch is read.
+ *
+ *  @param where             the SQLITE WHERE clause to execute. may be nil. See notes.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param orderBy           A comma-separated list of JSON field names to order the results by. May be nil. Items with the same values
+ *                           are returned in rowid order.
+ *  @param batchSize         the number of items to read in each batch. Pass zero to use the default (100.)
+ *  @param continuation      the continuation of a previous cursor with the same where, args and orderBy to resume after the last item
+ *                           it returned, or nil to start at the beginning.
+ *  @return                  the cursor. Nothing is read until the first item or batch is requested.
+ *  @note Query strings are a subset of the SQLITE WHERE clause where JSON fields are enclosed in square braces. Values may be used by inserting a ?
+ *        in the query string and adding the value in the `args` array. (Parameterized SQL.) All JSON fields must be enclosed in square braces.
+ *        Nested JSON fields are allowed using "." notation.
+ */
+-(NTJsonCursor *)cursorWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy batchSize:(int)batchSize continuation:(NSArray *)continuation;
+
+/**
+ *  Returns a cursor that reads the items matching the where clause in batches, starting at the beginning.
+ *
+ *  @param where             the SQLITE WHERE clause to execute. may be nil.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param orderBy           A comma-separated list of JSON field names to order the results by. May be nil.
+ *  @param batchSize         the number of items to read in each batch. Pass zero to use the default (100.)
+ *  @return                  the cursor.
+ */
+-(NTJsonCursor *)cursorWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy batchSize:(int)batchSize;
+
+/**
+ *  Asynchronously reads the items matching the where clause in batches, calling batchHandler for each one. The next batch is not
+ *  read until batchHandler returns, so memory use is bounded by the batch size.
+ *
+ *  @param where             the SQLITE WHERE clause to execute. may be nil.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param orderBy           A comma-separated list of JSON field names to order the results by. May be nil.
+ *  @param batchSize         the number of items to read in each batch. Pass zero to use the default (100.)
+ *  @param continuation      the continuation to resume after or nil to start at the beginning.
+ *  @param completionQueue   the queue to execute the handlers in. Passing nil will cause a default to be selected for you.
+ *  @param batchHandler      called with each batch. Return NO to stop the enumeration. May not be nil.
+ *  @param completionHandler called once the enumeration is complete or stopped with the continuation after the last item passed to
+ *                           batchHandler (pass it to resume later) and any error. May be nil.
+ */
+-(void)beginEnumerateWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy batchSize:(int)batchSize continuation:(NSArray *)continuation completionQueue:(dispatch_queue_t)completionQueue batchHandler:(BOOL (^)(NSArray *items))batchHandler completionHandler:(void (^)(NSArray *continuation, NSError *error))completionHandler;
+
+/**
+ *  Asynchronously reads the items matching the where clause in batches, calling batchHandler for each one.
+ *
+ *  @param where             the SQLITE WHERE clause to execute. may be nil.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param orderBy           A comma-separated list of JSON field names to order the results by. May be nil.
+ *  @param batchSize         the number of items to read in each batch. Pass zero to use the default (100.)
+ *  @param batchHandler      called with each batch. Return NO to stop the enumeration. May not be nil. Handlers are run on
+ *                           the UI thread if the call is made from the UI thread, otherwise the call is made from a background thread.
+ *  @param completionHandler called once the enumeration is complete or stopped. May be nil.
+ */
+-(void)beginEnumerateWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy batchSize:(int)batchSize batchHandler:(BOOL (^)(NSArray *items))batchHandler completionHandler:(void (^)(NSArray *continuation, NSError *error))completionHandler;
+
+/**
+ *  Adds a handler that is called with each batch of changes made through this collection. Changes are coalesced for
+ *  changeDeliveryInterval before they are delivered. Changes made by other processes are only reported when the store's
+ *  detectExternalChanges is enabled.
+ *
+ *  @param completionQueue   the queue to execute the handler in. Passing nil will cause a default to be selected for you.
+ *  @param handler           called with the inserted, updated and removed rowids. May not be nil.
+ *  @return                  the observer, pass it to removeChangeObserver: to stop receiving changes.
+ */
+-(id)addChangeObserverWithQueue:(dispatch_queue_t)completionQueue handler:(void (^)(NTJsonChanges *changes))handler;
+
+/**
+ *  Adds a handler that is called with each batch of changes made through this collection.
+ *
+ *  @param handler           called with the inserted, updated and removed rowids. May not be nil. Handlers are run on the UI thread
+ *                           if the call is made from the UI thread, otherwise the call is made from a background thread.
+ *  @return                  the observer, pass it to removeChangeObserver: to stop receiving changes.
+ */
+-(id)addChangeObserverWithHandler:(void (^)(NTJsonChanges *changes))handler;
+
+/**
+ *  Stops delivering changes to an observer.
+ *
+ *  @param observer          the value returned by addChangeObserver...
+ */
+-(void)removeChangeObserver:(id)observer;
+
+/**
+ *  Returns a live query, which keeps the results of a find current as the collection changes. Only items that changed are read
+ *  again. The handler is called with the initial results (changes is nil) and again whenever the results change.
+ *
+ *  @param where             the SQLITE WHERE clause to execute. may be nil. See notes.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param orderBy           A comma-separated list of JSON field names to order the results by. May be nil. Items with the same values
+ *                           are returned in rowid order.
+ *  @param limit             the maximum number of items to return or 0 for no limit.
+ *  @param completionQueue   the queue to execute the handler in. Passing nil will cause a default to be selected for you.
+ *  @param handler           called with the current results and the rowids that were inserted into, updated in or removed from them.
+ *                           If an error occurs items is nil and the live query is reloaded on the next change. May not be nil.
+ *  @return                  the live query. Call -stop when it is no longer needed.
+ *  @note Query strings are a subset of the SQLITE WHERE clause where JSON fields are enclosed in square braces. Values may be used by inserting a ?
+ *        in the query string and adding the value in the `args` array. (Parameterized SQL.) All JSON fields must be enclosed in square braces.
+ *        Nested JSON fields are allowed using "." notation. orderBy may not use COLLATE.
+ */
+-(NTJsonLiveQuery *)liveQueryWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionQueue:(dispatch_queue_t)completionQueue handler:(void (^)(NSArray *items, NTJsonChanges *changes, NSError *error))handler;
+
+/**
+ *  Returns a live query, which keeps the results of a find current as the collection changes.
+ *
+ *  @param where             the SQLITE WHERE clause to execute. may be nil.
+ *  @param args              arguments to the where clause, may be nil.
+ *  @param orderBy           A comma-separated list of JSON field names to order the results by. May be nil.
+ *  @param limit             the maximum number of items to return or 0 for no limit.
+ *  @param handler           called with the current results and the changes to them. May not be nil. Handlers are run on the UI thread
+ *                           if the call is made from the UI thread, otherwise the call is made from a background thread.
+ *  @return                  the live query. Call -stop when it is no longer needed.
+ */
+-(NTJsonLiveQuery *)liveQueryWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit handler:(void (^)(NSArray *items, NTJsonChanges *changes, NSError *error))handler;
+
 /**
  *  Remove all items matching the where clause.
  *
@@ -644,7 +1187,8 @@
 -(void)beginSyncWithCompletionHandler:(void (^)())completionHandler;
 
 /**
- *  block the current thread until all currently pending operations have been completed or the timeout has elapsed.
+ *  block the current thread until all currently pending operations have been completed or the timeout has elapsed. This includes
+ *  finds and counts running on read connections.
  *
  *  @param duration the maximum number of MS to wait for pending operations to complete.
  *
@@ -9,6 +9,87 @@
 #import "NTJsonStore+Private.h"
 
 
+static const int DEFAULT_SERIALIZATION_CHUNK_SIZE = 500;
+static const int DEFAULT_MATERIALIZATION_BATCH_SIZE = 1000;
+static const int DEFAULT_QUERY_CACHE_SIZE = 0;
+static const int DEFAULT_QUERY_CACHE_MAX_ROWS = 1000;
+static const int MAX_COMPILED_SQL = 256;
+static const double STATISTICS_SAVE_DELAY = 2.0;
+static const int STATISTICS_REBUILD_BATCH_SIZE = 10000;    // only the materialized columns are read, so batches can be large
+static const int STATISTICS_ANALYSIS_LIMIT = 1000;         // rows ANALYZE samples per index
+static const double DEFAULT_CHANGE_DELIVERY_INTERVAL = 0.05;
+static const int CHANGE_LOG_MAX_ENTRIES = 10000;
+static const int CHANGE_LOG_PRUNE_INTERVAL = 1000;
+
+typedef enum
+{
+    NTJsonChangeLogOpInsert = 1,
+    NTJsonChangeLogOpUpdate = 2,
+    NTJsonChangeLogOpRemove = 3,
+} NTJsonChangeLogOp;
+
+
+@interface NTJsonCompiledSql : NSObject
+{
+@public // allow direct access for performance
+    NSString *_sql;                 // aliases replaced
+    NSArray *_columnNames;          // every [column] referenced, except __rowid__
+    NSSet *_queryColumnNames;       // for the query cache, nil if the document is referenced directly
+    NSString *_equalityColumnName;  // set when the SQL is "[column] = ?"
+    BOOL _isScanned;                // new columns have been added to the schema
+    NSString *_resolvedSql;         // columns resolved for the current schema, nil until needed
+}
+
+@end
+
+
+@implementation NTJsonCompiledSql
+
+@end
+
+
+@interface NTJsonQueryPlan : NSObject
+{
+@public // allow direct access for performance
+    NSString *_sql;
+    NSArray *_args;
+    NSArray *_rowColumns;       // lazy row columns to select (finds only)
+    NSString *_queryKey;        // query cache key, nil if we aren't caching the results
+    NSSet *_columnNames;        // the columns the query depends on, for the query cache
+    int _queryCacheGeneration;  // results are only cached if nothing was invalidated while the query ran
+    int _objectCacheGeneration; // rows read on a read connection are only cached if nothing was written since the plan was made
+    NSArray *_items;            // find results answered without running the query
+    NSNumber *_count;           // count answered without running the query
+    int _keyIndex;              // the first cursor key column (cursors only)
+    int _keyCount;              // the number of cursor key columns, the rowid is added to these
+    NSMutableArray *_rowKeys;   // receives the cursor continuation for each row
+    NSArray *_resultKeys;       // the dictionary key for each selected column (aggregates and projections only)
+    NSDictionary *_typeColumns; // result index -> the column holding its JSON type (projections only)
+}
+
+@end
+
+
+@implementation NTJsonQueryPlan
+
+@end
+
+
+@interface NTJsonChangeObserver : NSObject
+{
+@public
+    dispatch_queue_t _completionQueue;
+    void (^_handler)(NTJsonChanges *changes);
+}
+
+@end
+
+
+@implementation NTJsonChangeObserver
+
+@end
+
+
 @interface NTJsonCollection ()
 {
     NTJsonStore __weak *_store;
@@ -19,8 +100,13 @@
     NSArray *_columns;
     NSArray *_indexes;
     NTJsonObjectCache *_objectCache;
+    int _cacheByteLimit;                // kept here so it survives the cache being disabled
+    NTJsonQueryCache *_queryCache;
     NSDictionary *_defaultJson;
     NSDictionary *_aliases;
+    NSMutableDictionary *_compiledSql;  // raw where or orderBy -> NTJsonCompiledSql
+    dispatch_group_t _readGroup;        // finds and counts running on read connections
+    NTJsonMetrics *_metrics;            // thread safe, never changes after init
     NSError *_lastError;
     
     BOOL _isClosing;
@@ -30,9 +116,73 @@
     
     NSMutableArray *_pendingColumns;
     NSMutableArray *_pendingIndexes;
+    
+    int _serializationChunkSize;
+    BOOL _lazyDecoding;
+    
+    NSNumber *_columnMode;  // lazy loaded
+    BOOL _needsColumnModeMigration; // saved with the column mode so a migration isn't lost if we exit first
+    
+    BOOL _isMaterializationLoaded;
+    BOOL _isMaterializationScheduled;
+    NSMutableArray *_materializingColumns;
+    NTJsonRowId _materializationLastRowId;
+    NTJsonRowId _materializationMaxRowId;
+    int _materializationBatchSize;
+    void (^_materializationProgressHandler)(NSArray *columnNames, float progress);
+    
+    NSNumber *_documentFormat;  // lazy loaded
+    NTJsonKeyDictionary *_keyDictionary;    // lazy loaded
+    
+    BOOL _isConversionLoaded;
+    BOOL _isConversionScheduled;
+    BOOL _isConverting;
+    NTJsonRowId _conversionLastRowId;
+    NTJsonRowId _conversionMaxRowId;
+    
+    BOOL _uniqueKeyLookup;
+    NSMutableDictionary *_uniqueKeyMaps;    // columnName -> NTJsonUniqueKeyMap, nil until the first lookup
+    BOOL _isUniqueKeyLoadScheduled;
+    NTJsonRowId _uniqueKeyLoadLastRowId;
+    NTJsonRowId _uniqueKeyLoadMaxRowId;
+    
+    NTJsonStatistics *_statistics;  // lazy loaded
+    BOOL _isStatisticsDirty;        // the saved statistics are marked as out of date
+    BOOL _isStatisticsStale;        // another process changed the collection, recount instead of loading the saved statistics
+    BOOL _isStatisticsSaveScheduled;
+    BOOL _isStatisticsRebuildScheduled;         // also set while a rebuild is in progress
+    NSArray *_statisticsRebuildColumns;         // the columns being rebuilt
+    NSArray *_statisticsRebuildColumnStatistics;
+    NTJsonRowId _statisticsRebuildLastRowId;
+    int64_t _statisticsRebuildRowCount;
+    BOOL _statisticsRebuildDidAnalyze;
+    BOOL _statisticsRebuildSawWrite;            // rows were written while the rebuild was in progress
+    
+    NSMutableArray *_changeObservers;       // NTJsonChangeObservers, nil until the first is added
+    NSMutableArray *_liveQueries;           // active NTJsonLiveQueries, nil until the first is added
+    NTJsonPendingChanges *_pendingChanges;  // changes waiting to be delivered
+    NTJsonPendingChanges *_heldChanges;     // changes of a multi-row write, passed on only if it commits (nil otherwise)
+    BOOL _isChangeDeliveryScheduled;
+    NSTimeInterval _changeDeliveryInterval;
+    
+    BOOL _isInStoreTransaction;                     // our queue is suspended and we are running on the store connection
+    BOOL _wasNewCollection;                         // _isNewCollection when the transaction started
+    NSMutableSet *_transactionRowIds;               // rows inserted, updated or removed in the transaction
+    NSMutableDictionary *_transactionCacheUpdates;  // rowid -> @[json, cost], added to the object cache if the transaction commits
+    NTJsonPendingChanges *_transactionChanges;      // changes delivered if the transaction commits
+    
+    NSString *_groupCommitTransactionId;        // the open group commit transaction, nil if there isn't one
+    NSMutableArray *_groupCommitCompletions;    // blocks called with the commit error once the group is committed
+    
+    BOOL _detectExternalChanges;    // copied from the store, it can't change once the store is open
+    BOOL _isChangeLogReady;         // the change log table and our triggers exist
+    int64_t _dataVersion;           // PRAGMA data_version when the change log was last read
+    int64_t _changeLogSeq;          // the last change log entry we have seen, -1 until the log is first read
+    int _changeLogWrites;           // writes since the change log was last pruned
 }
 
 @property (nonatomic,readonly) NTJsonSqlConnection *connection;
+@property (atomic) BOOL isBinaryDocumentFormat;    // mirrors documentFormat so bulk inserts can check it before reaching the queue
 
 @end
 
@@ -58,8 +208,36 @@
         
         _pendingColumns = [NSMutableArray array];
         _pendingIndexes = [NSMutableArray array];
-        _connection = [[NTJsonSqlConnection alloc] initWithFilename:store.storeFilename connectionName:self.name];
+        _serializationChunkSize = DEFAULT_SERIALIZATION_CHUNK_SIZE;
+        _materializingColumns = [NSMutableArray array];
+        _materializationBatchSize = DEFAULT_MATERIALIZATION_BATCH_SIZE;
+        _compiledSql = [NSMutableDictionary dictionary];
+        _readGroup = dispatch_group_create();
+        _connection = [[NTJsonSqlConnection alloc] initWithFilename:[store filenameForCollectionName:self.name] connectionName:self.name];
+        _metrics = [[NTJsonMetrics alloc] init];
+        _metrics.isEnabled = store.metricsEnabled;
+        _metrics.slowQueryThreshold = store.slowQueryThreshold;
+        _connection.metrics = _metrics;
+        _connection.synchronous = store.synchronous;
         _objectCache = [[NTJsonObjectCache alloc] initWithDeallocQueue:_connection.queue];
+        _cacheByteLimit = (int)_objectCache.cacheByteLimit;
+        _queryCache = [[NTJsonQueryCache alloc] initWithCacheSize:DEFAULT_QUERY_CACHE_SIZE maxRows:DEFAULT_QUERY_CACHE_MAX_ROWS];
+        _pendingChanges = [[NTJsonPendingChanges alloc] init];
+        _changeDeliveryInterval = DEFAULT_CHANGE_DELIVERY_INTERVAL;
+        _detectExternalChanges = store.detectExternalChanges;
+        _changeLogSeq = -1;
+        
+        NTJsonCollection __weak *weakSelf = self;
+        
+        [_connection dispatchAsync:^{
+            [weakSelf.connection addFunctionWithName:@"NTJson_extract" argCount:2 block:^(sqlite3_context *context, int argc, sqlite3_value **argv) {
+                [weakSelf sqlFunction_extract:context argv:argv];
+            }];
+            
+            [weakSelf.connection addFunctionWithName:@"NTJson_type" argCount:2 block:^(sqlite3_context *context, int argc, sqlite3_value **argv) {
+                [weakSelf sqlFunction_type:context argv:argv];
+            }];
+        }];
     }
 
     return self;
@@ -76,6 +254,8 @@
         _columns = [NSArray array];
         _indexes = [NSArray array];
         _defaultJson = nil;
+        _isMaterializationLoaded = YES;   // nothing to resume for a new collection
+        _isConversionLoaded = YES;
     }
     
     return self;
@@ -196,7 +376,10 @@
         else
         {
             if ( !_objectCache )
+            {
                 _objectCache = [[NTJsonObjectCache alloc] initWithCacheSize:cacheSize deallocQueue:self.connection.queue];
+                _objectCache.cacheByteLimit = _cacheByteLimit;
+            }
 
             else
                 _objectCache.cacheSize = cacheSize;
@@ -205,10 +388,134 @@
 }
 
 
+-(int)cacheByteLimit
+{
+    __block int cacheByteLimit;
+    
+    [self.connection dispatchSync:^{
+        cacheByteLimit = _cacheByteLimit;
+    }];
+    
+    return cacheByteLimit;
+}
+
+
+-(void)setCacheByteLimit:(int)cacheByteLimit
+{
+    [self.connection dispatchAsync:^{
+        _cacheByteLimit = MAX(cacheByteLimit, 0);
+        _objectCache.cacheByteLimit = _cacheByteLimit;
+    }];
+}
+
+
 -(void)flushCache
 {
     [self.connection dispatchAsync:^{
         [_objectCache flush];
+        [_queryCache removeAll];
+    }];
+}
+
+
+-(int)queryCacheSize
+{
+    __block int queryCacheSize;
+    
+    [self.connection dispatchSync:^{
+        queryCacheSize = _queryCache.cacheSize;
+    }];
+    
+    return queryCacheSize;
+}
+
+
+-(void)setQueryCacheSize:(int)queryCacheSize
+{
+    [self.connection dispatchAsync:^{
+        _queryCache.cacheSize = queryCacheSize;
+    }];
+}
+
+
+-(int)queryCacheMaxRows
+{
+    __block int queryCacheMaxRows;
+    
+    [self.connection dispatchSync:^{
+        queryCacheMaxRows = _queryCache.maxRows;
+    }];
+    
+    return queryCacheMaxRows;
+}
+
+
+-(void)setQueryCacheMaxRows:(int)queryCacheMaxRows
+{
+    [self.connection dispatchAsync:^{
+        _queryCache.maxRows = queryCacheMaxRows;
+    }];
+}
+
+
+-(int)queryCacheHits
+{
+    __block int queryCacheHits;
+    
+    [self.connection dispatchSync:^{
+        queryCacheHits = _queryCache.hits;
+    }];
+    
+    return queryCacheHits;
+}
+
+
+-(int)queryCacheMisses
+{
+    __block int queryCacheMisses;
+    
+    [self.connection dispatchSync:^{
+        queryCacheMisses = _queryCache.misses;
+    }];
+    
+    return queryCacheMisses;
+}
+
+
+-(int)serializationChunkSize
+{
+    @synchronized(self)     // read before requests reach the queue
+    {
+        return _serializationChunkSize;
+    }
+}
+
+
+-(void)setSerializationChunkSize:(int)serializationChunkSize
+{
+    @synchronized(self)
+    {
+        _serializationChunkSize = MAX(serializationChunkSize, 1);
+    }
+}
+
+
+-(BOOL)lazyDecoding
+{
+    __block BOOL lazyDecoding;
+    
+    [self.connection dispatchSync:^{
+        lazyDecoding = _lazyDecoding;
+    }];
+    
+    return lazyDecoding;
+}
+
+
+-(void)setLazyDecoding:(BOOL)lazyDecoding
+{
+    [self.connection dispatchAsync:^{
+        _lazyDecoding = lazyDecoding;
     }];
 }
 
@@ -219,6 +526,18 @@
 -(void)applyConfig:(NSDictionary *)config
 {
     NSNumber *cacheSize = config[@"cacheSize"];
+    NSNumber *cacheByteLimit = config[@"cacheByteLimit"];
+    NSNumber *serializationChunkSize = config[@"serializationChunkSize"];
+    NSNumber *materializationBatchSize = config[@"materializationBatchSize"];
+    NSNumber *lazyDecoding = config[@"lazyDecoding"];
+    NSNumber *queryCacheSize = config[@"queryCacheSize"];
+    NSNumber *queryCacheMaxRows = config[@"queryCacheMaxRows"];
+    NSNumber *uniqueKeyLookup = config[@"uniqueKeyLookup"];
+    NSNumber *metricsEnabled = config[@"metricsEnabled"];
+    NSNumber *slowQueryThreshold = config[@"slowQueryThreshold"];
+    NSNumber *changeDeliveryInterval = config[@"changeDeliveryInterval"];
+    NSString *columnMode = config[@"columnMode"];
+    NSString *documentFormat = config[@"documentFormat"];
     NSDictionary *defaultJson = config[@"defaultJson"];
     NSArray *indexes = config[@"indexes"];
     NSArray *uniqueIndexes = config[@"uniqueIndexes"];
@@ -229,6 +548,83 @@
         self.cacheSize = [cacheSize intValue];
     }
     
+    if ( [cacheByteLimit isKindOfClass:[NSNumber class]] )
+    {
+        self.cacheByteLimit = [cacheByteLimit intValue];
+    }
+    
+    if ( [serializationChunkSize isKindOfClass:[NSNumber class]] )
+    {
+        self.serializationChunkSize = [serializationChunkSize intValue];
+    }
+    
+    if ( [materializationBatchSize isKindOfClass:[NSNumber class]] )
+    {
+        self.materializationBatchSize = [materializationBatchSize intValue];
+    }
+    
+    if ( [lazyDecoding isKindOfClass:[NSNumber class]] )
+    {
+        self.lazyDecoding = [lazyDecoding boolValue];
+    }
+    
+    if ( [queryCacheSize isKindOfClass:[NSNumber class]] )
+    {
+        self.queryCacheSize = [queryCacheSize intValue];
+    }
+    
+    if ( [queryCacheMaxRows isKindOfClass:[NSNumber class]] )
+    {
+        self.queryCacheMaxRows = [queryCacheMaxRows intValue];
+    }
+    
+    if ( [metricsEnabled isKindOfClass:[NSNumber class]] )
+    {
+        self.metricsEnabled = [metricsEnabled boolValue];
+    }
+    
+    if ( [slowQueryThreshold isKindOfClass:[NSNumber class]] )
+    {
+        self.slowQueryThreshold = [slowQueryThreshold doubleValue];
+    }
+    
+    if ( [changeDeliveryInterval isKindOfClass:[NSNumber class]] )
+    {
+        self.changeDeliveryInterval = [changeDeliveryInterval doubleValue];
+    }
+    
+    if ( [uniqueKeyLookup isKindOfClass:[NSNumber class]] )
+    {
+        self.uniqueKeyLookup = [uniqueKeyLookup boolValue];
+    }
+    
+    if ( [columnMode isKindOfClass:[NSString class]] )
+    {
+        if ( [columnMode isEqualToString:@"materialized"] )
+            self.columnMode = NTJsonColumnModeMaterialized;
+        
+        else if ( [columnMode isEqualToString:@"virtual"] )
+            self.columnMode = NTJsonColumnModeVirtual;
+        
+        else if ( [columnMode isEqualToString:@"expression"] )
+            self.columnMode = NTJsonColumnModeExpression;
+        
+        else
+            LOG_ERROR(@"Unknown columnMode for %@ - %@", self.name, columnMode);
+    }
+    
+    if ( [documentFormat isKindOfClass:[NSString class]] )
+    {
+        if ( [documentFormat isEqualToString:@"text"] )
+            self.documentFormat = NTJsonDocumentFormatText;
+        
+        else if ( [documentFormat isEqualToString:@"binary"] )
+            self.documentFormat = NTJsonDocumentFormatBinary;
+        
+        else
+            LOG_ERROR(@"Unknown documentFormat for %@ - %@", self.name, documentFormat);
+    }
+    
     if ( [defaultJson isKindOfClass:[NSDictionary class]] )
     {
         self.defaultJson = defaultJson;
@@ -289,6 +685,90 @@
 }
 
 
+#pragma mark - metrics
+
+
+-(BOOL)metricsEnabled
+{
+    return _metrics.isEnabled;
+}
+
+
+-(void)setMetricsEnabled:(BOOL)metricsEnabled
+{
+    _metrics.isEnabled = metricsEnabled;
+}
+
+
+-(double)slowQueryThreshold
+{
+    return _metrics.slowQueryThreshold;
+}
+
+
+-(void)setSlowQueryThreshold:(double)slowQueryThreshold
+{
+    _metrics.slowQueryThreshold = slowQueryThreshold;
+}
+
+
+-(NSDictionary *)metrics
+{
+    NSMutableDictionary *metrics = [_metrics snapshot];
+    
+    [self.connection dispatchSync:^{
+        int hits = _objectCache.hits;
+        int misses = _objectCache.misses;
+        
+        metrics[@"objectCache"] = @{
+                                    @"hits": @(hits),
+                                    @"misses": @(misses),
+                                    @"hitRate": @((hits + misses) ? (double)hits / (hits + misses) : 0),
+                                    @"cachedCount": @(_objectCache.cachedCount),
+                                    @"cachedBytes": @(_objectCache.cachedBytes),
+                                    };
+        
+        metrics[@"queryCache"] = @{
+                                   @"hits": @(_queryCache.hits),
+                                   @"misses": @(_queryCache.misses),
+                                   };
+        
+        metrics[@"statementCache"] = @{
+                                       @"hits": @(self.connection.statementCacheHits),
+                                       @"misses": @(self.connection.statementCacheMisses),
+                                       @"cachedCount": @(self.connection.statementCacheCount),
+                                       };
+    }];
+    
+    return [metrics copy];
+}
+
+
+-(void)resetMetrics
+{
+    [_metrics reset];
+    
+    [self.connection dispatchAsync:^{
+        [_objectCache resetStatistics];
+    }];
+}
+
+
+-(void)metrics_checkSlowQueryWithPlan:(NTJsonQueryPlan *)plan connection:(NTJsonSqlConnection *)connection startedAt:(CFAbsoluteTime)startedAt
+{
+    // Called on the connection that ran the query, the plan is explained on the same connection...
+    
+    if ( ![_metrics isSlowQueryStartedAt:startedAt] )
+        return ;
+    
+    NSArray *queryPlan = [connection queryPlanWithSql:plan->_sql args:plan->_args];
+    
+    LOG(@"Slow query on %@ (%.3fs): %@", self.name, CFAbsoluteTimeGetCurrent() - startedAt, plan->_sql);
+    
+    [_metrics addSlowQueryWithSql:plan->_sql expandedSql:[NTJsonSqlConnection expandedSql:plan->_sql args:plan->_args] queryPlan:queryPlan startedAt:startedAt];
+}
+
+
 #pragma mark - close
 
 
@@ -303,6 +783,13 @@
     
     [self.connection dispatchSync:^
     {
+        // let SQLITE analyze anything our queries showed would benefit from it...
+        
+        [self groupCommit_commit];
+        
+        if ( _statistics )
+            [self.connection execSql:@"PRAGMA optimize;" args:nil];
+        
         [self.connection close];
         
         // release all memory associated with this connection
@@ -312,9 +799,19 @@
         _columns = nil;
         _indexes = nil;
         _objectCache = nil;
+        _queryCache = nil;
         _defaultJson = nil;
         _pendingColumns = nil;
         _pendingIndexes = nil;
+        _materializingColumns = nil;
+        _materializationProgressHandler = nil;
+        _keyDictionary = nil;
+        _uniqueKeyMaps = nil;
+        _compiledSql = nil;
+        _statistics = nil;
+        _changeObservers = nil;
+        _liveQueries = nil;
+        _pendingChanges = nil;
         
         _isClosed = YES;
         _isClosing = NO;
@@ -404,62 +901,375 @@
                 [_pendingColumns addObject:column];
         }
         
+        // Indexes on virtual and expression columns include the default, so they need to be re-created as well...
+        
+        NSArray *changedIndexes = [self.indexes NTJsonStore_transform:^id(NTJsonIndex *index) {
+            return [changedColumns NTJsonStore_find:^BOOL(NTJsonColumn *column) {
+                return column.kind != NTJsonColumnKindMaterialized && [index.keys rangeOfString:[NSString stringWithFormat:@"[%@]", column.name]].location != NSNotFound;
+            }] ? index : nil;
+        }];
+        
+        if ( changedIndexes.count )
+        {
+            _indexes = [_indexes NTJsonStore_transform:^id(NTJsonIndex *index) { return [changedIndexes containsObject:index] ? nil : index; }];
+            
+            for(NTJsonIndex *index in changedIndexes)
+                [_pendingIndexes addObject:[NTJsonIndex indexWithName:index.name keys:index.keys isUnique:index.isUnique kind:index.kind]];
+        }
+        
         // Update our internal variables...
         
         _defaultJson = [defaultJson copy];
         
+        [self flushCompiledSql];    // virtual columns resolve their defaults in the query
+        
+        [_queryCache removeAll];    // queries with defaults may have different results now
+        
+        if ( changedColumns.count && _uniqueKeyMaps )
+            [self uniqueKeys_reset];    // rows without a key now have a different value
+        
         // save our metadata...
-
-        [self.store saveMetadataWithKey:[self defaultJsonMetadataKey] value:_defaultJson];
+        
+        [self saveMetadataWithKey:[self defaultJsonMetadataKey] value:_defaultJson];
     }];
 }
 
 
-#pragma mark - aliases
+#pragma mark - columnMode
 
 
--(NSString *)aliasesMetadataKey
+-(NSString *)columnModeMetadataKey
 {
-    return [NSString stringWithFormat:@"%@/aliases", self.name];
+    return [NSString stringWithFormat:@"%@/columnMode", self.name];
 }
 
 
--(NSDictionary *)aliases
+-(void)columnMode_loadState
 {
-    __block NSDictionary *aliases;
+    if ( _columnMode )
+        return ;
+    
+    NSDictionary *metadata = [self.store metadataWithKey:[self columnModeMetadataKey]];
+    
+    _columnMode = [metadata[@"columnMode"] isKindOfClass:[NSNumber class]] ? metadata[@"columnMode"] : @(NTJsonColumnModeMaterialized);
+    _needsColumnModeMigration = [metadata[@"needsMigration"] boolValue];
+}
+
+
+-(void)columnMode_saveState
+{
+    [self saveMetadataWithKey:[self columnModeMetadataKey] value:@{@"columnMode": _columnMode, @"needsMigration": @(_needsColumnModeMigration)}];
+}
+
+
+-(NTJsonColumnMode)columnMode
+{
+    __block NTJsonColumnMode columnMode;
     
     [self.connection dispatchSync:^{
-        if ( !_aliases )
-        {
-            _aliases = [self.store metadataWithKey:[self aliasesMetadataKey]] ?: [NSDictionary dictionary];
-        }
+        [self columnMode_loadState];
         
-        aliases = _aliases;
+        columnMode = [_columnMode intValue];
     }];
     
-    return aliases;
+    return columnMode;
 }
 
 
--(void)setAliases:(NSDictionary *)aliases
+-(void)setColumnMode:(NTJsonColumnMode)columnMode
 {
-    aliases = [aliases copy] ?: @{};
-    
     [self.connection dispatchAsync:^{
+        if ( self.columnMode == columnMode )
+            return ;
         
-        // Update our internal variables...
-    
-        _aliases = aliases;
+        [self conversion_loadState];
+        
+        if ( columnMode != NTJsonColumnModeMaterialized && (self.documentFormat == NTJsonDocumentFormatBinary || _isConverting) )
+        {
+            LOG_ERROR(@"Binary documents require NTJsonColumnModeMaterialized, ignoring columnMode for %@", self.name);
+            return ;
+        }
+        
+        _columnMode = @(columnMode);
+        
+        [self flushCompiledSql];
+        
+        // existing columns and indexes will be converted the next time the schema is updated...
+        
+        if ( !_isNewCollection )
+            _needsColumnModeMigration = YES;
+        
+        [self columnMode_saveState];
+    }];
+}
+
+
+#pragma mark - documentFormat
+
+
+-(NSString *)documentFormatMetadataKey
+{
+    return [NSString stringWithFormat:@"%@/documentFormat", self.name];
+}
+
+
+-(NSString *)keyDictionaryMetadataKey
+{
+    return [NSString stringWithFormat:@"%@/binaryKeys", self.name];
+}
+
+
+-(NTJsonDocumentFormat)documentFormat
+{
+    __block NTJsonDocumentFormat documentFormat;
+    
+    [self.connection dispatchSync:^{
+        if ( !_documentFormat )
+        {
+            NSDictionary *metadata = [self.store metadataWithKey:[self documentFormatMetadataKey]];
+            
+            _documentFormat = [metadata[@"documentFormat"] isKindOfClass:[NSNumber class]] ? metadata[@"documentFormat"] : @(NTJsonDocumentFormatText);
+            self.isBinaryDocumentFormat = ([_documentFormat intValue] == NTJsonDocumentFormatBinary);
+        }
+        
+        documentFormat = [_documentFormat intValue];
+    }];
+    
+    return documentFormat;
+}
+
+
+-(void)setDocumentFormat:(NTJsonDocumentFormat)documentFormat
+{
+    [self.connection dispatchAsync:^{
+        if ( self.documentFormat == documentFormat )
+            return ;
+        
+        if ( documentFormat == NTJsonDocumentFormatBinary && self.columnMode != NTJsonColumnModeMaterialized )
+        {
+            LOG_ERROR(@"Binary documents require NTJsonColumnModeMaterialized, ignoring documentFormat for %@", self.name);
+            return ;
+        }
+        
+        _documentFormat = @(documentFormat);
+        self.isBinaryDocumentFormat = (documentFormat == NTJsonDocumentFormatBinary);
+        
+        [self flushCompiledSql];    // materializing columns are extracted differently from binary documents
+        
+        [self saveMetadataWithKey:[self documentFormatMetadataKey] value:@{@"documentFormat": _documentFormat}];
+        
+        // New writes use the new format right away, existing rows are converted in the background...
+        
+        if ( !_isNewCollection )
+            [self conversion_start];
+    }];
+}
+
+
+-(NTJsonKeyDictionary *)keyDictionary
+{
+    // Only called on our queue. Once loaded, the key dictionary itself is thread safe.
+    
+    if ( !_keyDictionary )
+    {
+        NSDictionary *metadata = [self.store metadataWithKey:[self keyDictionaryMetadataKey]];
+        NSArray *keys = [metadata[@"keys"] isKindOfClass:[NSArray class]] ? metadata[@"keys"] : nil;
+        
+        _keyDictionary = [[NTJsonKeyDictionary alloc] initWithKeys:keys];
+    }
+    
+    return _keyDictionary;
+}
+
+
+-(BOOL)saveKeyDictionary
+{
+    // New keys must be saved before any row using them is written...
+    
+    if ( !_keyDictionary.isDirty )
+        return YES;
+    
+    return [self saveMetadataWithKey:[self keyDictionaryMetadataKey] value:@{@"keys": [_keyDictionary keysForSaving]}];  // _lastError is set on failure
+}
+
+
+-(NSData *)encodeJson:(NSDictionary *)json error:(NSError **)error
+{
+    CFAbsoluteTime startedAt = [_metrics now];
+    
+    NSData *data;
+    
+    if ( self.documentFormat != NTJsonDocumentFormatBinary )
+        data = [NSJSONSerialization dataWithJSONObject:json options:0 error:error];
+    
+    else
+    {
+        data = [NTJsonBinaryCoder dataWithJson:json keyDictionary:self.keyDictionary error:error];
+        
+        if ( data && ![self saveKeyDictionary] )
+        {
+            if ( error )
+                *error = _lastError;
+            
+            data = nil;
+        }
+    }
+    
+    [_metrics addTimeStartedAt:startedAt toCounter:NTJsonMetricsCounterEncodeTime];
+    
+    return data;
+}
+
+
+-(NSDictionary *)decodeJsonBytes:(const void *)bytes length:(NSUInteger)length error:(NSError **)error
+{
+    // Rows may be in either format, particularly while a conversion is running...
+    
+    id json;
+    
+    if ( [NTJsonBinaryCoder isBinaryBytes:bytes length:length] )
+        json = [NTJsonBinaryCoder jsonWithBytes:bytes length:length keys:self.keyDictionary.keys error:error];
+    
+    else
+        json = [NSJSONSerialization JSONObjectWithData:[NSData dataWithBytesNoCopy:(void *)bytes length:length freeWhenDone:NO] options:0 error:error];
+    
+    if ( json && ![json isKindOfClass:[NSDictionary class]] )
+    {
+        if ( error )
+            *error = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidDocumentFormat];
+        
+        return nil;
+    }
+    
+    return json;
+}
+
+
+-(id)sqlFunction_valueWithArgv:(sqlite3_value **)argv
+{
+    // the value at argv[1] (a key path) in the document at argv[0], in either document format...
+    
+    const void *bytes = sqlite3_value_blob(argv[0]);
+    NSUInteger length = sqlite3_value_bytes(argv[0]);
+    const char *keyPath = (const char *)sqlite3_value_text(argv[1]);
+    
+    if ( !bytes || !keyPath )
+        return nil;
+    
+    if ( [NTJsonBinaryCoder isBinaryBytes:bytes length:length] )
+        return [NTJsonBinaryCoder valueForKeyPath:@(keyPath) inBytes:bytes length:length keyDictionary:self.keyDictionary];
+    
+    return [[self decodeJsonBytes:bytes length:length error:nil] NTJsonStore_objectForKeyPath:@(keyPath)];
+}
+
+
+-(void)sqlFunction_extract:(sqlite3_context *)context argv:(sqlite3_value **)argv
+{
+    // NTJson_extract(document, 'key.path') - like json_extract but works with both document formats...
+    
+    id value = [self sqlFunction_valueWithArgv:argv];
+    
+    if ( [value isKindOfClass:[NSNumber class]] )
+    {
+        const char *numType = [value objCType];
+        
+        if ( strcmp(numType, @encode(float)) == 0 || strcmp(numType, @encode(double)) == 0 )
+            sqlite3_result_double(context, [value doubleValue]);
+        
+        else
+            sqlite3_result_int64(context, [value longLongValue]);
+    }
+    
+    else if ( [value isKindOfClass:[NSString class]] )
+        sqlite3_result_text(context, [value UTF8String], -1, SQLITE_TRANSIENT);
+    
+    else if ( [value isKindOfClass:[NSArray class]] || [value isKindOfClass:[NSDictionary class]] )
+    {
+        NSData *jsonData = [NSJSONSerialization dataWithJSONObject:value options:0 error:nil];
+        
+        sqlite3_result_text(context, jsonData.bytes, (int)jsonData.length, SQLITE_TRANSIENT);
+    }
+    
+    else
+        sqlite3_result_null(context);
+}
+
+
+-(void)sqlFunction_type:(sqlite3_context *)context argv:(sqlite3_value **)argv
+{
+    // NTJson_type(document, 'key.path') - like json_type but works with both document formats. Only the types
+    // that NTJson_extract doesn't preserve are reported, anything else is NULL...
+    
+    id value = [self sqlFunction_valueWithArgv:argv];
+    const char *type = NULL;
+    
+    if ( value && CFGetTypeID((__bridge CFTypeRef)value) == CFBooleanGetTypeID() )
+        type = ([value boolValue]) ? "true" : "false";
+    
+    else if ( [value isKindOfClass:[NSArray class]] )
+        type = "array";
+    
+    else if ( [value isKindOfClass:[NSDictionary class]] )
+        type = "object";
+    
+    if ( type )
+        sqlite3_result_text(context, type, -1, SQLITE_STATIC);
+    else
+        sqlite3_result_null(context);
+}
+
+
+#pragma mark - aliases
+
+
+-(NSString *)aliasesMetadataKey
+{
+    return [NSString stringWithFormat:@"%@/aliases", self.name];
+}
+
+
+-(NSDictionary *)aliases
+{
+    __block NSDictionary *aliases;
+    
+    [self.connection dispatchSync:^{
+        if ( !_aliases )
+        {
+            _aliases = [self.store metadataWithKey:[self aliasesMetadataKey]] ?: [NSDictionary dictionary];
+        }
+        
+        aliases = _aliases;
+    }];
+    
+    return aliases;
+}
+
+
+-(void)setAliases:(NSDictionary *)aliases
+{
+    aliases = [aliases copy] ?: @{};
+    
+    [self.connection dispatchAsync:^{
+        
+        // Update our internal variables...
+    
+        _aliases = aliases;
+        
+        [self flushCompiledSql];
         
         // save our metadata...
         
-        [self.store saveMetadataWithKey:[self aliasesMetadataKey] value:_aliases];
+        [self saveMetadataWithKey:[self aliasesMetadataKey] value:_aliases];
     }];
 }
 
 
--(NSString *)_replaceAliasesIn:(NSString *)string
+-(NSString *)replaceTokensIn:(NSString *)string identifierBlock:(NSString *(^)(NSString *identifier))identifierBlock columnBlock:(NSString *(^)(NSString *columnName))columnBlock
 {
+    // The tokenizer behind alias expansion and column resolution. Each bare identifier and []-enclosed column name outside
+    // of quotes is passed to its block (if any), which returns the replacement or nil to leave it alone. The strings passed
+    // to the blocks point into our buffer, so they must not be kept.
+    
     // note: this uses unichar (unicode 16) which is the native format for NSString.
     // some characters (like emoji) would be 2 chars here, but that's unlikely to show up in
     // query strings, so we ignore that case. If it became an issue we could convert to unicode 32
@@ -473,60 +1283,34 @@
     
     const unichar *start = buffer;
     const unichar *ptr = start;
-
-    NSDictionary *aliases = [self aliases];
     
     NSMutableString *result = nil; // we initialize this when (and if) we actually use it...
     
     while (*ptr)
     {
+        const unichar *startToken = ptr;
+        NSString *value = nil;
+        
         if ( isalpha(*ptr) || *ptr == '_')  // this is a possible alias
         {
-            const unichar *startAlias = ptr;
-            
             while (*ptr && (isalnum(*ptr) || *ptr == '_'))
                 ++ptr;
             
-            NSString *alias = [[NSString alloc] initWithCharactersNoCopy:(unichar *)startAlias length:(ptr-startAlias) freeWhenDone:NO];
-            
-            NSString *value = aliases[alias];
-            
-            if ( value )
-            {
-                // append anything before the start of our alias first...
-                
-                if ( start != startAlias )
-                {
-                    if ( !result )
-                        result = [[NSMutableString alloc] initWithCharacters:(unichar *)start length:(startAlias-start)];
-                    else
-                        [result appendString:[[NSString alloc] initWithCharactersNoCopy:(unichar *)start length:(startAlias-start) freeWhenDone:NO]];
-                }
-                
-                // append the alias value...
-                
-                if ( !result )
-                    result = [[NSMutableString alloc] initWithString:value];
-                else
-                    [result appendString:value];
-                
-                // update our start pointer...
-                
-                start = ptr;
-            }
+            if ( identifierBlock )
+                value = identifierBlock([[NSString alloc] initWithCharactersNoCopy:(unichar *)startToken length:(ptr-startToken) freeWhenDone:NO]);
         }
         
-        else if ( *ptr == '\'' )    // quoted string
+        else if ( *ptr == '\'' || *ptr == '"' )    // quoted string or identifier
         {
-            ++ptr;
+            unichar quote = *ptr++;
             
             while (*ptr)
             {
-                if ( *ptr == '\'' )
+                if ( *ptr == quote )
                 {
                     ++ptr;
                     
-                    if ( *ptr == '\'' )
+                    if ( *ptr == quote )
                         ++ptr; // embedded quote
                     else
                         break;
@@ -536,22 +1320,53 @@
             }
         }
         
-        else if ( *ptr == '[' )     // []-enclosed values are ignored
+        else if ( *ptr == '[' )     // []-enclosed column name
         {
+            const unichar *startName = ++ptr;
+            
             while (*ptr && *ptr != ']' )
                 ++ptr;
             
             if ( *ptr )
+            {
+                if ( columnBlock )
+                    value = columnBlock([[NSString alloc] initWithCharactersNoCopy:(unichar *)startName length:(ptr-startName) freeWhenDone:NO]);
+                
                 ++ptr;
+            }
         }
         
         else    // a run of any other characters is ignored...
         {
             ++ptr;
             
-            while (*ptr && !isalpha(*ptr) && *ptr != '_' && *ptr != '\'' && *ptr != '[' )
+            while (*ptr && !isalpha(*ptr) && *ptr != '_' && *ptr != '\'' && *ptr != '"' && *ptr != '[' )
                 ++ptr;
         }
+        
+        if ( value )
+        {
+            // append anything before the start of our token first...
+            
+            if ( start != startToken )
+            {
+                if ( !result )
+                    result = [[NSMutableString alloc] initWithCharacters:(unichar *)start length:(startToken-start)];
+                else
+                    [result appendString:[[NSString alloc] initWithCharactersNoCopy:(unichar *)start length:(startToken-start) freeWhenDone:NO]];
+            }
+            
+            // append the replacement...
+            
+            if ( !result )
+                result = [[NSMutableString alloc] initWithString:value];
+            else
+                [result appendString:value];
+            
+            // update our start pointer...
+            
+            start = ptr;
+        }
     }
     
     // Append anything we haven't gotten to yet...
@@ -572,12 +1387,24 @@
 }
 
 
+-(NSString *)_replaceAliasesIn:(NSString *)string
+{
+    NSDictionary *aliases = [self aliases];
+    
+    if ( !aliases.count )
+        return [string copy];
+    
+    return [self replaceTokensIn:string identifierBlock:^NSString *(NSString *identifier) { return aliases[identifier]; } columnBlock:nil];
+}
+
+
 -(NSString *)replaceAliasesIn:(NSString *)string cacheable:(BOOL)cacheable
 {
     if ( !string.length )
         return string;
     
-    // We haven't implemented caching for alias parsing yet. When we do, it will go right here.
+    if ( cacheable )
+        return [self compiledSql:string]->_sql;
     
     return [self _replaceAliasesIn:string];
 }
@@ -589,136 +1416,353 @@
 }
 
 
-#pragma mark - Schema Management
+#pragma mark - Compiled SQL
 
 
--(BOOL)schema_createCollection
++(NSArray *)columnNamesInSql:(NSString *)sql
 {
-    if ( !_isNewCollection )
-        return YES;
+    // Every [column] referenced. Our row id is ignored, it's always available...
     
-    LOG_DBG(@"Adding table: %@", self.name);
+    if ( !sql.length )
+        return [NSArray array];
     
-    _isNewCollection = NO;
-    NSString *sql = [NSString stringWithFormat:@"CREATE TABLE [%@] ([%@] INTEGER PRIMARY KEY AUTOINCREMENT, [__json__] BLOB);", self.name, NTJsonRowIdKey];
+    static NSRegularExpression *regex = nil;
+    static dispatch_once_t onceToken;
     
-    _columns = [NSArray array];
-    _indexes = [NSArray array];
+    dispatch_once(&onceToken, ^{
+        regex = [NSRegularExpression regularExpressionWithPattern:@"\\[(.+?)\\]" options:0 error:nil];
+    });
     
-    __block BOOL success = YES;
+    NSMutableArray *columnNames = [NSMutableArray array];
     
-    [self.store.connection dispatchSync:^{
-        if ( ![self.store.connection execSql:sql args:nil] )
-        {
-            _lastError = self.store.connection.lastError;
-            success = NO;
-        }
-    }];
+    for(NSTextCheckingResult *match in [regex matchesInString:sql options:0 range:NSMakeRange(0, sql.length)])
+    {
+        NSString *columnName = [sql substringWithRange:[match rangeAtIndex:1]];
+        
+        if ( ![columnName isEqualToString:NTJsonRowIdKey] && ![columnNames containsObject:columnName] )
+            [columnNames addObject:columnName];
+    }
     
-    return success;
+    return [columnNames copy];
 }
 
 
--(BOOL)schema_addOrUpdatePendingColumns
++(NSString *)equalityColumnNameInSql:(NSString *)sql
 {
-    if ( !_pendingColumns.count )
-        return YES;
+    // Recognizes "[column] = ?"...
     
-    // First, we need to add the columns to the table...
-    // (SQLITE only allows you to add one at a time)
+    NSScanner *scanner = [NSScanner scannerWithString:sql];
+    NSString *columnName = nil;
     
-    NSMutableArray *newColumns = [NSMutableArray arrayWithArray:_columns];
+    BOOL isMatch = [scanner scanString:@"[" intoString:nil]
+                && [scanner scanUpToString:@"]" intoString:&columnName]
+                && [scanner scanString:@"]" intoString:nil]
+                && ([scanner scanString:@"==" intoString:nil] || [scanner scanString:@"=" intoString:nil])
+                && [scanner scanString:@"?" intoString:nil]
+                && [scanner isAtEnd];
     
-    for(NTJsonColumn *column in _pendingColumns)
-    {
+    return (isMatch) ? columnName : nil;
+}
 
-        if ( [_columns NTJsonStore_find:^BOOL(NTJsonColumn *existing) { return [existing.name isEqualToString:column.name]; }] )
-        {
-            LOG_DBG(@"Updating column: %@.%@", self.name, column.name);
-            continue; // don't re-add columns that already exist
-        }
-        
-        [newColumns addObject:column];
-        
-        LOG_DBG(@"Adding column: %@.%@", self.name, column.name);
 
-        NSString *alterSql = [NSString stringWithFormat:@"ALTER TABLE [%@] ADD COLUMN [%@];", self.name, column.name];
-        
-        __block BOOL success = YES;
-        
-        [self.store.connection dispatchSync:^{
-            if ( ![self.store.connection execSql:alterSql args:nil] )
+-(NTJsonCompiledSql *)compiledSql:(NSString *)sql
+{
+    // Alias expansion and parsing are done once for each distinct where or orderBy string. Returns nil for empty SQL.
+    
+    if ( !sql.length )
+        return nil;
+    
+    NTJsonCompiledSql *compiledSql = _compiledSql[sql];
+    
+    if ( compiledSql )
+        return compiledSql;
+    
+    compiledSql = [[NTJsonCompiledSql alloc] init];
+    
+    compiledSql->_sql = [self _replaceAliasesIn:sql];
+    compiledSql->_columnNames = [NTJsonCollection columnNamesInSql:compiledSql->_sql];
+    compiledSql->_queryColumnNames = [NTJsonQueryCache columnNamesInSql:compiledSql->_sql];
+    compiledSql->_equalityColumnName = [NTJsonCollection equalityColumnNameInSql:compiledSql->_sql];
+    
+    if ( _compiledSql.count >= MAX_COMPILED_SQL )
+        [_compiledSql removeAllObjects];    // keep this from growing forever if queries are built on the fly
+    
+    _compiledSql[sql] = compiledSql;
+    
+    return compiledSql;
+}
+
+
+-(void)scanCompiledSqlForNewColumns:(NTJsonCompiledSql *)compiledSql
+{
+    if ( !compiledSql || compiledSql->_isScanned )
+        return ;
+    
+    [self addPendingColumnsWithNames:compiledSql->_columnNames];
+    
+    compiledSql->_isScanned = YES;
+}
+
+
+-(NSString *)resolvedSqlWithCompiledSql:(NTJsonCompiledSql *)compiledSql
+{
+    // must be called after the schema has been updated...
+    
+    if ( !compiledSql )
+        return nil;
+    
+    if ( !compiledSql->_resolvedSql )
+        compiledSql->_resolvedSql = [self resolveColumnsIn:compiledSql->_sql];
+    
+    return compiledSql->_resolvedSql;
+}
+
+
+-(void)flushCompiledSql
+{
+    // Called whenever aliases or anything that changes how columns are resolved changes...
+    
+    [_compiledSql removeAllObjects];
+}
+
+
+#pragma mark - Schema Management
+
+
+-(NTJsonSqlConnection *)schemaConnection
+{
+    // With collection files our table isn't in the store file, so schema changes are made on our own connection...
+    
+    return (self.store.collectionFiles) ? self.connection : self.store.connection;
+}
+
+
+-(BOOL)schema_createCollection
+{
+    if ( !_isNewCollection )
+        return YES;
+    
+    LOG_DBG(@"Adding table: %@", self.name);
+    
+    _isNewCollection = NO;
+    [self groupCommit_commit];
+    NSString *sql = [NSString stringWithFormat:@"CREATE TABLE [%@] ([%@] INTEGER PRIMARY KEY AUTOINCREMENT, [__json__] BLOB);", self.name, NTJsonRowIdKey];
+    
+    _columns = [NSArray array];
+    _indexes = [NSArray array];
+    
+    __block BOOL success = YES;
+    
+    [self.schemaConnection dispatchSync:^{
+        if ( ![self.schemaConnection execSql:sql args:nil] )
+        {
+            _lastError = self.schemaConnection.lastError;
+            success = NO;
+        }
+    }];
+    
+    return success;
+}
+
+
+-(BOOL)schema_execSql:(NSArray *)sqls
+{
+    // schema changes are always made on the schema connection, within a single transaction...
+    
+    [self groupCommit_commit];
+    
+    __block BOOL success = YES;
+    
+    [self.schemaConnection dispatchSync:^{
+        NSString *transactionId = [self.schemaConnection beginTransaction];
+        
+        if ( !transactionId )
+        {
+            _lastError = self.schemaConnection.lastError;
+            success = NO;
+            return ;
+        }
+        
+        for(NSString *sql in sqls)
+        {
+            if ( ![self.schemaConnection execSql:sql args:nil] )
             {
-                _lastError = self.store.connection.lastError;
-                LOG_ERROR(@"Failed to add column %@.%@ - %@", self.name, column.name, _lastError.localizedDescription);
+                _lastError = self.schemaConnection.lastError;
+                LOG_ERROR(@"Schema change failed for %@ - %@ (%@)", self.name, _lastError.localizedDescription, sql);
+                [self.schemaConnection rollbackTransation:transactionId];
                 success = NO;
+                return ;
             }
-        }];
+        }
         
-        if ( !success )
-            return NO;
+        [self.schemaConnection commitTransation:transactionId];
+    }];
+    
+    return success;
+}
+
+
+-(BOOL)schema_migrateColumnMode
+{
+    if ( !_needsColumnModeMigration )
+        return YES;
+    
+    _needsColumnModeMigration = NO;
+    
+    NTJsonColumnKind kind = [NTJsonColumn columnKindWithColumnMode:self.columnMode];
+    NSArray *oldColumns = self.columns;
+    NSArray *oldIndexes = self.indexes;
+    
+    if ( ![oldColumns NTJsonStore_find:^BOOL(NTJsonColumn *column) { return column.kind != kind; }] )
+    {
+        [self columnMode_saveState];
+        return YES; // everything is already the right kind
     }
     
-    // Now we need to populate the data...
+    LOG_DBG(@"Migrating columns for %@ to mode %d", self.name, (int)self.columnMode);
     
-    sqlite3_stmt *selectStatement = [self.connection statementWithSql:[NSString stringWithFormat:@"SELECT [%@], [__json__] FROM [%@]", NTJsonRowIdKey, self.name] args:nil];
+    // SQLITE can't drop indexed columns (or change a column to a generated column) so we rebuild the table with just
+    // the rowid and JSON. Rowids are preserved so the object cache is still valid.
     
-    if ( !selectStatement )
+    NSString *tempName = [NSString stringWithFormat:@"%@__migrate", self.name];
+    
+    NSArray *sqls =
+    @[
+      [NSString stringWithFormat:@"CREATE TABLE [%@] ([%@] INTEGER PRIMARY KEY AUTOINCREMENT, [__json__] BLOB);", tempName, NTJsonRowIdKey],
+      [NSString stringWithFormat:@"INSERT INTO [%@] ([%@], [__json__]) SELECT [%@], [__json__] FROM [%@];", tempName, NTJsonRowIdKey, NTJsonRowIdKey, self.name],
+      [NSString stringWithFormat:@"DROP TABLE [%@];", self.name],
+      [NSString stringWithFormat:@"ALTER TABLE [%@] RENAME TO [%@];", tempName, self.name],
+    ];
+    
+    if ( ![self schema_execSql:sqls] )
+        return NO;
+    
+    [self.connection flushStatementCache];
+    
+    _isChangeLogReady = NO;     // our triggers were dropped with the old table
+    
+    // Any materialization in progress is moot now...
+    
+    [_materializingColumns removeAllObjects];
+    [self materialization_saveState];
+    
+    // Now re-add all columns and indexes using the new kind, they will be created as usual...
+    
+    _columns = [NSArray array];
+    _indexes = [NSArray array];
+    
+    [self expressionColumns_saveState];
+    [self columnMode_saveState];
+    
+    // (anything already pending was queued with the old kind)
+    
+    NSArray *pendingColumns = [_pendingColumns copy];
+    NSArray *pendingIndexes = [_pendingIndexes copy];
+    
+    [_pendingColumns removeAllObjects];
+    [_pendingIndexes removeAllObjects];
+    
+    for(NTJsonColumn *column in [oldColumns arrayByAddingObjectsFromArray:pendingColumns])
     {
-        _lastError = self.connection.lastError;
-        return NO;  // todo: cleanup here somehow? transaction?
+        if ( ![_pendingColumns NTJsonStore_find:^BOOL(NTJsonColumn *item) { return [item.name isEqualToString:column.name]; }] )
+            [_pendingColumns addObject:[NTJsonColumn columnWithName:column.name kind:kind]];
     }
     
-    NSString *updateSql = [NSString stringWithFormat:@"UPDATE [%@] SET %@ WHERE [%@] = ?;",
-                           self.name,
-                           [[_pendingColumns NTJsonStore_transform:^id(NTJsonColumn *column) { return [NSString stringWithFormat:@"[%@] = ?", column.name]; }] componentsJoinedByString:@", "],
-                           NTJsonRowIdKey];
-    int status;
+    NTJsonIndexKind indexKind = (kind == NTJsonColumnKindExpression) ? NTJsonIndexKindExpression : NTJsonIndexKindColumn;
     
-    while ( (status=sqlite3_step(selectStatement)) == SQLITE_ROW )
+    for(NTJsonIndex *index in [oldIndexes arrayByAddingObjectsFromArray:pendingIndexes])
     {
-        int rowid = sqlite3_column_int(selectStatement, 0);
-        
-        // todo: take advantage of any cached JSON... cache it to???
-        
-        NSData *jsonData = [NSData dataWithBytes:sqlite3_column_blob(selectStatement, 1) length:sqlite3_column_bytes(selectStatement, 1)];
-        
-        NSError *error;
-        
-        NSDictionary *json = [NSJSONSerialization JSONObjectWithData:jsonData options:NSJSONReadingAllowFragments error:&error];
-        
-        if ( !json )
+        if ( ![_pendingIndexes NTJsonStore_find:^BOOL(NTJsonIndex *item) { return [item.name isEqualToString:index.name]; }] )
+            [_pendingIndexes addObject:[NTJsonIndex indexWithName:index.name keys:index.keys isUnique:index.isUnique kind:indexKind]];
+    }
+    
+    return YES;
+}
+
+
+-(BOOL)schema_addOrUpdatePendingColumns
+{
+    if ( !_pendingColumns.count )
+        return YES;
+    
+    // First, we need to add the columns to the table...
+    // (SQLITE only allows you to add one at a time)
+    
+    NSMutableArray *newColumns = [NSMutableArray arrayWithArray:_columns];
+    BOOL addedExpressionColumns = NO;
+    
+    for(NTJsonColumn *column in _pendingColumns)
+    {
+
+        if ( [_columns NTJsonStore_find:^BOOL(NTJsonColumn *existing) { return [existing.name isEqualToString:column.name]; }] )
         {
-            LOG_ERROR(@"Unable to parse JSON for %@:%d - %@", self.name, rowid, error.localizedDescription);
-            continue; // forge on ahead, do not consider this fatal.
+            LOG_DBG(@"Updating column: %@.%@", self.name, column.name);
+            continue; // don't re-add columns that already exist
         }
         
-        // Extract our data...
-        
-        NSMutableArray *values = [NSMutableArray array];
+        LOG_DBG(@"Adding column: %@.%@ (kind %d)", self.name, column.name, (int)column.kind);
+
+        NSString *alterSql = [column alterSqlWithTableName:self.name];
         
-        [self extractValuesInColumns:_pendingColumns fromJson:json intoArray:values];
-        [values addObject:@(rowid)];
+        if ( !alterSql )
+        {
+            [newColumns addObject:column];  // expression columns don't exist in the table
+            addedExpressionColumns = YES;
+            continue;
+        }
         
-        // Perform our update...
+        __block BOOL success = YES;
         
-        BOOL success = [self.connection execSql:updateSql args:values];
+        [self.schemaConnection dispatchSync:^{
+            if ( ![self.schemaConnection execSql:alterSql args:nil] )
+            {
+                _lastError = self.schemaConnection.lastError;
+                LOG_ERROR(@"Failed to add column %@.%@ - %@", self.name, column.name, _lastError.localizedDescription);
+                success = NO;
+            }
+        }];
         
-        if ( !success )
+        if ( !success && column.kind == NTJsonColumnKindVirtual )
         {
-            LOG_ERROR(@"sql update failed for %@:%d - %@", self.name, rowid, self.connection.lastError.localizedDescription);
-            // continue on here, do our best.
+            // Most likely this version of SQLITE doesn't support generated columns. Fall back to an expression...
+            
+            LOG_ERROR(@"Using json_extract() for %@.%@ instead", self.name, column.name);
+            
+            [newColumns addObject:[NTJsonColumn columnWithName:column.name kind:NTJsonColumnKindExpression]];
+            addedExpressionColumns = YES;
+            continue;
         }
+        
+        if ( !success )
+            return NO;
+        
+        [newColumns addObject:column];
     }
     
-    sqlite3_finalize(selectStatement);
-    
     // update to our new column list...
     
     _columns = [newColumns copy];
     
+    if ( addedExpressionColumns )
+        [self expressionColumns_saveState];   // they aren't in the table, so this is the only record of them
+    
+    // Now we need to populate the data. This happens in the background, queries will use json_extract()
+    // for these columns until they are ready...
+    
+    NSArray *materializedColumns = [_pendingColumns NTJsonStore_transform:^id(NTJsonColumn *column) {
+        NTJsonColumn *actual = [_columns NTJsonStore_find:^BOOL(NTJsonColumn *existing) { return [existing.name isEqualToString:column.name]; }];
+        return (actual.kind == NTJsonColumnKindMaterialized) ? actual : nil;
+    }];
+    
+    if ( materializedColumns.count )
+        [self materialization_addColumns:materializedColumns];
+    
     [_pendingColumns removeAllObjects];
     
+    // any cached statements were prepared against the old column list...
+    
+    [self.connection flushStatementCache];
+    
     return YES;
 }
 
@@ -728,15 +1772,36 @@
     if ( !_pendingIndexes.count )
         return YES;
     
+    // Indexes on expression columns must be expression indexes...
+    
+    for(NSUInteger pos=0; pos<_pendingIndexes.count; pos++)
+    {
+        NTJsonIndex *index = _pendingIndexes[pos];
+        
+        if ( index.kind == NTJsonIndexKindColumn && [self keysUseExpressionColumns:index.keys] )
+            index = [NTJsonIndex indexWithName:index.name keys:index.keys isUnique:index.isUnique kind:NTJsonIndexKindExpression];
+        
+        _pendingIndexes[pos] = [index indexWithKeysSql:[self indexKeysSqlWithIndex:index]];
+    }
+    
     for(NTJsonIndex *index in _pendingIndexes)
     {
+        // Rows that haven't been materialized yet are NULL in the index, so duplicates would only show up later as failed
+        // materialization updates. Materialize the rest now so they fail the index instead...
+        
+        if ( index.isUnique && [self keysUseMaterializingColumns:index.keys] && ![self materialization_finishNow] )
+            return NO;
+        
         LOG_DBG(@"Adding index: %@.%@ (%@)", self.name, index.name, index.keys);
         
         __block BOOL success = YES;
-        [self.store.connection dispatchSync:^{
-            if ( ![self.store.connection execSql:[index sqlWithTableName:self.name] args:nil])
+        [self.schemaConnection dispatchSync:^{
+            // (indexes are re-created when the defaults they include change)
+            
+            if ( ![self.schemaConnection execSql:[NSString stringWithFormat:@"DROP INDEX IF EXISTS [%@];", index.name] args:nil]
+                || ![self.schemaConnection execSql:[index sqlWithTableName:self.name] args:nil])
             {
-                _lastError = self.store.connection.lastError;
+                _lastError = self.schemaConnection.lastError;
                 LOG_ERROR(@"Failed to create index: %@.%@ (%@) - %@", self.name, index.name, index.keys, _lastError.localizedDescription);
                 success = NO;
             }
@@ -746,10 +1811,19 @@
             return NO;
     }
     
-    _indexes = [self.indexes arrayByAddingObjectsFromArray:_pendingIndexes];
+    _indexes = [[self.indexes NTJsonStore_transform:^id(NTJsonIndex *index) {
+        return [_pendingIndexes NTJsonStore_find:^BOOL(NTJsonIndex *item) { return [item.name isEqualToString:index.name]; }] ? nil : index;
+    }] arrayByAddingObjectsFromArray:_pendingIndexes];
 
     [_pendingIndexes removeAllObjects];
     
+    // cached statements may have query plans that don't know about the new indexes...
+    
+    [self.connection flushStatementCache];
+    
+    if ( _uniqueKeyMaps )
+        [self uniqueKeys_reset];    // pick up any new unique indexes
+    
     return YES;
 }
 
@@ -759,21 +1833,29 @@
     if ( ![self validateEnvironment] )
         return NO;
     
+    [self columnMode_loadState];    // a column mode migration may still be pending from a previous run
+    
     if ( !_isNewCollection
+        && !_needsColumnModeMigration
         && !_pendingColumns.count
         && !_pendingIndexes.count )
-        return YES; // no schema changes, so we can just return
+        return [self externalChanges_check]; // no schema changes, we just need to know if other processes changed anything
     
     if ( ![self schema_createCollection] )
         return NO;
     
+    if ( ![self schema_migrateColumnMode] )
+        return NO;
+    
     if ( ![self schema_addOrUpdatePendingColumns] )
         return NO;
     
     if ( ![self schema_addPendingIndexes] )
         return NO;
     
-    return YES;
+    [self flushCompiledSql];
+    
+    return [self externalChanges_check];
 }
 
 
@@ -819,836 +1901,5200 @@
 }
 
 
-#pragma mark - Column Support
+#pragma mark - Column Materialization
 
 
--(NSArray *)columns
+-(NSString *)materializationMetadataKey
 {
-    __block NSArray *columns;
+    return [NSString stringWithFormat:@"%@/materialization", self.name];
+}
 
-    [self.connection dispatchSync:^{
-        
-        // if we don't have our list of columns, let's extract them...
-        
-        if ( !_columns )
-        {
-            if ( [self validateEnvironment] )
-            {
-                NSMutableArray *columns = [NSMutableArray array];
-                sqlite3_stmt *statement = [self.connection statementWithSql:[NSString stringWithFormat:@"PRAGMA table_info(%@);", self.name] args:nil];
-                
-                if ( !statement )
-                {
-                    _lastError = self.connection.lastError;
-                    columns = nil;
-                    return ;
-                }
-                
-                int status;
-                
-                while ( (status=sqlite3_step(statement)) == SQLITE_ROW )
-                {
-                    NSString *columnName = [NSString stringWithUTF8String:(const char *)sqlite3_column_text(statement, 1)];
-                    
-                    if ( [columnName isEqualToString:NTJsonRowIdKey] || [columnName isEqualToString:@"__json__"] )
-                        continue;
-                    
-                    [columns addObject:[NTJsonColumn columnWithName:columnName]];
-                }
-                
-                _columns = [columns copy];
-                
-                sqlite3_finalize(statement);
-                
-            } // if validateEnv
-            
-        } // if !columns
-        
-        columns = _columns;
-    }];
-    
-    return columns;
+
+-(int)materializationBatchSize
+{
+    return _materializationBatchSize;
 }
 
 
--(void)extractValuesInColumns:(NSArray *)columns fromJson:(NSDictionary *)json intoArray:(NSMutableArray *)values
+-(void)setMaterializationBatchSize:(int)materializationBatchSize
 {
-    for(NTJsonColumn *column in columns)
-    {
-        id value = [json NTJsonStore_objectForKeyPath:column.name];
-        
-        if ( !value )
-            value = [_defaultJson NTJsonStore_objectForKeyPath:column.name];
-        
-        if ( !value )
-            value = [NSNull null];
-        
-        [values addObject:value];
-    }
+    _materializationBatchSize = MAX(materializationBatchSize, 1);
 }
 
 
--(BOOL)scanSqlForNewColumns:(NSString *)sql     // returns YES if new columns were found
+-(void (^)(NSArray *, float))materializationProgressHandler
 {
-    if ( !sql )
-        return NO; // nothing to parse
-    
-    __block BOOL newColumnsAdded = NO;
+    __block void (^materializationProgressHandler)(NSArray *, float);
     
-    NSRegularExpression *regex = [NSRegularExpression regularExpressionWithPattern:@"\\[.+?\\]" options:0 error:nil];
+    [self.connection dispatchSync:^{
+        materializationProgressHandler = _materializationProgressHandler;
+    }];
     
-    [regex enumerateMatchesInString:sql
-                            options:0
-                              range:NSMakeRange(0, sql.length)
-                         usingBlock:^(NSTextCheckingResult *result, NSMatchingFlags flags, BOOL *stop) {
-        NSString *columnName = [sql substringWithRange:result.range];
-        
-        // massage the column name a bit...
-        
-        if ( [columnName hasPrefix:@"["] )
-            columnName = [columnName substringFromIndex:1];
+    return materializationProgressHandler;
+}
+
+
+-(void)setMaterializationProgressHandler:(void (^)(NSArray *, float))materializationProgressHandler
+{
+    materializationProgressHandler = [materializationProgressHandler copy];
+    
+    [self.connection dispatchAsync:^{
+        _materializationProgressHandler = materializationProgressHandler;
+    }];
+}
+
+
+-(BOOL)isMaterializingColumn:(NSString *)columnName
+{
+    return [_materializingColumns NTJsonStore_find:^BOOL(NTJsonColumn *column) { return [column.name isEqualToString:columnName]; }] ? YES : NO;
+}
+
+
+-(void)materialization_saveState
+{
+    NSDictionary *state = nil;
+    
+    if ( _materializingColumns.count )
+    {
+        state = @{
+                  @"columns": [_materializingColumns NTJsonStore_transform:^id(NTJsonColumn *column) { return column.name; }],
+                  @"lastRowId": @(_materializationLastRowId),
+                  @"maxRowId": @(_materializationMaxRowId),
+                  };
+    }
+    
+    [self saveMetadataWithKey:[self materializationMetadataKey] value:state];
+}
+
+
+-(void)materialization_loadState
+{
+    // Resume any materialization that was in progress when the app last exited...
+    
+    if ( _isMaterializationLoaded )
+        return ;
+    
+    _isMaterializationLoaded = YES;
+    
+    NSDictionary *state = [self.store metadataWithKey:[self materializationMetadataKey]];
+    NSArray *columnNames = state[@"columns"];
+    
+    if ( ![columnNames isKindOfClass:[NSArray class]] || !columnNames.count )
+        return ;
+    
+    for(NSString *columnName in columnNames)
+    {
+        if ( [columnName isKindOfClass:[NSString class]] && ![self isMaterializingColumn:columnName] )
+            [_materializingColumns addObject:[NTJsonColumn columnWithName:columnName]];
+    }
+    
+    _materializationLastRowId = [state[@"lastRowId"] longLongValue];
+    _materializationMaxRowId = [state[@"maxRowId"] longLongValue];
+    
+    LOG_DBG(@"Resuming materialization: %@ (%@) at rowid %lld", self.name, [columnNames componentsJoinedByString:@", "], _materializationLastRowId);
+    
+    [self materialization_schedule];
+}
+
+
+-(void)materialization_addColumns:(NSArray *)columns
+{
+    [self materialization_loadState];
+    
+    for(NTJsonColumn *column in columns)
+    {
+        if ( ![self isMaterializingColumn:column.name] )
+            [_materializingColumns addObject:column];
+    }
+    
+    // (Re)start from the beginning. Anything inserted or updated from now on will have all columns populated,
+    // so we only need to go up to the current max rowid.
+    
+    _materializationLastRowId = 0;
+    _materializationMaxRowId = [[self.connection execValueSql:[NSString stringWithFormat:@"SELECT MAX([%@]) FROM [%@]", NTJsonRowIdKey, self.name] args:nil] longLongValue];
+    
+    if ( !_materializationMaxRowId )
+    {
+        [_materializingColumns removeAllObjects];    // table is empty, nothing to do
+        return ;
+    }
+    
+    LOG_DBG(@"Starting materialization: %@ (%@) - up to rowid %lld", self.name, [[columns NTJsonStore_transform:^id(NTJsonColumn *column) { return column.name; }] componentsJoinedByString:@", "], _materializationMaxRowId);
+    
+    [self materialization_saveState];
+    [self materialization_schedule];
+}
+
+
+-(void)materialization_schedule
+{
+    if ( _isMaterializationScheduled || !_materializingColumns.count )
+        return ;
+    
+    _isMaterializationScheduled = YES;
+    
+    // By running each batch as a separate block, other requests on the queue get a chance to run in between...
+    
+    [self.connection dispatchAsync:^{
+        _isMaterializationScheduled = NO;
+        
+        if ( ![self validateEnvironment] )
+            return ;
+        
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self materialization_processBatch];
         
-        if ( [columnName hasSuffix:@"]"] )
-            columnName = [columnName substringToIndex:columnName.length-1];
+        [_metrics addTimeStartedAt:startedAt toCounter:NTJsonMetricsCounterMaterializationTime];
+    }];
+}
+
+
+-(void)materialization_finish
+{
+    LOG_DBG(@"Materialization complete: %@ (%@)", self.name, [[_materializingColumns NTJsonStore_transform:^id(NTJsonColumn *column) { return column.name; }] componentsJoinedByString:@", "]);
+    
+    [_materializingColumns removeAllObjects];
+    _materializationLastRowId = 0;
+    _materializationMaxRowId = 0;
+    
+    [self materialization_saveState];
+    
+    // queries will now reference the real columns...
+    
+    [self flushCompiledSql];
+    [self.connection flushStatementCache];
+    
+    // the new columns need statistics...
+    
+    [self statistics_scheduleRebuildWithAnalyze:NO];
+}
+
+
+-(BOOL)materialization_finishNow
+{
+    // Runs the remaining batches without giving up our queue. Fails if a batch makes no progress.
+    
+    while ( _materializingColumns.count )
+    {
+        NTJsonRowId lastRowId = _materializationLastRowId;
+        
+        [self materialization_processBatch];
+        
+        if ( _materializingColumns.count && _materializationLastRowId == lastRowId )
+        {
+            _lastError = self.connection.lastError;
+            return NO;
+        }
+    }
+    
+    return YES;
+}
+
+
+-(void)materialization_processBatch
+{
+    if ( !_materializingColumns.count )
+        return ;
+    
+    NSArray *columns = [_materializingColumns copy];
+    int batchSize = _materializationBatchSize;
+    
+    [self defaultJson]; // make sure defaults are loaded, extractValuesInColumns uses _defaultJson
+    
+    // Grab the next batch of rows. We read them all before updating anything.
+    
+    NSString *selectSql = [NSString stringWithFormat:@"SELECT [%@], [__json__] FROM [%@] WHERE [%@] > ? AND [%@] <= ? ORDER BY [%@] LIMIT %d",
+                           NTJsonRowIdKey, self.name, NTJsonRowIdKey, NTJsonRowIdKey, NTJsonRowIdKey, batchSize];
+    
+    sqlite3_stmt *selectStatement = [self.connection cachedStatementWithSql:selectSql args:@[@(_materializationLastRowId), @(_materializationMaxRowId)]];
+    
+    if ( !selectStatement )
+    {
+        LOG_ERROR(@"Materialization failed for %@ - %@", self.name, self.connection.lastError.localizedDescription);
+        return ; // we will try again the next time we start up
+    }
+    
+    NSMutableArray *rowids = [NSMutableArray arrayWithCapacity:batchSize];
+    NSMutableArray *jsons = [NSMutableArray arrayWithCapacity:batchSize];
+    
+    while ( sqlite3_step(selectStatement) == SQLITE_ROW )
+    {
+        NTJsonRowId rowid = sqlite3_column_int64(selectStatement, 0);
+        
+        // take advantage of any cached JSON...
+        
+        NSDictionary *json = [_objectCache peekJsonWithRowId:rowid];
+        
+        if ( !json )
+        {
+            NSError *error;
+            
+            json = [self decodeJsonBytes:sqlite3_column_blob(selectStatement, 1) length:sqlite3_column_bytes(selectStatement, 1) error:&error];
+            
+            if ( !json )
+                LOG_ERROR(@"Unable to parse JSON for %@:%lld - %@", self.name, rowid, error.localizedDescription);
+        }
+        
+        [rowids addObject:@(rowid)];
+        [jsons addObject:json ?: [NSNull null]];
+    }
+    
+    [self.connection releaseStatement:selectStatement];
+    
+    // Update everything in a single transaction...
+    
+    if ( rowids.count )
+    {
+        NSString *updateSql = [NSString stringWithFormat:@"UPDATE [%@] SET %@ WHERE [%@] = ?;",
+                               self.name,
+                               [[columns NTJsonStore_transform:^id(NTJsonColumn *column) { return [NSString stringWithFormat:@"[%@] = ?", column.name]; }] componentsJoinedByString:@", "],
+                               NTJsonRowIdKey];
         
-        // Ignore our row id, it's always available...
+        NSString *transactionId = [self.connection beginTransaction];
         
-        if ( [columnName isEqualToString:NTJsonRowIdKey] )
+        if ( !transactionId )
+        {
+            LOG_ERROR(@"Materialization failed for %@ - %@", self.name, self.connection.lastError.localizedDescription);
             return ;
+        }
         
-        // check existing column list...
+        sqlite3_stmt *updateStatement = [self.connection cachedStatementWithSql:updateSql args:nil];
         
-        NTJsonColumn *column = [self.columns NTJsonStore_find:^BOOL(NTJsonColumn *column) { return [column.name isEqualToString:columnName]; }];
+        if ( !updateStatement )
+        {
+            LOG_ERROR(@"Materialization failed for %@ - %@", self.name, self.connection.lastError.localizedDescription);
+            [self.connection rollbackTransation:transactionId];
+            return ;
+        }
         
-        // and pending columns...
+        NSMutableArray *values = [NSMutableArray arrayWithCapacity:columns.count+1];
+        
+        for(NSUInteger index=0; index<rowids.count; index++)
+        {
+            NSDictionary *json = jsons[index];
+            
+            if ( (id)json == [NSNull null] )
+                continue; // forge on ahead, do not consider this fatal.
+            
+            [values removeAllObjects];
+            [self extractValuesInColumns:columns fromJson:json intoArray:values];
+            [values addObject:rowids[index]];
+            
+            if ( ![self.connection execStatement:updateStatement args:values] )
+                LOG_ERROR(@"sql update failed for %@:%@ - %@", self.name, rowids[index], self.connection.lastError.localizedDescription); // continue on here, do our best.
+        }
+        
+        [self.connection releaseStatement:updateStatement];
+        
+        if ( ![self.connection commitTransation:transactionId] )
+        {
+            LOG_ERROR(@"Materialization failed for %@ - %@", self.name, self.connection.lastError.localizedDescription);
+            return ;
+        }
+        
+        _materializationLastRowId = [[rowids lastObject] longLongValue];
+    }
+    
+    // checkpoint our progress and let anyone interested know...
+    
+    BOOL isComplete = (rowids.count < batchSize || _materializationLastRowId >= _materializationMaxRowId);
+    
+    void (^progressHandler)(NSArray *, float) = _materializationProgressHandler;
+    
+    if ( progressHandler )
+    {
+        NSArray *columnNames = [columns NTJsonStore_transform:^id(NTJsonColumn *column) { return column.name; }];
+        float progress = (isComplete) ? 1.0 : (float)_materializationLastRowId / (float)_materializationMaxRowId;
+        
+        dispatch_async(dispatch_get_main_queue(), ^{
+            progressHandler(columnNames, progress);
+        });
+    }
+    
+    if ( isComplete )
+        [self materialization_finish];
+    
+    else
+    {
+        [self materialization_saveState];
+        [self materialization_schedule];
+    }
+}
+
+
+-(NSString *)resolveColumnsIn:(NSString *)sql
+{
+    // Columns that are still being materialized and expression columns are read straight from the JSON. Defaults
+    // for virtual columns are applied here as well, since they aren't part of the column definition...
+    
+    if ( !sql.length || (!_materializingColumns.count && self.columnMode == NTJsonColumnModeMaterialized) )
+        return sql;
+    
+    NSMutableDictionary *columns = [NSMutableDictionary dictionary];
+    
+    for(NTJsonColumn *column in self.columns)
+        columns[column.name] = column;
+    
+    // only real column references are resolved, not names that happen to appear in a string literal or quoted identifier...
+    
+    return [self replaceTokensIn:sql identifierBlock:nil columnBlock:^NSString *(NSString *columnName) {
+        NTJsonColumn *column = columns[columnName];
         
         if ( !column )
-            column = [_pendingColumns NTJsonStore_find:^BOOL(NTJsonColumn *column) { return [column.name isEqualToString:columnName]; }];
+            return nil;
         
-        if ( column )
-            return ;    // found this column
+        id defaultValue = [self.defaultJson NTJsonStore_objectForKeyPath:column.name];
         
-        // We have a new column, add to pending list...
+        if ( [self isMaterializingColumn:column.name] && (self.documentFormat == NTJsonDocumentFormatBinary || _isConverting) )
+            return [column documentExtractSqlWithDefaultValue:defaultValue];    // json_extract() can't read binary documents
+        
+        if ( column.kind == NTJsonColumnKindExpression || [self isMaterializingColumn:column.name] )
+            return [column jsonExtractSqlWithDefaultValue:defaultValue];
+        
+        if ( column.kind == NTJsonColumnKindVirtual && defaultValue && defaultValue != [NSNull null] )
+            return [NSString stringWithFormat:@"COALESCE([%@], %@)", column.name, [NTJsonColumn sqlLiteralWithValue:defaultValue]];
+        
+        return nil;
+    }];
+}
+
+
+-(NSString *)indexKeysSqlWithIndex:(NTJsonIndex *)index
+{
+    // SQLITE only uses an expression index when the query has the exact same expression, so index keys are resolved
+    // like resolveColumnsIn: does, defaults included. Materializing columns are real columns as far as the index goes.
+    
+    NSMutableDictionary *columns = [NSMutableDictionary dictionary];
+    
+    for(NTJsonColumn *column in self.columns)
+        columns[column.name] = column;
+    
+    return [self replaceTokensIn:index.keys identifierBlock:nil columnBlock:^NSString *(NSString *columnName) {
+        NTJsonColumn *column = columns[columnName];
+        
+        if ( !column && index.kind == NTJsonIndexKindExpression )
+            column = [NTJsonColumn columnWithName:[columnName copy] kind:NTJsonColumnKindExpression];
+        
+        id defaultValue = [self.defaultJson NTJsonStore_objectForKeyPath:columnName];
+        
+        if ( column.kind == NTJsonColumnKindExpression )
+            return [column jsonExtractSqlWithDefaultValue:defaultValue];
+        
+        if ( column.kind == NTJsonColumnKindVirtual && defaultValue && defaultValue != [NSNull null] )
+            return [NSString stringWithFormat:@"COALESCE([%@], %@)", column.name, [NTJsonColumn sqlLiteralWithValue:defaultValue]];
+        
+        return nil;
+    }];
+}
+
+
+#pragma mark - Document Conversion
+
+
+-(NSString *)conversionMetadataKey
+{
+    return [NSString stringWithFormat:@"%@/conversion", self.name];
+}
+
+
+-(void)conversion_saveState
+{
+    NSDictionary *state = nil;
+    
+    if ( _isConverting )
+    {
+        state = @{
+                  @"lastRowId": @(_conversionLastRowId),
+                  @"maxRowId": @(_conversionMaxRowId),
+                  };
+    }
+    
+    [self saveMetadataWithKey:[self conversionMetadataKey] value:state];
+}
+
+
+-(void)conversion_loadState
+{
+    // Resume any conversion that was in progress when the app last exited...
+    
+    if ( _isConversionLoaded )
+        return ;
+    
+    _isConversionLoaded = YES;
+    
+    NSDictionary *state = [self.store metadataWithKey:[self conversionMetadataKey]];
+    
+    if ( ![state[@"maxRowId"] isKindOfClass:[NSNumber class]] )
+        return ;
+    
+    _isConverting = YES;
+    _conversionLastRowId = [state[@"lastRowId"] longLongValue];
+    _conversionMaxRowId = [state[@"maxRowId"] longLongValue];
+    
+    LOG_DBG(@"Resuming document conversion: %@ at rowid %lld", self.name, _conversionLastRowId);
+    
+    [self conversion_schedule];
+}
+
+
+-(void)conversion_start
+{
+    [self conversion_loadState];
+    
+    // (Re)start from the beginning, rows written from now on will already be in the new format...
+    
+    _conversionLastRowId = 0;
+    _conversionMaxRowId = [[self.connection execValueSql:[NSString stringWithFormat:@"SELECT MAX([%@]) FROM [%@]", NTJsonRowIdKey, self.name] args:nil] longLongValue];
+    _isConverting = (_conversionMaxRowId > 0);
+    
+    if ( _isConverting )
+        LOG_DBG(@"Starting document conversion: %@ to format %d - up to rowid %lld", self.name, (int)self.documentFormat, _conversionMaxRowId);
+    
+    [self conversion_saveState];
+    [self conversion_schedule];
+}
+
+
+-(void)conversion_schedule
+{
+    if ( _isConversionScheduled || !_isConverting )
+        return ;
+    
+    _isConversionScheduled = YES;
+    
+    [self.connection dispatchAsync:^{
+        _isConversionScheduled = NO;
+        
+        if ( ![self validateEnvironment] )
+            return ;
+        
+        CFAbsoluteTime startedAt = [_metrics now];
         
-        column = [NTJsonColumn columnWithName:columnName];
+        [self conversion_processBatch];
+        
+        [_metrics addTimeStartedAt:startedAt toCounter:NTJsonMetricsCounterMaterializationTime];
+    }];
+}
+
+
+-(void)conversion_finish
+{
+    LOG_DBG(@"Document conversion complete: %@", self.name);
+    
+    _isConverting = NO;
+    _conversionLastRowId = 0;
+    _conversionMaxRowId = 0;
+    
+    [self conversion_saveState];
+    
+    // queries on materializing columns may go back to json_extract()...
+    
+    [self flushCompiledSql];
+    [self.connection flushStatementCache];
+}
+
+
+-(void)conversion_processBatch
+{
+    if ( !_isConverting )
+        return ;
+    
+    int batchSize = _materializationBatchSize;
+    BOOL toBinary = (self.documentFormat == NTJsonDocumentFormatBinary);
+    
+    NSString *selectSql = [NSString stringWithFormat:@"SELECT [%@], [__json__] FROM [%@] WHERE [%@] > ? AND [%@] <= ? ORDER BY [%@] LIMIT %d",
+                           NTJsonRowIdKey, self.name, NTJsonRowIdKey, NTJsonRowIdKey, NTJsonRowIdKey, batchSize];
+    
+    sqlite3_stmt *selectStatement = [self.connection cachedStatementWithSql:selectSql args:@[@(_conversionLastRowId), @(_conversionMaxRowId)]];
+    
+    if ( !selectStatement )
+    {
+        LOG_ERROR(@"Document conversion failed for %@ - %@", self.name, self.connection.lastError.localizedDescription);
+        return ; // we will try again the next time we start up
+    }
+    
+    // Re-encode any rows that aren't in the target format...
+    
+    NSMutableArray *rowids = [NSMutableArray arrayWithCapacity:batchSize];
+    NSMutableArray *jsonDatas = [NSMutableArray arrayWithCapacity:batchSize];
+    int rowCount = 0;
+    NTJsonRowId lastRowId = _conversionLastRowId;
+    
+    while ( sqlite3_step(selectStatement) == SQLITE_ROW )
+    {
+        NTJsonRowId rowid = sqlite3_column_int64(selectStatement, 0);
+        const void *bytes = sqlite3_column_blob(selectStatement, 1);
+        NSUInteger length = sqlite3_column_bytes(selectStatement, 1);
+        
+        ++rowCount;
+        lastRowId = rowid;
+        
+        if ( [NTJsonBinaryCoder isBinaryBytes:bytes length:length] == toBinary )
+            continue;   // already converted
+        
+        NSError *error;
+        NSDictionary *json = [_objectCache peekJsonWithRowId:rowid] ?: [self decodeJsonBytes:bytes length:length error:&error];
+        NSData *jsonData = (json) ? [self encodeJson:json error:&error] : nil;
+        
+        if ( !jsonData )
+        {
+            LOG_ERROR(@"Unable to convert document %@:%lld - %@", self.name, rowid, error.localizedDescription);
+            continue;   // leave it as it is, it's still readable.
+        }
+        
+        [rowids addObject:@(rowid)];
+        [jsonDatas addObject:jsonData];
+    }
+    
+    [self.connection releaseStatement:selectStatement];
+    
+    if ( rowids.count )
+    {
+        NSString *transactionId = [self.connection beginTransaction];
+        
+        if ( !transactionId )
+        {
+            LOG_ERROR(@"Document conversion failed for %@ - %@", self.name, self.connection.lastError.localizedDescription);
+            return ;
+        }
+        
+        NSString *updateSql = [NSString stringWithFormat:@"UPDATE [%@] SET [__json__] = ? WHERE [%@] = ?;", self.name, NTJsonRowIdKey];
+        sqlite3_stmt *updateStatement = [self.connection cachedStatementWithSql:updateSql args:nil];
+        
+        if ( !updateStatement )
+        {
+            LOG_ERROR(@"Document conversion failed for %@ - %@", self.name, self.connection.lastError.localizedDescription);
+            [self.connection rollbackTransation:transactionId];
+            return ;
+        }
+        
+        for(NSUInteger index=0; index<rowids.count; index++)
+        {
+            if ( ![self.connection execStatement:updateStatement args:@[jsonDatas[index], rowids[index]]] )
+                LOG_ERROR(@"sql update failed for %@:%@ - %@", self.name, rowids[index], self.connection.lastError.localizedDescription); // do our best
+        }
+        
+        [self.connection releaseStatement:updateStatement];
+        
+        if ( ![self.connection commitTransation:transactionId] )
+        {
+            LOG_ERROR(@"Document conversion failed for %@ - %@", self.name, self.connection.lastError.localizedDescription);
+            return ;
+        }
+        
+        [self externalChanges_didWrite];
+    }
+    
+    _conversionLastRowId = lastRowId;
+    
+    if ( rowCount < batchSize || _conversionLastRowId >= _conversionMaxRowId )
+        [self conversion_finish];
+    
+    else
+    {
+        [self conversion_saveState];
+        [self conversion_schedule];
+    }
+}
+
+
+#pragma mark - Column Support
+
+
+-(NSArray *)columns
+{
+    __block NSArray *columns;
+
+    [self.connection dispatchSync:^{
+        
+        // if we don't have our list of columns, let's extract them...
+        
+        if ( !_columns )
+        {
+            if ( [self validateEnvironment] )
+            {
+                NSMutableArray *columns = [NSMutableArray array];
+                
+                // table_xinfo includes generated columns, fall back to table_info for older versions of SQLITE...
+                
+                sqlite3_stmt *statement = [self.connection statementWithSql:[NSString stringWithFormat:@"PRAGMA table_xinfo(%@);", self.name] args:nil];
+                BOOL hasHidden = (statement) ? YES : NO;
+                
+                if ( !statement )
+                    statement = [self.connection statementWithSql:[NSString stringWithFormat:@"PRAGMA table_info(%@);", self.name] args:nil];
+                
+                if ( !statement )
+                {
+                    _lastError = self.connection.lastError;
+                    columns = nil;
+                    return ;
+                }
+                
+                int status;
+                
+                while ( (status=sqlite3_step(statement)) == SQLITE_ROW )
+                {
+                    NSString *columnName = [NSString stringWithUTF8String:(const char *)sqlite3_column_text(statement, 1)];
+                    
+                    if ( [columnName isEqualToString:NTJsonRowIdKey] || [columnName isEqualToString:@"__json__"] )
+                        continue;
+                    
+                    int hidden = (hasHidden) ? sqlite3_column_int(statement, 6) : 0;  // 2 = VIRTUAL, 3 = STORED generated columns
+                    
+                    [columns addObject:[NTJsonColumn columnWithName:columnName kind:(hidden >= 2) ? NTJsonColumnKindVirtual : NTJsonColumnKindMaterialized]];
+                }
+                
+                sqlite3_finalize(statement);
+                
+                // expression columns only exist in our metadata...
+                
+                NSArray *expressionColumnNames = [self.store metadataWithKey:[self expressionColumnsMetadataKey]][@"columns"];
+                
+                for(NSString *columnName in ([expressionColumnNames isKindOfClass:[NSArray class]]) ? expressionColumnNames : nil)
+                {
+                    if ( [columnName isKindOfClass:[NSString class]] && ![columns NTJsonStore_find:^BOOL(NTJsonColumn *column) { return [column.name isEqualToString:columnName]; }] )
+                        [columns addObject:[NTJsonColumn columnWithName:columnName kind:NTJsonColumnKindExpression]];
+                }
+                
+                _columns = [columns copy];
+                
+                [self materialization_loadState];
+                [self conversion_loadState];
+                
+            } // if validateEnv
+            
+        } // if !columns
+        
+        columns = _columns;
+    }];
+    
+    return columns;
+}
+
+
+-(NSString *)expressionColumnsMetadataKey
+{
+    return [NSString stringWithFormat:@"%@/expressionColumns", self.name];
+}
+
+
+-(void)expressionColumns_saveState
+{
+    NSArray *columnNames = [_columns NTJsonStore_transform:^id(NTJsonColumn *column) { return (column.kind == NTJsonColumnKindExpression) ? column.name : nil; }];
+    
+    [self saveMetadataWithKey:[self expressionColumnsMetadataKey] value:(columnNames.count) ? @{@"columns": columnNames} : nil];
+}
+
+
+-(NSArray *)materializedColumns
+{
+    // the columns we need to write on insert/update...
+    
+    return [self.columns NTJsonStore_transform:^id(NTJsonColumn *column) { return (column.kind == NTJsonColumnKindMaterialized) ? column : nil; }];
+}
+
+
+-(BOOL)keysUseExpressionColumns:(NSString *)keys
+{
+    for(NTJsonColumn *column in self.columns)
+    {
+        if ( column.kind == NTJsonColumnKindExpression && [keys rangeOfString:[NSString stringWithFormat:@"[%@]", column.name]].location != NSNotFound )
+            return YES;
+    }
+    
+    return NO;
+}
+
+
+-(BOOL)keysUseMaterializingColumns:(NSString *)keys
+{
+    for(NTJsonColumn *column in _materializingColumns)
+    {
+        if ( [keys rangeOfString:[NSString stringWithFormat:@"[%@]", column.name]].location != NSNotFound )
+            return YES;
+    }
+    
+    return NO;
+}
+
+
+-(void)extractValuesInColumns:(NSArray *)columns fromJson:(NSDictionary *)json intoArray:(NSMutableArray *)values
+{
+    for(NTJsonColumn *column in columns)
+    {
+        id value = [json NTJsonStore_objectForKeyPath:column.name];
+        
+        if ( !value )
+            value = [_defaultJson NTJsonStore_objectForKeyPath:column.name];
+        
+        if ( !value )
+            value = [NSNull null];
+        
+        [values addObject:value];
+    }
+}
+
+
+-(BOOL)addPendingColumnsWithNames:(NSArray *)columnNames     // returns YES if new columns were found
+{
+    BOOL newColumnsAdded = NO;
+    
+    for(NSString *columnName in columnNames)
+    {
+        // check existing column list...
+        
+        NTJsonColumn *column = [self.columns NTJsonStore_find:^BOOL(NTJsonColumn *column) { return [column.name isEqualToString:columnName]; }];
+        
+        // and pending columns...
+        
+        if ( !column )
+            column = [_pendingColumns NTJsonStore_find:^BOOL(NTJsonColumn *column) { return [column.name isEqualToString:columnName]; }];
+        
+        if ( column )
+            continue;    // found this column
+        
+        // We have a new column, add to pending list...
+        
+        column = [NTJsonColumn columnWithName:columnName kind:[NTJsonColumn columnKindWithColumnMode:self.columnMode]];
+        
+        [_pendingColumns addObject:column];
+        
+        newColumnsAdded = YES;
+    }
+    
+    return newColumnsAdded;
+}
+
+
+-(BOOL)scanSqlForNewColumns:(NSString *)sql     // returns YES if new columns were found
+{
+    if ( !sql )
+        return NO; // nothing to parse
+    
+    return [self addPendingColumnsWithNames:[NTJsonCollection columnNamesInSql:sql]];
+}
+
+
+-(void)addQueryableFields:(NSString *)fields
+{
+    [self.connection dispatchAsync:^{
+        NSString *realFields = [self replaceAliasesIn:fields cacheable:NO];
+        
+        [self scanSqlForNewColumns:realFields];
+    }];
+}
+
+
+#pragma mark - Index Support
+
+
+-(NSArray *)indexes
+{
+    __block NSArray *indexes;
+    
+    [self.connection dispatchSync:^{
+        
+        if ( !_indexes )
+        {
+            
+            if ( [self validateEnvironment] )
+            {
+                NSMutableArray *indexes = [NSMutableArray array];
+                
+                sqlite3_stmt *statement = [self.connection statementWithSql:@"SELECT sql FROM sqlite_master WHERE type='index' AND tbl_name=?" args:@[self.name]];
+                
+                if ( !statement )
+                {
+                    _lastError = self.connection.lastError;
+                    indexes = nil;
+                    return ;
+                }
+                
+                int status;
+                
+                while ( (status=sqlite3_step(statement)) == SQLITE_ROW )
+                {
+                    NSString *sql = [NSString stringWithUTF8String:(const char *)sqlite3_column_text(statement, 0)];
+                    
+                    if ( !sql.length )
+                        continue ;
+                    
+                    NTJsonIndex *index = [NTJsonIndex indexWithSql:sql];
+                    
+                    if ( !index )
+                    {
+                        LOG_ERROR(@"Ignoring index we can't parse - %@", sql);
+                        continue;
+                    }
+                    
+                    [indexes addObject:index];
+                }
+                
+                sqlite3_finalize(statement);
+                
+                _indexes = [indexes copy];
+                
+            } // if validate...
+            
+        } // if !indexes
+        
+        indexes = _indexes;
+    }];
+    
+    return indexes;
+}
+
+
+-(NSString *)createIndexNameWithIsUnique:(BOOL)isUnique
+{
+    const int MAX_TRIES = 10;
+    
+    int base = (int)self.indexes.count + (int)_pendingIndexes.count;
+    
+    for(int index=0; index<MAX_TRIES; index++)
+    {
+        NSString *name = [NSString stringWithFormat:@"%@_%@_%d", (isUnique) ? @"UX" : @"IX", self.name, base+index];
+        
+        NTJsonIndex *existing = [self.indexes NTJsonStore_find:^BOOL(NTJsonIndex *index) { return [index.name isEqualToString:name]; }];
+        
+        if ( !existing )
+            existing = [_pendingIndexes NTJsonStore_find:^BOOL(NTJsonIndex *index) { return [index.name isEqualToString:name]; }];
+        
+        if ( !existing )
+            return name;
+    }
+    
+    return nil;
+}
+
+
+-(void)addIndexWithKeys:(NSString *)keys isUnique:(BOOL)isUnique
+{
+    [self.connection dispatchAsync:^{
+        
+        NSString *realKeys = [self replaceAliasesIn:keys cacheable:NO];
+        
+        // First off, let's see if it already exists...
+        
+        if ( [self.indexes NTJsonStore_find:^BOOL(NTJsonIndex *index) { return (index.isUnique == isUnique) && [index.keys isEqualToString:realKeys]; }] )
+            return ;
+        
+        if ( [_pendingIndexes NTJsonStore_find:^BOOL(NTJsonIndex *index) { return (index.isUnique == isUnique) && [index.keys isEqualToString:realKeys]; }] )
+            return ;
+        
+        [self scanSqlForNewColumns:realKeys];
+        
+        NSString *name = [self createIndexNameWithIsUnique:isUnique];
+        
+        NTJsonIndex *index = [NTJsonIndex indexWithName:name keys:realKeys isUnique:isUnique];
+        
+        [_pendingIndexes addObject:index];
+    }];
+}
+
+
+-(void)addIndexWithKeys:(NSString *)keys
+{
+    [self addIndexWithKeys:keys isUnique:NO];
+}
+
+
+-(void)addUniqueIndexWithKeys:(NSString *)keys
+{
+    [self addIndexWithKeys:keys isUnique:YES];
+}
+
+
+#pragma mark - Unique Key Lookup
+
+
+-(BOOL)uniqueKeyLookup
+{
+    __block BOOL uniqueKeyLookup;
+    
+    [self.connection dispatchSync:^{
+        uniqueKeyLookup = _uniqueKeyLookup;
+    }];
+    
+    return uniqueKeyLookup;
+}
+
+
+-(void)setUniqueKeyLookup:(BOOL)uniqueKeyLookup
+{
+    [self.connection dispatchAsync:^{
+        if ( _uniqueKeyLookup == uniqueKeyLookup )
+            return ;
+        
+        _uniqueKeyLookup = uniqueKeyLookup;
+        _uniqueKeyMaps = nil;   // loaded on the next find
+    }];
+}
+
+
++(NSString *)uniqueKeyColumnNameWithKeys:(NSString *)keys
+{
+    // Only single column indexes ("[uid]") can be mapped...
+    
+    keys = [keys stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+    
+    if ( keys.length < 3 || ![keys hasPrefix:@"["] || ![keys hasSuffix:@"]"] )
+        return nil;
+    
+    NSString *columnName = [keys substringWithRange:NSMakeRange(1, keys.length-2)];
+    
+    return ([columnName rangeOfString:@"]"].location == NSNotFound) ? columnName : nil;
+}
+
+
+-(void)uniqueKeys_reset
+{
+    // (Re)creates the maps for all single column unique indexes and starts loading them in the background. Until a map
+    // is loaded, lookups on it go to SQLite...
+    
+    if ( !_uniqueKeyLookup )
+    {
+        _uniqueKeyMaps = nil;
+        return ;
+    }
+    
+    _uniqueKeyMaps = [NSMutableDictionary dictionary];
+    
+    for(NTJsonIndex *index in self.indexes)
+    {
+        NSString *columnName = (index.isUnique) ? [NTJsonCollection uniqueKeyColumnNameWithKeys:index.keys] : nil;
+        
+        if ( columnName )
+            _uniqueKeyMaps[columnName] = [[NTJsonUniqueKeyMap alloc] initWithColumnName:columnName];
+    }
+    
+    if ( !_uniqueKeyMaps.count )
+        return ;
+    
+    // Anything inserted or updated from now on is added as it happens, so we only need to go up to the current max rowid.
+    
+    _uniqueKeyLoadLastRowId = 0;
+    _uniqueKeyLoadMaxRowId = [[self.connection execValueSql:[NSString stringWithFormat:@"SELECT MAX([%@]) FROM [%@]", NTJsonRowIdKey, self.name] args:nil] longLongValue];
+    
+    [self uniqueKeys_schedule];
+}
+
+
+-(void)uniqueKeys_schedule
+{
+    if ( _isUniqueKeyLoadScheduled || !_uniqueKeyMaps.count )
+        return ;
+    
+    _isUniqueKeyLoadScheduled = YES;
+    
+    // Each batch is a separate block so other requests on the queue get a chance to run in between...
+    
+    [self.connection dispatchAsync:^{
+        _isUniqueKeyLoadScheduled = NO;
+        
+        if ( ![self validateEnvironment] )
+            return ;
+        
+        [self uniqueKeys_loadBatch];
+    }];
+}
+
+
+-(void)uniqueKeys_loadBatch
+{
+    NSArray *maps = [_uniqueKeyMaps allValues];
+    
+    if ( !maps.count )
+        return ;
+    
+    int batchSize = _materializationBatchSize;
+    int rowCount = 0;
+    
+    if ( _uniqueKeyLoadLastRowId < _uniqueKeyLoadMaxRowId )
+    {
+        // columns that are still being materialized are read from the document...
+        
+        NSString *columnsSql = [[maps NTJsonStore_transform:^id(NTJsonUniqueKeyMap *map) { return [self resolveColumnsIn:[NSString stringWithFormat:@"[%@]", map.columnName]]; }] componentsJoinedByString:@", "];
+        
+        NSString *sql = [NSString stringWithFormat:@"SELECT [%@], %@ FROM [%@] WHERE [%@] > ? AND [%@] <= ? ORDER BY [%@] LIMIT %d",
+                         NTJsonRowIdKey, columnsSql, self.name, NTJsonRowIdKey, NTJsonRowIdKey, NTJsonRowIdKey, batchSize];
+        
+        sqlite3_stmt *statement = [self.connection cachedStatementWithSql:sql args:@[@(_uniqueKeyLoadLastRowId), @(_uniqueKeyLoadMaxRowId)]];
+        
+        if ( !statement )
+        {
+            LOG_ERROR(@"Unique key loading failed for %@ - %@", self.name, self.connection.lastError.localizedDescription);
+            return ; // lookups will continue to use SQLite
+        }
+        
+        while ( sqlite3_step(statement) == SQLITE_ROW )
+        {
+            NTJsonRowId rowid = sqlite3_column_int64(statement, 0);
+            
+            for(int index=0; index<maps.count; index++)
+            {
+                id value;
+                
+                switch(sqlite3_column_type(statement, index+1))
+                {
+                    case SQLITE_INTEGER:
+                        value = @(sqlite3_column_int64(statement, index+1));
+                        break;
+                        
+                    case SQLITE_FLOAT:
+                        value = @(sqlite3_column_double(statement, index+1));
+                        break;
+                        
+                    case SQLITE_TEXT:
+                        value = [[NSString alloc] initWithBytes:sqlite3_column_text(statement, index+1) length:sqlite3_column_bytes(statement, index+1) encoding:NSUTF8StringEncoding];
+                        break;
+                        
+                    default:
+                        value = nil;    // NULLs and blobs are never mapped
+                        break;
+                }
+                
+                [maps[index] setValue:value forRowId:rowid];
+            }
+            
+            _uniqueKeyLoadLastRowId = rowid;
+            ++rowCount;
+        }
+        
+        [self.connection releaseStatement:statement];
+    }
+    
+    if ( rowCount == batchSize && _uniqueKeyLoadLastRowId < _uniqueKeyLoadMaxRowId )
+    {
+        [self uniqueKeys_schedule];
+        return ;
+    }
+    
+    for(NTJsonUniqueKeyMap *map in maps)
+        map.isLoaded = YES;
+    
+    LOG_DBG(@"Unique key lookup loaded: %@ (%@)", self.name, [[maps NTJsonStore_transform:^id(NTJsonUniqueKeyMap *map) { return map.columnName; }] componentsJoinedByString:@", "]);
+}
+
+
+-(void)uniqueKeys_setJson:(NSDictionary *)json withRowId:(NTJsonRowId)rowid
+{
+    // keeps the maps current after an insert or update, the value must match what's in the column (including defaults)...
+    
+    for(NTJsonUniqueKeyMap *map in [_uniqueKeyMaps objectEnumerator])
+    {
+        id value = [json NTJsonStore_objectForKeyPath:map.columnName];
+        
+        if ( !value )
+            value = [self.defaultJson NTJsonStore_objectForKeyPath:map.columnName];
+        
+        [map setValue:value forRowId:rowid];
+    }
+}
+
+
+-(void)uniqueKeys_didRollback
+{
+    // The maps must never have keys for rows that aren't in the database. If a write fails (and with it possibly an open
+    // group commit) we can't be sure what was kept, so they are rebuilt on the next lookup. A store transaction does this
+    // itself when it rolls back...
+    
+    if ( !_isInStoreTransaction )
+        _uniqueKeyMaps = nil;
+}
+
+
+-(void)uniqueKeys_removeRowId:(NTJsonRowId)rowid
+{
+    for(NTJsonUniqueKeyMap *map in [_uniqueKeyMaps objectEnumerator])
+        [map removeRowId:rowid];
+}
+
+
+-(NSArray *)uniqueKeys_findWhere:(NSString *)where args:(NSArray *)args
+{
+    // Answers "[column] = ?" on a unique key from memory (and the object cache.) Returns nil if the query can't be answered this way.
+    
+    if ( !_uniqueKeyLookup || !where.length || args.count != 1 )
+        return nil;
+    
+    id value = args[0];
+    
+    if ( ![value isKindOfClass:[NSString class]] && ![value isKindOfClass:[NSNumber class]] )
+        return nil;
+    
+    NSString *columnName = [self compiledSql:where]->_equalityColumnName;
+    
+    if ( !columnName || ![self _ensureSchema] )
+        return nil;
+    
+    if ( !_uniqueKeyMaps )
+        [self uniqueKeys_reset];
+    
+    NTJsonUniqueKeyMap *map = _uniqueKeyMaps[columnName];
+    
+    if ( !map.isLoaded )
+        return nil;
+    
+    NSNumber *rowid = [map rowidForValue:value];
+    
+    if ( !rowid )
+        return [NSArray array];    // the map is complete, so we know there's no match
+    
+    NSDictionary *json = [_objectCache jsonWithRowId:[rowid longLongValue]];
+    
+    if ( json )
+        return @[json];
+    
+    NSArray *rowColumns = (_lazyDecoding && _objectCache) ? [self lazyRowColumns] : nil;
+    
+    return [self itemsWithRowids:@[rowid] rowColumns:rowColumns];
+}
+
+
+#pragma mark - Statistics
+
+
+-(NSString *)statisticsMetadataKey
+{
+    return [NSString stringWithFormat:@"%@/statistics", self.name];
+}
+
+
+-(NTJsonStatistics *)statistics_load
+{
+    // Loaded the first time they are needed, after the schema is ready. Statistics that weren't saved after the last
+    // change (the app exited first) can't be trusted, so we count the rows and rebuild the rest in the background. Neither
+    // can the saved statistics after another process has changed the collection, its save may be behind its writes.
+    
+    if ( _statistics )
+        return _statistics;
+    
+    NSDictionary *state = [self.store metadataWithKey:[self statisticsMetadataKey]];
+    
+    if ( !_isStatisticsStale && ![state[@"isDirty"] boolValue] )
+        _statistics = [[NTJsonStatistics alloc] initWithState:state];
+    
+    if ( !_statistics )
+    {
+        id rowCount = [self.connection execValueSql:[NSString stringWithFormat:@"SELECT COUNT(*) FROM [%@]", self.name] args:nil];
+        
+        if ( ![rowCount isKindOfClass:[NSNumber class]] )
+            return nil;     // we'll try again next time
+        
+        _statistics = [[NTJsonStatistics alloc] init];
+        _statistics.rowCount = [rowCount longLongValue];
+        _statistics.isChanged = _isStatisticsStale;  // our count replaces what's saved
+        _isStatisticsStale = NO;
+        
+        if ( _statistics.rowCount > 0 )
+            [self statistics_scheduleRebuildWithAnalyze:NO];
+    }
+    
+    _isStatisticsDirty = [state[@"isDirty"] boolValue];
+    
+    return _statistics;
+}
+
+
+-(void)statistics_save
+{
+    if ( !_statistics.isChanged )
+        return ;
+    
+    if ( [self saveMetadataWithKey:[self statisticsMetadataKey] value:[_statistics state]] )
+    {
+        _statistics.isChanged = NO;
+        _isStatisticsDirty = NO;
+    }
+}
+
+
+-(void)statistics_scheduleSave
+{
+    if ( _isStatisticsSaveScheduled )
+        return ;
+    
+    _isStatisticsSaveScheduled = YES;
+    
+    // Changes are saved in bunches, a delay keeps us from writing metadata for every insert...
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(STATISTICS_SAVE_DELAY * NSEC_PER_SEC)), self.connection.queue, ^{
+        _isStatisticsSaveScheduled = NO;
+        
+        if ( ![self validateEnvironment] )
+            return ;
+        
+        [self statistics_save];
+    });
+}
+
+
+-(void)statistics_willChange
+{
+    // Called before every write. The first change after a save marks the saved statistics dirty, so they aren't
+    // trusted if we exit before the next save...
+    
+    if ( _statisticsRebuildColumns )
+        _statisticsRebuildSawWrite = YES;
+    
+    if ( ![self statistics_load] || _isStatisticsDirty )
+        return ;
+    
+    if ( [self saveMetadataWithKey:[self statisticsMetadataKey] value:@{@"isDirty": @YES}] )
+        _isStatisticsDirty = YES;
+}
+
+
+-(void)statistics_didRollback
+{
+    // The dirty mark may have been rolled back with the write, make sure the next change marks them again...
+    
+    _isStatisticsDirty = NO;
+}
+
+
+-(void)statistics_didChange
+{
+    if ( !_statistics )
+        return ;
+    
+    [self statistics_scheduleSave];
+    
+    if ( [_statistics needsAnalyze] )
+        [self statistics_scheduleRebuildWithAnalyze:YES];
+}
+
+
+-(void)statistics_scheduleRebuildWithAnalyze:(BOOL)analyze
+{
+    if ( _isStatisticsRebuildScheduled )
+        return ;
+    
+    _isStatisticsRebuildScheduled = YES;
+    
+    [self.connection dispatchAsync:^{
+        if ( ![self validateEnvironment] )
+        {
+            _isStatisticsRebuildScheduled = NO;
+            return ;
+        }
+        
+        [self statistics_startRebuildWithAnalyze:analyze];
+    }];
+}
+
+
+-(void)statistics_startRebuildWithAnalyze:(BOOL)analyze
+{
+    // Rebuilds the column statistics from the materialized columns (no documents are read.) When the table has changed
+    // enough we ANALYZE it first so SQLITE's planner has current information about our indexes. analysis_limit keeps
+    // ANALYZE from reading every row of a large table.
+    
+    if ( ![self _ensureSchema] || ![self statistics_load] )
+    {
+        _isStatisticsRebuildScheduled = NO;
+        return ;
+    }
+    
+    if ( analyze )
+    {
+        LOG_DBG(@"Analyzing %@ (%lld changes)", self.name, _statistics.changeCount);
+        
+        [self.connection execSql:[NSString stringWithFormat:@"PRAGMA analysis_limit = %d;", STATISTICS_ANALYSIS_LIMIT] args:nil];
+        
+        if ( [self.connection execSql:[NSString stringWithFormat:@"ANALYZE [%@];", self.name] args:nil] )
+            [self.connection flushStatementCache];  // let existing statements pick up the new plan
+    }
+    
+    _statisticsRebuildColumns = [[self materializedColumns] NTJsonStore_transform:^id(NTJsonColumn *column) { return ([self isMaterializingColumn:column.name]) ? nil : column; }];
+    _statisticsRebuildColumnStatistics = [_statisticsRebuildColumns NTJsonStore_transform:^id(NTJsonColumn *column) { return [[NTJsonColumnStatistics alloc] initWithName:column.name]; }];
+    _statisticsRebuildLastRowId = 0;
+    _statisticsRebuildRowCount = 0;
+    _statisticsRebuildDidAnalyze = analyze;
+    _statisticsRebuildSawWrite = NO;
+    
+    [self statistics_rebuildBatch];
+}
+
+
+-(void)statistics_endRebuild
+{
+    _statisticsRebuildColumns = nil;
+    _statisticsRebuildColumnStatistics = nil;
+    _isStatisticsRebuildScheduled = NO;
+}
+
+
+-(void)statistics_rebuildBatch
+{
+    // Rows are read in batches by rowid, each batch is a separate block so other requests on the queue get a chance to
+    // run in between. Rows inserted meanwhile have higher rowids so they are still counted...
+    
+    if ( ![self statistics_load] )
+    {
+        [self statistics_endRebuild];
+        return ;
+    }
+    
+    NSArray *columns = _statisticsRebuildColumns;
+    NSArray *columnStatistics = _statisticsRebuildColumnStatistics;
+    
+    NSMutableString *sql = [NSMutableString stringWithFormat:@"SELECT [%@]", NTJsonRowIdKey];
+    
+    for(NTJsonColumn *column in columns)
+        [sql appendFormat:@", [%@]", column.name];
+    
+    [sql appendFormat:@" FROM [%@] WHERE [%@] > ? ORDER BY [%@] LIMIT %d", self.name, NTJsonRowIdKey, NTJsonRowIdKey, STATISTICS_REBUILD_BATCH_SIZE];
+    
+    sqlite3_stmt *statement = [self.connection cachedStatementWithSql:sql args:@[@(_statisticsRebuildLastRowId)]];
+    
+    if ( !statement )
+    {
+        LOG_ERROR(@"Unable to rebuild statistics for %@ - %@", self.name, self.connection.lastError.localizedDescription);
+        [self statistics_endRebuild];
+        return ;
+    }
+    
+    int rowCount = 0;
+    int status;
+    
+    while ( (status=sqlite3_step(statement)) == SQLITE_ROW )
+    {
+        _statisticsRebuildLastRowId = sqlite3_column_int64(statement, 0);
+        ++rowCount;
+        
+        for(int index=0; index<columns.count; index++)
+            [columnStatistics[index] addValue:[self.connection valueWithStatement:statement index:index+1]];
+    }
+    
+    if ( status != SQLITE_DONE )
+        LOG_ERROR(@"Unable to rebuild statistics for %@ - %@", self.name, [NSError NTJsonStore_errorWithSqlite3:self.connection.db].localizedDescription);
+    
+    [self.connection releaseStatement:statement];
+    
+    if ( status != SQLITE_DONE )
+    {
+        [self statistics_endRebuild];
+        return ;
+    }
+    
+    _statisticsRebuildRowCount += rowCount;
+    
+    if ( rowCount == STATISTICS_REBUILD_BATCH_SIZE )
+    {
+        [self.connection dispatchAsync:^{
+            if ( ![self validateEnvironment] )
+            {
+                [self statistics_endRebuild];
+                return ;
+            }
+            
+            [self statistics_rebuildBatch];
+        }];
+        
+        return ;
+    }
+    
+    _statistics.rowCount = _statisticsRebuildRowCount;
+    [_statistics replaceColumns:columnStatistics];
+    
+    if ( _statisticsRebuildSawWrite )
+        _statistics.isExact = NO;   // rows we had already read may have changed since
+    
+    if ( _statisticsRebuildDidAnalyze )
+        [_statistics didAnalyze];
+    
+    [self statistics_endRebuild];
+    
+    [self statistics_save];
+}
+
+
+-(void)saveStatistics
+{
+    [self.connection dispatchSync:^{
+        if ( !_isClosed && !_isClosing )
+            [self statistics_save];
+    }];
+}
+
+
+-(NSDictionary *)statistics
+{
+    __block NSDictionary *statistics = nil;
+    
+    [self.connection dispatchSync:^{
+        if ( [self _ensureSchema] )
+            statistics = [[self statistics_load] snapshot];
+    }];
+    
+    return statistics;
+}
+
+
+#pragma mark - Change Notifications
+
+
+-(NSTimeInterval)changeDeliveryInterval
+{
+    __block NSTimeInterval changeDeliveryInterval;
+    
+    [self.connection dispatchSync:^{
+        changeDeliveryInterval = _changeDeliveryInterval;
+    }];
+    
+    return changeDeliveryInterval;
+}
+
+
+-(void)setChangeDeliveryInterval:(NSTimeInterval)changeDeliveryInterval
+{
+    [self.connection dispatchAsync:^{
+        _changeDeliveryInterval = MAX(changeDeliveryInterval, 0);
+    }];
+}
+
+
+-(BOOL)changes_isObserved
+{
+    return (_changeObservers.count || _liveQueries.count) ? YES : NO;
+}
+
+
+-(void)changes_schedule
+{
+    if ( _isChangeDeliveryScheduled || _pendingChanges.isEmpty )
+        return ;
+    
+    _isChangeDeliveryScheduled = YES;
+    
+    // Everything that changes before delivery is coalesced into a single batch. Even with no interval, any writes
+    // already queued will run first...
+    
+    void (^deliver)() = ^{
+        _isChangeDeliveryScheduled = NO;
+        
+        if ( _isClosed )
+            return ;
+        
+        [self changes_deliver];
+    };
+    
+    if ( _changeDeliveryInterval > 0 )
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_changeDeliveryInterval * NSEC_PER_SEC)), self.connection.queue, deliver);
+    
+    else
+        [self.connection dispatchAsync:deliver];
+}
+
+
+-(void)changes_addInsertedRowId:(NTJsonRowId)rowid
+{
+    [self transaction_didChangeRowId:rowid];
+    
+    if ( ![self changes_isObserved] )
+        return ;
+    
+    if ( _heldChanges )
+    {
+        [_heldChanges addInsertedRowId:rowid];
+        return ;
+    }
+    
+    if ( _isInStoreTransaction )
+    {
+        [_transactionChanges addInsertedRowId:rowid];   // delivered if the transaction commits
+        return ;
+    }
+    
+    [_pendingChanges addInsertedRowId:rowid];
+    [self changes_schedule];
+}
+
+
+-(void)changes_addUpdatedRowId:(NTJsonRowId)rowid
+{
+    [self transaction_didChangeRowId:rowid];
+    
+    if ( ![self changes_isObserved] )
+        return ;
+    
+    if ( _heldChanges )
+    {
+        [_heldChanges addUpdatedRowId:rowid];
+        return ;
+    }
+    
+    if ( _isInStoreTransaction )
+    {
+        [_transactionChanges addUpdatedRowId:rowid];   // delivered if the transaction commits
+        return ;
+    }
+    
+    [_pendingChanges addUpdatedRowId:rowid];
+    [self changes_schedule];
+}
+
+
+-(void)changes_addRemovedRowId:(NTJsonRowId)rowid
+{
+    [self transaction_didChangeRowId:rowid];
+    
+    if ( ![self changes_isObserved] )
+        return ;
+    
+    if ( _heldChanges )
+    {
+        [_heldChanges addRemovedRowId:rowid];
+        return ;
+    }
+    
+    if ( _isInStoreTransaction )
+    {
+        [_transactionChanges addRemovedRowId:rowid];   // delivered if the transaction commits
+        return ;
+    }
+    
+    [_pendingChanges addRemovedRowId:rowid];
+    [self changes_schedule];
+}
+
+
+-(void)changes_hold
+{
+    _heldChanges = [[NTJsonPendingChanges alloc] init];
+}
+
+
+-(void)changes_releaseHeldWithCommit:(BOOL)commit
+{
+    NTJsonPendingChanges *changes = _heldChanges;
+    
+    _heldChanges = nil;
+    
+    if ( !commit )
+        return ;    // the rows were never written
+    
+    if ( _isInStoreTransaction )
+    {
+        [_transactionChanges addChanges:changes];
+        return ;
+    }
+    
+    [_pendingChanges addChanges:changes];
+    [self changes_schedule];
+}
+
+
+-(void)changes_deliver
+{
+    if ( _pendingChanges.isEmpty )
+        return ;
+    
+    NTJsonChanges *changes = [_pendingChanges takeChangesWithCollection:self];
+    
+    LOG_DBG(@"Delivering %@", changes);
+    
+    // live queries are updated here, on our queue, so they see the collection exactly as the changes left it...
+    
+    for(NTJsonLiveQuery *liveQuery in [_liveQueries copy])
+        [liveQuery applyChanges:changes];
+    
+    for(NTJsonChangeObserver *observer in [_changeObservers copy])
+    {
+        void (^handler)(NTJsonChanges *changes) = observer->_handler;
+        
+        [self dispatchCompletionQueue:observer->_completionQueue completionHandler:^{
+            handler(changes);
+        }];
+    }
+}
+
+
+-(id)addChangeObserverWithQueue:(dispatch_queue_t)completionQueue handler:(void (^)(NTJsonChanges *changes))handler
+{
+    NTJsonChangeObserver *observer = [[NTJsonChangeObserver alloc] init];
+    
+    observer->_completionQueue = [self getCompletionQueue:completionQueue];
+    observer->_handler = [handler copy];
+    
+    [self.connection dispatchAsync:^{
+        if ( !_changeObservers )
+            _changeObservers = [NSMutableArray array];
+        
+        [_changeObservers addObject:observer];
+    }];
+    
+    return observer;
+}
+
+
+-(id)addChangeObserverWithHandler:(void (^)(NTJsonChanges *changes))handler
+{
+    return [self addChangeObserverWithQueue:nil handler:handler];
+}
+
+
+-(void)removeChangeObserver:(id)observer
+{
+    [self.connection dispatchAsync:^{
+        [_changeObservers removeObjectIdenticalTo:observer];
+    }];
+}
+
+
+-(NTJsonLiveQuery *)liveQueryWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionQueue:(dispatch_queue_t)completionQueue handler:(void (^)(NSArray *items, NTJsonChanges *changes, NSError *error))handler
+{
+    NTJsonLiveQuery *liveQuery = [[NTJsonLiveQuery alloc] initWithCollection:self where:where args:args orderBy:orderBy limit:limit completionQueue:[self getCompletionQueue:completionQueue] handler:handler];
+    
+    [self.connection dispatchAsync:^{
+        if ( !_liveQueries )
+            _liveQueries = [NSMutableArray array];
+        
+        [_liveQueries addObject:liveQuery];
+        
+        [liveQuery load];
+    }];
+    
+    return liveQuery;
+}
+
+
+-(NTJsonLiveQuery *)liveQueryWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit handler:(void (^)(NSArray *items, NTJsonChanges *changes, NSError *error))handler
+{
+    return [self liveQueryWhere:where args:args orderBy:orderBy limit:limit completionQueue:nil handler:handler];
+}
+
+
+-(void)removeLiveQuery:(NTJsonLiveQuery *)liveQuery
+{
+    [self.connection dispatchAsync:^{
+        [_liveQueries removeObjectIdenticalTo:liveQuery];
+    }];
+}
+
+
+#pragma mark - Store Transactions
+
+
+-(void)beginStoreTransaction
+{
+    // Collections created in the transaction are started from the store queue, they have no schema changes pending but
+    // calling _ensureSchema here could deadlock (it writes metadata on the store queue)...
+    
+    BOOL isStoreQueue = [self.store.connection isCurrentQueue];
+    
+    [self.connection dispatchSync:^{
+        if ( ![self validateEnvironment] )
+            return ;
+        
+        // Schema changes already requested happen before the transaction starts so they aren't lost in a rollback...
+        
+        if ( !isStoreQueue )
+            [self _ensureSchema];
+        
+        [self groupCommit_commit];
+        
+        _isInStoreTransaction = YES;
+        _wasNewCollection = _isNewCollection;
+        _transactionRowIds = [NSMutableSet set];
+        _transactionCacheUpdates = [NSMutableDictionary dictionary];
+        _transactionChanges = [[NTJsonPendingChanges alloc] init];
+        
+        [self.connection shareConnection:self.store.connection];
+    }];
+}
+
+
+-(void)transaction_didChangeRowId:(NTJsonRowId)rowid
+{
+    [_transactionRowIds addObject:@(rowid)];  // nil unless we are in a store transaction
+}
+
+
+-(void)transaction_deferCacheJson:(NSDictionary *)json cost:(NSUInteger)cost withRowId:(NTJsonRowId)rowid
+{
+    // Other threads may read the object cache at any time, it only sees the new version once it's committed...
+    
+    [_objectCache removeObjectWithRowId:rowid];
+    
+    _transactionCacheUpdates[@(rowid)] = @[json, @(cost)];
+}
+
+
+-(void)transaction_discardChanges
+{
+    // Anything we remember about the rows or schema may have been rolled back, start over from what's in the database...
+    
+    for(NSNumber *rowid in _transactionRowIds)
+        [_objectCache removeObjectWithRowId:[rowid longLongValue]];  // inserted rowids may be re-used after a rollback
+    
+    [_transactionRowIds removeAllObjects];
+    [_transactionCacheUpdates removeAllObjects];
+    
+    [_queryCache removeAll];
+    
+    _uniqueKeyMaps = nil;   // loaded on the next find
+    
+    _statistics = nil;      // reloaded from the metadata
+    _isStatisticsDirty = NO;
+    
+    _isNewCollection = _wasNewCollection;
+    _columns = (_isNewCollection) ? [NSArray array] : nil;
+    _indexes = (_isNewCollection) ? [NSArray array] : nil;
+    [_materializingColumns removeAllObjects];
+    _isMaterializationLoaded = _isNewCollection;
+    _keyDictionary = nil;
+    
+    [self flushCompiledSql];
+    [self.connection flushStatementCache];
+}
+
+
+-(void)storeTransactionDidRollbackSavepoint
+{
+    if ( !_isInStoreTransaction )
+        return ;
+    
+    // changes that happened before the savepoint are still coming, so we keep _transactionChanges. They may
+    // report rows that were rolled back, which observers already need to handle.
+    
+    [self transaction_discardChanges];
+}
+
+
+-(void)endStoreTransactionWithCommit:(BOOL)commit
+{
+    if ( !_isInStoreTransaction )
+        return ;
+    
+    if ( commit )
+    {
+        for(NSNumber *rowid in _transactionCacheUpdates)
+        {
+            NSArray *update = _transactionCacheUpdates[rowid];
+            
+            [_objectCache addJson:update[0] cost:[update[1] unsignedIntegerValue] withRowId:[rowid longLongValue]];
+        }
+        
+        [_pendingChanges addChanges:_transactionChanges];
+    }
+    
+    else
+        [self transaction_discardChanges];
+    
+    _isInStoreTransaction = NO;
+    _transactionRowIds = nil;
+    _transactionCacheUpdates = nil;
+    _transactionChanges = nil;
+    
+    [self.connection endSharing];
+    
+    [self changes_schedule];
+}
+
+
+#pragma mark - Group Commit
+
+
+-(void)groupCommit_willWrite
+{
+    // Called before each asynchronous write. With group commit enabled, writes are made in a transaction that's committed
+    // after groupCommitInterval or groupCommitMaxWrites writes, whichever comes first...
+    
+    if ( _groupCommitTransactionId || self.store.groupCommitInterval <= 0 || ![self validateEnvironment] )
+        return ;
+    
+    // The first write after a statistics save marks them dirty, do that now rather than as a metadata write in the group.
+    // (The statistics load once the schema is ready.)
+    
+    if ( [self _ensureSchema] )
+        [self statistics_willChange];
+    
+    NSString *transactionId = [self.connection beginTransaction];
+    
+    if ( !transactionId )
+        return ;    // the write will commit on its own
+    
+    _groupCommitTransactionId = transactionId;
+    _groupCommitCompletions = [NSMutableArray array];
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.store.groupCommitInterval * NSEC_PER_SEC)), self.connection.queue, ^{
+        if ( _groupCommitTransactionId == transactionId )
+            [self groupCommit_commit];
+    });
+}
+
+
+-(void)groupCommit_didWriteWithCompletionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSError *commitError))completionHandler
+{
+    if ( !_groupCommitTransactionId )
+    {
+        [self dispatchCompletionQueue:completionQueue completionHandler:^{
+            completionHandler(nil);
+        }];
+        
+        return ;
+    }
+    
+    void (^completion)(NSError *commitError) = ^(NSError *commitError) {
+        [self dispatchCompletionQueue:completionQueue completionHandler:^{
+            completionHandler(commitError);
+        }];
+    };
+    
+    [_groupCommitCompletions addObject:completion];
+    
+    if ( (int)_groupCommitCompletions.count >= self.store.groupCommitMaxWrites )
+        [self groupCommit_commit];
+}
+
+
+-(void)groupCommit_commit
+{
+    // Commits any writes waiting for a group commit. This must happen before anything that writes using another connection
+    // (schema changes and metadata) or they would wait on our lock...
+    
+    if ( !_groupCommitTransactionId )
+        return ;
+    
+    NSString *transactionId = _groupCommitTransactionId;
+    NSArray *completions = _groupCommitCompletions;
+    
+    _groupCommitTransactionId = nil;
+    _groupCommitCompletions = nil;
+    
+    NSError *error = nil;
+    
+    if ( ![self.connection commitTransation:transactionId] )
+    {
+        error = self.connection.lastError;
+        
+        LOG_ERROR(@"Group commit failed for %@ - %@", self.name, error.localizedDescription);
+        
+        // if the savepoint can't be rolled back the group is the outermost transaction, end it so later writes
+        // aren't left in an open transaction...
+        
+        if ( ![self.connection rollbackTransation:transactionId] && !sqlite3_get_autocommit(self.connection.db) )
+            [self.connection execSql:@"ROLLBACK;" args:nil];
+        
+        // our caches have all of the rolled back writes...
+        
+        [_objectCache removeAll];
+        [_queryCache removeAll];
+        _uniqueKeyMaps = nil;
+        _statistics = nil;
+        _isStatisticsDirty = NO;
+        _changeLogSeq = -1;     // we may have skipped change log entries that were rolled back
+    }
+    
+    for(void (^completion)(NSError *commitError) in completions)
+        completion(error);
+}
+
+
+-(void)applySynchronous:(NTJsonSynchronous)synchronous
+{
+    [self.connection dispatchAsync:^{
+        [self groupCommit_commit];  // the level can't be changed in a transaction
+        
+        self.connection.synchronous = synchronous;
+    }];
+}
+
+
+-(BOOL)saveMetadataWithKey:(NSString *)key value:(NSDictionary *)value
+{
+    // Metadata lives in the store file. If that's our database the store connection would wait on the write lock of an
+    // open group commit, so we write it ourselves as part of the group (it commits or rolls back with the writes it
+    // describes.) With collectionFiles it's a different database and the group doesn't get in the way...
+    
+    NTJsonSqlConnection *connection = ( _groupCommitTransactionId && !self.store.collectionFiles ) ? self.connection : self.store.connection;
+    
+    BOOL success = (connection == self.connection) ? [self.store saveMetadataWithKey:key value:value connection:connection] : [self.store saveMetadataWithKey:key value:value];
+    
+    if ( !success )
+        _lastError = connection.lastError;
+    
+    return success;
+}
+
+
+#pragma mark - External Changes
+
+
+-(NSString *)externalChanges_triggerNameWithOp:(NSString *)op
+{
+    return [NSString stringWithFormat:@"%@__%@_change", self.name, op];
+}
+
+
+-(BOOL)externalChanges_createChangeLog
+{
+    // Triggers add every change to the change log, so writes are logged no matter which process (or which version of this
+    // code) makes them. Updates are only logged when the document changes, materializing a column doesn't count...
+    
+    NSArray *triggerNames = @[[self externalChanges_triggerNameWithOp:@"insert"], [self externalChanges_triggerNameWithOp:@"update"], [self externalChanges_triggerNameWithOp:@"remove"]];
+    
+    NSNumber *count = [self.connection execValueSql:@"SELECT count(*) FROM sqlite_master WHERE type = 'trigger' AND name IN (?, ?, ?);" args:triggerNames];
+    
+    if ( [count intValue] < (int)triggerNames.count )
+    {
+        LOG_DBG(@"Adding change log triggers: %@", self.name);
+        
+        NSString *collection = [self.name stringByReplacingOccurrencesOfString:@"'" withString:@"''"];
+        NSString *insertSql = [NSString stringWithFormat:@"INSERT INTO [%@] ([collection], [row_id], [op]) VALUES ('%@'", NTJsonStore_ChangeLogTableName, collection];
+        
+        NSArray *sqls =
+        @[
+          [NSString stringWithFormat:@"CREATE TABLE IF NOT EXISTS [%@] ([seq] INTEGER PRIMARY KEY AUTOINCREMENT, [collection] TEXT, [row_id] INTEGER, [op] INTEGER);", NTJsonStore_ChangeLogTableName],
+          [NSString stringWithFormat:@"CREATE TRIGGER IF NOT EXISTS [%@] AFTER INSERT ON [%@] BEGIN %@, NEW.[%@], %d); END;", triggerNames[0], self.name, insertSql, NTJsonRowIdKey, NTJsonChangeLogOpInsert],
+          [NSString stringWithFormat:@"CREATE TRIGGER IF NOT EXISTS [%@] AFTER UPDATE OF [__json__] ON [%@] BEGIN %@, NEW.[%@], %d); END;", triggerNames[1], self.name, insertSql, NTJsonRowIdKey, NTJsonChangeLogOpUpdate],
+          [NSString stringWithFormat:@"CREATE TRIGGER IF NOT EXISTS [%@] AFTER DELETE ON [%@] BEGIN %@, OLD.[%@], %d); END;", triggerNames[2], self.name, insertSql, NTJsonRowIdKey, NTJsonChangeLogOpRemove],
+        ];
+        
+        if ( ![self schema_execSql:sqls] )
+            return NO;
+    }
+    
+    _isChangeLogReady = YES;
+    
+    return YES;
+}
+
+
+-(NSNumber *)externalChanges_lastSeq
+{
+    return [self.connection execValueSql:[NSString stringWithFormat:@"SELECT IFNULL(MAX([seq]), 0) FROM [%@];", NTJsonStore_ChangeLogTableName] args:nil];
+}
+
+
+-(BOOL)externalChanges_check
+{
+    // Called by _ensureSchema, so before our caches are used and before each write. PRAGMA data_version only changes when
+    // another connection commits, so most of the time this is a single cached statement. When it has changed we read the
+    // change log entries since the last one we saw and evict the rows other processes changed...
+    
+    if ( !_detectExternalChanges || _isInStoreTransaction )
+        return YES;
+    
+    if ( !_isChangeLogReady && ![self externalChanges_createChangeLog] )
+        return NO;
+    
+    NSNumber *dataVersion = [self.connection execValueSql:@"PRAGMA data_version;" args:nil];
+    
+    if ( ![dataVersion isKindOfClass:[NSNumber class]] )
+    {
+        _lastError = self.connection.lastError;
+        return NO;
+    }
+    
+    if ( _changeLogSeq >= 0 && [dataVersion longLongValue] == _dataVersion )
+        return YES; // nobody else has committed
+    
+    if ( _changeLogSeq < 0 )
+    {
+        // Our caches are empty (or were just reset), we only need to know where the log ends...
+        
+        NSNumber *lastSeq = [self externalChanges_lastSeq];
+        
+        if ( ![lastSeq isKindOfClass:[NSNumber class]] )
+        {
+            _lastError = self.connection.lastError;
+            return NO;
+        }
+        
+        _changeLogSeq = [lastSeq longLongValue];
+        _dataVersion = [dataVersion longLongValue];
+        
+        return YES;
+    }
+    
+    NSString *sql = [NSString stringWithFormat:@"SELECT [seq], [row_id], [op], [collection] = ? FROM [%@] WHERE [seq] > ? ORDER BY [seq];", NTJsonStore_ChangeLogTableName];
+    sqlite3_stmt *statement = [self.connection cachedStatementWithSql:sql args:@[self.name, @(_changeLogSeq)]];
+    
+    if ( !statement )
+    {
+        _lastError = self.connection.lastError;
+        return NO;
+    }
+    
+    int64_t lastSeq = _changeLogSeq;
+    BOOL isPruned = NO;
+    BOOL isChanged = NO;
+    int status;
+    
+    while ( (status=sqlite3_step(statement)) == SQLITE_ROW )
+    {
+        int64_t seq = sqlite3_column_int64(statement, 0);
+        
+        if ( _changeLogSeq == lastSeq && seq > lastSeq + 1 )
+            isPruned = YES;     // entries we never saw have been removed from the log
+        
+        _changeLogSeq = seq;
+        
+        if ( !sqlite3_column_int(statement, 3) )
+            continue;   // another collection in the same file
+        
+        NTJsonRowId rowid = sqlite3_column_int64(statement, 1);
+        
+        [_objectCache removeObjectWithRowId:rowid];
+        isChanged = YES;
+        
+        switch ( sqlite3_column_int(statement, 2) )
+        {
+            case NTJsonChangeLogOpInsert:
+                [self changes_addInsertedRowId:rowid];
+                break;
+            
+            case NTJsonChangeLogOpUpdate:
+                [self changes_addUpdatedRowId:rowid];
+                break;
+            
+            case NTJsonChangeLogOpRemove:
+                [self changes_addRemovedRowId:rowid];
+                break;
+        }
+    }
+    
+    [self.connection releaseStatement:statement];
+    
+    if ( status != SQLITE_DONE )
+    {
+        _lastError = [NSError NTJsonStore_errorWithSqlite3:self.connection.db];
+        LOG_ERROR(@"Unable to read the change log for %@ - %@", self.name, _lastError.localizedDescription);
+        return NO;  // we'll pick up where we left off next time
+    }
+    
+    _dataVersion = [dataVersion longLongValue];
+    
+    if ( isPruned )
+    {
+        LOG_DBG(@"Missed changes to %@ in the change log, flushing the cache", self.name);
+        [_objectCache removeAll];
+    }
+    
+    if ( isChanged || isPruned )
+    {
+        // We don't know how the other process changed our query results, unique keys or counts...
+        
+        [_queryCache removeAll];
+        _uniqueKeyMaps = nil;   // loaded on the next find
+        _statistics = nil;      // recounted on the next use
+        _isStatisticsStale = YES;
+        _isStatisticsDirty = NO;
+        _keyDictionary = nil;   // other processes may have added keys
+    }
+    
+    return YES;
+}
+
+
+-(void)externalChanges_didWrite
+{
+    // Our own writes are in the change log too. If nobody else has committed since _ensureSchema read the log every new
+    // entry is ours, so we can skip them. We read the end of the log first, data_version can only move forward after that.
+    // Otherwise (metadata written on the store connection counts) our entries are evicted and reported like any other.
+    
+    if ( !_detectExternalChanges || _isInStoreTransaction || _changeLogSeq < 0 )
+        return ;
+    
+    NSNumber *lastSeq = [self externalChanges_lastSeq];
+    NSNumber *dataVersion = [self.connection execValueSql:@"PRAGMA data_version;" args:nil];
+    
+    if ( [lastSeq isKindOfClass:[NSNumber class]] && [dataVersion isKindOfClass:[NSNumber class]] && [dataVersion longLongValue] == _dataVersion )
+        _changeLogSeq = [lastSeq longLongValue];
+    
+    // Keep the log from growing forever, a process that falls further behind than this flushes its cache...
+    
+    if ( ++_changeLogWrites >= CHANGE_LOG_PRUNE_INTERVAL )
+    {
+        _changeLogWrites = 0;
+        
+        NSString *sql = [NSString stringWithFormat:@"DELETE FROM [%@] WHERE [seq] <= (SELECT MAX([seq]) FROM [%@]) - %d;", NTJsonStore_ChangeLogTableName, NTJsonStore_ChangeLogTableName, CHANGE_LOG_MAX_ENTRIES];
+        
+        if ( ![self.connection execSql:sql args:nil] )
+            LOG_ERROR(@"Unable to prune the change log - %@", self.connection.lastError.localizedDescription);
+    }
+}
+
+
+#pragma mark - insert
+
+
+-(NSString *)insertSqlWithColumns:(NSArray *)columns
+{
+    NSMutableArray *columnNames = [NSMutableArray arrayWithObject:@"__json__"];
+    [columnNames addObjectsFromArray:[columns NTJsonStore_transform:^id(NTJsonColumn *column) { return [NSString stringWithFormat:@"[%@]", column.name]; }]];
+    
+    return [NSString stringWithFormat:@"INSERT INTO [%@] (%@) VALUES (%@);",
+            self.name,
+            [columnNames componentsJoinedByString:@", "],
+            [@"" stringByPaddingToLength:columnNames.count*3-2 withString:@"?, " startingAtIndex:0]];
+}
+
+
+-(NTJsonRowId)_insert:(NSDictionary *)json
+{
+    // Be careful of any side effects in this code impacting memory (caching, etc). It may be run
+    // inside a transaction so we need to be safe for rollbacks.
+    
+    if ( ![self _ensureSchema] )
+        return 0;
+    
+    NSArray *columns = [self materializedColumns];
+    NSString *sql = [self insertSqlWithColumns:columns];
+    
+    NSMutableArray *values = [NSMutableArray array];
+    
+    NSError *error;
+    
+    NSData *jsonData = [self encodeJson:json error:&error];
+    
+    if ( !jsonData )
+    {
+        _lastError = error;
+        return 0;
+    }
+    
+    [values addObject:jsonData];
+    
+    [self extractValuesInColumns:columns fromJson:json intoArray:values];
+    
+    [self statistics_willChange];
+    
+    if ( ![self.connection execSql:sql args:values cached:YES] )
+    {
+        _lastError = self.connection.lastError;
+        return 0;
+    }
+    
+    NTJsonRowId rowid = sqlite3_last_insert_rowid(self.connection.db);
+    
+    [self externalChanges_didWrite];
+    
+    [_queryCache invalidateForInsert];
+    [self uniqueKeys_setJson:json withRowId:rowid];
+    
+    [_statistics addRowWithValues:[values subarrayWithRange:NSMakeRange(1, columns.count)] columns:columns];
+    [self statistics_didChange];
+    
+    [self changes_addInsertedRowId:rowid];
+    
+    return rowid;
+}
+
+
+-(void)beginInsert:(NSDictionary *)json completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NTJsonRowId rowid, NSError *error))completionHandler
+{
+    completionQueue = [self getCompletionQueue:completionQueue];
+    
+    [self.connection dispatchAsync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_willWrite];
+        
+        NTJsonRowId rowid = [self _insert:json];
+        
+        [_metrics addOperation:@"insert" startedAt:startedAt];
+        
+        NSError *error = (rowid) ? nil : _lastError;
+        
+        [self groupCommit_didWriteWithCompletionQueue:completionQueue completionHandler:^(NSError *commitError) {
+            completionHandler(rowid, error ?: commitError);
+        }];
+    }];
+}
+
+
+-(void)beginInsert:(NSDictionary *)json completionHandler:(void (^)(NTJsonRowId rowid, NSError *error))completionHandler
+{
+    [self beginInsert:json completionQueue:nil completionHandler:completionHandler];
+}
+
+
+-(NTJsonRowId)insert:(NSDictionary *)json error:(NSError **)error
+{
+    __block NTJsonRowId rowid;
+    
+    [self.connection dispatchSync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_commit];  // so this write is committed when we return
+        
+        rowid = [self _insert:json];
+        
+        [_metrics addOperation:@"insert" startedAt:startedAt];
+        
+        if ( error )
+            *error = (rowid) ? nil : _lastError;
+    }];
+    
+    return rowid;
+}
+
+
+-(NTJsonRowId)insert:(NSDictionary *)json
+{
+    return [self insert:json error:nil];
+}
+
+
+#pragma mark - insertBatch
+
+
++(NSArray *)serializeItems:(NSArray *)items chunkSize:(int)chunkSize keyDictionary:(NTJsonKeyDictionary *)keyDictionary error:(NSError **)error
+{
+    // NSJSONSerialization is thread safe, so we serialize each chunk on a worker thread. This doesn't touch
+    // any collection state so it's safe to run before we get to the collection queue. If keyDictionary is passed
+    // we encode binary documents instead (the key dictionary is thread safe as well.)
+    
+    NSUInteger chunkCount = (items.count + chunkSize - 1) / chunkSize;
+    NSMutableArray *chunks = [NSMutableArray arrayWithCapacity:chunkCount];
+    __block NSError *chunkError = nil;
+    
+    for(NSUInteger chunk=0; chunk<chunkCount; chunk++)
+        [chunks addObject:[NSNull null]];
+    
+    dispatch_apply(chunkCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunk)
+    {
+        NSUInteger start = chunk * chunkSize;
+        NSUInteger end = MIN(start + chunkSize, items.count);
+        NSMutableArray *jsonDatas = [NSMutableArray arrayWithCapacity:end-start];
+        
+        for(NSUInteger index=start; index<end; index++)
+        {
+            NSError *error;
+            NSData *jsonData = (keyDictionary) ? [NTJsonBinaryCoder dataWithJson:items[index] keyDictionary:keyDictionary error:&error] : [NSJSONSerialization dataWithJSONObject:items[index] options:0 error:&error];
+            
+            if ( !jsonData )
+            {
+                @synchronized(chunks)
+                {
+                    chunkError = error;
+                }
+                return ;
+            }
+            
+            [jsonDatas addObject:jsonData];
+        }
+        
+        @synchronized(chunks)
+        {
+            chunks[chunk] = jsonDatas;
+        }
+    });
+    
+    if ( chunkError )
+    {
+        if ( error )
+            *error = chunkError;
+        
+        return nil;
+    }
+    
+    NSMutableArray *jsonDatas = [NSMutableArray arrayWithCapacity:items.count];
+    
+    for(NSArray *chunk in chunks)
+        [jsonDatas addObjectsFromArray:chunk];
+    
+    return [jsonDatas copy];
+}
+
+
+-(NSArray *)extractValuesInColumns:(NSArray *)columns fromItems:(NSArray *)items chunkSize:(int)chunkSize
+{
+    // Column extraction only reads the json and _defaultJson, so this can be done in parallel as well. The collection queue
+    // is blocked until dispatch_apply returns so nothing else can change our state.
+    
+    NSUInteger chunkCount = (items.count + chunkSize - 1) / chunkSize;
+    NSMutableArray *chunks = [NSMutableArray arrayWithCapacity:chunkCount];
+    
+    for(NSUInteger chunk=0; chunk<chunkCount; chunk++)
+        [chunks addObject:[NSNull null]];
+    
+    dispatch_apply(chunkCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunk)
+    {
+        NSUInteger start = chunk * chunkSize;
+        NSUInteger end = MIN(start + chunkSize, items.count);
+        NSMutableArray *rows = [NSMutableArray arrayWithCapacity:end-start];
+        
+        for(NSUInteger index=start; index<end; index++)
+        {
+            NSMutableArray *values = [NSMutableArray arrayWithCapacity:columns.count];
+            
+            [self extractValuesInColumns:columns fromJson:items[index] intoArray:values];
+            
+            [rows addObject:values];
+        }
+        
+        @synchronized(chunks)
+        {
+            chunks[chunk] = rows;
+        }
+    });
+    
+    NSMutableArray *rows = [NSMutableArray arrayWithCapacity:items.count];
+    
+    for(NSArray *chunk in chunks)
+        [rows addObjectsFromArray:chunk];
+    
+    return rows;
+}
+
+
+-(NSArray *)_bulkInsert:(NSArray *)items jsonDatas:(NSArray *)jsonDatas
+{
+    // jsonDatas is the pre-serialized JSON for each item...
+    
+    if ( !items.count )
+        return [NSArray array];
+    
+    if ( ![self _ensureSchema] )
+        return nil;
+    
+    int chunkSize = self.serializationChunkSize;
+    NSArray *columns = [self materializedColumns];
+    NSArray *columnValues = (columns.count) ? [self extractValuesInColumns:columns fromItems:items chunkSize:chunkSize] : nil;
+    
+    [self statistics_willChange];
+    
+    NSString *transactionId = [self.connection beginTransaction];
+    
+    if ( !transactionId )
+    {
+        _lastError = self.connection.lastError;
+        return nil;
+    }
+    
+    // One statement is bound and stepped for every row...
+    
+    sqlite3_stmt *statement = [self.connection cachedStatementWithSql:[self insertSqlWithColumns:columns] args:nil];
+    
+    if ( !statement )
+    {
+        _lastError = self.connection.lastError;
+        [self.connection rollbackTransation:transactionId];
+        [self uniqueKeys_didRollback];
+        return nil;
+    }
+    
+    NSMutableArray *rowids = [NSMutableArray arrayWithCapacity:items.count];
+    NSMutableArray *values = [NSMutableArray arrayWithCapacity:columns.count+1];
+    
+    for(NSUInteger index=0; index<items.count; index++)
+    {
+        [values removeAllObjects];
+        [values addObject:jsonDatas[index]];
+        
+        if ( columnValues )
+            [values addObjectsFromArray:columnValues[index]];
+        
+        if ( ![self.connection execStatement:statement args:values] )
+        {
+            _lastError = self.connection.lastError;
+            [self.connection releaseStatement:statement];
+            [self.connection rollbackTransation:transactionId];
+            [self uniqueKeys_didRollback];
+            return nil;
+        }
+        
+        [rowids addObject:@(sqlite3_last_insert_rowid(self.connection.db))];
+    }
+    
+    [self.connection releaseStatement:statement];
+    
+    if ( ![self.connection commitTransation:transactionId] )
+    {
+        _lastError = self.connection.lastError;
+        [self uniqueKeys_didRollback];
+        return nil;
+    }
+    
+    [self externalChanges_didWrite];
+    
+    [_queryCache invalidateForInsert];
+    
+    if ( _uniqueKeyMaps.count )
+    {
+        for(NSUInteger index=0; index<items.count; index++)
+            [self uniqueKeys_setJson:items[index] withRowId:[rowids[index] longLongValue]];
+    }
+    
+    for(NSUInteger index=0; index<items.count; index++)
+        [_statistics addRowWithValues:(columnValues) ? columnValues[index] : nil columns:columns];
+    
+    [self statistics_didChange];
+    
+    for(NSNumber *rowid in rowids)
+        [self changes_addInsertedRowId:[rowid longLongValue]];
+    
+    return [rowids copy];
+}
+
+
+-(NSArray *)encodedJsonDatas:(NSArray *)jsonDatas items:(NSArray *)items error:(NSError *)serializeError
+{
+    // Finishes the work started by serializing the items before we reached the queue. nil on failure (_lastError is set)...
+    
+    if ( serializeError )
+    {
+        _lastError = serializeError;
+        return nil;
+    }
+    
+    // Binary documents need our key dictionary so they are encoded here (still in parallel). We also end up here
+    // if the format changed after text was pre-serialized...
+    
+    NTJsonKeyDictionary *keyDictionary = (self.documentFormat == NTJsonDocumentFormatBinary) ? self.keyDictionary : nil;
+    NSData *first = [jsonDatas firstObject];
+    
+    if ( !jsonDatas || (first && [NTJsonBinaryCoder isBinaryBytes:first.bytes length:first.length] != (keyDictionary != nil)) )
+    {
+        NSError *error;
+        
+        jsonDatas = [self.class serializeItems:items chunkSize:self.serializationChunkSize keyDictionary:keyDictionary error:&error];
+        
+        if ( !jsonDatas )
+        {
+            _lastError = error;
+            return nil;
+        }
+    }
+    
+    if ( keyDictionary && ![self saveKeyDictionary] )
+        return nil;
+    
+    return jsonDatas;
+}
+
+
+-(NSArray *)_insertBatch:(NSArray *)items jsonDatas:(NSArray *)jsonDatas error:(NSError *)serializeError
+{
+    if ( ![self validateEnvironment] )
+        return nil;
+    
+    jsonDatas = [self encodedJsonDatas:jsonDatas items:items error:serializeError];
+    
+    if ( !jsonDatas )
+        return nil;
+    
+    return [self _bulkInsert:items jsonDatas:jsonDatas];
+}
+
+
+-(void)beginBulkInsert:(NSArray *)items completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *rowids, NSError *error))completionHandler
+{
+    completionQueue = [self getCompletionQueue:completionQueue];
+    
+    // start serializing right away, the collection queue will wait for us when it gets to this request...
+    
+    int chunkSize = self.serializationChunkSize;
+    dispatch_group_t group = dispatch_group_create();
+    __block NSArray *jsonDatas;
+    __block NSError *serializeError;
+    
+    if ( !self.isBinaryDocumentFormat )
+    {
+        dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            NSError *error;
+            jsonDatas = [self.class serializeItems:items chunkSize:chunkSize keyDictionary:nil error:&error];
+            serializeError = error;
+        });
+    }
+    
+    [self.connection dispatchAsync:^{
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+        
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_willWrite];
+        
+        NSArray *rowids = [self _insertBatch:items jsonDatas:jsonDatas error:serializeError];
+        
+        [_metrics addOperation:@"insertBatch" startedAt:startedAt];
+        
+        NSError *error = (rowids) ? nil : _lastError;
+        
+        [self groupCommit_didWriteWithCompletionQueue:completionQueue completionHandler:^(NSError *commitError) {
+            completionHandler(rowids, error ?: commitError);
+        }];
+    }];
+}
+
+
+-(void)beginBulkInsert:(NSArray *)items completionHandler:(void (^)(NSArray *rowids, NSError *error))completionHandler
+{
+    [self beginBulkInsert:items completionQueue:nil completionHandler:completionHandler];
+}
+
+
+-(NSArray *)bulkInsert:(NSArray *)items error:(NSError **)error
+{
+    // serialize on the calling thread (and workers) before we enter the collection queue...
+    
+    NSError *serializeError = nil;
+    NSArray *jsonDatas = (self.isBinaryDocumentFormat) ? nil : [self.class serializeItems:items chunkSize:self.serializationChunkSize keyDictionary:nil error:&serializeError];
+    
+    __block NSArray *rowids;
+    
+    [self.connection dispatchSync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_commit];  // so this write is committed when we return
+        
+        rowids = [self _insertBatch:items jsonDatas:jsonDatas error:serializeError];
+        
+        [_metrics addOperation:@"insertBatch" startedAt:startedAt];
+        
+        if ( error )
+            *error = (rowids) ? nil : _lastError;
+    }];
+    
+    return rowids;
+}
+
+
+-(NSArray *)bulkInsert:(NSArray *)items
+{
+    return [self bulkInsert:items error:nil];
+}
+
+
+-(void)beginInsertBatch:(NSArray *)items completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSError *error))completionHandler
+{
+    [self beginBulkInsert:items completionQueue:completionQueue completionHandler:^(NSArray *rowids, NSError *error) {
+        completionHandler(error);
+    }];
+}
+
+
+-(void)beginInsertBatch:(NSArray *)items completionHandler:(void (^)(NSError *error))completionHandler
+{
+    [self beginInsertBatch:items completionQueue:nil completionHandler:completionHandler];
+}
+
+
+-(BOOL)insertBatch:(NSArray *)items error:(NSError **)error
+{
+    return ([self bulkInsert:items error:error]) ? YES : NO;
+}
+
+
+-(BOOL)insertBatch:(NSArray *)items
+{
+    return [self insertBatch:items error:nil];
+}
+
+
+#pragma mark - upsertBatch
+
+
++(NSString *)normalizedKeys:(NSString *)keys
+{
+    return [[keys componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] componentsJoinedByString:@""];
+}
+
+
+-(NTJsonIndex *)uniqueIndexWithKeys:(NSString *)keys
+{
+    NSString *normalizedKeys = [self.class normalizedKeys:keys];
+    
+    return [self.indexes NTJsonStore_find:^BOOL(NTJsonIndex *index) { return index.isUnique && [[self.class normalizedKeys:index.keys] isEqualToString:normalizedKeys]; }];
+}
+
+
+-(BOOL)_upsertBatch:(NSArray *)items onKeys:(NSString *)keys jsonDatas:(NSArray *)jsonDatas error:(NSError *)serializeError insertedCount:(int *)insertedCount updatedCount:(int *)updatedCount
+{
+    if ( insertedCount )
+        *insertedCount = 0;
+    
+    if ( updatedCount )
+        *updatedCount = 0;
+    
+    if ( ![self _ensureSchema] )
+        return NO;
+    
+    NTJsonIndex *uniqueIndex = [self uniqueIndexWithKeys:keys];
+    
+    if ( !uniqueIndex )
+    {
+        _lastError = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidSqlArgument message:[NSString stringWithFormat:@"There is no unique index on %@ in %@.", keys, self.name]];
+        return NO;
+    }
+    
+    if ( !items.count )
+        return YES;
+    
+    jsonDatas = [self encodedJsonDatas:jsonDatas items:items error:serializeError];
+    
+    if ( !jsonDatas )
+        return NO;
+    
+    NSArray *columns = [self materializedColumns];
+    NSArray *columnValues = (columns.count) ? [self extractValuesInColumns:columns fromItems:items chunkSize:self.serializationChunkSize] : nil;
+    
+    // Existing rows are updated in place so their rowids don't change (INSERT OR REPLACE would delete and re-insert them.)
+    // RETURNING gives us the rowid either way and last_insert_rowid tells us which one happened...
+    
+    NSMutableArray *columnNames = [NSMutableArray arrayWithObject:@"__json__"];
+    [columnNames addObjectsFromArray:[columns NTJsonStore_transform:^id(NTJsonColumn *column) { return column.name; }]];
+    
+    NSString *insertSql = [self insertSqlWithColumns:columns];
+    NSString *sql = [NSString stringWithFormat:@"%@ ON CONFLICT (%@) DO UPDATE SET %@ RETURNING [%@];",
+                     [insertSql substringToIndex:insertSql.length-1],  // without the ";"
+                     [uniqueIndex keysSql],
+                     [[columnNames NTJsonStore_transform:^id(NSString *columnName) { return [NSString stringWithFormat:@"[%@] = excluded.[%@]", columnName, columnName]; }] componentsJoinedByString:@", "],
+                     NTJsonRowIdKey];
+    
+    NSString *transactionId = [self.connection beginTransaction];
+    
+    if ( !transactionId )
+    {
+        _lastError = self.connection.lastError;
+        return NO;
+    }
+    
+    [self statistics_willChange];   // in the transaction, so it's rolled back with it
+    
+    sqlite3_stmt *statement = [self.connection cachedStatementWithSql:sql args:nil];
+    
+    if ( !statement )
+    {
+        _lastError = self.connection.lastError;
+        [self.connection rollbackTransation:transactionId];
+        [self statistics_didRollback];
+        [self uniqueKeys_didRollback];
+        return NO;
+    }
+    
+    sqlite3 *db = self.connection.db;
+    NSMutableArray *rowids = [NSMutableArray arrayWithCapacity:items.count];
+    NSMutableIndexSet *insertedIndexes = [NSMutableIndexSet indexSet];
+    NSMutableArray *values = [NSMutableArray arrayWithCapacity:columns.count+1];
+    
+    for(NSUInteger index=0; index<items.count; index++)
+    {
+        [values removeAllObjects];
+        [values addObject:jsonDatas[index]];
+        
+        if ( columnValues )
+            [values addObjectsFromArray:columnValues[index]];
+        
+        sqlite3_set_last_insert_rowid(db, 0);
+        
+        if ( ![self.connection execStatement:statement args:values] || sqlite3_data_count(statement) < 1 )
+        {
+            _lastError = self.connection.lastError ?: [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidSqlResult];
+            [self.connection releaseStatement:statement];
+            [self.connection rollbackTransation:transactionId];
+            [self statistics_didRollback];
+            [self uniqueKeys_didRollback];
+            return NO;
+        }
+        
+        [rowids addObject:@(sqlite3_column_int64(statement, 0))];
+        
+        if ( sqlite3_last_insert_rowid(db) )
+            [insertedIndexes addIndex:index];
+    }
+    
+    [self.connection releaseStatement:statement];
+    
+    if ( ![self.connection commitTransation:transactionId] )
+    {
+        _lastError = self.connection.lastError;
+        [self statistics_didRollback];
+        [self uniqueKeys_didRollback];
+        return NO;
+    }
+    
+    [self externalChanges_didWrite];
+    
+    [_queryCache removeAll];    // we don't know which fields the updates changed
+    
+    for(NSUInteger index=0; index<items.count; index++)
+    {
+        NTJsonRowId rowid = [rowids[index] longLongValue];
+        NSArray *newValues = (columnValues) ? columnValues[index] : nil;
+        
+        if ( [insertedIndexes containsIndex:index] )
+        {
+            [_statistics addRowWithValues:newValues columns:columns];
+            [self changes_addInsertedRowId:rowid];
+        }
+        
+        else
+        {
+            // the statistics need the old values, which we only know if the item is cached...
+            
+            NSDictionary *oldJson = [_objectCache peekJsonWithRowId:rowid];
+            NSMutableArray *oldValues = (oldJson) ? [NSMutableArray arrayWithCapacity:columns.count] : nil;
+            
+            if ( oldJson )
+                [self extractValuesInColumns:columns fromJson:oldJson intoArray:oldValues];
+            
+            [_statistics updateRowWithOldValues:oldValues newValues:newValues columns:columns];
+            
+            // the cached copy is replaced, so anyone holding the item sees the same rowid...
+            
+            NSMutableDictionary *json = [items[index] mutableCopy];
+            json[NTJsonRowIdKey] = @(rowid);
+            
+            if ( _isInStoreTransaction )
+                [self transaction_deferCacheJson:json cost:[jsonDatas[index] length] withRowId:rowid];
+            
+            else
+                [_objectCache addJson:json cost:[jsonDatas[index] length] withRowId:rowid];
+            
+            [self changes_addUpdatedRowId:rowid];
+        }
+        
+        if ( _uniqueKeyMaps.count )
+            [self uniqueKeys_setJson:items[index] withRowId:rowid];
+    }
+    
+    [self statistics_didChange];
+    
+    if ( insertedCount )
+        *insertedCount = (int)insertedIndexes.count;
+    
+    if ( updatedCount )
+        *updatedCount = (int)(items.count - insertedIndexes.count);
+    
+    return YES;
+}
+
+
+-(void)beginUpsertBatch:(NSArray *)items onKeys:(NSString *)keys completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(int insertedCount, int updatedCount, NSError *error))completionHandler
+{
+    completionQueue = [self getCompletionQueue:completionQueue];
+    
+    // start serializing right away, the collection queue will wait for us when it gets to this request...
+    
+    int chunkSize = self.serializationChunkSize;
+    dispatch_group_t group = dispatch_group_create();
+    __block NSArray *jsonDatas;
+    __block NSError *serializeError;
+    
+    if ( !self.isBinaryDocumentFormat )
+    {
+        dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            NSError *error;
+            jsonDatas = [self.class serializeItems:items chunkSize:chunkSize keyDictionary:nil error:&error];
+            serializeError = error;
+        });
+    }
+    
+    [self.connection dispatchAsync:^{
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+        
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_willWrite];
+        
+        int insertedCount, updatedCount;
+        BOOL success = [self _upsertBatch:items onKeys:keys jsonDatas:jsonDatas error:serializeError insertedCount:&insertedCount updatedCount:&updatedCount];
+        
+        [_metrics addOperation:@"upsertBatch" startedAt:startedAt];
+        
+        NSError *error = (success) ? nil : _lastError;
+        
+        [self groupCommit_didWriteWithCompletionQueue:completionQueue completionHandler:^(NSError *commitError) {
+            completionHandler(insertedCount, updatedCount, error ?: commitError);
+        }];
+    }];
+}
+
+
+-(void)beginUpsertBatch:(NSArray *)items onKeys:(NSString *)keys completionHandler:(void (^)(int insertedCount, int updatedCount, NSError *error))completionHandler
+{
+    [self beginUpsertBatch:items onKeys:keys completionQueue:nil completionHandler:completionHandler];
+}
+
+
+-(BOOL)upsertBatch:(NSArray *)items onKeys:(NSString *)keys insertedCount:(int *)insertedCount updatedCount:(int *)updatedCount error:(NSError **)error
+{
+    // serialize on the calling thread (and workers) before we enter the collection queue...
+    
+    NSError *serializeError = nil;
+    NSArray *jsonDatas = (self.isBinaryDocumentFormat) ? nil : [self.class serializeItems:items chunkSize:self.serializationChunkSize keyDictionary:nil error:&serializeError];
+    
+    __block BOOL success;
+    
+    [self.connection dispatchSync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_commit];  // so this write is committed when we return
+        
+        success = [self _upsertBatch:items onKeys:keys jsonDatas:jsonDatas error:serializeError insertedCount:insertedCount updatedCount:updatedCount];
+        
+        [_metrics addOperation:@"upsertBatch" startedAt:startedAt];
+        
+        if ( error )
+            *error = (success) ? nil : _lastError;
+    }];
+    
+    return success;
+}
+
+
+-(BOOL)upsertBatch:(NSArray *)items onKeys:(NSString *)keys
+{
+    return [self upsertBatch:items onKeys:keys insertedCount:NULL updatedCount:NULL error:nil];
+}
+
+
+#pragma mark - update
+
+
+-(NSSet *)changedColumnNamesWithOldJson:(NSDictionary *)oldJson json:(NSDictionary *)json
+{
+    // compares against the previous version of the item, returns nil if we don't have it (meaning anything could have changed)...
+    
+    if ( !oldJson )
+        return nil;
+    
+    NSMutableSet *changedColumnNames = [NSMutableSet set];
+    
+    for(NTJsonColumn *column in self.columns)
+    {
+        id oldValue = [oldJson NTJsonStore_objectForKeyPath:column.name];
+        id newValue = [json NTJsonStore_objectForKeyPath:column.name];
+        
+        if ( oldValue != newValue && ![oldValue isEqual:newValue] )
+            [changedColumnNames addObject:column.name];
+    }
+    
+    return changedColumnNames;
+}
+
+
+-(BOOL)_updateJson:(NSDictionary *)json withRowId:(NTJsonRowId)rowid columns:(NSArray *)columns oldJson:(NSDictionary *)oldJson changedColumnNames:(NSSet *)changedColumnNames
+{
+    // Writes the document and the given materialized columns. oldJson (if we know it) keeps the statistics exact...
+    
+    NSMutableArray *columnNames = [NSMutableArray arrayWithObject:@"__json__"];
+    [columnNames addObjectsFromArray:[columns NTJsonStore_transform:^id(NTJsonColumn *column) { return column.name; }]];
+    
+    NSString *sql = [NSString stringWithFormat:@"UPDATE [%@] SET %@ WHERE [%@] = ?;",
+                     self.name,
+                     [[columnNames NTJsonStore_transform:^id(NSString *columnName) { return [NSString stringWithFormat:@"[%@] = ?", columnName]; }] componentsJoinedByString:@", "],
+                     NTJsonRowIdKey];
+    
+    NSMutableArray *values = [NSMutableArray array];
+    
+    NSError *error;
+    
+    NSData *jsonData = [self encodeJson:json error:&error];
+    
+    if ( !jsonData )
+    {
+        _lastError = error;
+        return NO;
+    }
+    
+    [values addObject:jsonData];
+    
+    [self extractValuesInColumns:columns fromJson:json intoArray:values];
+    
+    [values addObject:@(rowid)];
+    
+    NSMutableArray *oldValues = (oldJson) ? [NSMutableArray arrayWithCapacity:columns.count] : nil;
+    
+    if ( oldJson )
+        [self extractValuesInColumns:columns fromJson:oldJson intoArray:oldValues];
+    
+    [self statistics_willChange];
+    
+    BOOL success = [self.connection execSql:sql args:values cached:YES];
+    
+    if ( success )
+    {
+        if ( _isInStoreTransaction )
+            [self transaction_deferCacheJson:json cost:jsonData.length withRowId:rowid];
+        
+        else
+            [_objectCache addJson:json cost:jsonData.length withRowId:rowid];
+        
+        [_queryCache invalidateForUpdateWithChangedColumnNames:changedColumnNames];
+        [self uniqueKeys_setJson:json withRowId:rowid];
+        
+        if ( sqlite3_changes(self.connection.db) > 0 )
+        {
+            [_statistics updateRowWithOldValues:oldValues newValues:[values subarrayWithRange:NSMakeRange(1, columns.count)] columns:columns];
+            [self statistics_didChange];
+            
+            [self changes_addUpdatedRowId:rowid];
+        }
+        
+        [self externalChanges_didWrite];
+    }
+    
+    return success;
+}
+
+
+-(BOOL)_update:(NSDictionary *)json
+{
+    if ( ![self _ensureSchema] )
+        return NO;
+    
+    NTJsonRowId rowid = [json[NTJsonRowIdKey] longLongValue];
+    
+    // the statistics and query cache need the old values, which we only know if the item is cached...
+    
+    NSDictionary *oldJson = [_objectCache peekJsonWithRowId:rowid];
+    NSSet *changedColumnNames = (_queryCache.cacheSize) ? [self changedColumnNamesWithOldJson:oldJson json:json] : nil;
+    
+    return [self _updateJson:json withRowId:rowid columns:[self materializedColumns] oldJson:oldJson changedColumnNames:changedColumnNames];
+}
+
+
+-(void)beginUpdate:(NSDictionary *)json completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSError *error))completionHandler
+{
+    completionQueue = [self getCompletionQueue:completionQueue];
+    
+    [self.connection dispatchAsync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_willWrite];
+        
+        BOOL success = [self _update:json];
+        
+        [_metrics addOperation:@"update" startedAt:startedAt];
+        
+        NSError *error = (success) ? nil : _lastError;
+        
+        [self groupCommit_didWriteWithCompletionQueue:completionQueue completionHandler:^(NSError *commitError) {
+            completionHandler(error ?: commitError);
+        }];
+    }];
+}
+
+
+-(void)beginUpdate:(NSDictionary *)json completionHandler:(void (^)(NSError *error))completionHandler
+{
+    [self beginUpdate:json completionQueue:nil completionHandler:completionHandler];
+}
+
+
+-(BOOL)update:(NSDictionary *)json error:(NSError **)error
+{
+    __block BOOL success;
+    
+    [self.connection dispatchSync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_commit];  // so this write is committed when we return
+        
+        success = [self _update:json];
+        
+        [_metrics addOperation:@"update" startedAt:startedAt];
+        
+        if ( error )
+            *error = (success) ? nil : _lastError;
+    }];
+    
+    return success;
+}
+
+
+-(BOOL)update:(NSDictionary *)json
+{
+    return [self update:json error:nil];
+}
+
+
+#pragma mark - updateFields
+
+
+-(BOOL)_updateFields:(NSDictionary *)fields forRowId:(NTJsonRowId)rowid
+{
+    // Merges the fields into the current document and only writes the materialized columns that actually changed. If
+    // nothing changed there's no write at all...
+    
+    if ( ![self _ensureSchema] )
+        return NO;
+    
+    NSDictionary *oldJson = [[self itemsWithRowids:@[@(rowid)] rowColumns:nil] firstObject];
+    
+    if ( !oldJson )
+    {
+        _lastError = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorNotFound];
+        return NO;
+    }
+    
+    NSMutableDictionary *patch = [fields mutableCopy];
+    [patch removeObjectForKey:NTJsonRowIdKey];  // the rowid can't be changed
+    
+    NSDictionary *json = [oldJson NTJsonStore_dictionaryWithPatch:patch];
+    
+    if ( [json isEqualToDictionary:oldJson] )
+        return YES;
+    
+    NSSet *changedColumnNames = [self changedColumnNamesWithOldJson:oldJson json:json];
+    NSArray *columns = [[self materializedColumns] NTJsonStore_transform:^id(NTJsonColumn *column) { return ([changedColumnNames containsObject:column.name]) ? column : nil; }];
+    
+    return [self _updateJson:json withRowId:rowid columns:columns oldJson:oldJson changedColumnNames:changedColumnNames];
+}
+
+
+-(void)beginUpdateFields:(NSDictionary *)fields forRowId:(NTJsonRowId)rowid completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSError *error))completionHandler
+{
+    completionQueue = [self getCompletionQueue:completionQueue];
+    
+    [self.connection dispatchAsync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_willWrite];
+        
+        BOOL success = [self _updateFields:fields forRowId:rowid];
+        
+        [_metrics addOperation:@"updateFields" startedAt:startedAt];
+        
+        NSError *error = (success) ? nil : _lastError;
+        
+        [self groupCommit_didWriteWithCompletionQueue:completionQueue completionHandler:^(NSError *commitError) {
+            completionHandler(error ?: commitError);
+        }];
+    }];
+}
+
+
+-(void)beginUpdateFields:(NSDictionary *)fields forRowId:(NTJsonRowId)rowid completionHandler:(void (^)(NSError *error))completionHandler
+{
+    [self beginUpdateFields:fields forRowId:rowid completionQueue:nil completionHandler:completionHandler];
+}
+
+
+-(BOOL)updateFields:(NSDictionary *)fields forRowId:(NTJsonRowId)rowid error:(NSError **)error
+{
+    __block BOOL success;
+    
+    [self.connection dispatchSync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_commit];  // so this write is committed when we return
+        
+        success = [self _updateFields:fields forRowId:rowid];
+        
+        [_metrics addOperation:@"updateFields" startedAt:startedAt];
+        
+        if ( error )
+            *error = (success) ? nil : _lastError;
+    }];
+    
+    return success;
+}
+
+
+-(BOOL)updateFields:(NSDictionary *)fields forRowId:(NTJsonRowId)rowid
+{
+    return [self updateFields:fields forRowId:rowid error:nil];
+}
+
+
+#pragma mark - updateWhere
+
+
++(void)addKeyPathsInPatch:(NSDictionary *)patch prefix:(NSString *)prefix toSet:(NSMutableSet *)keyPaths
+{
+    for(NSString *key in patch)
+    {
+        NSString *keyPath = (prefix) ? [NSString stringWithFormat:@"%@.%@", prefix, key] : key;
+        id value = patch[key];
+        
+        if ( [value isKindOfClass:[NSDictionary class]] && [value count] )
+            [self addKeyPathsInPatch:value prefix:keyPath toSet:keyPaths];  // merged, only the nested keys change
+        
+        else
+            [keyPaths addObject:keyPath];
+    }
+}
+
+
+-(NSArray *)columnsChangedByPatch:(NSDictionary *)patch
+{
+    // A column may change if the patch sets it, something inside it or something it's inside of...
+    
+    NSMutableSet *keyPaths = [NSMutableSet set];
+    
+    [self.class addKeyPathsInPatch:patch prefix:nil toSet:keyPaths];
+    
+    return [self.columns NTJsonStore_transform:^id(NTJsonColumn *column) {
+        NSString *columnPrefix = [column.name stringByAppendingString:@"."];
+        
+        for(NSString *keyPath in keyPaths)
+        {
+            if ( [keyPath isEqualToString:column.name] || [keyPath hasPrefix:columnPrefix] || [column.name hasPrefix:[keyPath stringByAppendingString:@"."]] )
+                return column;
+        }
+        
+        return nil;
+    }];
+}
+
+
+-(void)updateDocuments_didRollbackRowIds:(NSArray *)rowids
+{
+    // Each row was cached, counted, given its new unique keys and reported as it was written. The rollback only undid
+    // the database...
+    
+    for(NSNumber *rowid in rowids)
+    {
+        [_objectCache removeObjectWithRowId:[rowid longLongValue]];
+        [_transactionCacheUpdates removeObjectForKey:rowid];   // nil unless we are in a store transaction
+    }
+    
+    [_queryCache removeAll];
+    [self uniqueKeys_didRollback];
+    
+    _statistics = nil;      // reloaded from the metadata
+    _isStatisticsDirty = NO;
+    _changeLogSeq = -1;     // we may have skipped change log entries that were rolled back
+    
+    [self changes_releaseHeldWithCommit:NO];
+}
+
+
+-(int)_updateDocumentsWhere:(NSString *)where args:(NSArray *)args patch:(NSDictionary *)patch
+{
+    // json_patch() can't read binary documents, so they are patched one at a time in a single transaction...
+    
+    NSString *selectSql = [NSString stringWithFormat:@"SELECT [%@] FROM [%@]", NTJsonRowIdKey, self.name];
+    
+    if ( where )
+        selectSql = [selectSql stringByAppendingFormat:@" WHERE %@", where];
+    
+    sqlite3_stmt *statement = [self.connection cachedStatementWithSql:selectSql args:args];
+    
+    if ( !statement )
+    {
+        _lastError = self.connection.lastError;
+        return -1;
+    }
+    
+    NSMutableArray *rowids = [NSMutableArray array];
+    int status;
+    
+    while ( (status = sqlite3_step(statement)) == SQLITE_ROW )
+        [rowids addObject:@(sqlite3_column_int64(statement, 0))];
+    
+    if ( status != SQLITE_DONE )
+        _lastError = [NSError NTJsonStore_errorWithSqlite3:self.connection.db];
+    
+    [self.connection releaseStatement:statement];
+    
+    if ( status != SQLITE_DONE )
+        return -1;
+    
+    NSString *transactionId = [self.connection beginTransaction];
+    
+    if ( !transactionId )
+    {
+        _lastError = self.connection.lastError;
+        return -1;
+    }
+    
+    [self changes_hold];
+    
+    for(NSUInteger index=0; index<rowids.count; index++)
+    {
+        if ( ![self _updateFields:patch forRowId:[rowids[index] longLongValue]] )
+        {
+            [self.connection rollbackTransation:transactionId];
+            [self updateDocuments_didRollbackRowIds:[rowids subarrayWithRange:NSMakeRange(0, index+1)]];
+            return -1;
+        }
+    }
+    
+    if ( ![self.connection commitTransation:transactionId] )
+    {
+        _lastError = self.connection.lastError;
+        [self updateDocuments_didRollbackRowIds:rowids];
+        return -1;
+    }
+    
+    [self changes_releaseHeldWithCommit:YES];
+    
+    return (int)rowids.count;
+}
+
+
+-(int)_updateWhere:(NSString *)where args:(NSArray *)args set:(NSDictionary *)fields
+{
+    NTJsonCompiledSql *compiledWhere = [self compiledSql:where];
+    
+    [self scanCompiledSqlForNewColumns:compiledWhere];
+    
+    if ( ![self _ensureSchema] )
+        return -1;
+    
+    where = [self resolvedSqlWithCompiledSql:compiledWhere];
+    
+    NSMutableDictionary *patch = [fields mutableCopy];
+    [patch removeObjectForKey:NTJsonRowIdKey];  // the rowid can't be changed
+    
+    if ( !patch.count )
+        return 0;
+    
+    if ( self.documentFormat == NTJsonDocumentFormatBinary || _isConverting )
+        return [self _updateDocumentsWhere:where args:args patch:patch];
+    
+    NSError *error;
+    NSData *patchData = [NSJSONSerialization dataWithJSONObject:patch options:0 error:&error];
+    
+    if ( !patchData )
+    {
+        _lastError = error;
+        return -1;
+    }
+    
+    // Each document is patched once in a sub-select and the materialized columns the patch can change are extracted from
+    // the result in the same statement, so documents never leave SQLite. RETURNING tells us exactly which rows changed...
+    
+    NSArray *changedColumns = [self columnsChangedByPatch:patch];
+    NSArray *columns = [changedColumns NTJsonStore_transform:^id(NTJsonColumn *column) { return (column.kind == NTJsonColumnKindMaterialized) ? column : nil; }];
+    
+    NSMutableArray *columnNames = [NSMutableArray arrayWithObject:@"[__json__]"];
+    NSMutableArray *valuesSql = [NSMutableArray arrayWithObject:@"CAST([__patched__] AS BLOB)"];
+    
+    for(NTJsonColumn *column in columns)
+    {
+        [columnNames addObject:[NSString stringWithFormat:@"[%@]", column.name]];
+        [valuesSql addObject:[column jsonExtractSqlWithDocumentSql:@"[__patched__]" defaultValue:[self.defaultJson NTJsonStore_objectForKeyPath:column.name]]];
+    }
+    
+    NSMutableString *sql = [NSMutableString stringWithFormat:@"UPDATE [%@] SET (%@) = (SELECT %@ FROM (SELECT json_patch(CAST([__json__] AS TEXT), ?) AS [__patched__]))",
+                            self.name,
+                            [columnNames componentsJoinedByString:@", "],
+                            [valuesSql componentsJoinedByString:@", "]];
+    
+    if ( where )
+        [sql appendFormat:@" WHERE %@", where];
+    
+    [sql appendFormat:@" RETURNING [%@];", NTJsonRowIdKey];
+    
+    NSMutableArray *sqlArgs = [NSMutableArray arrayWithObject:[[NSString alloc] initWithData:patchData encoding:NSUTF8StringEncoding]];
+    
+    if ( args )
+        [sqlArgs addObjectsFromArray:args];
+    
+    NSString *transactionId = [self.connection beginTransaction];
+    
+    if ( !transactionId )
+    {
+        _lastError = self.connection.lastError;
+        return -1;
+    }
+    
+    [self statistics_willChange];   // in the transaction, so it's rolled back with it
+    
+    sqlite3_stmt *statement = [self.connection cachedStatementWithSql:sql args:sqlArgs];
+    
+    if ( !statement )
+    {
+        _lastError = self.connection.lastError;
+        [self.connection rollbackTransation:transactionId];
+        [self statistics_didRollback];
+        return -1;
+    }
+    
+    NSMutableArray *rowids = [NSMutableArray array];
+    int status;
+    
+    while ( (status = sqlite3_step(statement)) == SQLITE_ROW )
+        [rowids addObject:@(sqlite3_column_int64(statement, 0))];
+    
+    if ( status != SQLITE_DONE )
+        _lastError = [NSError NTJsonStore_errorWithSqlite3:self.connection.db];
+    
+    [self.connection releaseStatement:statement];
+    
+    if ( status != SQLITE_DONE )
+    {
+        [self.connection rollbackTransation:transactionId];    // the statement is rolled back as a whole, this undoes the statistics mark
+        [self statistics_didRollback];
+        return -1;
+    }
+    
+    if ( ![self.connection commitTransation:transactionId] )
+    {
+        _lastError = self.connection.lastError;
+        [self statistics_didRollback];
+        return -1;
+    }
+    
+    [self externalChanges_didWrite];
+    
+    if ( !rowids.count )
+        return 0;
+    
+    for(NSNumber *rowid in rowids)
+    {
+        [_objectCache removeObjectWithRowId:[rowid longLongValue]];
+        [_transactionCacheUpdates removeObjectForKey:rowid];   // nil unless we are in a store transaction
+        [self changes_addUpdatedRowId:[rowid longLongValue]];
+    }
+    
+    [_queryCache invalidateForUpdateWithChangedColumnNames:[NSSet setWithArray:[changedColumns NTJsonStore_transform:^id(NTJsonColumn *column) { return column.name; }]]];
+    
+    if ( [changedColumns NTJsonStore_find:^BOOL(NTJsonColumn *column) { return (_uniqueKeyMaps[column.name]) ? YES : NO; }] )
+        [self uniqueKeys_reset];    // a unique key changed, reload the maps
+    
+    [_statistics updateRowsWithCount:rowids.count columns:columns];
+    [self statistics_didChange];
+    
+    return (int)rowids.count;
+}
+
+
+-(void)beginUpdateWhere:(NSString *)where args:(NSArray *)args set:(NSDictionary *)fields completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(int count, NSError *error))completionHandler
+{
+    completionQueue = [self getCompletionQueue:completionQueue];
+    
+    [self.connection dispatchAsync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_willWrite];
+        
+        int count = [self _updateWhere:where args:args set:fields];
+        
+        [_metrics addOperation:@"updateWhere" startedAt:startedAt];
+        
+        NSError *error = (count != -1) ? nil : _lastError;
+        
+        [self groupCommit_didWriteWithCompletionQueue:completionQueue completionHandler:^(NSError *commitError) {
+            completionHandler(count, error ?: commitError);
+        }];
+    }];
+}
+
+
+-(void)beginUpdateWhere:(NSString *)where args:(NSArray *)args set:(NSDictionary *)fields completionHandler:(void (^)(int count, NSError *error))completionHandler
+{
+    [self beginUpdateWhere:where args:args set:fields completionQueue:nil completionHandler:completionHandler];
+}
+
+
+-(int)updateWhere:(NSString *)where args:(NSArray *)args set:(NSDictionary *)fields error:(NSError **)error
+{
+    __block int count;
+    
+    [self.connection dispatchSync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_commit];  // so this write is committed when we return
+        
+        count = [self _updateWhere:where args:args set:fields];
+        
+        [_metrics addOperation:@"updateWhere" startedAt:startedAt];
+        
+        if ( error )
+            *error = (count != -1) ? nil : _lastError;
+    }];
+    
+    return count;
+}
+
+
+-(int)updateWhere:(NSString *)where args:(NSArray *)args set:(NSDictionary *)fields
+{
+    return [self updateWhere:where args:args set:fields error:nil];
+}
+
+
+#pragma mark - remove
+
+
+-(BOOL)_remove:(NSDictionary *)json
+{
+    if( ![self _ensureSchema] )
+        return NO;
+    
+    long long rowid = [json[NTJsonRowIdKey] longLongValue];
+    
+    NSArray *columns = [self materializedColumns];
+    NSDictionary *oldJson = [_objectCache peekJsonWithRowId:rowid] ?: ((json.count > 1) ? json : nil);
+    NSMutableArray *oldValues = (oldJson) ? [NSMutableArray arrayWithCapacity:columns.count] : nil;
+    
+    if ( oldJson )
+        [self extractValuesInColumns:columns fromJson:oldJson intoArray:oldValues];
+    
+    [self statistics_willChange];
+    
+    BOOL success = [self.connection execSql:[NSString stringWithFormat:@"DELETE FROM [%@] WHERE [%@] = ?", self.name, NTJsonRowIdKey] args:@[@(rowid)] cached:YES];
+    
+    if ( success && sqlite3_changes(self.connection.db) > 0 )
+    {
+        [_statistics removeRowWithValues:oldValues columns:columns];
+        [self statistics_didChange];
+        
+        [self changes_addRemovedRowId:rowid];
+    }
+    
+    if ( success )
+    {
+        [self externalChanges_didWrite];
+        
+        [_objectCache removeObjectWithRowId:rowid];
+        [_transactionCacheUpdates removeObjectForKey:@(rowid)];   // nil unless we are in a store transaction
+        [_queryCache invalidateForRemoveWithRowId:rowid];
+        [self uniqueKeys_removeRowId:rowid];
+    }
+    
+    return success;
+}
+
+
+-(void)beginRemove:(NSDictionary *)json completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSError *error))completionHandler
+{
+    completionQueue = [self getCompletionQueue:completionQueue];
+    
+    [self.connection dispatchAsync:^
+    {
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_willWrite];
+        
+        BOOL success = [self _remove:json];
+        
+        [_metrics addOperation:@"remove" startedAt:startedAt];
+        
+        NSError *error = (success) ? nil : _lastError;
+        
+        [self groupCommit_didWriteWithCompletionQueue:completionQueue completionHandler:^(NSError *commitError) {
+            completionHandler(error ?: commitError);
+        }];
+    }];
+}
+
+
+-(void)beginRemove:(NSDictionary *)json completionHandler:(void (^)(NSError *error))completionHandler
+{
+    [self beginRemove:json completionQueue:nil completionHandler:completionHandler];
+}
+
+
+-(BOOL)remove:(NSDictionary *)json error:(NSError **)error
+{
+    __block BOOL success;
+    
+    [self.connection dispatchSync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_commit];  // so this write is committed when we return
+        
+        success = [self _remove:json];
+        
+        [_metrics addOperation:@"remove" startedAt:startedAt];
+        
+        if ( error )
+            *error = (success) ? nil : _lastError;
+    }];
+    
+    return success;
+}
+
+
+-(BOOL)remove:(NSDictionary *)json
+{
+    return [self remove:json error:nil];
+}
+
+
+#pragma mark - count
+
+
+-(NTJsonQueryPlan *)_planCountWhere:(NSString *)where args:(NSArray *)args
+{
+    NTJsonCompiledSql *compiledWhere = [self compiledSql:where];
+    
+    [self scanCompiledSqlForNewColumns:compiledWhere];
+
+    if ( ![self _ensureSchema] )
+        return nil;
+    
+    NTJsonQueryPlan *plan = [[NTJsonQueryPlan alloc] init];
+    
+    // We always know the total count...
+    
+    NTJsonStatistics *statistics = (compiledWhere) ? nil : [self statistics_load];
+    
+    if ( statistics && statistics.rowCount >= 0 )
+    {
+        plan->_count = @(statistics.rowCount);
+        return plan;
+    }
+    
+    where = [self resolvedSqlWithCompiledSql:compiledWhere];
+    
+    NSMutableString *sql = [NSMutableString stringWithFormat:@"SELECT COUNT(*) FROM [%@]", self.name];
+    
+    if ( where )
+        [sql appendFormat:@" WHERE %@", where];
+    
+    plan->_sql = sql;
+    plan->_args = args;
+    
+    NSString *queryKey = (_queryCache.cacheSize) ? [NTJsonQueryCache keyWithSql:sql args:args] : nil;
+    
+    if ( queryKey )
+    {
+        plan->_count = [_queryCache countWithKey:queryKey];
         
-        [_pendingColumns addObject:column];
+        if ( plan->_count )
+            return plan;
         
-        newColumnsAdded = YES;
-    }];
+        plan->_queryKey = queryKey;
+        plan->_columnNames = (compiledWhere) ? compiledWhere->_queryColumnNames : [NSSet set];
+        plan->_queryCacheGeneration = _queryCache.generation;
+    }
     
-    return newColumnsAdded;
+    return plan;
 }
 
 
--(void)addQueryableFields:(NSString *)fields
+-(NSNumber *)countWithPlan:(NTJsonQueryPlan *)plan connection:(NTJsonSqlConnection *)connection error:(NSError **)error
 {
-    [self.connection dispatchAsync:^{
-        NSString *realFields = [self replaceAliasesIn:fields cacheable:NO];
+    // Runs the count on either our connection or a read connection. Must be called on the connection's queue.
+    
+    if ( plan->_count )
+        return plan->_count;
+    
+    CFAbsoluteTime startedAt = [_metrics now];
+    
+    id count = [connection execValueSql:plan->_sql args:plan->_args];
+    
+    [self metrics_checkSlowQueryWithPlan:plan connection:connection startedAt:startedAt];
+    
+    if ( ![count isKindOfClass:[NSNumber class]] )
+    {
+        if ( error )
+            *error = connection.lastError;
         
-        [self scanSqlForNewColumns:realFields];
-    }];
+        return nil;
+    }
+    
+    return count;
 }
 
 
-#pragma mark - Index Support
-
-
--(NSArray *)indexes
+-(void)addCount:(NSNumber *)count toQueryCacheWithPlan:(NTJsonQueryPlan *)plan
 {
-    __block NSArray *indexes;
-    
-    [self.connection dispatchSync:^{
-        
-        if ( !_indexes )
-        {
-            
-            if ( [self validateEnvironment] )
-            {
-                NSMutableArray *indexes = [NSMutableArray array];
-                
-                sqlite3_stmt *statement = [self.connection statementWithSql:@"SELECT sql FROM sqlite_master WHERE type='index' AND tbl_name=?" args:@[self.name]];
-                
-                if ( !statement )
-                {
-                    _lastError = self.connection.lastError;
-                    indexes = nil;
-                    return ;
-                }
-                
-                int status;
-                
-                while ( (status=sqlite3_step(statement)) == SQLITE_ROW )
-                {
-                    NSString *sql = [NSString stringWithUTF8String:(const char *)sqlite3_column_text(statement, 0)];
-                    
-                    if ( !sql.length )
-                        continue ;
-                    
-                    NTJsonIndex *index = [NTJsonIndex indexWithSql:sql];
-                    
-                    if ( !index )
-                    {
-                        LOG_ERROR(@"Ignoring index we can't parse - %@", sql);
-                        continue;
-                    }
-                    
-                    [indexes addObject:index];
-                }
-                
-                sqlite3_finalize(statement);
-                
-                _indexes = [indexes copy];
-                
-            } // if validate...
-            
-        } // if !indexes
-        
-        indexes = _indexes;
-    }];
+    if ( !count || !plan->_queryKey || _queryCache.generation != plan->_queryCacheGeneration )
+        return ;
     
-    return indexes;
+    [_queryCache addCount:[count intValue] columnNames:plan->_columnNames withKey:plan->_queryKey];
 }
 
 
--(NSString *)createIndexNameWithIsUnique:(BOOL)isUnique
+-(int)_countWithPlan:(NTJsonQueryPlan *)plan
 {
-    const int MAX_TRIES = 10;
+    NSError *error;
     
-    int base = (int)self.indexes.count + (int)_pendingIndexes.count;
+    NSNumber *count = [self countWithPlan:plan connection:self.connection error:&error];
     
-    for(int index=0; index<MAX_TRIES; index++)
+    if ( !count )
     {
-        NSString *name = [NSString stringWithFormat:@"%@_%@_%d", (isUnique) ? @"UX" : @"IX", self.name, base+index];
-        
-        NTJsonIndex *existing = [self.indexes NTJsonStore_find:^BOOL(NTJsonIndex *index) { return [index.name isEqualToString:name]; }];
-        
-        if ( !existing )
-            existing = [_pendingIndexes NTJsonStore_find:^BOOL(NTJsonIndex *index) { return [index.name isEqualToString:name]; }];
-        
-        if ( !existing )
-            return name;
+        _lastError = error;
+        return -1;
     }
     
-    return nil;
+    [self addCount:count toQueryCacheWithPlan:plan];
+    
+    return [count intValue];
 }
 
 
--(void)addIndexWithKeys:(NSString *)keys isUnique:(BOOL)isUnique
+-(int)_countWhere:(NSString *)where args:(NSArray *)args
+{
+    NTJsonQueryPlan *plan = [self _planCountWhere:where args:args];
+    
+    return (plan) ? [self _countWithPlan:plan] : -1;
+}
+
+
+-(void)beginCountWhere:(NSString *)where args:(NSArray *)args completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(int count, NSError *error))completionHandler
 {
+    completionQueue = [self getCompletionQueue:completionQueue];
+    
     [self.connection dispatchAsync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
         
-        NSString *realKeys = [self replaceAliasesIn:keys cacheable:NO];
-        
-        // First off, let's see if it already exists...
+        NTJsonQueryPlan *plan = [self _planCountWhere:where args:args];
         
-        if ( [self.indexes NTJsonStore_find:^BOOL(NTJsonIndex *index) { return (index.isUnique == isUnique) && [index.keys isEqualToString:realKeys]; }] )
+        if ( plan && [self shouldReadWithPlan:plan] )
+        {
+            [self beginReadCountWithPlan:plan completionQueue:completionQueue completionHandler:^(int count, NSError *error) {
+                [_metrics addOperation:@"count" startedAt:startedAt];
+                completionHandler(count, error);
+            }];
             return ;
+        }
         
-        if ( [_pendingIndexes NTJsonStore_find:^BOOL(NTJsonIndex *index) { return (index.isUnique == isUnique) && [index.keys isEqualToString:realKeys]; }] )
-            return ;
+        int count = (plan) ? [self _countWithPlan:plan] : -1;
+        NSError *error = (count != -1) ? nil : _lastError;
         
-        [self scanSqlForNewColumns:realKeys];
+        [_metrics addOperation:@"count" startedAt:startedAt];
         
-        NSString *name = [self createIndexNameWithIsUnique:isUnique];
+        [self dispatchCompletionQueue:completionQueue completionHandler:^{
+            completionHandler(count, error);
+        }];
+    }];
+}
+
+
+-(void)beginCountWhere:(NSString *)where args:(NSArray *)args completionHandler:(void (^)(int count, NSError *error))completionHandler
+{
+    [self beginCountWhere:where args:args completionQueue:nil completionHandler:completionHandler];
+}
+
+
+-(int)countWhere:(NSString *)where args:(NSArray *)args error:(NSError **)error
+{
+    __block int count = -1;
+    __block NSError *countError = nil;
+    __block NTJsonQueryPlan *readPlan = nil;
+    
+    __block CFAbsoluteTime startedAt = 0;
+    
+    BOOL canRead = ![self.connection isCurrentQueue];   // nested calls stay on our queue
+    
+    [self.connection dispatchSync:^{
+        startedAt = [_metrics now];
         
-        NTJsonIndex *index = [NTJsonIndex indexWithName:name keys:realKeys isUnique:isUnique];
+        NTJsonQueryPlan *plan = [self _planCountWhere:where args:args];
         
-        [_pendingIndexes addObject:index];
+        if ( plan && canRead && [self shouldReadWithPlan:plan] )
+        {
+            readPlan = plan;
+            return ;
+        }
+        
+        count = (plan) ? [self _countWithPlan:plan] : -1;
+        countError = (count != -1) ? nil : _lastError;
     }];
+    
+    if ( readPlan )
+        count = [self readCountWithPlan:readPlan error:&countError];
+    
+    [_metrics addOperation:@"count" startedAt:startedAt];
+    
+    if ( error )
+        *error = countError;
+    
+    return count;
 }
 
 
--(void)addIndexWithKeys:(NSString *)keys
+-(int)countWhere:(NSString *)where args:(NSArray *)args
 {
-    [self addIndexWithKeys:keys isUnique:NO];
+    return [self countWhere:where args:args error:nil];
 }
 
 
--(void)addUniqueIndexWithKeys:(NSString *)keys
+-(void)beginCountWithCompletionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(int count, NSError *error))completionHandler
 {
-    [self addIndexWithKeys:keys isUnique:YES];
+    [self beginCountWhere:nil args:nil completionQueue:completionQueue completionHandler:completionHandler];
 }
 
 
-#pragma mark - insert
+-(void)beginCountWithCompletionHandler:(void (^)(int count, NSError *error))completionHandler
+{
+    [self beginCountWhere:nil args:nil completionQueue:nil completionHandler:completionHandler];
+}
 
 
--(NTJsonRowId)_insert:(NSDictionary *)json
+-(int)countWithError:(NSError **)error
+{
+    return [self countWhere:nil args:nil error:error];
+}
+
+
+-(int)count
+{
+    return [self countWhere:nil args:nil error:nil];
+}
+
+
+#pragma mark - aggregate
+
+
++(NSString *)resultKeyWithSql:(NSString *)sql
+{
+    // "[field]" becomes "field", anything else is used as is...
+    
+    NSArray *columnNames = [NTJsonCollection columnNamesInSql:sql];
+    
+    if ( columnNames.count == 1 && [sql isEqualToString:[NSString stringWithFormat:@"[%@]", columnNames[0]]] )
+        return columnNames[0];
+    
+    return sql;
+}
+
+
+-(NTJsonQueryPlan *)_planAggregate:(NSDictionary *)aggregates where:(NSString *)where args:(NSArray *)args groupBy:(NSString *)groupBy
 {
-    // Be careful of any side effects in this code impacting memory (caching, etc). It is used by
-    // insertBatch which runs in a transaction so we need to be safe for rollbacks.
+    // Aggregates are built with the same alias and column logic as counts. Keys are sorted so the same request always
+    // generates the same SQL (and reuses the same cached statement.)
+    
+    if ( ![aggregates isKindOfClass:[NSDictionary class]] || !aggregates.count )
+    {
+        _lastError = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidSqlArgument];
+        return nil;
+    }
+    
+    NSArray *aggregateKeys = [aggregates.allKeys sortedArrayUsingSelector:@selector(compare:)];
+    NSMutableArray *compiledAggregates = [NSMutableArray arrayWithCapacity:aggregateKeys.count];
+    
+    for(NSString *key in aggregateKeys)
+    {
+        NTJsonCompiledSql *compiledAggregate = ([aggregates[key] isKindOfClass:[NSString class]]) ? [self compiledSql:aggregates[key]] : nil;
+        
+        if ( !compiledAggregate )
+        {
+            _lastError = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidSqlArgument];
+            return nil;
+        }
+        
+        [self scanCompiledSqlForNewColumns:compiledAggregate];
+        [compiledAggregates addObject:compiledAggregate];
+    }
+    
+    NTJsonCompiledSql *compiledWhere = [self compiledSql:where];
+    NTJsonCompiledSql *compiledGroupBy = [self compiledSql:groupBy];
+    
+    [self scanCompiledSqlForNewColumns:compiledWhere];
+    [self scanCompiledSqlForNewColumns:compiledGroupBy];
     
     if ( ![self _ensureSchema] )
-        return 0;
+        return nil;
     
-    NSMutableArray *columnNames = [NSMutableArray arrayWithObject:@"__json__"];
-    [columnNames addObjectsFromArray:[self.columns NTJsonStore_transform:^id(NTJsonColumn *column) { return [NSString stringWithFormat:@"[%@]", column.name]; }]];
+    NSMutableArray *resultKeys = [NSMutableArray array];
+    NSMutableArray *expressions = [NSMutableArray array];
+    NSMutableArray *groupExpressions = [NSMutableArray array];
     
-    NSString *sql = [NSString stringWithFormat:@"INSERT INTO [%@] (%@) VALUES (%@);",
-                     self.name,
-                     [columnNames componentsJoinedByString:@", "],
-                     [@"" stringByPaddingToLength:columnNames.count*3-2 withString:@"?, " startingAtIndex:0]];
+    // Each group by term is returned with the results, keyed by the field name the caller used (which may be an alias)...
     
-    NSMutableArray *values = [NSMutableArray array];
+    if ( compiledGroupBy )
+    {
+        NSArray *terms = [NTJsonCollection orderByTermsInSql:compiledGroupBy->_sql];
+        NSArray *callerTerms = [NTJsonCollection orderByTermsInSql:groupBy];
+        
+        for(NSUInteger index=0; index<terms.count; index++)
+        {
+            NSString *expression = [self resolveColumnsIn:terms[index][0]];
+            NSString *keySql = (callerTerms.count == terms.count) ? callerTerms[index][0] : terms[index][0];
+            
+            [resultKeys addObject:[NTJsonCollection resultKeyWithSql:keySql]];
+            [expressions addObject:expression];
+            [groupExpressions addObject:expression];
+        }
+    }
     
-    NSError *error;
+    for(int index=0; index<aggregateKeys.count; index++)
+    {
+        [resultKeys addObject:aggregateKeys[index]];
+        [expressions addObject:[self resolvedSqlWithCompiledSql:compiledAggregates[index]]];
+    }
+    
+    where = [self resolvedSqlWithCompiledSql:compiledWhere];
+    
+    NSMutableString *sql = [NSMutableString stringWithFormat:@"SELECT %@ FROM %@", [expressions componentsJoinedByString:@", "], self.name];
+    
+    if ( where )
+        [sql appendFormat:@" WHERE %@", where];
+    
+    if ( groupExpressions.count )
+    {
+        NSString *groupBySql = [groupExpressions componentsJoinedByString:@", "];
+        
+        [sql appendFormat:@" GROUP BY %@ ORDER BY %@", groupBySql, groupBySql];
+    }
+    
+    NTJsonQueryPlan *plan = [[NTJsonQueryPlan alloc] init];
+    
+    plan->_sql = sql;
+    plan->_args = args;
+    plan->_resultKeys = [resultKeys copy];
+    
+    return plan;
+}
+
+
+-(NSArray *)rowsWithPlan:(NTJsonQueryPlan *)plan connection:(NTJsonSqlConnection *)connection error:(NSError **)error
+{
+    // Returns a plain dictionary for each row, keyed by the plan's resultKeys. No documents are decoded and nothing is
+    // cached. NULL values are left out, just like missing JSON fields. Must be called on the connection's queue.
+    
+    CFAbsoluteTime startedAt = [_metrics now];
+    
+    sqlite3_stmt *statement = [connection cachedStatementWithSql:plan->_sql args:plan->_args];
+    
+    [_metrics addTimeStartedAt:startedAt toCounter:NTJsonMetricsCounterPrepareTime];
+    
+    if ( !statement )
+    {
+        if ( error )
+            *error = connection.lastError;
+        
+        return nil;
+    }
+    
+    NSMutableArray *rows = [NSMutableArray array];
+    int columnCount = (int)plan->_resultKeys.count;
+    int status;
     
-    NSData *jsonData = [NSJSONSerialization dataWithJSONObject:json options:0 error:&error];
+    while ( (status=sqlite3_step(statement)) == SQLITE_ROW )
+    {
+        NSMutableDictionary *row = [NSMutableDictionary dictionaryWithCapacity:columnCount];
+        
+        for(int index=0; index<columnCount; index++)
+        {
+            id value = [connection valueWithStatement:statement index:index];
+            NSNumber *typeColumn = plan->_typeColumns[@(index)];
+            
+            if ( typeColumn )
+                value = [NTJsonCollection projectedValue:value withJsonType:(const char *)sqlite3_column_text(statement, typeColumn.intValue)];
+            
+            if ( value && value != [NSNull null] )
+                row[plan->_resultKeys[index]] = value;
+        }
+        
+        [rows addObject:[row copy]];
+    }
     
-    if ( !jsonData )
+    if ( status != SQLITE_DONE )
     {
-        _lastError = error;
-        return 0;
+        if ( error )
+            *error = [NSError NTJsonStore_errorWithSqlite3:connection.db];
+        
+        rows = nil; // failure
     }
     
-    [values addObject:jsonData];
+    int rowsScanned = sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);  // always reset, the statement is cached
     
-    [self extractValuesInColumns:self.columns fromJson:json intoArray:values];
+    [connection releaseStatement:statement];
     
-    if ( ![self.connection execSql:sql args:values] )
+    if ( startedAt )
     {
-        _lastError = self.connection.lastError;
-        return 0;
+        [_metrics addCount:rowsScanned toCounter:NTJsonMetricsCounterRowsScanned];
+        [_metrics addCount:rows.count toCounter:NTJsonMetricsCounterRowsReturned];
+        
+        [self metrics_checkSlowQueryWithPlan:plan connection:connection startedAt:startedAt];
     }
     
-    NTJsonRowId rowid = sqlite3_last_insert_rowid(self.connection.db);
+    return [rows copy];
+}
+
+
+-(NSArray *)_rowsWithPlan:(NTJsonQueryPlan *)plan
+{
+    NSError *error;
     
-    return rowid;
+    NSArray *rows = [self rowsWithPlan:plan connection:self.connection error:&error];
+    
+    if ( !rows )
+        _lastError = error;
+    
+    return rows;
 }
 
 
--(void)beginInsert:(NSDictionary *)json completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NTJsonRowId rowid, NSError *error))completionHandler
+-(void)beginAggregate:(NSDictionary *)aggregates where:(NSString *)where args:(NSArray *)args groupBy:(NSString *)groupBy completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *results, NSError *error))completionHandler
 {
     completionQueue = [self getCompletionQueue:completionQueue];
     
     [self.connection dispatchAsync:^{
-        NTJsonRowId rowid = [self _insert:json];
-        NSError *error = (rowid) ? nil : _lastError;
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        NTJsonQueryPlan *plan = [self _planAggregate:aggregates where:where args:args groupBy:groupBy];
+        
+        if ( plan && [self shouldReadWithPlan:plan] )
+        {
+            [self beginReadRowsWithPlan:plan completionQueue:completionQueue completionHandler:^(NSArray *results, NSError *error) {
+                [_metrics addOperation:@"aggregate" startedAt:startedAt];
+                completionHandler(results, error);
+            }];
+            return ;
+        }
+        
+        NSArray *results = (plan) ? [self _rowsWithPlan:plan] : nil;
+        NSError *error = (results) ? nil : _lastError;
+        
+        [_metrics addOperation:@"aggregate" startedAt:startedAt];
         
         [self dispatchCompletionQueue:completionQueue completionHandler:^{
-            completionHandler(rowid, error);
+            completionHandler(results, error);
         }];
     }];
 }
 
 
--(void)beginInsert:(NSDictionary *)json completionHandler:(void (^)(NTJsonRowId rowid, NSError *error))completionHandler
+-(void)beginAggregate:(NSDictionary *)aggregates where:(NSString *)where args:(NSArray *)args groupBy:(NSString *)groupBy completionHandler:(void (^)(NSArray *results, NSError *error))completionHandler
 {
-    [self beginInsert:json completionQueue:nil completionHandler:completionHandler];
+    [self beginAggregate:aggregates where:where args:args groupBy:groupBy completionQueue:nil completionHandler:completionHandler];
 }
 
 
--(NTJsonRowId)insert:(NSDictionary *)json error:(NSError **)error
+-(NSArray *)aggregate:(NSDictionary *)aggregates where:(NSString *)where args:(NSArray *)args groupBy:(NSString *)groupBy error:(NSError **)error
 {
-    __block NTJsonRowId rowid;
+    __block NSArray *results = nil;
+    __block NSError *aggregateError = nil;
+    __block NTJsonQueryPlan *readPlan = nil;
+    
+    __block CFAbsoluteTime startedAt = 0;
+    
+    BOOL canRead = ![self.connection isCurrentQueue];   // nested calls stay on our queue
     
     [self.connection dispatchSync:^{
-        rowid = [self _insert:json];
-        if ( error )
-            *error = (rowid) ? nil : _lastError;
+        startedAt = [_metrics now];
+        
+        NTJsonQueryPlan *plan = [self _planAggregate:aggregates where:where args:args groupBy:groupBy];
+        
+        if ( plan && canRead && [self shouldReadWithPlan:plan] )
+        {
+            readPlan = plan;
+            return ;
+        }
+        
+        results = (plan) ? [self _rowsWithPlan:plan] : nil;
+        aggregateError = (results) ? nil : _lastError;
     }];
     
-    return rowid;
+    if ( readPlan )
+        results = [self readRowsWithPlan:readPlan error:&aggregateError];
+    
+    [_metrics addOperation:@"aggregate" startedAt:startedAt];
+    
+    if ( error )
+        *error = aggregateError;
+    
+    return results;
 }
 
 
--(NTJsonRowId)insert:(NSDictionary *)json
+-(NSArray *)aggregate:(NSDictionary *)aggregates where:(NSString *)where args:(NSArray *)args groupBy:(NSString *)groupBy
 {
-    return [self insert:json error:nil];
+    return [self aggregate:aggregates where:where args:args groupBy:groupBy error:nil];
 }
 
 
-#pragma mark - insertBatch
+#pragma mark - find
 
 
--(BOOL)_insertBatch:(NSArray *)items
+-(NSArray *)lazyRowColumns
 {
-    if ( !items.count )
-        return YES;
+    // Top-level materialized columns that hold exactly what is in the document. Columns with defaults or that are
+    // still being materialized might not...
     
-    if ( ![self validateEnvironment] )
-        return NO;
+    NSDictionary *defaultJson = self.defaultJson;
     
-    NSString *transactionId = [self.connection beginTransaction];
+    return [[self materializedColumns] NTJsonStore_transform:^id(NTJsonColumn *column) {
+        if ( [column.name rangeOfString:@"."].location != NSNotFound || defaultJson[column.name] || [self isMaterializingColumn:column.name] )
+            return nil;
+        
+        return column;
+    }];
+}
+
+
+-(NSDictionary *)rowValuesWithStatement:(sqlite3_stmt *)statement columns:(NSArray *)columns firstIndex:(int)firstIndex
+{
+    // Only integers and strings are returned. NULL may mean the key is missing and REAL values may have been BOOLs, so
+    // those are left for the document.
     
-    if ( !transactionId )
-        return NO;
+    NSMutableDictionary *rowValues = [NSMutableDictionary dictionaryWithCapacity:columns.count];
     
-    for(NSDictionary *item in items)
+    for(int index=0; index<columns.count; index++)
     {
-        NTJsonRowId rowid = [self _insert:item];
+        NSString *columnName = [columns[index] name];
         
-        if ( !rowid )
+        switch(sqlite3_column_type(statement, firstIndex+index))
         {
-            [self.connection rollbackTransation:transactionId];
-            return NO;
+            case SQLITE_INTEGER:
+                rowValues[columnName] = @(sqlite3_column_int64(statement, firstIndex+index));
+                break;
+                
+            case SQLITE_TEXT:
+                rowValues[columnName] = [[NSString alloc] initWithBytes:sqlite3_column_text(statement, firstIndex+index) length:sqlite3_column_bytes(statement, firstIndex+index) encoding:NSUTF8StringEncoding];
+                break;
+                
+            default:
+                break;
         }
     }
     
-    [self.connection commitTransation:transactionId];
-    
-    return YES;
+    return rowValues;
 }
 
 
--(void)beginInsertBatch:(NSArray *)items completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSError *error))completionHandler
+-(NSSet *)queryColumnNamesWithWhere:(NTJsonCompiledSql *)where orderBy:(NTJsonCompiledSql *)orderBy
 {
-    completionQueue = [self getCompletionQueue:completionQueue];
+    // the columns a query depends on, nil if it may depend on anything...
     
-    [self.connection dispatchAsync:^{
-        BOOL success = [self _insertBatch:items];
-        NSError *error = (success) ? nil : _lastError;
-       
-        [self dispatchCompletionQueue:completionQueue completionHandler:^{
-            completionHandler(error);
-        }];
-    }];
+    NSSet *whereColumnNames = (where) ? where->_queryColumnNames : [NSSet set];
+    NSSet *orderByColumnNames = (orderBy) ? orderBy->_queryColumnNames : [NSSet set];
+    
+    if ( !whereColumnNames || !orderByColumnNames )
+        return nil;
+    
+    return [whereColumnNames setByAddingObjectsFromSet:orderByColumnNames];
 }
 
 
--(void)beginInsertBatch:(NSArray *)items completionHandler:(void (^)(NSError *error))completionHandler
+-(NSDictionary *)itemWithStatement:(sqlite3_stmt *)statement rowColumns:(NSArray *)rowColumns cacheGeneration:(int)cacheGeneration error:(NSError **)error
 {
-    [self beginInsertBatch:items completionQueue:nil completionHandler:completionHandler];
+    // Returns the item for the current row ([__rowid__], [__json__], rowColumns...) from the cache or by decoding it. nil on failure.
+    // This also runs on read connections so it must not touch any state that belongs to our queue. A read connection may be
+    // looking at an older snapshot, so the row is only cached if the object cache hasn't changed since cacheGeneration.
+    
+    NTJsonRowId rowid = sqlite3_column_int64(statement, 0);
+    
+    NSDictionary *json = [_objectCache jsonWithRowId:rowid];
+    
+    if ( json )
+        return json;
+    
+    const void *bytes = sqlite3_column_blob(statement, 1);
+    int length = sqlite3_column_bytes(statement, 1);
+    
+    if ( rowColumns )
+    {
+        // keep the raw document, it will be decoded when (and if) it's needed...
+        
+        NTJsonKeyDictionary *keyDictionary = ([NTJsonBinaryCoder isBinaryBytes:bytes length:length]) ? self.keyDictionary : nil;
+        
+        NSDictionary *lazyJson = [_objectCache addData:[NSData dataWithBytes:bytes length:length]
+                                         keyDictionary:keyDictionary
+                                             rowValues:[self rowValuesWithStatement:statement columns:rowColumns firstIndex:2]
+                                             withRowId:rowid
+                                            generation:cacheGeneration];
+        
+        if ( lazyJson )
+            return lazyJson;
+        
+        // too late to cache it, decode it now since nothing would keep the raw document...
+    }
+    
+    NSError *decodeError;
+    CFAbsoluteTime decodeStartedAt = [_metrics now];
+    
+    NSDictionary *rawJson = [self decodeJsonBytes:bytes length:length error:&decodeError];
+    
+    [_metrics addTimeStartedAt:decodeStartedAt toCounter:NTJsonMetricsCounterDecodeTime];
+    
+    if ( !rawJson )
+    {
+        if ( error )
+            *error = decodeError;
+        
+        LOG_ERROR(@"Unable to parse JSON for %@:%lld - %@", self.name, rowid, decodeError.localizedDescription);
+        return nil;
+    }
+    
+    // Make sure __rowid__ is valid and correct.
+    
+    if (  ![rawJson[NTJsonRowIdKey] isEqualToNumber:@(rowid)] )
+    {
+        NSMutableDictionary *mutableJson = [rawJson mutableCopy];
+        mutableJson[NTJsonRowIdKey] = @(rowid);
+        rawJson = [mutableJson copy];
+    }
+    
+    return [_objectCache addJson:rawJson cost:length withRowId:rowid generation:cacheGeneration] ?: rawJson;
 }
 
 
--(BOOL)insertBatch:(NSArray *)items error:(NSError **)error
+-(NSArray *)itemsWithRowids:(NSArray *)rowids rowColumns:(NSArray *)rowColumns
 {
-    __block BOOL success;
+    // Reassembles a cached find result. Anything that has dropped out of the object cache is re-read in one query.
+    // Returns nil if any row can't be found.
     
-    [self.connection dispatchSync:^{
-        success = [self _insertBatch:items];
-
-        if ( error )
-            *error = (success) ? nil : _lastError;
-    }];
+    NSMutableDictionary *itemsByRowid = [NSMutableDictionary dictionaryWithCapacity:rowids.count];
+    NSMutableArray *missingRowids = [NSMutableArray array];
     
-    return success;
+    for(NSNumber *rowid in rowids)
+    {
+        NSDictionary *json = [_objectCache jsonWithRowId:[rowid longLongValue]];
+        
+        if ( json )
+            itemsByRowid[rowid] = json;
+        else
+            [missingRowids addObject:rowid];
+    }
+    
+    if ( missingRowids.count )
+    {
+        NSString *rowColumnsSql = [[rowColumns NTJsonStore_transform:^id(NTJsonColumn *column) { return [NSString stringWithFormat:@", [%@]", column.name]; }] componentsJoinedByString:@""];
+        NSString *sql = [NSString stringWithFormat:@"SELECT [%@], [__json__]%@ FROM [%@] WHERE [%@] IN (%@)",
+                         NTJsonRowIdKey, rowColumnsSql ?: @"", self.name, NTJsonRowIdKey, [missingRowids componentsJoinedByString:@", "]];
+        
+        sqlite3_stmt *statement = [self.connection statementWithSql:sql args:nil];  // not worth caching, the SQL is different every time
+        
+        if ( !statement )
+            return nil;
+        
+        while ( sqlite3_step(statement) == SQLITE_ROW )
+        {
+            NSDictionary *json = [self itemWithStatement:statement rowColumns:rowColumns cacheGeneration:_objectCache.generation error:nil];
+            
+            if ( json )
+                itemsByRowid[@(sqlite3_column_int64(statement, 0))] = json;
+        }
+        
+        sqlite3_finalize(statement);
+    }
+    
+    NSArray *items = [itemsByRowid objectsForKeys:rowids notFoundMarker:[NSNull null]];
+    
+    return ([items containsObject:[NSNull null]]) ? nil : items;
 }
 
 
--(BOOL)insertBatch:(NSArray *)items
+-(NTJsonQueryPlan *)_planFindWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit
 {
-    return [self insertBatch:items error:nil];
-}
-
+    // Does everything that needs our queue - the schema, the caches and building the SQL. nil on failure.
+    
+    NTJsonQueryPlan *plan = [[NTJsonQueryPlan alloc] init];
+    
+    plan->_args = args;
+    
+    // Lookups on a unique key don't need to touch SQLite at all...
+    
+    plan->_items = [self uniqueKeys_findWhere:where args:args];
+    
+    if ( plan->_items )
+        return plan;
+    
+    NTJsonCompiledSql *compiledWhere = [self compiledSql:where];
+    NTJsonCompiledSql *compiledOrderBy = [self compiledSql:orderBy];
+    
+    [self scanCompiledSqlForNewColumns:compiledWhere];
+    [self scanCompiledSqlForNewColumns:compiledOrderBy];
 
-#pragma mark - update
+    if ( ![self _ensureSchema] )
+        return nil;
+    
+    NSSet *columnNames = [self queryColumnNamesWithWhere:compiledWhere orderBy:compiledOrderBy];
+    
+    where = [self resolvedSqlWithCompiledSql:compiledWhere];
+    orderBy = [self resolvedSqlWithCompiledSql:compiledOrderBy];
+    
+    // In lazy mode we also select any scalar columns the proxies can answer without decoding...
+    
+    NSArray *rowColumns = (_lazyDecoding && _objectCache) ? [self lazyRowColumns] : nil;
+    NSString *rowColumnsSql = [[rowColumns NTJsonStore_transform:^id(NTJsonColumn *column) { return [NSString stringWithFormat:@", [%@]", column.name]; }] componentsJoinedByString:@""];
+    
+    // Ok, now we can build the query...
+    
+    NSMutableString *sql = [NSMutableString stringWithFormat:@"SELECT [%@], [__json__]%@ FROM %@", NTJsonRowIdKey, rowColumnsSql ?: @"", self.name];
+    
+    if ( where )
+        [sql appendFormat:@" WHERE %@", where];
+    
+    if ( orderBy )
+        [sql appendFormat:@" ORDER BY %@", orderBy];
+    
+    if ( limit > 0 )
+        [sql appendFormat:@" LIMIT %d", limit];
+    
+    plan->_sql = sql;
+    plan->_rowColumns = rowColumns;
+    
+    // Check the query cache. Results are reassembled from the object cache so we need one of those too...
+    
+    NSString *queryKey = (_queryCache.cacheSize && _objectCache) ? [NTJsonQueryCache keyWithSql:sql args:args] : nil;
+    
+    if ( queryKey )
+    {
+        NSArray *rowids = [_queryCache rowidsWithKey:queryKey];
+        
+        plan->_items = (rowids) ? [self itemsWithRowids:rowids rowColumns:rowColumns] : nil;
+        
+        [_queryCache recordHit:(plan->_items) ? YES : NO];
+        
+        if ( plan->_items )
+            return plan;
+        
+        if ( rowids )
+            [_queryCache removeObjectWithKey:queryKey];    // some of the rows are gone, the entry is stale
+        
+        plan->_queryKey = queryKey;
+        plan->_columnNames = columnNames;
+        plan->_queryCacheGeneration = _queryCache.generation;
+    }
+    
+    plan->_objectCacheGeneration = _objectCache.generation;
+    
+    [self keyDictionary];   // rows may be decoded on a read connection, make sure this is loaded first
+    
+    return plan;
+}
 
 
--(BOOL)_update:(NSDictionary *)json
+-(NSArray *)findItemsWithPlan:(NTJsonQueryPlan *)plan connection:(NTJsonSqlConnection *)connection error:(NSError **)error
 {
-    if ( ![self _ensureSchema] )
-        return NO;
+    // Runs the query on either our connection or a read connection. Must be called on the connection's queue.
     
-    NTJsonRowId rowid = [json[NTJsonRowIdKey] longLongValue];
+    if ( plan->_items )
+        return plan->_items;
     
-    NSMutableArray *columnNames = [NSMutableArray arrayWithObject:@"__json__"];
-    [columnNames addObjectsFromArray:[self.columns NTJsonStore_transform:^id(NTJsonColumn *column) { return column.name; }]];
+    // nothing can be written while our own connection is reading, a read connection only sees what was there when the plan was made...
     
-    NSString *sql = [NSString stringWithFormat:@"UPDATE [%@] SET %@ WHERE [%@] = ?;",
-                     self.name,
-                     [[columnNames NTJsonStore_transform:^id(NSString *columnName) { return [NSString stringWithFormat:@"[%@] = ?", columnName]; }] componentsJoinedByString:@", "],
-                     NTJsonRowIdKey];
+    int cacheGeneration = (connection == self.connection) ? _objectCache.generation : plan->_objectCacheGeneration;
     
-    NSMutableArray *values = [NSMutableArray array];
+    CFAbsoluteTime startedAt = [_metrics now];
+    
+    sqlite3_stmt *selectStatement = [connection cachedStatementWithSql:plan->_sql args:plan->_args];
+    
+    [_metrics addTimeStartedAt:startedAt toCounter:NTJsonMetricsCounterPrepareTime];
+    
+    if ( !selectStatement )
+    {
+        if ( error )
+            *error = connection.lastError;
+        
+        return nil;
+    }
+    
+    // Now we can extract our results!
+    
+    NSMutableArray *items = [NSMutableArray array];
+    
+    int status;
+    double stepTime = 0;
+    CFAbsoluteTime stepStartedAt = (startedAt) ? CFAbsoluteTimeGetCurrent() : 0;
+    
+    while ( (status=sqlite3_step(selectStatement)) == SQLITE_ROW )
+    {
+        if ( startedAt )
+            stepTime += CFAbsoluteTimeGetCurrent() - stepStartedAt;
+        
+        NSDictionary *json = [self itemWithStatement:selectStatement rowColumns:plan->_rowColumns cacheGeneration:cacheGeneration error:error];
+        
+        if ( !json )
+        {
+            [connection releaseStatement:selectStatement];
+            return nil;
+        }
+        
+        [items addObject:json];
+        
+        if ( plan->_rowKeys )
+        {
+            NSMutableArray *key = [NSMutableArray arrayWithCapacity:plan->_keyCount + 1];
+            
+            for(int index=0; index<plan->_keyCount; index++)
+                [key addObject:[connection valueWithStatement:selectStatement index:plan->_keyIndex + index] ?: [NSNull null]];
+            
+            [key addObject:@(sqlite3_column_int64(selectStatement, 0))];
+            
+            [plan->_rowKeys addObject:key];
+        }
+        
+        if ( startedAt )
+            stepStartedAt = CFAbsoluteTimeGetCurrent();
+    }
+    
+    if ( startedAt )
+        stepTime += CFAbsoluteTimeGetCurrent() - stepStartedAt;
+    
+    if ( status != SQLITE_DONE )
+    {
+        if ( error )
+            *error = [NSError NTJsonStore_errorWithSqlite3:connection.db];
+        
+        items = nil; // failure
+    }
+    
+    int rowsScanned = sqlite3_stmt_status(selectStatement, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);  // always reset, the statement is cached
+    
+    [connection releaseStatement:selectStatement];
+    
+    if ( startedAt )
+    {
+        [_metrics addTime:stepTime toCounter:NTJsonMetricsCounterStepTime];
+        [_metrics addCount:rowsScanned toCounter:NTJsonMetricsCounterRowsScanned];
+        [_metrics addCount:items.count toCounter:NTJsonMetricsCounterRowsReturned];
+        
+        [self metrics_checkSlowQueryWithPlan:plan connection:connection startedAt:startedAt];
+    }
+    
+    return [items copy];
+}
+
+
+-(void)addItems:(NSArray *)items toQueryCacheWithPlan:(NTJsonQueryPlan *)plan
+{
+    // Only called on our queue. If anything was invalidated since the plan was made the results may already be stale.
+    
+    if ( !items || !plan->_queryKey || _queryCache.generation != plan->_queryCacheGeneration )
+        return ;
     
+    [_queryCache addRowids:[items NTJsonStore_transform:^id(NSDictionary *item) { return item[NTJsonRowIdKey]; }] columnNames:plan->_columnNames withKey:plan->_queryKey];
+}
+
+
+-(NSArray *)_findItemsWithPlan:(NTJsonQueryPlan *)plan
+{
     NSError *error;
     
-    NSData *jsonData = [NSJSONSerialization dataWithJSONObject:json options:0 error:&error];
+    NSArray *items = [self findItemsWithPlan:plan connection:self.connection error:&error];
     
-    if ( !jsonData )
+    if ( !items )
     {
         _lastError = error;
-        return NO;
+        return nil;
     }
     
-    [values addObject:jsonData];
-    
-    [self extractValuesInColumns:self.columns fromJson:json intoArray:values];
+    [self addItems:items toQueryCacheWithPlan:plan];
     
-    [values addObject:@(rowid)];
-    
-    BOOL success = [self.connection execSql:sql args:values];
-    
-    if ( success )
-        [_objectCache addJson:json withRowId:rowid];
+    return items;
+}
+
+
+-(NSArray *)_findWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit
+{
+    NTJsonQueryPlan *plan = [self _planFindWhere:where args:args orderBy:orderBy limit:limit];
     
-    return success;
+    return (plan) ? [self _findItemsWithPlan:plan] : nil;
 }
 
 
--(void)beginUpdate:(NSDictionary *)json completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSError *error))completionHandler
+-(void)beginFindWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *items, NSError *error))completionHandler
 {
     completionQueue = [self getCompletionQueue:completionQueue];
     
     [self.connection dispatchAsync:^{
-        BOOL success = [self _update:json];
-        NSError *error = (success) ? nil : _lastError;
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        NTJsonQueryPlan *plan = [self _planFindWhere:where args:args orderBy:orderBy limit:limit];
+        
+        if ( plan && [self shouldReadWithPlan:plan] )
+        {
+            [self beginReadItemsWithPlan:plan completionQueue:completionQueue completionHandler:^(NSArray *items, NSError *error) {
+                [_metrics addOperation:@"find" startedAt:startedAt];
+                completionHandler(items, error);
+            }];
+            return ;
+        }
+        
+        NSArray *items = (plan) ? [self _findItemsWithPlan:plan] : nil;
+        NSError *error = (items) ? nil : _lastError;
+        
+        [_metrics addOperation:@"find" startedAt:startedAt];
         
         [self dispatchCompletionQueue:completionQueue completionHandler:^{
-            completionHandler(error);
+            completionHandler(items, error);
         }];
     }];
 }
 
 
--(void)beginUpdate:(NSDictionary *)json completionHandler:(void (^)(NSError *error))completionHandler
+-(void)beginFindWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionHandler:(void (^)(NSArray *items, NSError *error))completionHandler
 {
-    [self beginUpdate:json completionQueue:nil completionHandler:completionHandler];
+    [self beginFindWhere:where args:args orderBy:orderBy limit:limit completionQueue:nil completionHandler:completionHandler];
 }
 
 
--(BOOL)update:(NSDictionary *)json error:(NSError **)error
+-(NSArray *)findWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit error:(NSError **)error
 {
-    __block BOOL success;
+    __block NSArray *items = nil;
+    __block NSError *findError = nil;
+    __block NTJsonQueryPlan *readPlan = nil;
+    
+    __block CFAbsoluteTime startedAt = 0;
+    
+    BOOL canRead = ![self.connection isCurrentQueue];   // nested calls stay on our queue
     
     [self.connection dispatchSync:^{
-        success = [self _update:json];
-        if ( error )
-            *error = (success) ? nil : _lastError;
+        startedAt = [_metrics now];
+        
+        NTJsonQueryPlan *plan = [self _planFindWhere:where args:args orderBy:orderBy limit:limit];
+        
+        if ( plan && canRead && [self shouldReadWithPlan:plan] )
+        {
+            readPlan = plan;
+            return ;
+        }
+        
+        items = (plan) ? [self _findItemsWithPlan:plan] : nil;
+        findError = (items) ? nil : _lastError;
     }];
     
-    return success;
+    if ( readPlan )
+        items = [self readItemsWithPlan:readPlan error:&findError];
+    
+    [_metrics addOperation:@"find" startedAt:startedAt];
+    
+    if ( error )
+        *error = findError;
+    
+    return items;
 }
 
 
--(BOOL)update:(NSDictionary *)json
+-(NSArray *)findWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit
 {
-    return [self update:json error:nil];
+    return [self findWhere:where args:args orderBy:orderBy limit:limit error:nil];
 }
 
 
-#pragma mark - remove
+-(void)beginFindWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *items, NSError *error))completionHandler
+{
+    [self beginFindWhere:where args:args orderBy:orderBy limit:0 completionQueue:completionQueue completionHandler:completionHandler];
+}
 
 
--(BOOL)_remove:(NSDictionary *)json
+-(void)beginFindWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy completionHandler:(void (^)(NSArray *items, NSError *error))completionHandler
 {
-    if( ![self _ensureSchema] )
-        return NO;
-    
-    long long rowid = [json[NTJsonRowIdKey] longLongValue];
+    [self beginFindWhere:where args:args orderBy:orderBy limit:0 completionQueue:nil completionHandler:completionHandler];
+}
 
-    BOOL success = [self.connection execSql:[NSString stringWithFormat:@"DELETE FROM [%@] WHERE [%@] = ?", self.name, NTJsonRowIdKey] args:@[@(rowid)]];
-    
-    if ( success )
-        [_objectCache removeObjectWithRowId:rowid];
-    
-    return success;
+
+-(NSArray *)findWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy error:(NSError **)error
+{
+    return [self findWhere:where args:args orderBy:orderBy limit:0 error:error];
 }
 
 
--(void)beginRemove:(NSDictionary *)json completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSError *error))completionHandler
+-(NSArray *)findWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy
 {
-    completionQueue = [self getCompletionQueue:completionQueue];
-    
-    [self.connection dispatchAsync:^
+    return [self findWhere:where args:args orderBy:orderBy limit:0 error:nil];
+}
+
+
+-(void)beginFindOneWhere:(NSString *)where args:(NSArray *)args completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSDictionary *item, NSError *error))completionHandler
+{
+    [self beginFindWhere:where args:args orderBy:nil limit:1 completionQueue:completionQueue completionHandler:^(NSArray *items, NSError *error)
     {
-        BOOL success = [self _remove:json];
-        NSError *error = (success) ? nil : _lastError;
-        
-        [self dispatchCompletionQueue:completionQueue completionHandler:^{
-            completionHandler(error);
-        }];
+        if ( completionHandler )
+            completionHandler([items lastObject], error);
     }];
 }
 
 
--(void)beginRemove:(NSDictionary *)json completionHandler:(void (^)(NSError *error))completionHandler
+-(void)beginFindOneWhere:(NSString *)where args:(NSArray *)args completionHandler:(void (^)(NSDictionary *item, NSError *error))completionHandler
 {
-    [self beginRemove:json completionQueue:nil completionHandler:completionHandler];
+    [self beginFindWhere:where args:args orderBy:nil limit:1 completionQueue:nil completionHandler:^(NSArray *items, NSError *error) {
+         if ( completionHandler )
+             completionHandler([items lastObject], error);
+     }];
 }
 
 
--(BOOL)remove:(NSDictionary *)json error:(NSError **)error
+-(NSDictionary *)findOneWhere:(NSString *)where args:(NSArray *)args error:(NSError **)error
 {
-    __block BOOL success;
-    
-    [self.connection dispatchSync:^{
-        success = [self _remove:json];
-        if ( error )
-            *error = (success) ? nil : _lastError;
-    }];
-    
-    return success;
+    return [[self findWhere:where args:args orderBy:nil limit:1 error:error] lastObject];
 }
 
 
--(BOOL)remove:(NSDictionary *)json
+-(NSDictionary *)findOneWhere:(NSString *)where args:(NSArray *)args
 {
-    return [self remove:json error:nil];
+    return [[self findWhere:where args:args orderBy:nil limit:1 error:nil] lastObject];
 }
 
 
-#pragma mark - count
+#pragma mark - findFields
 
 
--(int)_countWhere:(NSString *)where args:(NSArray *)args
+-(NSString *)fieldSqlWithName:(NSString *)fieldName typeSql:(NSString **)typeSql
+{
+    // Queryable fields are read from their column (or whatever resolveColumnsIn uses while it's not ready), anything
+    // else is read straight from the document without adding a new column. Either way objects and arrays come back as
+    // JSON text and booleans as 0/1, so typeSql reads the field's JSON type from the document for projectedValue...
+    
+    NSString *columnRef = [NSString stringWithFormat:@"[%@]", fieldName];
+    NTJsonColumn *column = [NTJsonColumn columnWithName:fieldName];
+    id defaultValue = [self.defaultJson NTJsonStore_objectForKeyPath:fieldName];
+    BOOL isBinary = (self.documentFormat == NTJsonDocumentFormatBinary || _isConverting) ? YES : NO;    // json_extract() can't read binary documents
+    
+    *typeSql = (isBinary) ? [column documentTypeSqlWithDefaultValue:defaultValue] : [column jsonTypeSqlWithDefaultValue:defaultValue];
+    
+    if ( [self.columns NTJsonStore_find:^BOOL(NTJsonColumn *existing) { return [existing.name isEqualToString:fieldName]; }] )
+        return [self resolveColumnsIn:columnRef];
+    
+    return (isBinary) ? [column documentExtractSqlWithDefaultValue:defaultValue] : [column jsonExtractSqlWithDefaultValue:defaultValue];
+}
+
+
++(id)projectedValue:(id)value withJsonType:(const char *)type
 {
-    where = [self replaceAliasesIn:where cacheable:YES];
+    // undoes what extracting a field from the document did to objects, arrays and booleans...
+    
+    if ( !type )
+        return value;
+    
+    if ( strcmp(type, "true") == 0 )
+        return @YES;
+    
+    if ( strcmp(type, "false") == 0 )
+        return @NO;
+    
+    if ( (strcmp(type, "object") == 0 || strcmp(type, "array") == 0) && [value isKindOfClass:[NSString class]] )
+        return [NSJSONSerialization JSONObjectWithData:[value dataUsingEncoding:NSUTF8StringEncoding] options:0 error:nil] ?: value;
     
-    [self scanSqlForNewColumns:where];
+    return value;
+}
+
 
+-(NTJsonQueryPlan *)_planFindFields:(NSString *)fields where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit
+{
+    NTJsonCompiledSql *compiledFields = [self compiledSql:fields];
+    
+    if ( !compiledFields || !compiledFields->_columnNames.count )
+    {
+        _lastError = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidSqlArgument];
+        return nil;
+    }
+    
+    NTJsonCompiledSql *compiledWhere = [self compiledSql:where];
+    NTJsonCompiledSql *compiledOrderBy = [self compiledSql:orderBy];
+    
+    [self scanCompiledSqlForNewColumns:compiledWhere];
+    [self scanCompiledSqlForNewColumns:compiledOrderBy];
+    
     if ( ![self _ensureSchema] )
-        return -1;
+        return nil;
     
-    NSMutableString *sql = [NSMutableString stringWithFormat:@"SELECT COUNT(*) FROM [%@]", self.name];
+    NSMutableArray *resultKeys = [NSMutableArray arrayWithObject:NTJsonRowIdKey];
+    NSMutableString *sql = [NSMutableString stringWithFormat:@"SELECT [%@]", NTJsonRowIdKey];
+    NSMutableArray *typeSqls = [NSMutableArray array];
+    NSMutableDictionary *typeColumns = [NSMutableDictionary dictionary];
+    
+    for(NSString *fieldName in compiledFields->_columnNames)
+    {
+        NSString *typeSql;
+        
+        [resultKeys addObject:fieldName];
+        [sql appendFormat:@", %@", [self fieldSqlWithName:fieldName typeSql:&typeSql]];
+        
+        typeColumns[@(resultKeys.count - 1)] = @(compiledFields->_columnNames.count + 1 + typeSqls.count);
+        [typeSqls addObject:typeSql];
+    }
+    
+    // types are selected after all of the fields...
+    
+    for(NSString *typeSql in typeSqls)
+    {
+        [sql appendFormat:@", %@", typeSql];
+    }
+    
+    [sql appendFormat:@" FROM %@", self.name];
+    
+    where = [self resolvedSqlWithCompiledSql:compiledWhere];
+    orderBy = [self resolvedSqlWithCompiledSql:compiledOrderBy];
     
     if ( where )
         [sql appendFormat:@" WHERE %@", where];
     
-    id count = [self.connection execValueSql:sql args:args];
+    if ( orderBy )
+        [sql appendFormat:@" ORDER BY %@", orderBy];
     
-    return (count) ? [count intValue] : -1;
+    if ( limit > 0 )
+        [sql appendFormat:@" LIMIT %d", limit];
+    
+    NTJsonQueryPlan *plan = [[NTJsonQueryPlan alloc] init];
+    
+    plan->_sql = sql;
+    plan->_args = args;
+    plan->_resultKeys = [resultKeys copy];
+    plan->_typeColumns = [typeColumns copy];
+    
+    return plan;
 }
 
 
--(void)beginCountWhere:(NSString *)where args:(NSArray *)args completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(int count, NSError *error))completionHandler
+-(void)beginFindFields:(NSString *)fields where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *rows, NSError *error))completionHandler
 {
     completionQueue = [self getCompletionQueue:completionQueue];
     
     [self.connection dispatchAsync:^{
-        int count = [self _countWhere:where args:args];
-        NSError *error = (count != -1) ? nil : _lastError;
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        NTJsonQueryPlan *plan = [self _planFindFields:fields where:where args:args orderBy:orderBy limit:limit];
+        
+        if ( plan && [self shouldReadWithPlan:plan] )
+        {
+            [self beginReadRowsWithPlan:plan completionQueue:completionQueue completionHandler:^(NSArray *rows, NSError *error) {
+                [_metrics addOperation:@"findFields" startedAt:startedAt];
+                completionHandler(rows, error);
+            }];
+            return ;
+        }
+        
+        NSArray *rows = (plan) ? [self _rowsWithPlan:plan] : nil;
+        NSError *error = (rows) ? nil : _lastError;
+        
+        [_metrics addOperation:@"findFields" startedAt:startedAt];
         
         [self dispatchCompletionQueue:completionQueue completionHandler:^{
-            completionHandler(count, error);
+            completionHandler(rows, error);
         }];
     }];
 }
 
 
--(void)beginCountWhere:(NSString *)where args:(NSArray *)args completionHandler:(void (^)(int count, NSError *error))completionHandler
+-(void)beginFindFields:(NSString *)fields where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionHandler:(void (^)(NSArray *rows, NSError *error))completionHandler
 {
-    [self beginCountWhere:where args:args completionQueue:nil completionHandler:completionHandler];
+    [self beginFindFields:fields where:where args:args orderBy:orderBy limit:limit completionQueue:nil completionHandler:completionHandler];
 }
 
 
--(int)countWhere:(NSString *)where args:(NSArray *)args error:(NSError **)error
+-(NSArray *)findFields:(NSString *)fields where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit error:(NSError **)error
 {
-    __block int count;
+    __block NSArray *rows = nil;
+    __block NSError *findError = nil;
+    __block NTJsonQueryPlan *readPlan = nil;
+    
+    __block CFAbsoluteTime startedAt = 0;
+    
+    BOOL canRead = ![self.connection isCurrentQueue];   // nested calls stay on our queue
     
     [self.connection dispatchSync:^{
-        count = [self _countWhere:where args:args];
-        if ( error )
-            *error = (count != -1) ? nil : _lastError;
+        startedAt = [_metrics now];
+        
+        NTJsonQueryPlan *plan = [self _planFindFields:fields where:where args:args orderBy:orderBy limit:limit];
+        
+        if ( plan && canRead && [self shouldReadWithPlan:plan] )
+        {
+            readPlan = plan;
+            return ;
+        }
+        
+        rows = (plan) ? [self _rowsWithPlan:plan] : nil;
+        findError = (rows) ? nil : _lastError;
     }];
     
-    return count;
-}
-
-
--(int)countWhere:(NSString *)where args:(NSArray *)args
-{
-    return [self countWhere:where args:args error:nil];
+    if ( readPlan )
+        rows = [self readRowsWithPlan:readPlan error:&findError];
+    
+    [_metrics addOperation:@"findFields" startedAt:startedAt];
+    
+    if ( error )
+        *error = findError;
+    
+    return rows;
 }
 
 
--(void)beginCountWithCompletionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(int count, NSError *error))completionHandler
+-(NSArray *)findFields:(NSString *)fields where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit
 {
-    [self beginCountWhere:nil args:nil completionQueue:completionQueue completionHandler:completionHandler];
+    return [self findFields:fields where:where args:args orderBy:orderBy limit:limit error:nil];
 }
 
 
--(void)beginCountWithCompletionHandler:(void (^)(int count, NSError *error))completionHandler
-{
-    [self beginCountWhere:nil args:nil completionQueue:nil completionHandler:completionHandler];
-}
+#pragma mark - Cursors
 
 
--(int)countWithError:(NSError **)error
++(NSArray *)orderByTermsInSql:(NSString *)orderBy
 {
-    return [self countWhere:nil args:nil error:error];
+    // Splits a resolved ORDER BY into @[expression, @(isDescending)] terms. Commas inside parens, quotes or braces don't count.
+    
+    NSMutableArray *terms = [NSMutableArray array];
+    NSMutableArray *expressions = [NSMutableArray array];
+    
+    int depth = 0;
+    unichar quote = 0;
+    NSUInteger start = 0;
+    
+    for(NSUInteger index=0; index<orderBy.length; index++)
+    {
+        unichar c = [orderBy characterAtIndex:index];
+        
+        if ( quote )
+        {
+            if ( c == quote )
+                quote = 0;
+        }
+        
+        else if ( c == '\'' || c == '"' )
+            quote = c;
+        
+        else if ( c == '[' )
+            quote = ']';
+        
+        else if ( c == '(' )
+            ++depth;
+        
+        else if ( c == ')' )
+            --depth;
+        
+        else if ( c == ',' && depth == 0 )
+        {
+            [expressions addObject:[orderBy substringWithRange:NSMakeRange(start, index-start)]];
+            start = index + 1;
+        }
+    }
+    
+    [expressions addObject:[orderBy substringFromIndex:start]];
+    
+    for(NSString *rawExpression in expressions)
+    {
+        NSString *expression = [rawExpression stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+        BOOL isDescending = NO;
+        
+        if ( [expression.uppercaseString hasSuffix:@" DESC"] )
+        {
+            expression = [expression substringToIndex:expression.length - 5];
+            isDescending = YES;
+        }
+        
+        else if ( [expression.uppercaseString hasSuffix:@" ASC"] )
+            expression = [expression substringToIndex:expression.length - 4];
+        
+        expression = [expression stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+        
+        if ( expression.length )
+            [terms addObject:@[expression, @(isDescending)]];
+    }
+    
+    return terms;
 }
 
 
--(int)count
++(NSString *)keysetSqlWithTerms:(NSArray *)terms continuation:(NSArray *)continuation args:(NSMutableArray *)args
 {
-    return [self countWhere:nil args:nil error:nil];
+    // Builds the condition for "rows after continuation" in the order of terms (the last term is always the rowid.) SQLITE sorts
+    // NULLs first, so they need special handling in both directions.
+    
+    NSMutableArray *conditions = [NSMutableArray array];
+    NSMutableArray *equalExpressions = [NSMutableArray array];
+    NSMutableArray *equalArgs = [NSMutableArray array];
+    
+    for(int index=0; index<terms.count; index++)
+    {
+        NSString *expression = terms[index][0];
+        BOOL isDescending = [terms[index][1] boolValue];
+        id value = continuation[index];
+        
+        NSString *after;
+        
+        if ( value == [NSNull null] )
+            after = (isDescending) ? nil : [NSString stringWithFormat:@"%@ IS NOT NULL", expression];  // nothing comes after NULL when descending
+        
+        else
+            after = (isDescending) ? [NSString stringWithFormat:@"(%@ < ? OR %@ IS NULL)", expression, expression] : [NSString stringWithFormat:@"%@ > ?", expression];
+        
+        if ( after )
+        {
+            NSMutableArray *parts = [equalExpressions mutableCopy];
+            [parts addObject:after];
+            
+            [conditions addObject:[NSString stringWithFormat:@"(%@)", [parts componentsJoinedByString:@" AND "]]];
+            
+            [args addObjectsFromArray:equalArgs];
+            
+            if ( value != [NSNull null] )
+                [args addObject:value];
+        }
+        
+        if ( value == [NSNull null] )
+            [equalExpressions addObject:[NSString stringWithFormat:@"%@ IS NULL", expression]];
+        
+        else
+        {
+            [equalExpressions addObject:[NSString stringWithFormat:@"%@ = ?", expression]];
+            [equalArgs addObject:value];
+        }
+    }
+    
+    return (conditions.count) ? [conditions componentsJoinedByString:@" OR "] : @"0";
 }
 
 
-#pragma mark - find
-
-
--(NSArray *)_findWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit
+-(NTJsonQueryPlan *)_planFindBatchWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy continuation:(NSArray *)continuation limit:(int)limit
 {
-    where = [self replaceAliasesIn:where cacheable:YES];
-    orderBy = [self replaceAliasesIn:orderBy cacheable:YES];
+    NTJsonCompiledSql *compiledWhere = [self compiledSql:where];
+    NTJsonCompiledSql *compiledOrderBy = [self compiledSql:orderBy];
+    
+    [self scanCompiledSqlForNewColumns:compiledWhere];
+    [self scanCompiledSqlForNewColumns:compiledOrderBy];
     
-    [self scanSqlForNewColumns:where];
-    [self scanSqlForNewColumns:orderBy];
-
     if ( ![self _ensureSchema] )
         return nil;
     
-    // Ok, now we can actually do the query...
+    where = [self resolvedSqlWithCompiledSql:compiledWhere];
+    orderBy = [self resolvedSqlWithCompiledSql:compiledOrderBy];
     
-    NSMutableString *sql = [NSMutableString stringWithFormat:@"SELECT [%@], [__json__] FROM %@", NTJsonRowIdKey, self.name];
+    // The rowid is always the last term so every row has a unique position...
     
-    if ( where )
-        [sql appendFormat:@" WHERE %@", where];
+    NSMutableArray *terms = (orderBy) ? [[self.class orderByTermsInSql:orderBy] mutableCopy] : [NSMutableArray array];
+    NSUInteger keyCount = terms.count;
     
-    if ( orderBy )
-        [sql appendFormat:@" ORDER BY %@", orderBy];
+    [terms addObject:@[[NSString stringWithFormat:@"[%@]", NTJsonRowIdKey], @NO]];
+    
+    if ( continuation && continuation.count != terms.count )
+    {
+        _lastError = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidSqlArgument];
+        LOG_ERROR(@"Invalid continuation for %@ - expected %d values", self.name, (int)terms.count);
+        return nil;
+    }
+    
+    NSArray *rowColumns = (_lazyDecoding && _objectCache) ? [self lazyRowColumns] : nil;
+    NSString *rowColumnsSql = [[rowColumns NTJsonStore_transform:^id(NTJsonColumn *column) { return [NSString stringWithFormat:@", [%@]", column.name]; }] componentsJoinedByString:@""];
+    NSString *keysSql = [[[terms subarrayWithRange:NSMakeRange(0, keyCount)] NTJsonStore_transform:^id(NSArray *term) { return [NSString stringWithFormat:@", %@", term[0]]; }] componentsJoinedByString:@""];
+    
+    NSMutableString *sql = [NSMutableString stringWithFormat:@"SELECT [%@], [__json__]%@%@ FROM %@", NTJsonRowIdKey, rowColumnsSql ?: @"", keysSql ?: @"", self.name];
+    NSMutableArray *allArgs = [NSMutableArray arrayWithArray:args];
+    
+    NSString *keysetSql = (continuation) ? [self.class keysetSqlWithTerms:terms continuation:continuation args:allArgs] : nil;
+    
+    if ( where && keysetSql )
+        [sql appendFormat:@" WHERE (%@) AND (%@)", where, keysetSql];
+    
+    else if ( where || keysetSql )
+        [sql appendFormat:@" WHERE %@", where ?: keysetSql];
+    
+    [sql appendFormat:@" ORDER BY %@", [[terms NTJsonStore_transform:^id(NSArray *term) { return [NSString stringWithFormat:@"%@%@", term[0], [term[1] boolValue] ? @" DESC" : @""]; }] componentsJoinedByString:@", "]];
     
     if ( limit > 0 )
         [sql appendFormat:@" LIMIT %d", limit];
     
-    sqlite3_stmt *selectStatement = [self.connection statementWithSql:sql args:args];
+    NTJsonQueryPlan *plan = [[NTJsonQueryPlan alloc] init];
     
-    if ( !selectStatement )
-        return nil;
+    plan->_sql = sql;
+    plan->_args = allArgs;
+    plan->_rowColumns = rowColumns;
+    plan->_keyIndex = 2 + (int)rowColumns.count;
+    plan->_keyCount = (int)keyCount;
+    plan->_rowKeys = [NSMutableArray arrayWithCapacity:MAX(limit, 0)];
+    plan->_objectCacheGeneration = _objectCache.generation;
     
-    // Now we can extract our results!
+    [self keyDictionary];   // rows may be decoded on a read connection, make sure this is loaded first
     
-    NSMutableArray *items = [NSMutableArray array];
+    return plan;
+}
+
+
+-(NSArray *)findBatchWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy continuation:(NSArray *)continuation limit:(int)limit keys:(NSArray **)keys error:(NSError **)error
+{
+    __block NSArray *items = nil;
+    __block NSError *findError = nil;
+    __block NTJsonQueryPlan *plan = nil;
+    __block BOOL shouldRead = NO;
     
-    int status;
+    BOOL canRead = ![self.connection isCurrentQueue];   // nested calls stay on our queue
     
-    while ( (status=sqlite3_step(selectStatement)) == SQLITE_ROW )
-    {
-        NTJsonRowId rowid = sqlite3_column_int64(selectStatement, 0);
+    __block CFAbsoluteTime startedAt = 0;
+    
+    [self.connection dispatchSync:^{
+        startedAt = [_metrics now];
         
-        NSDictionary *json = [_objectCache jsonWithRowId:rowid];
+        plan = [self _planFindBatchWhere:where args:args orderBy:orderBy continuation:continuation limit:limit];
         
-        if ( !json )
+        if ( !plan )
         {
-            NSData *jsonData = [NSData dataWithBytes:sqlite3_column_blob(selectStatement, 1) length:sqlite3_column_bytes(selectStatement, 1)];
-            
-            NSError *error;
-            
-            NSDictionary *rawJson = [NSJSONSerialization JSONObjectWithData:jsonData options:0 error:&error];
-            
-            if ( !rawJson )
-            {
-                _lastError = error;
-                LOG_ERROR(@"Unable to parse JSON for %@:%lld - %@", self.name, rowid, error.localizedDescription);
-                sqlite3_finalize(selectStatement);
-                return nil;
-            }
-            
-            // Make sure __rowid__ is valid and correct.
-            
-            if (  ![rawJson[NTJsonRowIdKey] isEqualToNumber:@(rowid)] )
-            {
-                NSMutableDictionary *mutableJson = [rawJson mutableCopy];
-                mutableJson[NTJsonRowIdKey] = @(rowid);
-                rawJson = [mutableJson copy];
-            }
-            
-            json = (_objectCache) ? [_objectCache addJson:rawJson withRowId:rowid] : rawJson;
+            findError = _lastError;
+            return ;
         }
         
-        [items addObject:json];
-    }
+        if ( canRead && [self shouldReadWithPlan:plan] )
+        {
+            shouldRead = YES;
+            return ;
+        }
+        
+        items = [self _findItemsWithPlan:plan];
+        findError = (items) ? nil : _lastError;
+    }];
     
-    if ( status != SQLITE_DONE )
-    {
-        _lastError = [NSError NTJsonStore_errorWithSqlite3:self.connection.db];
-        items = nil; // failure
-    }
+    if ( shouldRead )
+        items = [self readItemsWithPlan:plan error:&findError];
     
-    sqlite3_finalize(selectStatement);
-
-    return [items copy];
+    [_metrics addOperation:@"findBatch" startedAt:startedAt];
+    
+    if ( keys )
+        *keys = (items) ? [plan->_rowKeys copy] : nil;
+    
+    if ( error )
+        *error = findError;
+    
+    return items;
 }
 
 
--(void)beginFindWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *items, NSError *error))completionHandler
+-(NSArray *)_findBatchWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy continuation:(NSArray *)continuation limit:(int)limit keys:(NSArray **)keys error:(NSError **)error
 {
-    completionQueue = [self getCompletionQueue:completionQueue];
+    // The same as findBatchWhere, but always runs right here on our queue (for live queries)...
     
-    [self.connection dispatchAsync:^{
-        NSArray *items = [self _findWhere:where args:args orderBy:orderBy limit:limit];
-        NSError *error = (items) ? nil : _lastError;
-        
-        [self dispatchCompletionQueue:completionQueue completionHandler:^{
-            completionHandler(items, error);
-        }];
-    }];
+    NTJsonQueryPlan *plan = [self _planFindBatchWhere:where args:args orderBy:orderBy continuation:continuation limit:limit];
+    NSArray *items = (plan) ? [self _findItemsWithPlan:plan] : nil;
+    
+    if ( keys )
+        *keys = (items) ? [plan->_rowKeys copy] : nil;
+    
+    if ( error )
+        *error = (items) ? nil : _lastError;
+    
+    return items;
 }
 
 
--(void)beginFindWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionHandler:(void (^)(NSArray *items, NSError *error))completionHandler
+-(NTJsonCursor *)cursorWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy batchSize:(int)batchSize continuation:(NSArray *)continuation
 {
-    [self beginFindWhere:where args:args orderBy:orderBy limit:limit completionQueue:nil completionHandler:completionHandler];
+    return [[NTJsonCursor alloc] initWithCollection:self where:where args:args orderBy:orderBy batchSize:batchSize continuation:continuation];
 }
 
 
--(NSArray *)findWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit error:(NSError **)error
+-(NTJsonCursor *)cursorWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy batchSize:(int)batchSize
 {
-    __block NSArray *items;
-    
-    [self.connection dispatchSync:^{
-        items = [self _findWhere:where args:args orderBy:orderBy limit:limit];
-        if ( error )
-            *error = (items) ? nil : _lastError;
-    }];
+    return [self cursorWhere:where args:args orderBy:orderBy batchSize:batchSize continuation:nil];
+}
+
+
+-(void)enumerateCursor:(NTJsonCursor *)cursor completionQueue:(dispatch_queue_t)completionQueue batchHandler:(BOOL (^)(NSArray *items))batchHandler completionHandler:(void (^)(NSArray *continuation, NSError *error))completionHandler
+{
+    // Reads one batch at a time; the next batch isn't read until the handler is done with this one.
     
-    return items;
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSArray *items = [cursor nextBatch];
+        
+        dispatch_async(completionQueue, ^{
+            if ( items && batchHandler(items) && !cursor.isFinished )
+            {
+                [self enumerateCursor:cursor completionQueue:completionQueue batchHandler:batchHandler completionHandler:completionHandler];
+                return ;
+            }
+            
+            if ( completionHandler )
+                completionHandler(cursor.continuation, cursor.error);
+        });
+    });
 }
 
 
--(NSArray *)findWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit
+-(void)beginEnumerateWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy batchSize:(int)batchSize continuation:(NSArray *)continuation completionQueue:(dispatch_queue_t)completionQueue batchHandler:(BOOL (^)(NSArray *items))batchHandler completionHandler:(void (^)(NSArray *continuation, NSError *error))completionHandler
 {
-    return [self findWhere:where args:args orderBy:orderBy limit:limit error:nil];
+    completionQueue = [self getCompletionQueue:completionQueue];
+    
+    NTJsonCursor *cursor = [self cursorWhere:where args:args orderBy:orderBy batchSize:batchSize continuation:continuation];
+    
+    [self enumerateCursor:cursor completionQueue:completionQueue batchHandler:batchHandler completionHandler:completionHandler];
 }
 
 
--(void)beginFindWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *items, NSError *error))completionHandler
+-(void)beginEnumerateWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy batchSize:(int)batchSize batchHandler:(BOOL (^)(NSArray *items))batchHandler completionHandler:(void (^)(NSArray *continuation, NSError *error))completionHandler
 {
-    [self beginFindWhere:where args:args orderBy:orderBy limit:0 completionQueue:completionQueue completionHandler:completionHandler];
+    [self beginEnumerateWhere:where args:args orderBy:orderBy batchSize:batchSize continuation:nil completionQueue:nil batchHandler:batchHandler completionHandler:completionHandler];
 }
 
 
--(void)beginFindWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy completionHandler:(void (^)(NSArray *items, NSError *error))completionHandler
+#pragma mark - Read Connections
+
+
+-(BOOL)shouldReadWithPlan:(NTJsonQueryPlan *)plan
 {
-    [self beginFindWhere:where args:args orderBy:orderBy limit:0 completionQueue:nil completionHandler:completionHandler];
+    // Called on our queue after the plan is made. Queries that were answered from a cache are never worth moving and
+    // NTJson_extract and NTJson_type are only registered on our own connection (it's used while columns are being materialized.)
+    
+    if ( plan->_items || plan->_count )
+        return NO;
+    
+    if ( self.store.readConnectionCount <= 0 )
+        return NO;
+    
+    if ( _groupCommitTransactionId )
+        return NO;  // writes waiting for the group commit are only visible on our connection
+    
+    return ([plan->_sql rangeOfString:@"NTJson_"].location == NSNotFound) ? YES : NO;
 }
 
 
--(NSArray *)findWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy error:(NSError **)error
+-(NSArray *)readItemsWithPlan:(NTJsonQueryPlan *)plan error:(NSError **)error
 {
-    return [self findWhere:where args:args orderBy:orderBy limit:0 error:error];
+    // Runs a find on a read connection, falling back to our own connection if none are available. Never called on our queue.
+    
+    NTJsonSqlConnection *readConnection = [self.store checkoutReadConnectionWithFilename:self.connection.filename];
+    
+    if ( !readConnection )
+    {
+        __block NSArray *items;
+        
+        [self.connection dispatchSync:^{
+            items = [self _findItemsWithPlan:plan];
+            if ( error )
+                *error = (items) ? nil : _lastError;
+        }];
+        
+        return items;
+    }
+    
+    __block NSArray *items;
+    __block NSError *readError;
+    
+    [readConnection dispatchSync:^{
+        NSError *statementError;
+        items = [self findItemsWithPlan:plan connection:readConnection error:&statementError];
+        readError = statementError;
+    }];
+    
+    [self.store checkinReadConnection:readConnection];
+    
+    if ( items && plan->_queryKey )
+    {
+        [self.connection dispatchAsync:^{
+            [self addItems:items toQueryCacheWithPlan:plan];
+        }];
+    }
+    
+    if ( error )
+        *error = readError;
+    
+    return items;
 }
 
 
--(NSArray *)findWhere:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy
+-(int)readCountWithPlan:(NTJsonQueryPlan *)plan error:(NSError **)error
 {
-    return [self findWhere:where args:args orderBy:orderBy limit:0 error:nil];
+    // Runs a count on a read connection, falling back to our own connection if none are available. Never called on our queue.
+    
+    NTJsonSqlConnection *readConnection = [self.store checkoutReadConnectionWithFilename:self.connection.filename];
+    
+    if ( !readConnection )
+    {
+        __block int count;
+        
+        [self.connection dispatchSync:^{
+            count = [self _countWithPlan:plan];
+            if ( error )
+                *error = (count != -1) ? nil : _lastError;
+        }];
+        
+        return count;
+    }
+    
+    __block NSNumber *count;
+    __block NSError *readError;
+    
+    [readConnection dispatchSync:^{
+        NSError *statementError;
+        count = [self countWithPlan:plan connection:readConnection error:&statementError];
+        readError = statementError;
+    }];
+    
+    [self.store checkinReadConnection:readConnection];
+    
+    if ( count && plan->_queryKey )
+    {
+        [self.connection dispatchAsync:^{
+            [self addCount:count toQueryCacheWithPlan:plan];
+        }];
+    }
+    
+    if ( error )
+        *error = readError;
+    
+    return (count) ? [count intValue] : -1;
 }
 
 
--(void)beginFindOneWhere:(NSString *)where args:(NSArray *)args completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSDictionary *item, NSError *error))completionHandler
+-(NSArray *)readRowsWithPlan:(NTJsonQueryPlan *)plan error:(NSError **)error
 {
-    [self beginFindWhere:where args:args orderBy:nil limit:1 completionQueue:completionQueue completionHandler:^(NSArray *items, NSError *error)
+    // Runs an aggregate or projection on a read connection, falling back to our own connection if none are available.
+    
+    NTJsonSqlConnection *readConnection = [self.store checkoutReadConnectionWithFilename:self.connection.filename];
+    
+    if ( !readConnection )
     {
-        if ( completionHandler )
-            completionHandler([items lastObject], error);
+        __block NSArray *rows;
+        
+        [self.connection dispatchSync:^{
+            rows = [self _rowsWithPlan:plan];
+            if ( error )
+                *error = (rows) ? nil : _lastError;
+        }];
+        
+        return rows;
+    }
+    
+    __block NSArray *rows;
+    __block NSError *readError;
+    
+    [readConnection dispatchSync:^{
+        NSError *statementError;
+        rows = [self rowsWithPlan:plan connection:readConnection error:&statementError];
+        readError = statementError;
     }];
+    
+    [self.store checkinReadConnection:readConnection];
+    
+    if ( error )
+        *error = readError;
+    
+    return rows;
 }
 
 
--(void)beginFindOneWhere:(NSString *)where args:(NSArray *)args completionHandler:(void (^)(NSDictionary *item, NSError *error))completionHandler
+-(void)beginReadItemsWithPlan:(NTJsonQueryPlan *)plan completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *items, NSError *error))completionHandler
 {
-    [self beginFindWhere:where args:args orderBy:nil limit:1 completionQueue:nil completionHandler:^(NSArray *items, NSError *error) {
-         if ( completionHandler )
-             completionHandler([items lastObject], error);
-     }];
+    // Called on our queue. The completion is dispatched directly since we are no longer running on our queue when
+    // it's called (dispatchCompletionQueue calls it inline for NTJsonStoreSerialQueue.)
+    
+    dispatch_group_async(_readGroup, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSError *error;
+        NSArray *items = [self readItemsWithPlan:plan error:&error];
+        
+        if ( completionQueue )
+        {
+            dispatch_async(completionQueue, ^{
+                completionHandler(items, error);
+            });
+        }
+    });
 }
 
 
--(NSDictionary *)findOneWhere:(NSString *)where args:(NSArray *)args error:(NSError **)error
+-(void)beginReadCountWithPlan:(NTJsonQueryPlan *)plan completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(int count, NSError *error))completionHandler
 {
-    return [[self findWhere:where args:args orderBy:nil limit:1 error:error] lastObject];
+    dispatch_group_async(_readGroup, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSError *error;
+        int count = [self readCountWithPlan:plan error:&error];
+        
+        if ( completionQueue )
+        {
+            dispatch_async(completionQueue, ^{
+                completionHandler(count, error);
+            });
+        }
+    });
 }
 
 
--(NSDictionary *)findOneWhere:(NSString *)where args:(NSArray *)args
+-(void)beginReadRowsWithPlan:(NTJsonQueryPlan *)plan completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(NSArray *rows, NSError *error))completionHandler
 {
-    return [[self findWhere:where args:args orderBy:nil limit:1 error:nil] lastObject];
+    dispatch_group_async(_readGroup, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSError *error;
+        NSArray *rows = [self readRowsWithPlan:plan error:&error];
+        
+        if ( completionQueue )
+        {
+            dispatch_async(completionQueue, ^{
+                completionHandler(rows, error);
+            });
+        }
+    });
+}
+
+
+-(void)addPendingOperationsToGroup:(dispatch_group_t)group
+{
+    // Adds everything queued so far to the group, including any reads the queue has handed off to read connections.
+    
+    dispatch_group_async(group, self.connection.queue, ^{
+        [self groupCommit_commit];
+        
+        dispatch_group_enter(group);
+        
+        dispatch_group_notify(_readGroup, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            dispatch_group_leave(group);
+        });
+    });
 }
 
 
@@ -1657,23 +7103,82 @@
 
 -(int)_removeWhere:(NSString *)where args:(NSArray *)args
 {
-    where = [self replaceAliasesIn:where cacheable:YES];
+    NTJsonCompiledSql *compiledWhere = [self compiledSql:where];
     
-    [self scanSqlForNewColumns:where];
+    [self scanCompiledSqlForNewColumns:compiledWhere];
     
     if ( ![self _ensureSchema] )
         return -1;
     
+    where = [self resolvedSqlWithCompiledSql:compiledWhere];
+    
+    // The unique key maps and change observers need to know exactly which rows are going away...
+    
+    NSMutableArray *removedRowids = nil;
+    
+    if ( (_uniqueKeyMaps.count && where) || [self changes_isObserved] )
+    {
+        NSString *selectSql = [NSString stringWithFormat:@"SELECT [%@] FROM [%@]", NTJsonRowIdKey, self.name];
+        
+        if ( where )
+            selectSql = [selectSql stringByAppendingFormat:@" WHERE %@", where];
+        
+        sqlite3_stmt *statement = [self.connection cachedStatementWithSql:selectSql args:args];
+        
+        if ( !statement )
+            return -1;
+        
+        removedRowids = [NSMutableArray array];
+        
+        while ( sqlite3_step(statement) == SQLITE_ROW )
+            [removedRowids addObject:@(sqlite3_column_int64(statement, 0))];
+        
+        [self.connection releaseStatement:statement];
+    }
+    
     NSMutableString *sql = [NSMutableString stringWithFormat:@"DELETE FROM [%@] ", self.name];
     
     if ( where )
         [sql appendFormat:@" WHERE %@", where];
     
+    [self statistics_willChange];
+    
     if ( ![self.connection execSql:sql args:args] )
         return -1;
     
     int count = sqlite3_changes(self.connection.db);
     
+    [self externalChanges_didWrite];
+    
+    if ( count > 0 )
+    {
+        [_queryCache removeAll];
+        [_transactionCacheUpdates removeAllObjects];  // we don't know which were removed, they will be loaded again as needed
+    }
+    
+    if ( !where )
+        [_statistics removeAllRows];
+    
+    else
+        [_statistics removeRowsWithCount:count];
+    
+    [self statistics_didChange];
+    
+    if ( removedRowids )
+    {
+        for(NSNumber *rowid in removedRowids)
+        {
+            [self uniqueKeys_removeRowId:[rowid longLongValue]];
+            [self changes_addRemovedRowId:[rowid longLongValue]];
+        }
+    }
+    
+    else if ( !where && _uniqueKeyMaps.count )
+    {
+        for(NTJsonUniqueKeyMap *map in [_uniqueKeyMaps objectEnumerator])
+            [map removeAll];
+    }
+    
     // note: we may leave objects in the cache that were deleted, but the rowid will not be re-used (thanks to AUTOINCREMENT PK)
     // so it should be eventually cleaned out of the cache from lack of use.
     
@@ -1686,11 +7191,18 @@
     completionQueue = [self getCompletionQueue:completionQueue];
     
     [self.connection dispatchAsync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_willWrite];
+        
         int count = [self _removeWhere:where args:args];
+        
+        [_metrics addOperation:@"removeWhere" startedAt:startedAt];
+        
         NSError *error = (count != -1) ? nil : _lastError;
         
-        [self dispatchCompletionQueue:completionQueue completionHandler:^{
-            completionHandler(count, error);
+        [self groupCommit_didWriteWithCompletionQueue:completionQueue completionHandler:^(NSError *commitError) {
+            completionHandler(count, error ?: commitError);
         }];
     }];
 }
@@ -1707,7 +7219,14 @@
     __block int count;
     
     [self.connection dispatchSync:^{
+        CFAbsoluteTime startedAt = [_metrics now];
+        
+        [self groupCommit_commit];  // so this write is committed when we return
+        
         count = [self _removeWhere:where args:args];
+        
+        [_metrics addOperation:@"removeWhere" startedAt:startedAt];
+        
         if ( error )
             *error = (count != -1) ? nil : _lastError;
     }];
@@ -1753,9 +7272,11 @@
 {
     completionQueue = [self getCompletionQueue:completionQueue];
     
-    dispatch_async(self.connection.queue, ^{
-        [self dispatchCompletionQueue:completionQueue completionHandler:completionHandler];
-    });
+    dispatch_group_t group = dispatch_group_create();
+    
+    [self addPendingOperationsToGroup:group];
+    
+    dispatch_group_notify(group, completionQueue, completionHandler);
 }
 
 
@@ -1769,10 +7290,7 @@
 {
     dispatch_group_t group = dispatch_group_create();
     
-    dispatch_group_async(group, self.connection.queue, ^
-    {
-        // we don't actually need to do anything here specific...
-    });
+    [self addPendingOperationsToGroup:group];
     
     return (dispatch_group_wait(group, timeout) == 0) ? YES : NO;
 }
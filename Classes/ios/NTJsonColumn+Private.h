@@ -7,10 +7,39 @@
 //
 
 
+typedef enum
+{
+    NTJsonColumnKindMaterialized,   // a real column, populated on insert/update
+    NTJsonColumnKindVirtual,        // a VIRTUAL generated column over [__json__]
+    NTJsonColumnKindExpression,     // not a column at all, replaced with json_extract() in queries
+} NTJsonColumnKind;
+
+
 @interface NTJsonColumn : NSObject
 
 @property (nonatomic,readonly) NSString *name;
+@property (nonatomic,readonly) NTJsonColumnKind kind;
 
 +(NTJsonColumn *)columnWithName:(NSString *)name;
++(NTJsonColumn *)columnWithName:(NSString *)name kind:(NTJsonColumnKind)kind;
++(NTJsonColumnKind)columnKindWithColumnMode:(NTJsonColumnMode)columnMode;
+
++(NSString *)sqlLiteralWithValue:(id)value;
+
+/// json_extract() expression that reads this column's value directly from [__json__]
+-(NSString *)jsonExtractSql;
+-(NSString *)jsonExtractSqlWithDefaultValue:(id)defaultValue;
+-(NSString *)jsonExtractSqlWithDocumentSql:(NSString *)documentSql defaultValue:(id)defaultValue;  // reads from any JSON TEXT expression
+
+/// NTJson_extract() expression, which understands both text and binary documents. Only available on the collection connection.
+-(NSString *)documentExtractSql;
+-(NSString *)documentExtractSqlWithDefaultValue:(id)defaultValue;
+
+/// the JSON type of this column's value in [__json__] ('true', 'false', 'object', 'array', ...), using json_type() or NTJson_type() for
+/// documents of either format. Used to restore the values extracting loses (objects and arrays become JSON text, booleans 0/1.)
+-(NSString *)jsonTypeSqlWithDefaultValue:(id)defaultValue;
+-(NSString *)documentTypeSqlWithDefaultValue:(id)defaultValue;
+
+-(NSString *)alterSqlWithTableName:(NSString *)tableName;   // nil for expression columns
 
 @end
@@ -11,6 +11,7 @@
 @interface NTJsonColumn ()
 {
     NSString *_name;
+    NTJsonColumnKind _kind;
 }
 
 @end
@@ -25,14 +26,154 @@
 }
 
 
-+(NTJsonColumn *)columnWithName:(NSString *)name
+-(NTJsonColumnKind)kind
+{
+    return _kind;
+}
+
+
++(NTJsonColumn *)columnWithName:(NSString *)name kind:(NTJsonColumnKind)kind
 {
     NTJsonColumn *column = [[NTJsonColumn alloc] init];
     
     column->_name = name;
+    column->_kind = kind;
     
     return column;
 }
 
 
++(NTJsonColumn *)columnWithName:(NSString *)name
+{
+    return [self columnWithName:name kind:NTJsonColumnKindMaterialized];
+}
+
+
++(NTJsonColumnKind)columnKindWithColumnMode:(NTJsonColumnMode)columnMode
+{
+    switch(columnMode)
+    {
+        case NTJsonColumnModeVirtual:
+            return NTJsonColumnKindVirtual;
+            
+        case NTJsonColumnModeExpression:
+            return NTJsonColumnKindExpression;
+            
+        case NTJsonColumnModeMaterialized:
+        default:
+            return NTJsonColumnKindMaterialized;
+    }
+}
+
+
++(NSString *)sqlLiteralWithValue:(id)value
+{
+    if ( [value isKindOfClass:[NSNumber class]] )
+        return [value stringValue];
+    
+    if ( [value isKindOfClass:[NSString class]] )
+        return [NSString stringWithFormat:@"'%@'", [value stringByReplacingOccurrencesOfString:@"'" withString:@"''"]];
+    
+    return @"NULL";
+}
+
+
+-(NSString *)jsonPath
+{
+    // "a.b" becomes $."a"."b" - quoting keeps us safe from any odd characters in key names...
+    
+    NSMutableString *path = [NSMutableString stringWithString:@"$"];
+    
+    for(NSString *key in [_name componentsSeparatedByString:@"."])
+        [path appendFormat:@".\"%@\"", [key stringByReplacingOccurrencesOfString:@"\"" withString:@"\\\""]];
+    
+    return [path copy];
+}
+
+
+-(NSString *)jsonExtractSql
+{
+    // __json__ is stored as a BLOB, json_extract needs TEXT...
+    
+    return [self jsonExtractSqlWithDocumentSql:@"CAST([__json__] AS TEXT)" defaultValue:nil];
+}
+
+
+-(NSString *)jsonExtractSqlWithDefaultValue:(id)defaultValue
+{
+    return [self jsonExtractSqlWithDocumentSql:@"CAST([__json__] AS TEXT)" defaultValue:defaultValue];
+}
+
+
+-(NSString *)jsonExtractSqlWithDocumentSql:(NSString *)documentSql defaultValue:(id)defaultValue
+{
+    NSString *extractSql = [NSString stringWithFormat:@"json_extract(%@, %@)", documentSql, [self.class sqlLiteralWithValue:[self jsonPath]]];
+    
+    if ( !defaultValue || defaultValue == [NSNull null] )
+        return extractSql;
+    
+    return [NSString stringWithFormat:@"COALESCE(%@, %@)", extractSql, [self.class sqlLiteralWithValue:defaultValue]];
+}
+
+
+-(NSString *)documentExtractSql
+{
+    return [NSString stringWithFormat:@"NTJson_extract([__json__], %@)", [self.class sqlLiteralWithValue:_name]];
+}
+
+
+-(NSString *)documentExtractSqlWithDefaultValue:(id)defaultValue
+{
+    if ( !defaultValue || defaultValue == [NSNull null] )
+        return [self documentExtractSql];
+    
+    return [NSString stringWithFormat:@"COALESCE(%@, %@)", [self documentExtractSql], [self.class sqlLiteralWithValue:defaultValue]];
+}
+
+
++(NSString *)typeSql:(NSString *)typeSql withDefaultValue:(id)defaultValue
+{
+    // a boolean default is extracted as 0/1 like any other boolean, so it needs its type as well...
+    
+    if ( !defaultValue || CFGetTypeID((__bridge CFTypeRef)defaultValue) != CFBooleanGetTypeID() )
+        return typeSql;
+    
+    return [NSString stringWithFormat:@"COALESCE(%@, '%@')", typeSql, ([defaultValue boolValue]) ? @"true" : @"false"];
+}
+
+
+-(NSString *)jsonTypeSqlWithDefaultValue:(id)defaultValue
+{
+    NSString *typeSql = [NSString stringWithFormat:@"json_type(CAST([__json__] AS TEXT), %@)", [self.class sqlLiteralWithValue:[self jsonPath]]];
+    
+    return [self.class typeSql:typeSql withDefaultValue:defaultValue];
+}
+
+
+-(NSString *)documentTypeSqlWithDefaultValue:(id)defaultValue
+{
+    NSString *typeSql = [NSString stringWithFormat:@"NTJson_type([__json__], %@)", [self.class sqlLiteralWithValue:_name]];
+    
+    return [self.class typeSql:typeSql withDefaultValue:defaultValue];
+}
+
+
+-(NSString *)alterSqlWithTableName:(NSString *)tableName
+{
+    switch(_kind)
+    {
+        case NTJsonColumnKindMaterialized:
+            return [NSString stringWithFormat:@"ALTER TABLE [%@] ADD COLUMN [%@];", tableName, _name];
+            
+        case NTJsonColumnKindVirtual:
+            // defaults are not part of the column definition, they are applied in queries so they can change freely.
+            return [NSString stringWithFormat:@"ALTER TABLE [%@] ADD COLUMN [%@] GENERATED ALWAYS AS (%@) VIRTUAL;", tableName, _name, [self jsonExtractSql]];
+            
+        case NTJsonColumnKindExpression:
+        default:
+            return nil;
+    }
+}
+
+
 @end
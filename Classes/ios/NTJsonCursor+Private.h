@@ -0,0 +1,16 @@
+//
+//  NTJsonCursor+Private.h
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import "NTJsonCursor.h"
+
+
+@interface NTJsonCursor (Private)
+
+-(id)initWithCollection:(NTJsonCollection *)collection where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy batchSize:(int)batchSize continuation:(NSArray *)continuation;
+
+@end
@@ -0,0 +1,52 @@
+//
+//  NTJsonCursor.h
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "NTJsonStoreTypes.h"
+
+
+@class NTJsonCollection;
+
+
+/// Returns the results of a find in batches so large result sets can be processed in bounded memory. Each batch is a separate
+/// query that continues after the last item returned (keyset pagination), so no SQLITE state is held between batches and
+/// writes made while enumerating may or may not be seen. Create cursors with -[NTJsonCollection cursorWhere:...]. A cursor may be
+/// used from any thread but only from one thread at a time.
+@interface NTJsonCursor : NSEnumerator
+
+@property (nonatomic,readonly) NTJsonCollection *collection;
+
+/// The maximum number of items read in each batch.
+@property (nonatomic,readonly) int batchSize;
+
+/// YES once every matching item has been returned or an error occurred.
+@property (nonatomic,readonly) BOOL isFinished;
+
+/// The error that ended the enumeration, if any.
+@property (nonatomic,readonly) NSError *error;
+
+/// Identifies the position after the last item returned. Pass this to -[NTJsonCollection cursorWhere:...continuation:] with the same where, args
+/// and orderBy to resume the enumeration later. The value is a JSON compatible array so it may be persisted. nil before the first item.
+@property (nonatomic,readonly) NSArray *continuation;
+
+/**
+ *  Returns the next batch of items, reading it from the store if needed.
+ *
+ *  @return up to batchSize items or nil when there are no more items (or on error, see self.error)
+ */
+-(NSArray *)nextBatch;
+
+/**
+ *  Returns the next item, reading the next batch from the store when needed.
+ *
+ *  @return the next item or nil when there are no more items (or on error, see self.error)
+ */
+-(id)nextObject;
+
+@end
@@ -0,0 +1,119 @@
+//
+//  NTJsonCursor.m
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import "NTJsonStore+Private.h"
+
+
+static const int DEFAULT_BATCH_SIZE = 100;
+
+
+@interface NTJsonCursor ()
+{
+    NSString *_where;
+    NSArray *_args;
+    NSString *_orderBy;
+    
+    NSArray *_items;        // the current batch
+    NSArray *_keys;         // the continuation for each item in the current batch
+    NSUInteger _nextIndex;  // the next item to return from the current batch
+}
+
+@end
+
+
+@implementation NTJsonCursor
+
+
+-(id)initWithCollection:(NTJsonCollection *)collection where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy batchSize:(int)batchSize continuation:(NSArray *)continuation
+{
+    self = [super init];
+    
+    if ( self )
+    {
+        _collection = collection;
+        _where = [where copy];
+        _args = [args copy];
+        _orderBy = [orderBy copy];
+        _batchSize = (batchSize > 0) ? batchSize : DEFAULT_BATCH_SIZE;
+        _continuation = [continuation copy];
+    }
+    
+    return self;
+}
+
+
+-(BOOL)readBatch
+{
+    NSArray *keys;
+    NSError *error;
+    
+    NSArray *items = [_collection findBatchWhere:_where args:_args orderBy:_orderBy continuation:_continuation limit:_batchSize keys:&keys error:&error];
+    
+    if ( !items )
+    {
+        _error = error;
+        _isFinished = YES;
+        return NO;
+    }
+    
+    _items = items;
+    _keys = keys;
+    _nextIndex = 0;
+    
+    if ( !items.count )
+    {
+        _isFinished = YES;
+        return NO;
+    }
+    
+    return YES;
+}
+
+
+-(NSArray *)nextBatch
+{
+    if ( _isFinished )
+        return nil;
+    
+    if ( _nextIndex >= _items.count && ![self readBatch] )
+        return nil;
+    
+    // return whatever is left of the current batch (all of it unless nextObject has been used)...
+    
+    NSArray *batch = (_nextIndex == 0) ? _items : [_items subarrayWithRange:NSMakeRange(_nextIndex, _items.count - _nextIndex)];
+    
+    _continuation = [_keys lastObject];
+    _nextIndex = _items.count;
+    
+    // A short batch means there is nothing left, no need to ask again...
+    
+    if ( _items.count < _batchSize )
+        _isFinished = YES;
+    
+    return batch;
+}
+
+
+-(id)nextObject
+{
+    if ( _nextIndex >= _items.count )
+    {
+        if ( _isFinished || (_items && _items.count < _batchSize) || ![self readBatch] )
+        {
+            _isFinished = YES;
+            return nil;
+        }
+    }
+    
+    _continuation = _keys[_nextIndex];
+    
+    return _items[_nextIndex++];
+}
+
+
+@end
@@ -10,7 +10,7 @@
 #import "NTJsonStore+Private.h"
 
 
-#define dict _cacheItem->_json
+#define dict _cacheItem.json      // lazy items are decoded the first time we need the whole thing
 
 
 @interface NTJsonDictionary () <NSCopying>
@@ -61,7 +61,7 @@
 
 -(id)objectForKey:(id)aKey
 {
-    return [dict objectForKey:aKey];
+    return [_cacheItem objectForKey:aKey];   // may not need to decode everything
 }
 
 
@@ -7,15 +7,27 @@
 //
 
 
+typedef enum
+{
+    NTJsonIndexKindColumn,        // indexes real (or generated) columns
+    NTJsonIndexKindExpression,    // indexes json_extract() expressions over [__json__]
+} NTJsonIndexKind;
+
+
 @interface NTJsonIndex : NSObject
 
 @property (nonatomic,readonly) BOOL isUnique;
 @property (nonatomic,readonly) NSString *name;
 @property (nonatomic,readonly) NSString *keys;
+@property (nonatomic,readonly) NTJsonIndexKind kind;
 
 +(NTJsonIndex *)indexWithName:(NSString *)name keys:(NSString *)keys isUnique:(BOOL)isUnique;
++(NTJsonIndex *)indexWithName:(NSString *)name keys:(NSString *)keys isUnique:(BOOL)isUnique kind:(NTJsonIndexKind)kind;
 +(NTJsonIndex *)indexWithSql:(NSString *)sql;
 
+-(NTJsonIndex *)indexWithKeysSql:(NSString *)keysSql;  // a copy that is created with exactly these keys (defaults included)
+
+-(NSString *)keysSql;     // the keys as they appear in the index, json_extract() expressions for expression indexes
 -(NSString *)sqlWithTableName:(NSString *)tableName;
 
 @end
@@ -14,6 +14,8 @@
     BOOL _isUnique;
     NSString *_name;
     NSString *_keys;
+    NTJsonIndexKind _kind;
+    NSString *_keysSql;     // nil until the index is created or read back from the database
 }
 
 @end
@@ -40,7 +42,13 @@
 }
 
 
--(id)initWithName:(NSString *)name keys:(NSString *)keys isUnique:(BOOL)isUnique
+-(NTJsonIndexKind)kind
+{
+    return _kind;
+}
+
+
+-(id)initWithName:(NSString *)name keys:(NSString *)keys isUnique:(BOOL)isUnique kind:(NTJsonIndexKind)kind
 {
     self = [super init];
     
@@ -49,22 +57,71 @@
         _isUnique = isUnique;
         _name = name;
         _keys = keys;
-
+        _kind = kind;
     }
     
     return self;
 }
 
 
++(NTJsonIndex *)indexWithName:(NSString *)name keys:(NSString *)keys isUnique:(BOOL)isUnique kind:(NTJsonIndexKind)kind
+{
+    return [[NTJsonIndex alloc] initWithName:name keys:keys isUnique:isUnique kind:kind];
+}
+
+
 +(NTJsonIndex *)indexWithName:(NSString *)name keys:(NSString *)keys  isUnique:(BOOL)isUnique
 {
-    return [[NTJsonIndex alloc] initWithName:name keys:keys isUnique:isUnique];
+    return [[NTJsonIndex alloc] initWithName:name keys:keys isUnique:isUnique kind:NTJsonIndexKindColumn];
+}
+
+
+-(NTJsonIndex *)indexWithKeysSql:(NSString *)keysSql
+{
+    NTJsonIndex *index = [[NTJsonIndex alloc] initWithName:_name keys:_keys isUnique:_isUnique kind:_kind];
+    
+    index->_keysSql = keysSql;
+    
+    return index;
+}
+
+
++(NSString *)keysWithExpressionSql:(NSString *)expressionSql
+{
+    // Converts json_extract(CAST([__json__] AS TEXT), '$."a"."b"') back to [a.b]. Keys with a default are wrapped in
+    // COALESCE(key, literal), which is removed first...
+    
+    NSRegularExpression *defaultRegex = [NSRegularExpression regularExpressionWithPattern:@"COALESCE\\((json_extract\\(CAST\\(\\[__json__\\] AS TEXT\\), '\\$(?:\\.\"[^\"]*\")+'\\)|\\[[^\\]]+\\]), (?:'(?:[^']|'')*'|[-+0-9.eE]+)\\)" options:0 error:nil];
+    
+    expressionSql = [defaultRegex stringByReplacingMatchesInString:expressionSql options:0 range:NSMakeRange(0, expressionSql.length) withTemplate:@"$1"];
+    
+    NSRegularExpression *regex = [NSRegularExpression regularExpressionWithPattern:@"json_extract\\(CAST\\(\\[__json__\\] AS TEXT\\), '\\$((?:\\.\"[^\"]*\")+)'\\)" options:0 error:nil];
+    
+    NSMutableString *keys = [NSMutableString string];
+    __block NSUInteger start = 0;
+    
+    [regex enumerateMatchesInString:expressionSql options:0 range:NSMakeRange(0, expressionSql.length) usingBlock:^(NSTextCheckingResult *result, NSMatchingFlags flags, BOOL *stop) {
+        [keys appendString:[expressionSql substringWithRange:NSMakeRange(start, result.range.location-start)]];
+        
+        NSString *path = [expressionSql substringWithRange:[result rangeAtIndex:1]];  // ."a"."b"
+        NSString *keyPath = [[path substringWithRange:NSMakeRange(2, path.length-3)] stringByReplacingOccurrencesOfString:@"\".\"" withString:@"."];
+        
+        [keys appendFormat:@"[%@]", keyPath];
+        
+        start = result.range.location + result.range.length;
+    }];
+    
+    [keys appendString:[expressionSql substringFromIndex:start]];
+    
+    return [keys copy];
 }
 
 
 +(NTJsonIndex *)indexWithSql:(NSString *)sql
 {
-    NSRegularExpression *regex = [NSRegularExpression regularExpressionWithPattern:@".*?\\[(.*?)\\].*?\\((.*?)\\)" options:0 error:0];
+    // the keys are everything up to the last ")", expression indexes have nested parens...
+    
+    NSRegularExpression *regex = [NSRegularExpression regularExpressionWithPattern:@".*?\\[(.*?)\\].*?\\((.*)\\)" options:0 error:0];
     
     NSTextCheckingResult *match = [regex firstMatchInString:sql options:0 range:NSMakeRange(0, sql.length)];
     
@@ -72,15 +129,53 @@
         return nil;
     
     NSString *name = [sql substringWithRange:[match rangeAtIndex:1]];
-    NSString *keys = [sql substringWithRange:[match rangeAtIndex:2]];
+    NSString *keysSql = [sql substringWithRange:[match rangeAtIndex:2]];
+    NTJsonIndexKind kind = ([keysSql rangeOfString:@"json_extract("].location != NSNotFound) ? NTJsonIndexKindExpression : NTJsonIndexKindColumn;
+    NSString *keys = ([keysSql rangeOfString:@"json_extract("].location != NSNotFound || [keysSql rangeOfString:@"COALESCE("].location != NSNotFound) ? [self keysWithExpressionSql:keysSql] : keysSql;
+    
+    NTJsonIndex *index = [[NTJsonIndex alloc] initWithName:name keys:keys isUnique:[name hasPrefix:@"U"] ? YES : NO kind:kind];
+    
+    index->_keysSql = keysSql;
+    
+    return index;
+}
+
+
+-(NSString *)keysSql
+{
+    if ( _keysSql )
+        return _keysSql;
+    
+    if ( _kind != NTJsonIndexKindExpression )
+        return _keys;
+    
+    // replace each [field] with the matching json_extract() expression. This must match the expression used in queries exactly
+    // or SQLITE won't use the index.
+    
+    NSRegularExpression *regex = [NSRegularExpression regularExpressionWithPattern:@"\\[(.+?)\\]" options:0 error:nil];
+    
+    NSMutableString *keysSql = [NSMutableString string];
+    __block NSUInteger start = 0;
+    
+    [regex enumerateMatchesInString:_keys options:0 range:NSMakeRange(0, _keys.length) usingBlock:^(NSTextCheckingResult *result, NSMatchingFlags flags, BOOL *stop) {
+        [keysSql appendString:[_keys substringWithRange:NSMakeRange(start, result.range.location-start)]];
+        
+        NTJsonColumn *column = [NTJsonColumn columnWithName:[_keys substringWithRange:[result rangeAtIndex:1]] kind:NTJsonColumnKindExpression];
+        
+        [keysSql appendString:[column jsonExtractSql]];
+        
+        start = result.range.location + result.range.length;
+    }];
+    
+    [keysSql appendString:[_keys substringFromIndex:start]];
     
-    return [[NTJsonIndex alloc] initWithName:name keys:keys isUnique:[name hasPrefix:@"U"] ? YES : NO];
+    return [keysSql copy];
 }
 
 
 -(NSString *)sqlWithTableName:(NSString *)tableName
 {
-    return [NSString stringWithFormat:@"CREATE %@INDEX [%@] ON [%@] (%@);", (_isUnique) ? @"UNIQUE " : @"", _name, tableName, _keys];
+    return [NSString stringWithFormat:@"CREATE %@INDEX [%@] ON [%@] (%@);", (_isUnique) ? @"UNIQUE " : @"", _name, tableName, [self keysSql]];
 }
 
 
@@ -0,0 +1,29 @@
+//
+//  NTJsonKeyDictionary+Private.h
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/// The master list of keys for a collection using the binary document format. Keys are only ever added, so a key id
+/// is valid forever. This class is thread safe.
+@interface NTJsonKeyDictionary : NSObject
+
+/// an immutable snapshot of all keys, indexed by key id. Safe to use from any thread.
+@property (nonatomic,readonly) NSArray *keys;
+
+/// YES if keys have been added since the last call to keysForSaving.
+@property (nonatomic,readonly) BOOL isDirty;
+
+-(id)initWithKeys:(NSArray *)keys;
+
+-(NSUInteger)idForKey:(NSString *)key;          // adds the key if needed
+-(NSUInteger)existingIdForKey:(NSString *)key;  // NSNotFound if the key doesn't exist
+
+-(NSArray *)keysForSaving;  // returns the keys and clears isDirty
+
+@end
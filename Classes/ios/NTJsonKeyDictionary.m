@@ -0,0 +1,122 @@
+//
+//  NTJsonKeyDictionary.m
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import "NTJsonStore+Private.h"
+
+
+@interface NTJsonKeyDictionary ()
+{
+    NSMutableArray *_keys;
+    NSMutableDictionary *_ids;  // key -> @(id)
+    NSArray *_snapshot;         // nil when it needs to be rebuilt
+    BOOL _isDirty;
+}
+
+@end
+
+
+@implementation NTJsonKeyDictionary
+
+
+-(id)initWithKeys:(NSArray *)keys
+{
+    self = [super init];
+    
+    if ( self )
+    {
+        _keys = [NSMutableArray arrayWithCapacity:keys.count];
+        _ids = [NSMutableDictionary dictionaryWithCapacity:keys.count];
+        
+        for(NSString *key in keys)
+        {
+            _ids[key] = @(_keys.count);
+            [_keys addObject:key];
+        }
+        
+        _snapshot = [_keys copy];
+        _isDirty = NO;
+    }
+    
+    return self;
+}
+
+
+-(id)init
+{
+    return [self initWithKeys:nil];
+}
+
+
+-(NSArray *)keys
+{
+    @synchronized(self)
+    {
+        if ( !_snapshot )
+            _snapshot = [_keys copy];
+        
+        return _snapshot;
+    }
+}
+
+
+-(BOOL)isDirty
+{
+    @synchronized(self)
+    {
+        return _isDirty;
+    }
+}
+
+
+-(NSUInteger)idForKey:(NSString *)key
+{
+    @synchronized(self)
+    {
+        NSNumber *keyId = _ids[key];
+        
+        if ( keyId )
+            return [keyId unsignedIntegerValue];
+        
+        NSUInteger newId = _keys.count;
+        
+        key = [key copy];
+        
+        _ids[key] = @(newId);
+        [_keys addObject:key];
+        
+        _snapshot = nil;
+        _isDirty = YES;
+        
+        return newId;
+    }
+}
+
+
+-(NSUInteger)existingIdForKey:(NSString *)key
+{
+    @synchronized(self)
+    {
+        NSNumber *keyId = _ids[key];
+        
+        return (keyId) ? [keyId unsignedIntegerValue] : NSNotFound;
+    }
+}
+
+
+-(NSArray *)keysForSaving
+{
+    @synchronized(self)
+    {
+        _isDirty = NO;
+        
+        return [_keys copy];
+    }
+}
+
+
+@end
@@ -0,0 +1,24 @@
+//
+//  NTJsonLiveQuery+Private.h
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import "NTJsonLiveQuery.h"
+
+
+typedef void (^NTJsonLiveQueryHandler)(NSArray *items, NTJsonChanges *changes, NSError *error);
+
+
+@interface NTJsonLiveQuery (Private)
+
+-(id)initWithCollection:(NTJsonCollection *)collection where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionQueue:(dispatch_queue_t)completionQueue handler:(NTJsonLiveQueryHandler)handler;
+
+/// these must be called on the collection queue...
+
+-(void)load;
+-(void)applyChanges:(NTJsonChanges *)changes;
+
+@end
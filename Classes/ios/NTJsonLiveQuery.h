@@ -0,0 +1,41 @@
+//
+//  NTJsonLiveQuery.h
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "NTJsonStoreTypes.h"
+#import "NTJsonChanges.h"
+
+
+@class NTJsonCollection;
+
+
+/// The results of a find that are kept up to date as the collection changes. Changed items are tested against the query and
+/// merged into the results, so unchanged items are never read again. Create live queries with -[NTJsonCollection liveQueryWhere:...].
+/// The collection holds the live query until it is stopped.
+@interface NTJsonLiveQuery : NSObject
+
+@property (nonatomic,readonly) NTJsonCollection *collection;
+@property (nonatomic,readonly) NSString *where;
+@property (nonatomic,readonly) NSArray *args;
+@property (nonatomic,readonly) NSString *orderBy;
+@property (nonatomic,readonly) int limit;
+
+/// The current results, nil until they have been loaded. Safe to read from any thread.
+@property (atomic,readonly) NSArray *items;
+
+/// The last error, if any. A live query that fails keeps its previous results and tries again on the next change.
+@property (atomic,readonly) NSError *error;
+
+/// NO once the live query has been stopped.
+@property (atomic,readonly) BOOL isActive;
+
+/// Stops delivering changes and releases the results. Handlers already dispatched may still run.
+-(void)stop;
+
+@end
@@ -0,0 +1,340 @@
+//
+//  NTJsonLiveQuery.m
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import "NTJsonStore+Private.h"
+
+
+@interface NTJsonLiveQuery ()
+{
+    dispatch_queue_t _completionQueue;
+    NTJsonLiveQueryHandler _handler;
+    
+    NSArray *_isDescending;         // for each order by term, the rowid is always the last term
+    
+    BOOL _isLoaded;
+    NSMutableArray *_currentItems;  // only accessed on the collection queue
+    NSMutableArray *_currentKeys;   // the order by values (and rowid) for each item
+}
+
+@property (atomic,readwrite) NSArray *items;
+@property (atomic,readwrite) NSError *error;
+@property (atomic,readwrite) BOOL isActive;
+
+@end
+
+
+@implementation NTJsonLiveQuery
+
+
+-(id)initWithCollection:(NTJsonCollection *)collection where:(NSString *)where args:(NSArray *)args orderBy:(NSString *)orderBy limit:(int)limit completionQueue:(dispatch_queue_t)completionQueue handler:(NTJsonLiveQueryHandler)handler
+{
+    self = [super init];
+    
+    if ( self )
+    {
+        _collection = collection;
+        _where = [where copy];
+        _args = [args copy];
+        _orderBy = [orderBy copy];
+        _limit = MAX(limit, 0);
+        _completionQueue = completionQueue;
+        _handler = [handler copy];
+        
+        NSMutableArray *isDescending = [NSMutableArray array];
+        
+        for(NSArray *term in (orderBy) ? [NTJsonCollection orderByTermsInSql:orderBy] : @[])
+            [isDescending addObject:term[1]];
+        
+        [isDescending addObject:@NO];
+        
+        _isDescending = [isDescending copy];
+        
+        self.isActive = YES;
+    }
+    
+    return self;
+}
+
+
+-(void)stop
+{
+    if ( !self.isActive )
+        return ;
+    
+    self.isActive = NO;
+    
+    [_collection removeLiveQuery:self];
+}
+
+
+#pragma mark - Ordering
+
+
+static int compareTypeOrder(id value)
+{
+    // SQLITE sorts NULLs first, then numbers, text and blobs...
+    
+    if ( !value || value == [NSNull null] )
+        return 0;
+    
+    if ( [value isKindOfClass:[NSNumber class]] )
+        return 1;
+    
+    if ( [value isKindOfClass:[NSString class]] )
+        return 2;
+    
+    return 3;
+}
+
+
+static NSComparisonResult compareValues(id value1, id value2)
+{
+    int type1 = compareTypeOrder(value1);
+    int type2 = compareTypeOrder(value2);
+    
+    if ( type1 != type2 )
+        return (type1 < type2) ? NSOrderedAscending : NSOrderedDescending;
+    
+    switch (type1)
+    {
+        case 1:
+            return [value1 compare:value2];
+        
+        case 2:
+        {
+            int result = strcmp([value1 UTF8String], [value2 UTF8String]);    // BINARY collation
+            return (result < 0) ? NSOrderedAscending : (result > 0) ? NSOrderedDescending : NSOrderedSame;
+        }
+        
+        case 3:
+        {
+            NSData *data1 = value1;
+            NSData *data2 = value2;
+            int result = memcmp(data1.bytes, data2.bytes, MIN(data1.length, data2.length));
+            
+            if ( !result )
+                result = (data1.length < data2.length) ? -1 : (data1.length > data2.length) ? 1 : 0;
+            
+            return (result < 0) ? NSOrderedAscending : (result > 0) ? NSOrderedDescending : NSOrderedSame;
+        }
+        
+        default:
+            return NSOrderedSame;
+    }
+}
+
+
+-(NSComparisonResult)compareKey:(NSArray *)key1 withKey:(NSArray *)key2
+{
+    for(NSUInteger index=0; index<_isDescending.count; index++)
+    {
+        NSComparisonResult result = compareValues(key1[index], key2[index]);
+        
+        if ( result != NSOrderedSame )
+            return ([_isDescending[index] boolValue]) ? -result : result;
+    }
+    
+    return NSOrderedSame;
+}
+
+
+-(NSUInteger)insertionIndexWithKey:(NSArray *)key
+{
+    NSUInteger low = 0;
+    NSUInteger high = _currentKeys.count;
+    
+    while ( low < high )
+    {
+        NSUInteger middle = (low + high) / 2;
+        
+        if ( [self compareKey:_currentKeys[middle] withKey:key] == NSOrderedDescending )
+            high = middle;
+        
+        else
+            low = middle + 1;
+    }
+    
+    return low;
+}
+
+
+#pragma mark - Updating
+
+
+-(void)deliverChanges:(NTJsonChanges *)changes error:(NSError *)error
+{
+    NSArray *items = (error) ? nil : self.items;
+    NTJsonLiveQueryHandler handler = _handler;
+    
+    [_collection dispatchCompletionQueue:_completionQueue completionHandler:^{
+        handler(items, changes, error);
+    }];
+}
+
+
+-(void)failWithError:(NSError *)error
+{
+    // We start over with the next change...
+    
+    _isLoaded = NO;
+    _currentItems = nil;
+    _currentKeys = nil;
+    
+    self.error = error;
+    
+    [self deliverChanges:nil error:error];
+}
+
+
+-(void)load
+{
+    if ( !self.isActive )
+        return ;
+    
+    NSArray *keys;
+    NSError *error;
+    
+    NSArray *items = [_collection _findBatchWhere:_where args:_args orderBy:_orderBy continuation:nil limit:_limit keys:&keys error:&error];
+    
+    if ( !items )
+    {
+        [self failWithError:error];
+        return ;
+    }
+    
+    _currentItems = [items mutableCopy];
+    _currentKeys = [keys mutableCopy];
+    _isLoaded = YES;
+    
+    self.items = [_currentItems copy];
+    self.error = nil;
+    
+    [self deliverChanges:nil error:nil];
+}
+
+
+-(void)applyChanges:(NTJsonChanges *)changes
+{
+    // Removed items are simply dropped. Inserted and updated items are tested against the query in a single SELECT limited to
+    // their rowids and merged into the results in order. With a limit, we only know the results up to the last item we
+    // have, so anything sorting after it is left out and we read more items after our new last item if we end up short.
+    
+    if ( !self.isActive )
+        return ;
+    
+    if ( !_isLoaded )
+    {
+        [self load];
+        return ;
+    }
+    
+    NSSet *previousRowIds = [NSSet setWithArray:[_currentKeys NTJsonStore_transform:^id(NSArray *key) { return key.lastObject; }]];
+    BOOL isWindowFull = (_limit > 0 && _currentItems.count >= _limit);
+    NSArray *boundaryKey = (isWindowFull) ? _currentKeys.lastObject : nil;
+    
+    NSMutableSet *changedRowIds = [changes.insertedRowIds mutableCopy];
+    [changedRowIds unionSet:changes.updatedRowIds];
+    
+    NSMutableSet *droppedRowIds = [changes.removedRowIds mutableCopy];
+    [droppedRowIds unionSet:changedRowIds];   // changed items are added back below if they still match
+    
+    for(NSInteger index=_currentKeys.count-1; index>=0; index--)
+    {
+        if ( [droppedRowIds containsObject:[_currentKeys[index] lastObject]] )
+        {
+            [_currentItems removeObjectAtIndex:index];
+            [_currentKeys removeObjectAtIndex:index];
+        }
+    }
+    
+    if ( changedRowIds.count )
+    {
+        NSData *rowIdsJson = [NSJSONSerialization dataWithJSONObject:[changedRowIds allObjects] options:0 error:nil];
+        NSString *rowIdsWhere = [NSString stringWithFormat:@"[%@] IN (SELECT value FROM json_each(?))", NTJsonRowIdKey];
+        NSString *where = (_where) ? [NSString stringWithFormat:@"%@ AND (%@)", rowIdsWhere, _where] : rowIdsWhere;
+        
+        NSMutableArray *args = [NSMutableArray arrayWithObject:[[NSString alloc] initWithData:rowIdsJson encoding:NSUTF8StringEncoding]];
+        
+        if ( _args )
+            [args addObjectsFromArray:_args];
+        
+        NSArray *keys;
+        NSError *error;
+        
+        NSArray *items = [_collection _findBatchWhere:where args:args orderBy:_orderBy continuation:nil limit:0 keys:&keys error:&error];
+        
+        if ( !items )
+        {
+            [self failWithError:error];
+            return ;
+        }
+        
+        for(NSUInteger index=0; index<items.count; index++)
+        {
+            if ( boundaryKey && [self compareKey:keys[index] withKey:boundaryKey] == NSOrderedDescending )
+                continue;   // past the end of what we know
+            
+            NSUInteger insertIndex = [self insertionIndexWithKey:keys[index]];
+            
+            [_currentItems insertObject:items[index] atIndex:insertIndex];
+            [_currentKeys insertObject:keys[index] atIndex:insertIndex];
+        }
+    }
+    
+    if ( _limit > 0 && _currentItems.count > _limit )
+    {
+        NSRange extra = NSMakeRange(_limit, _currentItems.count - _limit);
+        
+        [_currentItems removeObjectsInRange:extra];
+        [_currentKeys removeObjectsInRange:extra];
+    }
+    
+    if ( isWindowFull && _currentItems.count < _limit )
+    {
+        NSArray *keys;
+        NSError *error;
+        
+        NSArray *items = [_collection _findBatchWhere:_where args:_args orderBy:_orderBy continuation:_currentKeys.lastObject limit:_limit - (int)_currentItems.count keys:&keys error:&error];
+        
+        if ( !items )
+        {
+            [self failWithError:error];
+            return ;
+        }
+        
+        [_currentItems addObjectsFromArray:items];
+        [_currentKeys addObjectsFromArray:keys];
+    }
+    
+    // Report the changes as they apply to our results...
+    
+    NSSet *currentRowIds = [NSSet setWithArray:[_currentKeys NTJsonStore_transform:^id(NSArray *key) { return key.lastObject; }]];
+    
+    NSMutableSet *insertedRowIds = [currentRowIds mutableCopy];
+    [insertedRowIds minusSet:previousRowIds];
+    
+    NSMutableSet *removedRowIds = [previousRowIds mutableCopy];
+    [removedRowIds minusSet:currentRowIds];
+    
+    NSMutableSet *updatedRowIds = [changedRowIds mutableCopy];
+    [updatedRowIds intersectSet:previousRowIds];
+    [updatedRowIds intersectSet:currentRowIds];
+    
+    NTJsonChanges *resultChanges = [[NTJsonChanges alloc] initWithCollection:_collection insertedRowIds:insertedRowIds updatedRowIds:updatedRowIds removedRowIds:removedRowIds];
+    
+    if ( resultChanges.isEmpty )
+        return ;
+    
+    self.items = [_currentItems copy];
+    self.error = nil;
+    
+    [self deliverChanges:resultChanges error:nil];
+}
+
+
+@end
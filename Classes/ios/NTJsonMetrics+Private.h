@@ -0,0 +1,53 @@
+//
+//  NTJsonMetrics+Private.h
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "NTJsonStoreTypes.h"
+
+
+typedef enum
+{
+    NTJsonMetricsCounterPrepareTime,
+    NTJsonMetricsCounterStepTime,
+    NTJsonMetricsCounterDecodeTime,
+    NTJsonMetricsCounterEncodeTime,
+    NTJsonMetricsCounterMaterializationTime,
+    NTJsonMetricsCounterRowsScanned,
+    NTJsonMetricsCounterRowsReturned,
+    
+    NTJsonMetricsCounterCount
+} NTJsonMetricsCounter;
+
+
+/// Collects timings and counters for a collection. When disabled every method returns immediately (now returns 0, which the
+/// other methods ignore), so instrumented code only pays for a flag check. Thread safe, reads on read connections record
+/// in parallel with the collection queue.
+@interface NTJsonMetrics : NSObject
+
+@property (atomic) BOOL isEnabled;
+
+/// queries slower than this (in seconds) are added to the slow query log, 0 disables the log.
+@property (atomic) double slowQueryThreshold;
+
+/// the current time or 0 if metrics are disabled.
+-(CFAbsoluteTime)now;
+
+-(void)addOperation:(NSString *)operation startedAt:(CFAbsoluteTime)startedAt;
+-(void)addQueueWaitQueuedAt:(CFAbsoluteTime)queuedAt;
+-(void)addTimeStartedAt:(CFAbsoluteTime)startedAt toCounter:(NTJsonMetricsCounter)counter;
+-(void)addTime:(double)time toCounter:(NTJsonMetricsCounter)counter;
+-(void)addCount:(int64_t)count toCounter:(NTJsonMetricsCounter)counter;
+
+-(BOOL)isSlowQueryStartedAt:(CFAbsoluteTime)startedAt;
+-(void)addSlowQueryWithSql:(NSString *)sql expandedSql:(NSString *)expandedSql queryPlan:(NSArray *)queryPlan startedAt:(CFAbsoluteTime)startedAt;
+
+-(NSMutableDictionary *)snapshot;
+-(void)reset;
+
+@end
@@ -0,0 +1,267 @@
+//
+//  NTJsonMetrics.m
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import "NTJsonStore+Private.h"
+
+
+static const int HISTOGRAM_BUCKETS = 24;   // bucket n counts times under 2^n microseconds, the last bucket takes everything longer
+static const int MAX_SLOW_QUERIES = 50;
+
+
+@interface NTJsonMetricsHistogram : NSObject
+{
+@public // allow direct access for performance
+    int64_t _count;
+    double _totalTime;
+    double _maxTime;
+    int64_t _buckets[HISTOGRAM_BUCKETS];
+}
+
+@end
+
+
+@implementation NTJsonMetricsHistogram
+
+
+-(void)addTime:(double)time
+{
+    ++_count;
+    _totalTime += time;
+    _maxTime = MAX(_maxTime, time);
+    
+    int bucket = 0;
+    double limit = 0.000001;
+    
+    while ( time >= limit && bucket < HISTOGRAM_BUCKETS-1 )
+    {
+        ++bucket;
+        limit *= 2;
+    }
+    
+    ++_buckets[bucket];
+}
+
+
+-(double)percentile:(double)percentile
+{
+    // returns the upper bound of the bucket the percentile falls in, which is as precise as we can be...
+    
+    int64_t target = (int64_t)ceil(_count * percentile);
+    int64_t total = 0;
+    
+    for(int bucket=0; bucket<HISTOGRAM_BUCKETS; bucket++)
+    {
+        total += _buckets[bucket];
+        
+        if ( total >= target )
+            return MIN(ldexp(0.000001, bucket), _maxTime);
+    }
+    
+    return _maxTime;
+}
+
+
+-(NSDictionary *)snapshot
+{
+    NSMutableArray *buckets = [NSMutableArray arrayWithCapacity:HISTOGRAM_BUCKETS];
+    
+    for(int bucket=0; bucket<HISTOGRAM_BUCKETS; bucket++)
+        [buckets addObject:@(_buckets[bucket])];
+    
+    return @{
+             @"count": @(_count),
+             @"totalTime": @(_totalTime),
+             @"averageTime": @((_count) ? _totalTime / _count : 0),
+             @"maxTime": @(_maxTime),
+             @"p50": @([self percentile:0.50]),
+             @"p95": @([self percentile:0.95]),
+             @"p99": @([self percentile:0.99]),
+             @"histogram": buckets,
+             };
+}
+
+
+@end
+
+
+@interface NTJsonMetrics ()
+{
+    NSMutableDictionary *_operations;   // operation -> NTJsonMetricsHistogram
+    NTJsonMetricsHistogram *_queueWait;
+    double _counters[NTJsonMetricsCounterCount];
+    NSMutableArray *_slowQueries;       // oldest first
+}
+
+@end
+
+
+@implementation NTJsonMetrics
+
+
+-(id)init
+{
+    self = [super init];
+    
+    if ( self )
+    {
+        _operations = [NSMutableDictionary dictionary];
+        _queueWait = [[NTJsonMetricsHistogram alloc] init];
+        _slowQueries = [NSMutableArray array];
+    }
+    
+    return self;
+}
+
+
+-(CFAbsoluteTime)now
+{
+    return (self.isEnabled) ? CFAbsoluteTimeGetCurrent() : 0;
+}
+
+
+-(void)addOperation:(NSString *)operation startedAt:(CFAbsoluteTime)startedAt
+{
+    if ( !startedAt )
+        return ;
+    
+    double time = CFAbsoluteTimeGetCurrent() - startedAt;
+    
+    @synchronized(self)
+    {
+        NTJsonMetricsHistogram *histogram = _operations[operation];
+        
+        if ( !histogram )
+        {
+            histogram = [[NTJsonMetricsHistogram alloc] init];
+            _operations[operation] = histogram;
+        }
+        
+        [histogram addTime:time];
+    }
+}
+
+
+-(void)addQueueWaitQueuedAt:(CFAbsoluteTime)queuedAt
+{
+    if ( !queuedAt )
+        return ;
+    
+    double time = CFAbsoluteTimeGetCurrent() - queuedAt;
+    
+    @synchronized(self)
+    {
+        [_queueWait addTime:time];
+    }
+}
+
+
+-(void)addTimeStartedAt:(CFAbsoluteTime)startedAt toCounter:(NTJsonMetricsCounter)counter
+{
+    if ( !startedAt )
+        return ;
+    
+    double time = CFAbsoluteTimeGetCurrent() - startedAt;
+    
+    @synchronized(self)
+    {
+        _counters[counter] += time;
+    }
+}
+
+
+-(void)addTime:(double)time toCounter:(NTJsonMetricsCounter)counter
+{
+    if ( !self.isEnabled )
+        return ;
+    
+    @synchronized(self)
+    {
+        _counters[counter] += time;
+    }
+}
+
+
+-(void)addCount:(int64_t)count toCounter:(NTJsonMetricsCounter)counter
+{
+    if ( !self.isEnabled )
+        return ;
+    
+    @synchronized(self)
+    {
+        _counters[counter] += count;
+    }
+}
+
+
+-(BOOL)isSlowQueryStartedAt:(CFAbsoluteTime)startedAt
+{
+    double slowQueryThreshold = self.slowQueryThreshold;
+    
+    return (startedAt && slowQueryThreshold > 0 && CFAbsoluteTimeGetCurrent() - startedAt >= slowQueryThreshold) ? YES : NO;
+}
+
+
+-(void)addSlowQueryWithSql:(NSString *)sql expandedSql:(NSString *)expandedSql queryPlan:(NSArray *)queryPlan startedAt:(CFAbsoluteTime)startedAt
+{
+    NSDictionary *slowQuery = @{
+                                @"sql": sql ?: @"",
+                                @"expandedSql": expandedSql ?: sql ?: @"",
+                                @"queryPlan": queryPlan ?: @[],
+                                @"time": @(CFAbsoluteTimeGetCurrent() - startedAt),
+                                @"date": [NSDate date],
+                                };
+    
+    @synchronized(self)
+    {
+        [_slowQueries addObject:slowQuery];
+        
+        if ( _slowQueries.count > MAX_SLOW_QUERIES )
+            [_slowQueries removeObjectAtIndex:0];
+    }
+}
+
+
+-(NSMutableDictionary *)snapshot
+{
+    @synchronized(self)
+    {
+        NSMutableDictionary *operations = [NSMutableDictionary dictionaryWithCapacity:_operations.count];
+        
+        for(NSString *operation in _operations)
+            operations[operation] = [_operations[operation] snapshot];
+        
+        return [@{
+                  @"enabled": @(self.isEnabled),
+                  @"operations": operations,
+                  @"queueWait": [_queueWait snapshot],
+                  @"prepareTime": @(_counters[NTJsonMetricsCounterPrepareTime]),
+                  @"stepTime": @(_counters[NTJsonMetricsCounterStepTime]),
+                  @"decodeTime": @(_counters[NTJsonMetricsCounterDecodeTime]),
+                  @"encodeTime": @(_counters[NTJsonMetricsCounterEncodeTime]),
+                  @"materializationTime": @(_counters[NTJsonMetricsCounterMaterializationTime]),
+                  @"rowsScanned": @((int64_t)_counters[NTJsonMetricsCounterRowsScanned]),
+                  @"rowsReturned": @((int64_t)_counters[NTJsonMetricsCounterRowsReturned]),
+                  @"slowQueries": [_slowQueries copy],
+                  } mutableCopy];
+    }
+}
+
+
+-(void)reset
+{
+    @synchronized(self)
+    {
+        [_operations removeAllObjects];
+        _queueWait = [[NTJsonMetricsHistogram alloc] init];
+        memset(_counters, 0, sizeof(_counters));
+        [_slowQueries removeAllObjects];
+    }
+}
+
+
+@end
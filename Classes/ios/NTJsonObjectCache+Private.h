@@ -13,6 +13,7 @@
 
 @class NTJsonObjectCache;
 @class NTJsonDictionary;
+@class NTJsonKeyDictionary;
 
 
 @interface NTJsonObjectCacheItem : NSObject
@@ -20,45 +21,79 @@
 @public // allow direct access for performance
     NTJsonObjectCache __weak *_cache;
     NTJsonRowId _rowId;
-    NSDictionary *_json;
+    NSDictionary *_json;    // nil until decoded for lazy items
     
     BOOL _isInUse;
     
+    BOOL _isLazy;           // lazy items are decoded on demand from _data, access is synchronized
+    NSData *_data;
+    NTJsonKeyDictionary *_keyDictionary;
+    NSDictionary *_rowValues;   // top-level values read from materialized columns, answered without decoding
+    NSMutableDictionary *_partialJson;  // top-level values decoded individually (binary documents only)
+    
     NTJsonDictionary __weak *_proxyObject;
+    
+    NSUInteger _cost;       // approximate size in bytes (the encoded document size)
+    NTJsonObjectCacheItem __unsafe_unretained *_lruPrev;    // LRU links, only valid while cached (not in use)
+    NTJsonObjectCacheItem __unsafe_unretained *_lruNext;
 }
 
 @property (nonatomic,readwrite,weak) NTJsonObjectCache *cache;
 @property (nonatomic,readonly) NTJsonRowId rowId;
-@property (nonatomic,readonly) NSDictionary *json;
+@property (nonatomic,readonly) NSDictionary *json;  // decodes lazy items
+@property (nonatomic,readonly) NSDictionary *jsonIfDecoded;
 
 @property (nonatomic,readwrite) BOOL isInUse;
 
 @property (nonatomic,readonly) NTJsonDictionary *proxyObject;
 
 -(id)initWithCache:(NTJsonObjectCache *)cache rowId:(NTJsonRowId)rowId json:(NSDictionary *)json;
+-(id)initWithCache:(NTJsonObjectCache *)cache rowId:(NTJsonRowId)rowId data:(NSData *)data keyDictionary:(NTJsonKeyDictionary *)keyDictionary rowValues:(NSDictionary *)rowValues;
+
+-(id)objectForKey:(id)key;
 
 @end
 
 
+/// Tracks items in use by the application and keeps an LRU of recently used items, limited by both cacheSize and cacheByteLimit.
+/// Lookups, adds and evictions are all O(1). The LRU is flushed when the application receives a memory warning.
+/// All methods are thread safe, finds on read connections use the cache in parallel with the collection queue.
 @interface NTJsonObjectCache : NSObject
-{
-    NSMutableDictionary *_items;
-    NSMutableArray *_cachedItems;
-    dispatch_queue_t _deallocQueue;
-}
-
 
+/// the maximum number of unused items to keep.
 @property (nonatomic) int cacheSize;
 
+/// the maximum approximate size in bytes of the unused items to keep, 0 for no limit.
+@property (nonatomic) NSUInteger cacheByteLimit;
+
+@property (nonatomic,readonly) int cachedCount;
+@property (nonatomic,readonly) NSUInteger cachedBytes;
+
+/// lookups with jsonWithRowId:, for metrics.
+@property (nonatomic,readonly) int hits;
+@property (nonatomic,readonly) int misses;
+
+/// incremented by every add and remove made by the collection queue. Reads on another connection capture it first and only
+/// cache what they read if it hasn't changed.
+@property (nonatomic,readonly) int generation;
+
 -(id)initWithCacheSize:(int)cacheSize deallocQueue:(dispatch_queue_t)deallocQueue;
 -(id)initWithDeallocQueue:(dispatch_queue_t)deallocQueue;
 
 -(NSDictionary *)jsonWithRowId:(NTJsonRowId)rowId;
--(id)addJson:(NSDictionary *)json withRowId:(NTJsonRowId)rowId;
+-(NSDictionary *)peekJsonWithRowId:(NTJsonRowId)rowId;
+-(id)addJson:(NSDictionary *)json cost:(NSUInteger)cost withRowId:(NTJsonRowId)rowId;
+-(id)addData:(NSData *)data keyDictionary:(NTJsonKeyDictionary *)keyDictionary rowValues:(NSDictionary *)rowValues withRowId:(NTJsonRowId)rowId;
 -(void)removeObjectWithRowId:(NTJsonRowId)rowId;
 
+/// For rows read on any connection - never replaces a cached item (that one is returned instead) and returns nil without adding
+/// anything if the generation changed since the read began.
+-(id)addJson:(NSDictionary *)json cost:(NSUInteger)cost withRowId:(NTJsonRowId)rowId generation:(int)generation;
+-(id)addData:(NSData *)data keyDictionary:(NTJsonKeyDictionary *)keyDictionary rowValues:(NSDictionary *)rowValues withRowId:(NTJsonRowId)rowId generation:(int)generation;
+
 -(void)flush;
 -(void)removeAll;
+-(void)resetStatistics;
 
 -(void)proxyDeallocedForCacheItem:(NTJsonObjectCacheItem *)cacheItem;
 
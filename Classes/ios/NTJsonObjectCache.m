@@ -22,6 +22,8 @@
 
 
 static const int DEFAULT_CACHE_SIZE = 50;
+static const NSUInteger DEFAULT_CACHE_BYTE_LIMIT = 4 * 1024 * 1024;
+static const NSUInteger INITIAL_SLOT_COUNT = 64;
 
 
 
@@ -61,12 +63,182 @@ static const int DEFAULT_CACHE_SIZE = 50;
 }
 
 
+-(id)initWithCache:(NTJsonObjectCache *)cache rowId:(NTJsonRowId)rowId data:(NSData *)data keyDictionary:(NTJsonKeyDictionary *)keyDictionary rowValues:(NSDictionary *)rowValues
+{
+    self = [self initWithCache:cache rowId:rowId json:nil];
+    
+    if ( self )
+    {
+        _isLazy = YES;
+        _data = data;
+        _keyDictionary = keyDictionary;
+        _rowValues = rowValues;
+    }
+    
+    return self;
+}
+
+
+-(void)decode
+{
+    // must be called while synchronized...
+    
+    NSError *error;
+    NSDictionary *json;
+    
+    if ( [NTJsonBinaryCoder isBinaryBytes:_data.bytes length:_data.length] )
+        json = [NTJsonBinaryCoder jsonWithBytes:_data.bytes length:_data.length keys:_keyDictionary.keys error:&error];
+    
+    else
+        json = [NSJSONSerialization JSONObjectWithData:_data options:0 error:&error];
+    
+    if ( ![json isKindOfClass:[NSDictionary class]] )
+    {
+        // We are past the point of returning an error, so the best we can do is return what we know...
+        
+        LOG_ERROR(@"Unable to decode document %lld - %@", _rowId, error.localizedDescription);
+        json = _rowValues ?: [NSDictionary dictionary];
+    }
+    
+    // Make sure __rowid__ is valid and correct.
+    
+    if ( ![json[NTJsonRowIdKey] isEqual:@(_rowId)] )
+    {
+        NSMutableDictionary *mutableJson = [json mutableCopy];
+        mutableJson[NTJsonRowIdKey] = @(_rowId);
+        json = [mutableJson copy];
+    }
+    
+    _json = json;
+    
+    _data = nil;
+    _keyDictionary = nil;
+    _rowValues = nil;
+    _partialJson = nil;
+}
+
+
+-(NSDictionary *)json
+{
+    if ( !_isLazy )
+        return _json;
+    
+    @synchronized(self)
+    {
+        if ( !_json )
+            [self decode];
+        
+        return _json;
+    }
+}
+
+
+-(NSDictionary *)jsonIfDecoded
+{
+    if ( !_isLazy )
+        return _json;
+    
+    @synchronized(self)
+    {
+        return _json;
+    }
+}
+
+
+-(id)objectForKey:(id)key
+{
+    if ( !_isLazy )
+        return [_json objectForKey:key];
+    
+    @synchronized(self)
+    {
+        if ( _json )
+            return [_json objectForKey:key];
+        
+        if ( [key isEqual:NTJsonRowIdKey] )
+            return @(_rowId);
+        
+        // scalars that were selected along with the document don't need any decoding at all...
+        
+        id value = _rowValues[key];
+        
+        if ( value )
+            return value;
+        
+        // binary documents let us decode just the value we are interested in...
+        
+        if ( [key isKindOfClass:[NSString class]] && [NTJsonBinaryCoder isBinaryBytes:_data.bytes length:_data.length] )
+        {
+            value = _partialJson[key];
+            
+            if ( !value )
+            {
+                value = [NTJsonBinaryCoder valueForKey:key inBytes:_data.bytes length:_data.length keyDictionary:_keyDictionary];
+                
+                if ( value )
+                {
+                    if ( !_partialJson )
+                        _partialJson = [NSMutableDictionary dictionary];
+                    
+                    _partialJson[key] = value;
+                }
+            }
+            
+            return value;
+        }
+        
+        [self decode];
+        
+        return [_json objectForKey:key];
+    }
+}
+
+
 @end
 
 
 #pragma mark - NTJsonObjectCache
 
 
+typedef struct
+{
+    NTJsonRowId rowId;
+    void *item;     // retained NTJsonObjectCacheItem, NULL if the slot is empty
+} NTJsonObjectCacheSlot;
+
+
+static inline NSUInteger NTJsonObjectCache_slotIndex(NTJsonRowId rowId, NSUInteger mask)
+{
+    // rowids are sequential, so mix the bits up a little before masking...
+    
+    uint64_t hash = (uint64_t)rowId * 0x9E3779B97F4A7C15ULL;
+    
+    return (NSUInteger)(hash ^ (hash >> 32)) & mask;
+}
+
+
+@interface NTJsonObjectCache ()
+{
+    dispatch_queue_t _deallocQueue;
+    id _memoryWarningObserver;
+    
+    // open addressing hash table of every item (in use or cached) by rowid, linear probing...
+    
+    NTJsonObjectCacheSlot *_slots;
+    NSUInteger _slotCount;      // always a power of 2
+    NSUInteger _itemCount;
+    
+    // the LRU of cached (not in use) items, oldest first...
+    
+    NTJsonObjectCacheItem __unsafe_unretained *_lruHead;
+    NTJsonObjectCacheItem __unsafe_unretained *_lruTail;
+    
+    int _generation;
+}
+
+@end
+
+
 @implementation NTJsonObjectCache
 
 
@@ -77,9 +249,20 @@ static const int DEFAULT_CACHE_SIZE = 50;
     if ( self )
     {
         _cacheSize = cacheSize;
-        _items = [NSMutableDictionary dictionary];
-        _cachedItems = [NSMutableArray array];
+        _cacheByteLimit = DEFAULT_CACHE_BYTE_LIMIT;
         _deallocQueue = deallocQueue;
+        
+        _slotCount = INITIAL_SLOT_COUNT;
+        _slots = calloc(_slotCount, sizeof(NTJsonObjectCacheSlot));
+        
+        // The string is the value of UIApplicationDidReceiveMemoryWarningNotification, so we don't need to link UIKit...
+        
+        __weak NTJsonObjectCache *weakSelf = self;
+        
+        _memoryWarningObserver = [[NSNotificationCenter defaultCenter] addObserverForName:@"UIApplicationDidReceiveMemoryWarningNotification" object:nil queue:nil usingBlock:^(NSNotification *notification) {
+            CACHE_LOG(@"Memory warning - flushing");
+            [weakSelf flush];
+        }];
     }
     
     return self;
@@ -92,104 +275,388 @@ static const int DEFAULT_CACHE_SIZE = 50;
 }
 
 
--(void)setCacheSize:(int)cacheSize
+-(void)dealloc
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:_memoryWarningObserver];
+    
+    [self removeAll];
+    
+    free(_slots);
+}
+
+
+#pragma mark - Hash Table
+
+
+-(NTJsonObjectCacheItem *)itemWithRowId:(NTJsonRowId)rowId
 {
-    if ( cacheSize == _cacheSize )
+    NSUInteger mask = _slotCount - 1;
+    
+    for(NSUInteger index=NTJsonObjectCache_slotIndex(rowId, mask); _slots[index].item; index=(index+1) & mask)
+    {
+        if ( _slots[index].rowId == rowId )
+            return (__bridge NTJsonObjectCacheItem *)_slots[index].item;
+    }
+    
+    return nil;
+}
+
+
+-(void)insertSlot:(NTJsonObjectCacheSlot)slot intoSlots:(NTJsonObjectCacheSlot *)slots count:(NSUInteger)slotCount
+{
+    NSUInteger mask = slotCount - 1;
+    NSUInteger index = NTJsonObjectCache_slotIndex(slot.rowId, mask);
+    
+    while ( slots[index].item )
+        index = (index+1) & mask;
+    
+    slots[index] = slot;
+}
+
+
+-(void)setItem:(NTJsonObjectCacheItem *)item
+{
+    // the rowid must not already be present. Grows at 75% full...
+    
+    if ( (_itemCount+1) * 4 > _slotCount * 3 )
+    {
+        NSUInteger slotCount = _slotCount * 2;
+        NTJsonObjectCacheSlot *slots = calloc(slotCount, sizeof(NTJsonObjectCacheSlot));
+        
+        for(NSUInteger index=0; index<_slotCount; index++)
+        {
+            if ( _slots[index].item )
+                [self insertSlot:_slots[index] intoSlots:slots count:slotCount];
+        }
+        
+        free(_slots);
+        _slots = slots;
+        _slotCount = slotCount;
+    }
+    
+    [self insertSlot:(NTJsonObjectCacheSlot){ item->_rowId, (void *)CFBridgingRetain(item) } intoSlots:_slots count:_slotCount];
+    ++_itemCount;
+}
+
+
+-(void)removeItemWithRowId:(NTJsonRowId)rowId
+{
+    NSUInteger mask = _slotCount - 1;
+    NSUInteger index = NTJsonObjectCache_slotIndex(rowId, mask);
+    
+    while ( _slots[index].item && _slots[index].rowId != rowId )
+        index = (index+1) & mask;
+    
+    if ( !_slots[index].item )
         return ;
     
-    _cacheSize = cacheSize;
+    CFBridgingRelease(_slots[index].item);
+    _slots[index].item = NULL;
+    --_itemCount;
     
-    [self purgeCacheWithFlushAll:NO];
+    // shift any following entries back so lookups never stop at the gap we just made...
+    
+    for(NSUInteger next=(index+1) & mask; _slots[next].item; next=(next+1) & mask)
+    {
+        NSUInteger home = NTJsonObjectCache_slotIndex(_slots[next].rowId, mask);
+        
+        BOOL canMove = (index <= next) ? (home <= index || home > next) : (home <= index && home > next);
+        
+        if ( canMove )
+        {
+            _slots[index] = _slots[next];
+            _slots[next].item = NULL;
+            index = next;
+        }
+    }
 }
 
 
--(void)proxyDeallocedForCacheItem:(NTJsonObjectCacheItem *)cacheItem
+#pragma mark - LRU
+
+
+-(void)lruAppendItem:(NTJsonObjectCacheItem *)item
 {
-    dispatch_async(_deallocQueue, ^{
-        CACHE_LOG(@"Caching - %d", (int)cacheItem.rowId);
+    item->_lruPrev = _lruTail;
+    item->_lruNext = nil;
+    
+    if ( _lruTail )
+        _lruTail->_lruNext = item;
+    else
+        _lruHead = item;
+    
+    _lruTail = item;
+    
+    ++_cachedCount;
+    _cachedBytes += item->_cost;
+}
+
+
+-(void)lruRemoveItem:(NTJsonObjectCacheItem *)item
+{
+    if ( item->_lruPrev )
+        item->_lruPrev->_lruNext = item->_lruNext;
+    else
+        _lruHead = item->_lruNext;
+    
+    if ( item->_lruNext )
+        item->_lruNext->_lruPrev = item->_lruPrev;
+    else
+        _lruTail = item->_lruPrev;
+    
+    item->_lruPrev = nil;
+    item->_lruNext = nil;
+    
+    --_cachedCount;
+    _cachedBytes -= item->_cost;
+}
+
+
+#pragma mark - Cache
 
-        cacheItem.isInUse = NO;
-        [_cachedItems addObject:cacheItem]; // newest are at end of the list.
 
-        if ( !_cachedItems.count > _cacheSize )
+-(void)setCacheSize:(int)cacheSize
+{
+    @synchronized(self)
+    {
+        if ( cacheSize == _cacheSize )
+            return ;
+        
+        _cacheSize = cacheSize;
+        
+        [self purgeCacheWithFlushAll:NO];
+    }
+}
+
+
+-(void)setCacheByteLimit:(NSUInteger)cacheByteLimit
+{
+    @synchronized(self)
+    {
+        if ( cacheByteLimit == _cacheByteLimit )
+            return ;
+        
+        _cacheByteLimit = cacheByteLimit;
+        
+        [self purgeCacheWithFlushAll:NO];
+    }
+}
+
+
+-(void)proxyDeallocedForCacheItem:(NTJsonObjectCacheItem *)cacheItem
+{
+    dispatch_async(_deallocQueue, ^{
+        @synchronized(self)
+        {
+            // The item may have been removed or handed out again since the proxy went away...
+            
+            if ( cacheItem->_cache != self || !cacheItem->_isInUse || cacheItem->_proxyObject )
+                return ;
+            
+            CACHE_LOG(@"Caching - %d", (int)cacheItem.rowId);
+            
+            cacheItem->_isInUse = NO;
+            [self lruAppendItem:cacheItem]; // newest are at end of the list.
+            
             [self purgeCacheWithFlushAll:NO];
+        }
     });
 }
 
 
 -(NSDictionary *)jsonWithRowId:(NTJsonRowId)rowId
 {
-    NTJsonObjectCacheItem *item = _items[@(rowId)];
-    
-    if ( !item )
+    @synchronized(self)
     {
-        CACHE_LOG(@"Cache miss - %d", (int)rowId);
-        return nil;
+        NTJsonObjectCacheItem *item = [self itemWithRowId:rowId];
+        
+        if ( !item )
+        {
+            CACHE_LOG(@"Cache miss - %d", (int)rowId);
+            ++_misses;
+            return nil;
+        }
+        
+        ++_hits;
+        
+        if ( !item->_isInUse )
+        {
+            CACHE_LOG(@"Cache Hit (not in use) - %d", (int)rowId);
+            // coming back into action!
+            item->_isInUse = YES;
+            [self lruRemoveItem:item];    // it is no longer in our cache, since it's active
+        }
+        else
+        {
+            CACHE_LOG(@"Cache Hit (already in use) - %d", (int)rowId);
+        }
+        
+        return item.proxyObject;
     }
+}
+
+
+-(NSDictionary *)peekJsonWithRowId:(NTJsonRowId)rowId
+{
+    // returns the raw JSON without marking the item as in use or changing its LRU position. For internal use.
     
-    if ( !item.isInUse )
+    @synchronized(self)
     {
-        CACHE_LOG(@"Cache Hit (not in use) - %d", (int)rowId);
-        // coming back into action!
-        item.isInUse = YES;
-        [_cachedItems removeObjectIdenticalTo:item];    // it is no longer in our cache, since it's active
+        return [self itemWithRowId:rowId].jsonIfDecoded;
     }
-    else
+}
+
+
+-(int)generation
+{
+    @synchronized(self)
+    {
+        return _generation;
+    }
+}
+
+
+-(id)addItem:(NTJsonObjectCacheItem *)item
+{
+    // must be called while synchronized...
+    
+    NTJsonObjectCacheItem *currentItem = [self itemWithRowId:item->_rowId];
+    
+    if ( currentItem )
+        [self removeCacheItem:currentItem];
+    
+    [self setItem:item];
+    item->_isInUse = YES;
+    
+    ++_generation;
+    
+    return item.proxyObject;
+}
+
+
+-(id)addItem:(NTJsonObjectCacheItem *)item generation:(int)generation
+{
+    // must be called while synchronized. The item may have been read from an older snapshot than what's cached (or
+    // what was removed since the read began), so it never replaces anything...
+    
+    NTJsonObjectCacheItem *currentItem = [self itemWithRowId:item->_rowId];
+    
+    if ( currentItem )
     {
-        CACHE_LOG(@"Cache Hit (already in use) - %d", (int)rowId);
+        if ( !currentItem->_isInUse )
+        {
+            currentItem->_isInUse = YES;
+            [self lruRemoveItem:currentItem];
+        }
+        
+        return currentItem.proxyObject;
     }
     
+    if ( generation != _generation )
+        return nil;
+    
+    [self setItem:item];
+    item->_isInUse = YES;
+    
     return item.proxyObject;
 }
 
 
--(NSDictionary *)addJson:(NSDictionary *)json withRowId:(NTJsonRowId)rowId
+-(NSDictionary *)addJson:(NSDictionary *)json cost:(NSUInteger)cost withRowId:(NTJsonRowId)rowId
 {
     CACHE_LOG(@"adding - %d", (int)rowId);
+    
+    NTJsonObjectCacheItem *item = [[NTJsonObjectCacheItem alloc] initWithCache:self rowId:rowId json:json];
+    
+    item->_cost = cost;
+    
+    @synchronized(self)
+    {
+        return [self addItem:item];
+    }
+}
+
 
-    NTJsonObjectCacheItem *currentItem = _items[@(rowId)];
+-(id)addData:(NSData *)data keyDictionary:(NTJsonKeyDictionary *)keyDictionary rowValues:(NSDictionary *)rowValues withRowId:(NTJsonRowId)rowId
+{
+    CACHE_LOG(@"adding lazy - %d", (int)rowId);
     
-    if ( currentItem )
+    NTJsonObjectCacheItem *item = [[NTJsonObjectCacheItem alloc] initWithCache:self rowId:rowId data:data keyDictionary:keyDictionary rowValues:rowValues];
+    
+    item->_cost = data.length;
+    
+    @synchronized(self)
     {
-        [self removeCacheItem:currentItem];
-        currentItem = nil;
+        return [self addItem:item];
     }
+}
+
+
+-(id)addJson:(NSDictionary *)json cost:(NSUInteger)cost withRowId:(NTJsonRowId)rowId generation:(int)generation
+{
+    CACHE_LOG(@"adding read - %d", (int)rowId);
     
     NTJsonObjectCacheItem *item = [[NTJsonObjectCacheItem alloc] initWithCache:self rowId:rowId json:json];
     
-    _items[@(rowId)] = item;
-    item.isInUse = YES;
+    item->_cost = cost;
     
-    return item.proxyObject;
+    @synchronized(self)
+    {
+        return [self addItem:item generation:generation];
+    }
+}
+
+
+-(id)addData:(NSData *)data keyDictionary:(NTJsonKeyDictionary *)keyDictionary rowValues:(NSDictionary *)rowValues withRowId:(NTJsonRowId)rowId generation:(int)generation
+{
+    CACHE_LOG(@"adding lazy read - %d", (int)rowId);
+    
+    NTJsonObjectCacheItem *item = [[NTJsonObjectCacheItem alloc] initWithCache:self rowId:rowId data:data keyDictionary:keyDictionary rowValues:rowValues];
+    
+    item->_cost = data.length;
+    
+    @synchronized(self)
+    {
+        return [self addItem:item generation:generation];
+    }
 }
 
 
 -(void)removeCacheItem:(NTJsonObjectCacheItem *)item
 {
     item.cache = nil;   // unlink from cache so proxyDeallocedForCacheItem: will not be called
-    [_cachedItems removeObjectIdenticalTo:item];
-    [_items removeObjectForKey:@(item.rowId)];
+    
+    if ( !item->_isInUse )
+        [self lruRemoveItem:item];
+    
+    [self removeItemWithRowId:item->_rowId];    // releases the item, must be last
 }
 
 
 -(void)removeObjectWithRowId:(NTJsonRowId)rowId
 {
-    NTJsonObjectCacheItem *item = _items[@(rowId)];
-    
-    if ( item )
-        [self removeCacheItem:item];
+    @synchronized(self)
+    {
+        NTJsonObjectCacheItem *item = [self itemWithRowId:rowId];
+        
+        if ( item )
+            [self removeCacheItem:item];
+        
+        ++_generation;
+    }
 }
 
 
 -(void)purgeCacheWithFlushAll:(BOOL)flushAll
 {
-    int cacheSize = (flushAll) ? 0 : _cacheSize;
+    int cacheSize = (flushAll) ? 0 : MAX(_cacheSize, 0);
+    NSUInteger cacheByteLimit = (flushAll) ? 0 : _cacheByteLimit;
     
-    // clear any unused values from the cache...
+    // clear the oldest unused values until we are within both limits...
     
-    while (_cachedItems.count > cacheSize )
+    while ( _lruHead && (_cachedCount > cacheSize || (cacheByteLimit && _cachedBytes > cacheByteLimit)) )
     {
-        NTJsonObjectCacheItem *item = _cachedItems[0];  // grab oldest...
+        NTJsonObjectCacheItem *item = _lruHead;  // grab oldest...
         
         CACHE_LOG(@"purging - %d", (int)item.rowId);
         
@@ -202,14 +669,45 @@ static const int DEFAULT_CACHE_SIZE = 50;
 
 -(void)flush
 {
-    [self purgeCacheWithFlushAll:YES];
+    @synchronized(self)
+    {
+        [self purgeCacheWithFlushAll:YES];
+    }
+}
+
+
+-(void)resetStatistics
+{
+    @synchronized(self)
+    {
+        _hits = 0;
+        _misses = 0;
+    }
 }
 
 
 -(void)removeAll
 {
-    for(NTJsonObjectCacheItem *item in _items.allValues)
-        [self removeCacheItem:item];
+    @synchronized(self)
+    {
+        for(NSUInteger index=0; index<_slotCount; index++)
+        {
+            if ( _slots[index].item )
+            {
+                NTJsonObjectCacheItem *item = CFBridgingRelease(_slots[index].item);
+                
+                item->_cache = nil;
+                _slots[index].item = NULL;
+            }
+        }
+        
+        _itemCount = 0;
+        _lruHead = nil;
+        _lruTail = nil;
+        _cachedCount = 0;
+        _cachedBytes = 0;
+        ++_generation;
+    }
 }
 
 
@@ -0,0 +1,50 @@
+//
+//  NTJsonQueryCache+Private.h
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "NTJsonStoreTypes.h"
+
+
+/// Caches the results of find (as an array of rowids) and count queries, keyed by the final SQL and args. Entries remember the
+/// columns their query references so updates only evict the queries they could affect. Must only be accessed on the collection queue.
+@interface NTJsonQueryCache : NSObject
+
+/// Maximum number of queries to cache, 0 disables the cache.
+@property (nonatomic) int cacheSize;
+
+/// find results with more rows than this are not cached.
+@property (nonatomic) int maxRows;
+
+@property (nonatomic,readonly) int hits;
+@property (nonatomic,readonly) int misses;
+
+/// Incremented every time anything is invalidated. Results computed off the collection queue are only added if this hasn't changed.
+@property (nonatomic,readonly) int generation;
+
+-(id)initWithCacheSize:(int)cacheSize maxRows:(int)maxRows;
+
++(NSString *)keyWithSql:(NSString *)sql args:(NSArray *)args;
++(NSSet *)columnNamesInSql:(NSString *)sql;
+
+-(NSArray *)rowidsWithKey:(NSString *)key;  // doesn't count as a hit or miss, the caller reports that with recordHit:
+-(NSNumber *)countWithKey:(NSString *)key;
+
+-(void)recordHit:(BOOL)hit;
+
+-(void)addRowids:(NSArray *)rowids columnNames:(NSSet *)columnNames withKey:(NSString *)key;
+-(void)addCount:(int)count columnNames:(NSSet *)columnNames withKey:(NSString *)key;
+
+-(void)invalidateForInsert;
+-(void)invalidateForRemoveWithRowId:(NTJsonRowId)rowid;
+-(void)invalidateForUpdateWithChangedColumnNames:(NSSet *)changedColumnNames;   // nil = any column may have changed
+
+-(void)removeObjectWithKey:(NSString *)key;
+-(void)removeAll;
+
+@end
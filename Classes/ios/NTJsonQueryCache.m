@@ -0,0 +1,325 @@
+//
+//  NTJsonQueryCache.m
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import "NTJsonStore+Private.h"
+
+
+@interface NTJsonQueryCacheEntry : NSObject
+{
+@public // allow direct access for performance
+    NSString *_key;
+    NSArray *_rowids;       // find results, nil for counts
+    NSSet *_rowidSet;
+    NSNumber *_count;       // count results, nil for finds
+    NSSet *_columnNames;    // nil = references the document directly
+    
+    NTJsonQueryCacheEntry __unsafe_unretained *_lruPrev;    // retained by _entries
+    NTJsonQueryCacheEntry __unsafe_unretained *_lruNext;
+}
+
+@end
+
+
+@implementation NTJsonQueryCacheEntry
+
+@end
+
+
+@interface NTJsonQueryCache ()
+{
+    NSMutableDictionary *_entries;  // key -> NTJsonQueryCacheEntry
+    NTJsonQueryCacheEntry __unsafe_unretained *_lruHead;    // oldest
+    NTJsonQueryCacheEntry __unsafe_unretained *_lruTail;
+}
+
+@end
+
+
+@implementation NTJsonQueryCache
+
+
+-(id)initWithCacheSize:(int)cacheSize maxRows:(int)maxRows
+{
+    self = [super init];
+    
+    if ( self )
+    {
+        _cacheSize = cacheSize;
+        _maxRows = maxRows;
+        _entries = [NSMutableDictionary dictionary];
+    }
+    
+    return self;
+}
+
+
+-(void)setCacheSize:(int)cacheSize
+{
+    _cacheSize = MAX(cacheSize, 0);
+    
+    [self purge];
+}
+
+
++(NSString *)keyWithSql:(NSString *)sql args:(NSArray *)args
+{
+    if ( !args.count )
+        return sql;
+    
+    // Args are tagged with their type so 1 and '1' are different queries...
+    
+    NSMutableString *key = [NSMutableString stringWithString:sql];
+    
+    for(id arg in args)
+    {
+        if ( [arg isKindOfClass:[NSString class]] )
+            [key appendFormat:@"\x1Fs:%@", arg];
+        
+        else if ( [arg isKindOfClass:[NSNumber class]] )
+            [key appendFormat:@"\x1Fn:%s:%@", [arg objCType], arg];
+        
+        else if ( [arg isKindOfClass:[NSData class]] )
+            [key appendFormat:@"\x1Fd:%@", [arg base64EncodedStringWithOptions:0]];
+        
+        else if ( arg == [NSNull null] )
+            [key appendString:@"\x1Fnull"];
+        
+        else
+            return nil; // not something we know how to cache
+    }
+    
+    return key;
+}
+
+
++(NSSet *)columnNamesInSql:(NSString *)sql
+{
+    if ( !sql.length )
+        return [NSSet set];
+    
+    if ( [sql rangeOfString:@"__json__"].location != NSNotFound )
+        return nil; // reads the document directly, any change could matter
+    
+    static NSRegularExpression *regex = nil;
+    static dispatch_once_t onceToken;
+    
+    dispatch_once(&onceToken, ^{
+        regex = [NSRegularExpression regularExpressionWithPattern:@"\\[(.+?)\\]" options:0 error:nil];
+    });
+    
+    NSMutableSet *columnNames = [NSMutableSet set];
+    
+    for(NSTextCheckingResult *match in [regex matchesInString:sql options:0 range:NSMakeRange(0, sql.length)])
+        [columnNames addObject:[sql substringWithRange:[match rangeAtIndex:1]]];
+    
+    [columnNames removeObject:NTJsonRowIdKey];  // rowids never change
+    
+    return columnNames;
+}
+
+
+-(void)lruAppendEntry:(NTJsonQueryCacheEntry *)entry
+{
+    entry->_lruPrev = _lruTail;
+    entry->_lruNext = nil;
+    
+    if ( _lruTail )
+        _lruTail->_lruNext = entry;
+    else
+        _lruHead = entry;
+    
+    _lruTail = entry;
+}
+
+
+-(void)lruRemoveEntry:(NTJsonQueryCacheEntry *)entry
+{
+    if ( entry->_lruPrev )
+        entry->_lruPrev->_lruNext = entry->_lruNext;
+    else
+        _lruHead = entry->_lruNext;
+    
+    if ( entry->_lruNext )
+        entry->_lruNext->_lruPrev = entry->_lruPrev;
+    else
+        _lruTail = entry->_lruPrev;
+    
+    entry->_lruPrev = nil;
+    entry->_lruNext = nil;
+}
+
+
+-(NTJsonQueryCacheEntry *)entryWithKey:(NSString *)key
+{
+    NTJsonQueryCacheEntry *entry = (key) ? _entries[key] : nil;
+    
+    if ( entry )
+    {
+        // move to the end of the LRU list...
+        
+        [self lruRemoveEntry:entry];
+        [self lruAppendEntry:entry];
+    }
+    
+    return entry;
+}
+
+
+-(NSArray *)rowidsWithKey:(NSString *)key
+{
+    // the caller reports the hit or miss once it knows if the rows could still be read...
+    
+    NTJsonQueryCacheEntry *entry = [self entryWithKey:key];
+    
+    return (entry) ? entry->_rowids : nil;
+}
+
+
+-(void)recordHit:(BOOL)hit
+{
+    if ( hit )
+        ++_hits;
+    else
+        ++_misses;
+}
+
+
+-(NSNumber *)countWithKey:(NSString *)key
+{
+    NTJsonQueryCacheEntry *entry = [self entryWithKey:key];
+    
+    [self recordHit:(entry) ? YES : NO];
+    
+    return (entry) ? entry->_count : nil;
+}
+
+
+-(void)purge
+{
+    while ( _lruHead && _entries.count > _cacheSize )
+        [self removeObjectWithKey:_lruHead->_key];
+}
+
+
+-(void)addEntry:(NTJsonQueryCacheEntry *)entry
+{
+    if ( !_cacheSize || !entry->_key )
+        return ;
+    
+    [self removeObjectWithKey:entry->_key];
+    
+    _entries[entry->_key] = entry;
+    [self lruAppendEntry:entry];
+    
+    [self purge];
+}
+
+
+-(void)addRowids:(NSArray *)rowids columnNames:(NSSet *)columnNames withKey:(NSString *)key
+{
+    if ( rowids.count > _maxRows )
+        return ;
+    
+    NTJsonQueryCacheEntry *entry = [[NTJsonQueryCacheEntry alloc] init];
+    
+    entry->_key = key;
+    entry->_rowids = [rowids copy];
+    entry->_rowidSet = [NSSet setWithArray:rowids];
+    entry->_columnNames = columnNames;
+    
+    [self addEntry:entry];
+}
+
+
+-(void)addCount:(int)count columnNames:(NSSet *)columnNames withKey:(NSString *)key
+{
+    NTJsonQueryCacheEntry *entry = [[NTJsonQueryCacheEntry alloc] init];
+    
+    entry->_key = key;
+    entry->_count = @(count);
+    entry->_columnNames = columnNames;
+    
+    [self addEntry:entry];
+}
+
+
+-(void)removeEntriesPassingTest:(BOOL (^)(NTJsonQueryCacheEntry *entry))test
+{
+    ++_generation;  // even if we are empty, a query may be running right now
+    
+    if ( !_entries.count )
+        return ;
+    
+    for(NTJsonQueryCacheEntry *entry in _entries.allValues)
+    {
+        if ( test(entry) )
+            [self removeObjectWithKey:entry->_key];
+    }
+}
+
+
+-(void)invalidateForInsert
+{
+    // a new row could match anything...
+    
+    [self removeAll];
+}
+
+
+-(void)invalidateForRemoveWithRowId:(NTJsonRowId)rowid
+{
+    // Removing a row that isn't in a find result can't change it, but we have no idea which rows were counted...
+    
+    NSNumber *rowidValue = @(rowid);
+    
+    [self removeEntriesPassingTest:^BOOL(NTJsonQueryCacheEntry *entry) {
+        return (entry->_count || [entry->_rowidSet containsObject:rowidValue]);
+    }];
+}
+
+
+-(void)invalidateForUpdateWithChangedColumnNames:(NSSet *)changedColumnNames
+{
+    // If none of the columns a query uses changed, the row matches (and sorts) exactly as it did before...
+    
+    [self removeEntriesPassingTest:^BOOL(NTJsonQueryCacheEntry *entry) {
+        if ( !entry->_columnNames )
+            return YES;
+        
+        if ( !changedColumnNames )
+            return (entry->_columnNames.count) ? YES : NO;
+        
+        return [entry->_columnNames intersectsSet:changedColumnNames];
+    }];
+}
+
+
+-(void)removeObjectWithKey:(NSString *)key
+{
+    NTJsonQueryCacheEntry *entry = _entries[key];
+    
+    if ( !entry )
+        return ;
+    
+    [self lruRemoveEntry:entry];
+    [_entries removeObjectForKey:key];
+}
+
+
+-(void)removeAll
+{
+    ++_generation;
+    
+    _lruHead = nil;
+    _lruTail = nil;
+    
+    [_entries removeAllObjects];
+}
+
+
+@end
@@ -11,6 +11,12 @@
 #import <Foundation/Foundation.h>
 
 
+@class NTJsonMetrics;
+
+
+typedef void (^NTJsonSqlFunction)(sqlite3_context *context, int argc, sqlite3_value **argv);
+
+
 @interface NTJsonSqlConnection : NSObject
 
 @property (nonatomic,readonly) NSString *filename;
@@ -19,22 +25,61 @@
 @property (nonatomic,readonly) NSError *lastError;
 @property (nonatomic,readonly) BOOL isOpen;
 
+/// Read only connections never create the database and can run in parallel with the writer (the database is in WAL mode.)
+@property (nonatomic,readonly) BOOL isReadOnly;
+
+/// The maximum number of prepared statements to keep in the statement cache. 0 disables caching. Default: 32.
+@property (nonatomic) int statementCacheSize;
+@property (nonatomic,readonly) int statementCacheHits;
+@property (nonatomic,readonly) int statementCacheMisses;
+@property (nonatomic,readonly) int statementCacheCount;
+
+/// The PRAGMA synchronous level (an NTJsonSynchronous), applied when the database is opened or immediately if it's already open.
+/// -1 (the default) leaves the SQLITE default. Must be set on the connection queue once the database is open.
+@property (nonatomic) int synchronous;
+
+/// When set, time spent waiting for the queue is recorded here.
+@property (atomic) NTJsonMetrics *metrics;
+
 -(sqlite3 *)db;
 
 -(id)initWithFilename:(NSString *)filename connectionName:(NSString *)connectionName;
+-(id)initWithFilename:(NSString *)filename connectionName:(NSString *)connectionName isReadOnly:(BOOL)isReadOnly;
 
 -(BOOL)open;
 -(void)close;
 
+/// Registers a scalar SQL function. The block is called on the connection queue. Functions survive the connection being re-opened.
+-(BOOL)addFunctionWithName:(NSString *)name argCount:(int)argCount block:(NTJsonSqlFunction)block;
+
 -(sqlite3_stmt *)statementWithSql:(NSString *)sql args:(NSArray *)args;
--(BOOL)execSql:(NSString *)sql args:(NSArray *)args;
+-(sqlite3_stmt *)cachedStatementWithSql:(NSString *)sql args:(NSArray *)args;
+-(void)releaseStatement:(sqlite3_stmt *)statement;
+-(void)flushStatementCache;
+
+-(BOOL)bindArgs:(NSArray *)args toStatement:(sqlite3_stmt *)statement;
+-(BOOL)execStatement:(sqlite3_stmt *)statement args:(NSArray *)args;
+-(BOOL)execSql:(NSString *)sql args:(NSArray *)args;  // not cached, for DDL and SQL with literal values
+-(BOOL)execSql:(NSString *)sql args:(NSArray *)args cached:(BOOL)cached;  // cache SQL that is run repeatedly with different args
 -(id)execValueSql:(NSString *)sql args:(NSArray *)args;
+-(id)valueWithStatement:(sqlite3_stmt *)statement index:(int)index; // NSNull for NULL, nil for an unknown type
+-(NSArray *)queryPlanWithSql:(NSString *)sql args:(NSArray *)args;  // EXPLAIN QUERY PLAN details
+
++(NSString *)expandedSql:(NSString *)sql args:(NSArray *)args;  // args substituted, for logging only
 
 -(NSString *)beginTransaction;
 -(BOOL)commitTransation:(NSString *)transactionId;
 -(BOOL)rollbackTransation:(NSString *)transactionId;
 
+-(BOOL)isCurrentQueue;
 -(void)dispatchSync:(void (^)())block;
 -(void)dispatchAsync:(void (^)())block;
 
+/// Used for store transactions. While shared, SQL runs on connection's database (with our functions) and dispatchSync from
+/// connection's queue runs immediately. Must be called on our queue, which is suspended once the current block completes.
+-(void)shareConnection:(NTJsonSqlConnection *)connection;
+
+/// Ends sharing and resumes our queue. Must be called on the shared connection's queue.
+-(void)endSharing;
+
 @end
@@ -14,6 +14,56 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
 
 
 #define BUSY_TIMEOUT_MS 1000        // 1 second as a default for now. This should probably be made configurable?
+#define DEFAULT_STATEMENT_CACHE_SIZE 32
+
+
+@interface NTJsonSqlCachedStatement : NSObject
+{
+@public // allow direct access for performance
+    NSString *_sql;
+    sqlite3_stmt *_statement;
+    BOOL _isInUse;
+    BOOL _isEvicted;    // removed from the cache while in use, finalize on release
+    
+    NTJsonSqlCachedStatement __unsafe_unretained *_lruPrev; // only statements that aren't in use are in the LRU list
+    NTJsonSqlCachedStatement __unsafe_unretained *_lruNext;
+}
+
+@end
+
+
+@implementation NTJsonSqlCachedStatement
+
+@end
+
+
+@interface NTJsonSqlFunctionEntry : NSObject
+{
+@public
+    NSString *_name;
+    int _argCount;
+    NTJsonSqlFunction _block;
+}
+
+@end
+
+
+@implementation NTJsonSqlFunctionEntry
+
+@end
+
+
+static void NTJsonSqlFunctionCallback(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    // the entry is owned by the connection and outlives the sqlite3 handle...
+    
+    NTJsonSqlFunctionEntry *entry = (__bridge NTJsonSqlFunctionEntry *)sqlite3_user_data(context);
+    
+    @autoreleasepool
+    {
+        entry->_block(context, argc, argv);
+    }
+}
 
 
 @interface NTJsonSqlConnection ()
@@ -26,6 +76,19 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
     int _nextTransactionId;
     
     dispatch_queue_t _queue;
+    
+    int _statementCacheSize;
+    int _statementCacheHits;
+    int _statementCacheMisses;
+    NSMutableDictionary *_statementCache;   // sql -> NTJsonSqlCachedStatement, owns the entries
+    NTJsonSqlCachedStatement __unsafe_unretained *_lruHead;    // oldest
+    NTJsonSqlCachedStatement __unsafe_unretained *_lruTail;
+    NSMapTable *_statementsInUse;           // sqlite3_stmt * -> NTJsonSqlCachedStatement
+    
+    NSMutableDictionary *_functions;        // name -> NTJsonSqlFunctionEntry
+    
+    NTJsonSqlConnection *_sharedConnection;             // the connection we are running on, see shareConnection:
+    NTJsonSqlConnection __weak *_functionsConnection;   // the connection whose functions are registered on our database
 }
 
 @property (nonatomic,readonly) NSString *queueName;
@@ -43,7 +106,7 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
 @implementation NTJsonSqlConnection
 
 
--(id)initWithFilename:(NSString *)filename connectionName:(NSString *)connectionName
+-(id)initWithFilename:(NSString *)filename connectionName:(NSString *)connectionName isReadOnly:(BOOL)isReadOnly
 {
     self = [super init];
     
@@ -51,14 +114,28 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
     {
         _filename = filename;
         _connectionName = connectionName;
+        _isReadOnly = isReadOnly;
         _queueName = [NSString stringWithFormat:@"com.nageltech.NTJsonStore:%@@%@", connectionName, filename];
         _queue = dispatch_queue_create(_queueName.UTF8String, DISPATCH_QUEUE_SERIAL);
+        
+        _statementCacheSize = DEFAULT_STATEMENT_CACHE_SIZE;
+        _synchronous = -1;
+        _statementCache = [NSMutableDictionary dictionary];
+        _statementsInUse = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsOpaqueMemory|NSPointerFunctionsOpaquePersonality
+                                                 valueOptions:NSPointerFunctionsStrongMemory];
+        _functions = [NSMutableDictionary dictionary];
     }
     
     return self;
 }
 
 
+-(id)initWithFilename:(NSString *)filename connectionName:(NSString *)connectionName
+{
+    return [self initWithFilename:filename connectionName:connectionName isReadOnly:NO];
+}
+
+
 -(void)dealloc
 {
     [self close];
@@ -79,7 +156,21 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
     if ( _db )
     {
         if ( _db != CONNECTION_CLOSED )
-            sqlite3_close(_db);
+        {
+            // sqlite3_close fails if any statements are still prepared, so statements that are checked out are finalized
+            // now too. releaseStatement: only forgets about them...
+            
+            [self flushStatementCache];
+            
+            for(NTJsonSqlCachedStatement *entry in [[_statementsInUse objectEnumerator] allObjects])
+            {
+                sqlite3_finalize(entry->_statement);
+                entry->_statement = NULL;
+            }
+            
+            if ( sqlite3_close(_db) != SQLITE_OK )
+                LOG_ERROR(@"Failed to close database %@ - %s", self.filename, sqlite3_errmsg(_db));
+        }
         
         _db = CONNECTION_CLOSED;    // explicitly closed not (no auto open)
     }
@@ -93,6 +184,12 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
     
 #ifdef DEBUG
     
+    if ( _sharedConnection )
+    {
+        [_sharedConnection validateQueue];
+        return ;
+    }
+    
     const char *queueName = dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL);
     
     NSAssert(strcmp(queueName, _queueName.UTF8String) == 0, @"Attempt to access SQL connection from the wrong queue.");
@@ -110,13 +207,17 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
 
 -(sqlite3 *)db
 {
+    if ( _sharedConnection )
+        return [_sharedConnection dbWithFunctionsOfConnection:self];
+    
     [self validateQueue];
     
     if ( !_db ) // nil = auto open
     {
         BOOL newDatabase = ![self exists];
+        int flags = (_isReadOnly) ? SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX : SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_NOMUTEX;
         
-        int status = sqlite3_open_v2([self.filename cStringUsingEncoding:NSUTF8StringEncoding], &_db, SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_NOMUTEX, NULL);
+        int status = sqlite3_open_v2([self.filename cStringUsingEncoding:NSUTF8StringEncoding], &_db, flags, NULL);
         
         if ( status != SQLITE_OK )
         {
@@ -133,7 +234,12 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
         
         sqlite3_busy_timeout(_db, BUSY_TIMEOUT_MS);
         
-        if ( newDatabase )
+        [self applySynchronous];
+        
+        for(NTJsonSqlFunctionEntry *entry in _functions.allValues)
+            [self registerFunction:entry];
+        
+        if ( newDatabase && !_isReadOnly )
         {
             NSString *journalMode = [self execValueSql:@"PRAGMA journal_mode=wal;" args:nil];
             
@@ -156,75 +262,209 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
 }
 
 
--(sqlite3_stmt *)statementWithSql:(NSString *)sql args:(NSArray *)args
+#pragma mark - synchronous
+
+
+-(void)applySynchronous
 {
-    sqlite3_stmt *statement = NULL;
+    // synchronous is set on our own database, even while sharing another connection...
+    
+    if ( _synchronous < 0 || !_db || _db == CONNECTION_CLOSED || _isReadOnly )
+        return ;
+    
+    NSString *sql = [NSString stringWithFormat:@"PRAGMA synchronous=%d;", _synchronous];
+    
+    if ( sqlite3_exec(_db, sql.UTF8String, NULL, NULL, NULL) != SQLITE_OK )
+        LOG_ERROR(@"Failed to set synchronous for %@ - %s", self.connectionName, sqlite3_errmsg(_db));
+}
+
+
+-(void)setSynchronous:(int)synchronous
+{
+    _synchronous = synchronous;
     
+    if ( _db && _db != CONNECTION_CLOSED )
+    {
+        [self validateQueue];
+        [self applySynchronous];
+    }
+}
+
+
+#pragma mark - functions
+
+
+-(BOOL)registerFunction:(NTJsonSqlFunctionEntry *)entry
+{
+    int status = sqlite3_create_function_v2(_db, entry->_name.UTF8String, entry->_argCount, SQLITE_UTF8|SQLITE_DETERMINISTIC,
+                                            (__bridge void *)entry, NTJsonSqlFunctionCallback, NULL, NULL, NULL);
+    
+    if ( status != SQLITE_OK )
+    {
+        _lastError = [NSError NTJsonStore_errorWithSqlite3:_db];
+        LOG_ERROR(@"Failed to register SQL function %@ - %@", entry->_name, _lastError.localizedDescription);
+        return NO;
+    }
+    
+    return YES;
+}
+
+
+-(BOOL)addFunctionWithName:(NSString *)name argCount:(int)argCount block:(NTJsonSqlFunction)block
+{
+    [self validateQueue];
+    
+    NTJsonSqlFunctionEntry *entry = [[NTJsonSqlFunctionEntry alloc] init];
+    
+    entry->_name = [name copy];
+    entry->_argCount = argCount;
+    entry->_block = [block copy];
+    
+    _functions[entry->_name] = entry;
+    
+    // if we are already open, register now. Otherwise it will happen when we are opened...
+    
+    if ( _db && _db != CONNECTION_CLOSED )
+        return [self registerFunction:entry];
+    
+    return YES;
+}
+
+
+#pragma mark - sharing
+
+
+-(sqlite3 *)dbWithFunctionsOfConnection:(NTJsonSqlConnection *)connection
+{
+    // Function names are shared by every connection running on our database, so the functions of whichever connection
+    // is using the database are registered as needed...
+    
+    sqlite3 *db = self.db;
+    
+    if ( db && _functionsConnection != connection )
+    {
+        for(NTJsonSqlFunctionEntry *entry in connection->_functions.allValues)
+            [self registerFunction:entry];
+        
+        _functionsConnection = connection;
+    }
+    
+    return db;
+}
+
+
+-(void)removeFunctionsOfConnection:(NTJsonSqlConnection *)connection
+{
+    if ( _functionsConnection != connection )
+        return ;
+    
+    if ( _db && _db != CONNECTION_CLOSED )
+    {
+        for(NTJsonSqlFunctionEntry *entry in connection->_functions.allValues)
+            sqlite3_create_function_v2(_db, entry->_name.UTF8String, entry->_argCount, SQLITE_UTF8, NULL, NULL, NULL, NULL, NULL);
+    }
+    
+    _functionsConnection = nil;
+}
+
+
+-(void)shareConnection:(NTJsonSqlConnection *)connection
+{
+    [self validateQueue];
+    
+    [self flushStatementCache];    // our statements belong to our own database
+    
+    _sharedConnection = connection;
+    
+    dispatch_suspend(_queue);
+}
+
+
+-(void)endSharing
+{
+    if ( !_sharedConnection )
+        return ;
+    
+    [_sharedConnection validateQueue];
+    
+    [self flushStatementCache];    // these were prepared on the shared database
+    [_sharedConnection removeFunctionsOfConnection:self];
+    
+    _sharedConnection = nil;
+    
+    dispatch_resume(_queue);
+}
+
+
+#pragma mark - statements
+
+
+-(NSString *)normalizeSql:(NSString *)sql
+{
     if ( !sql )
         sql = @"";
     
     if ( ![sql hasSuffix:@";"] )
         sql = [sql stringByAppendingString:@";"];
     
-    if ( !self.db )
-        return NULL;    // avoid even calling prepare
+    return sql;
+}
+
+
++(NSString *)expandedSql:(NSString *)sql args:(NSArray *)args
+{
+    // Returns the SQL with the args substituted, for logging only.
     
-#ifdef NTJsonStore_SHOW_SQL
+    if ( ![args count] )
+        return sql;
     
-    if ( [args count] )
+    NSMutableString *expSql = [NSMutableString stringWithString:sql];
+    
+    NSInteger offset = 0;
+    
+    for(id arg in args)
     {
-        //       NTLogDebug(@"    Args: %@", [args componentsJoinedByString:@", "]);
+        NSString *value;
         
-        NSMutableString *expSql = [NSMutableString stringWithString:sql];
+        if ( arg == nil || arg == [NSNull null] )
+            value = @"null";
         
-        NSInteger offset = 0;
+        else if ( [arg isKindOfClass:[NSString class]] )
+            value = [NSString stringWithFormat:@"\'%@\'", arg];
         
-        for(id arg in args)
-        {
-            NSString *value;
-            
-            if ( arg == nil || arg == [NSNull null] )
-                value = @"null";
-            
-            else if ( [arg isKindOfClass:[NSString class]] )
-                value = [NSString stringWithFormat:@"\'%@\'", arg];
-            
-            else if ( [arg isKindOfClass:[NSNumber class]] )
-                value = [arg stringValue];
-            
-            else if ( [arg isKindOfClass:[NSData class]] )
-                value = [NSString stringWithFormat:@"[BLOB %d]", (int)((NSData *)arg).length];
-            
-            else
-                value = [NSString stringWithFormat:@"[%@]", NSStringFromClass([arg class])];
-            
-            NSRange pos = [expSql rangeOfString:@"?" options:0 range:NSMakeRange(offset, expSql.length-offset)];
-            
-            if (pos.location == NSNotFound )
-                break; // unlikely
-            
-            [expSql replaceCharactersInRange:pos withString:value];
-            
-            offset = pos.location + value.length;
-        }
+        else if ( [arg isKindOfClass:[NSNumber class]] )
+            value = [arg stringValue];
+        
+        else if ( [arg isKindOfClass:[NSData class]] )
+            value = [NSString stringWithFormat:@"[BLOB %d]", (int)((NSData *)arg).length];
+        
+        else
+            value = [NSString stringWithFormat:@"[%@]", NSStringFromClass([arg class])];
+        
+        NSRange pos = [expSql rangeOfString:@"?" options:0 range:NSMakeRange(offset, expSql.length-offset)];
+        
+        if (pos.location == NSNotFound )
+            break; // unlikely
+        
+        [expSql replaceCharactersInRange:pos withString:value];
         
-        LOG_SQL(@"%@", expSql);
+        offset = pos.location + value.length;
     }
     
-    else
-        LOG_SQL(@"%@", sql);
-    
+    return expSql;
+}
+
+
+-(void)logSql:(NSString *)sql args:(NSArray *)args
+{
+#ifdef NTJsonStore_SHOW_SQL
+    LOG_SQL(@"%@", [self.class expandedSql:sql args:args]);
 #endif
-    
-    NSUInteger status = sqlite3_prepare_v2(self.db, [sql cStringUsingEncoding:NSUTF8StringEncoding], (int)sql.length, &statement, NULL);
-    
-    if (status != SQLITE_OK )
-    {
-        _lastError = [NSError NTJsonStore_errorWithSqlite3:_db];
-        LOG_ERROR(@"Failed to prepare statement %@ - %@", sql, _lastError.localizedDescription);
-        return NULL;
-    }
-    
+}
+
+
+-(BOOL)bindArgs:(NSArray *)args toStatement:(sqlite3_stmt *)statement
+{
     if ( args )
     {
         // Add arguments...
@@ -257,9 +497,7 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
                     
                     LOG_ERROR(@"%@", _lastError);
                     
-                    sqlite3_finalize(statement);
-                    
-                    return NULL;
+                    return NO;
                 }
             }
             
@@ -279,24 +517,271 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
                 
                 LOG_ERROR(@"%@", _lastError.localizedDescription);
                 
-                sqlite3_finalize(statement);
-                
-                return NULL;
+                return NO;
             }
             
             ++index;
         }
     }
     
+    return YES;
+}
+
+
+-(sqlite3_stmt *)prepareSql:(NSString *)sql
+{
+    sqlite3_stmt *statement = NULL;
+    sqlite3 *db = self.db;  // _db is nil when we share another connection's database
+    
+    NSUInteger status = sqlite3_prepare_v2(db, [sql cStringUsingEncoding:NSUTF8StringEncoding], -1, &statement, NULL);
+    
+    if (status != SQLITE_OK )
+    {
+        _lastError = [NSError NTJsonStore_errorWithSqlite3:db];
+        LOG_ERROR(@"Failed to prepare statement %@ - %@", sql, _lastError.localizedDescription);
+        return NULL;
+    }
+    
     return statement;
 }
 
 
--(BOOL)execSql:(NSString *)sql args:(NSArray *)args
+-(sqlite3_stmt *)statementWithSql:(NSString *)sql args:(NSArray *)args
 {
-    sqlite3_stmt *statement = [self statementWithSql:sql args:args];
+    sql = [self normalizeSql:sql];
+    
+    if ( !self.db )
+        return NULL;    // avoid even calling prepare
+    
+    [self logSql:sql args:args];
+    
+    sqlite3_stmt *statement = [self prepareSql:sql];
     
     if ( !statement )
+        return NULL;
+    
+    if ( ![self bindArgs:args toStatement:statement] )
+    {
+        sqlite3_finalize(statement);
+        return NULL;
+    }
+    
+    return statement;
+}
+
+
+#pragma mark - statement cache
+
+
+-(int)statementCacheSize
+{
+    return _statementCacheSize;
+}
+
+
+-(void)setStatementCacheSize:(int)statementCacheSize
+{
+    [self validateQueue];
+    
+    _statementCacheSize = MAX(statementCacheSize, 0);
+    
+    [self purgeStatementCache];
+}
+
+
+-(int)statementCacheHits
+{
+    return _statementCacheHits;
+}
+
+
+-(int)statementCacheMisses
+{
+    return _statementCacheMisses;
+}
+
+
+-(int)statementCacheCount
+{
+    return (int)_statementCache.count;
+}
+
+
+-(void)lruAppendEntry:(NTJsonSqlCachedStatement *)entry
+{
+    entry->_lruPrev = _lruTail;
+    entry->_lruNext = nil;
+    
+    if ( _lruTail )
+        _lruTail->_lruNext = entry;
+    else
+        _lruHead = entry;
+    
+    _lruTail = entry;
+}
+
+
+-(void)lruRemoveEntry:(NTJsonSqlCachedStatement *)entry
+{
+    if ( entry->_lruPrev )
+        entry->_lruPrev->_lruNext = entry->_lruNext;
+    else
+        _lruHead = entry->_lruNext;
+    
+    if ( entry->_lruNext )
+        entry->_lruNext->_lruPrev = entry->_lruPrev;
+    else
+        _lruTail = entry->_lruPrev;
+    
+    entry->_lruPrev = nil;
+    entry->_lruNext = nil;
+}
+
+
+-(void)evictCachedStatement:(NTJsonSqlCachedStatement *)entry
+{
+    if ( entry->_isInUse )
+        entry->_isEvicted = YES;    // releaseStatement: will finalize it
+    
+    else
+    {
+        [self lruRemoveEntry:entry];
+        sqlite3_finalize(entry->_statement);
+        entry->_statement = NULL;
+    }
+    
+    [_statementCache removeObjectForKey:entry->_sql];   // releases the entry, must be last
+}
+
+
+-(void)purgeStatementCache
+{
+    // evict the oldest statements that aren't currently checked out until we are within our limit...
+    
+    while ( _lruHead && _statementCache.count > _statementCacheSize )
+        [self evictCachedStatement:_lruHead];
+}
+
+
+-(void)flushStatementCache
+{
+    // Called when the schema changes. In use statements are finalized when they are released.
+    
+    for(NTJsonSqlCachedStatement *entry in _statementCache.allValues)
+        [self evictCachedStatement:entry];
+}
+
+
+-(sqlite3_stmt *)cachedStatementWithSql:(NSString *)sql args:(NSArray *)args
+{
+    sql = [self normalizeSql:sql];
+    
+    if ( !self.db )
+        return NULL;    // avoid even calling prepare
+    
+    [self logSql:sql args:args];
+    
+    NTJsonSqlCachedStatement *entry = _statementCache[sql];
+    sqlite3_stmt *statement;
+    
+    if ( entry && !entry->_isInUse )
+    {
+        ++_statementCacheHits;
+        
+        statement = entry->_statement;
+        
+        [self lruRemoveEntry:entry];    // checked out, it goes back at the end of the list when it's released
+    }
+    
+    else
+    {
+        ++_statementCacheMisses;
+        
+        statement = [self prepareSql:sql];
+        
+        if ( !statement )
+            return NULL;
+        
+        // If the same sql is already checked out (nested use) we just hand out an uncached statement...
+        
+        if ( !entry && _statementCacheSize > 0 )
+        {
+            entry = [[NTJsonSqlCachedStatement alloc] init];
+            
+            entry->_sql = sql;
+            entry->_statement = statement;
+            entry->_isInUse = YES;  // mark in use before purging so we can't evict ourselves
+            
+            _statementCache[sql] = entry;
+            
+            [self purgeStatementCache];
+        }
+        else
+            entry = nil;
+    }
+    
+    if ( entry )
+    {
+        entry->_isInUse = YES;
+        NSMapInsert(_statementsInUse, statement, (__bridge void *)entry);
+    }
+    
+    if ( ![self bindArgs:args toStatement:statement] )
+    {
+        [self releaseStatement:statement];
+        return NULL;
+    }
+    
+    return statement;
+}
+
+
+-(void)releaseStatement:(sqlite3_stmt *)statement
+{
+    if ( !statement )
+        return ;
+    
+    NTJsonSqlCachedStatement *entry = (__bridge NTJsonSqlCachedStatement *)NSMapGet(_statementsInUse, statement);
+    
+    if ( !entry || entry->_isEvicted )
+    {
+        if ( entry )
+        {
+            NSMapRemove(_statementsInUse, statement);
+            
+            if ( !entry->_statement )
+                return ;    // already finalized by close
+            
+            entry->_statement = NULL;
+        }
+        
+        sqlite3_finalize(statement);
+        return ;
+    }
+    
+    NSMapRemove(_statementsInUse, statement);
+    
+    sqlite3_reset(statement);
+    sqlite3_clear_bindings(statement);
+    
+    entry->_isInUse = NO;
+    [self lruAppendEntry:entry];
+    
+    [self purgeStatementCache];  // in case we went over the limit while this was checked out
+}
+
+
+#pragma mark - exec
+
+
+-(BOOL)execStatement:(sqlite3_stmt *)statement args:(NSArray *)args
+{
+    // re-executes an already prepared statement with new arguments. Used for batch operations.
+    
+    sqlite3_reset(statement);
+    sqlite3_clear_bindings(statement);
+    
+    if ( ![self bindArgs:args toStatement:statement] )
         return NO;
     
     int status = sqlite3_step(statement);
@@ -307,73 +792,99 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
         
         LOG_ERROR(@"Failed to execute statement - %@", _lastError.localizedDescription);
         
-        sqlite3_finalize(statement);
-        
         return NO;
     }
     
-    sqlite3_finalize(statement);
-    
     return YES;
 }
 
 
--(id)execValueSql:(NSString *)sql args:(NSArray *)args
+-(BOOL)execSql:(NSString *)sql args:(NSArray *)args cached:(BOOL)cached
 {
-    sqlite3_stmt *statement = [self statementWithSql:sql args:args];
+    sqlite3_stmt *statement = (cached) ? [self cachedStatementWithSql:sql args:args] : [self statementWithSql:sql args:args];
     
     if ( !statement )
-        return nil;
+        return NO;
     
     int status = sqlite3_step(statement);
     
-    if ( status != SQLITE_ROW )
+    if ( status != SQLITE_DONE && status != SQLITE_ROW )
     {
-        if ( status != SQLITE_DONE )
-        {
-            _lastError = [NSError NTJsonStore_errorWithSqlite3:self.db];
-            
-            LOG_ERROR(@"Failed to execute statement - %@", _lastError.localizedDescription);
-        }
+        _lastError = [NSError NTJsonStore_errorWithSqlite3:self.db];
         
-        sqlite3_finalize(statement);
+        LOG_ERROR(@"Failed to execute statement - %@", _lastError.localizedDescription);
         
-        return nil;
+        [self releaseStatement:statement];
+        
+        return NO;
     }
     
-    id value;
+    [self releaseStatement:statement];
     
-    switch(sqlite3_column_type(statement, 0))
+    return YES;
+}
+
+
+-(BOOL)execSql:(NSString *)sql args:(NSArray *)args
+{
+    return [self execSql:sql args:args cached:NO];
+}
+
+
+-(id)valueWithStatement:(sqlite3_stmt *)statement index:(int)index
+{
+    switch(sqlite3_column_type(statement, index))
     {
         case SQLITE_INTEGER:
-            value = [NSNumber numberWithLongLong:sqlite3_column_int64(statement, 0)];
-            break;
+            return [NSNumber numberWithLongLong:sqlite3_column_int64(statement, index)];
             
         case SQLITE_FLOAT:
-            value = [NSNumber numberWithDouble:sqlite3_column_double(statement, 0)];
-            break;
+            return [NSNumber numberWithDouble:sqlite3_column_double(statement, index)];
             
         case SQLITE_TEXT:
-            value = [NSString stringWithCString:(const char *)sqlite3_column_text(statement, 0) encoding:NSUTF8StringEncoding];
-            break;
+            return [NSString stringWithCString:(const char *)sqlite3_column_text(statement, index) encoding:NSUTF8StringEncoding];
             
         case SQLITE_BLOB:
-            value = [NSData dataWithBytes:sqlite3_column_blob(statement, 0) length:sqlite3_column_bytes(statement, 0)];
-            break;
+            return [NSData dataWithBytes:sqlite3_column_blob(statement, index) length:sqlite3_column_bytes(statement, index)];
             
         case SQLITE_NULL:
-            value = [NSNull null];
-            break;
+            return [NSNull null];
             
         default:
+            return nil;
+    }
+}
+
+
+-(id)execValueSql:(NSString *)sql args:(NSArray *)args
+{
+    sqlite3_stmt *statement = [self cachedStatementWithSql:sql args:args];
+    
+    if ( !statement )
+        return nil;
+    
+    int status = sqlite3_step(statement);
+    
+    if ( status != SQLITE_ROW )
+    {
+        if ( status != SQLITE_DONE )
         {
-            _lastError = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidSqlArgument];
-            value = nil;
-            break;
+            _lastError = [NSError NTJsonStore_errorWithSqlite3:self.db];
+            
+            LOG_ERROR(@"Failed to execute statement - %@", _lastError.localizedDescription);
         }
+        
+        [self releaseStatement:statement];
+        
+        return nil;
     }
     
-    sqlite3_finalize(statement);
+    id value = [self valueWithStatement:statement index:0];
+    
+    if ( !value )
+        _lastError = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidSqlArgument];
+    
+    [self releaseStatement:statement];
     
     LOG_SQL(@"    = %@", value ?: @"(null)");
     
@@ -381,13 +892,40 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
 }
 
 
+-(NSArray *)queryPlanWithSql:(NSString *)sql args:(NSArray *)args
+{
+    // Returns the detail of each step in the EXPLAIN QUERY PLAN output, nil on failure.
+    
+    sqlite3_stmt *statement = [self statementWithSql:[NSString stringWithFormat:@"EXPLAIN QUERY PLAN %@", sql] args:args];
+    
+    if ( !statement )
+        return nil;
+    
+    NSMutableArray *queryPlan = [NSMutableArray array];
+    
+    while ( sqlite3_step(statement) == SQLITE_ROW )
+    {
+        const char *detail = (const char *)sqlite3_column_text(statement, 3);
+        
+        if ( detail )
+            [queryPlan addObject:[NSString stringWithUTF8String:detail]];
+    }
+    
+    sqlite3_finalize(statement);
+    
+    return queryPlan;
+}
+
+
 -(NSString *)beginTransaction
 {
     [self validateQueue]; // do this before we access _nextTransactionId
     
     NSString *transactionId = [NSString stringWithFormat:@"%@_%04d", self.connectionName, _nextTransactionId++];
     
-    BOOL success = [self execSql:[NSString stringWithFormat:@"SAVEPOINT %@;", transactionId] args:nil];
+    // savepoint names are unique, so there's no point in caching these statements...
+    
+    BOOL success = [self execSql:[NSString stringWithFormat:@"SAVEPOINT %@;", transactionId] args:nil cached:NO];
     
     return (success) ? transactionId : nil;
 }
@@ -395,34 +933,73 @@ static sqlite3 *CONNECTION_CLOSED = (sqlite3 *)(void *)1;
 
 -(BOOL)commitTransation:(NSString *)transactionId
 {
-    return [self execSql:[NSString stringWithFormat:@"RELEASE SAVEPOINT %@;", transactionId] args:nil];
+    return [self execSql:[NSString stringWithFormat:@"RELEASE SAVEPOINT %@;", transactionId] args:nil cached:NO];
 }
 
 
 -(BOOL)rollbackTransation:(NSString *)transactionId
 {
-    return [self execSql:[NSString stringWithFormat:@"ROLLBACK TO SAVEPOINT %@; RELEASE SAVEPOINT %@;", transactionId, transactionId] args:nil];
+    // These must be separate statements, prepare only compiles the first statement in a string. ROLLBACK TO leaves the
+    // savepoint open, without the RELEASE the outermost transaction would never end...
+    
+    if ( ![self execSql:[NSString stringWithFormat:@"ROLLBACK TO SAVEPOINT %@;", transactionId] args:nil cached:NO] )
+        return NO;
+    
+    return [self execSql:[NSString stringWithFormat:@"RELEASE SAVEPOINT %@;", transactionId] args:nil cached:NO];
 }
 
 
 -(void)dispatchAsync:(void (^)())block
 {
-    dispatch_async(self.queue, block);
+    NTJsonMetrics *metrics = self.metrics;
+    CFAbsoluteTime queuedAt = [metrics now];
+    
+    if ( !queuedAt )
+    {
+        dispatch_async(self.queue, block);
+        return ;
+    }
+    
+    dispatch_async(self.queue, ^{
+        [metrics addQueueWaitQueuedAt:queuedAt];
+        block();
+    });
 }
 
 
--(void)dispatchSync:(void (^)())block
+-(BOOL)isCurrentQueue
 {
+    if ( _sharedConnection )
+        return [_sharedConnection isCurrentQueue];
+    
     const char *queueName = dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL);
     
-    if ( strcmp(queueName, _queueName.UTF8String) == 0 )
+    return (strcmp(queueName, _queueName.UTF8String) == 0) ? YES : NO;
+}
+
+
+-(void)dispatchSync:(void (^)())block
+{
+    if ( [self isCurrentQueue] )
     {
         block();
     }
     
     else
     {
-        dispatch_sync(self.queue, block);
+        NTJsonMetrics *metrics = self.metrics;
+        CFAbsoluteTime queuedAt = [metrics now];
+        
+        if ( !queuedAt )
+        {
+            dispatch_sync(self.queue, block);
+            return ;
+        }
+        
+        dispatch_sync(self.queue, ^{
+            [metrics addQueueWaitQueuedAt:queuedAt];
+            block();
+        });
     }
 }
 
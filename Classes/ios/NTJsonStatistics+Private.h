@@ -0,0 +1,58 @@
+//
+//  NTJsonStatistics+Private.h
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/// Statistics for a single materialized column. The distinct count is a HyperLogLog estimate, values are only ever added
+/// to it, so it may be high after removes until the statistics are rebuilt.
+@interface NTJsonColumnStatistics : NSObject
+
+@property (nonatomic,readonly) NSString *name;
+@property (nonatomic) int64_t nullCount;
+@property (nonatomic,readonly) int64_t distinctCount;
+
+-(id)initWithName:(NSString *)name;
+
+-(void)addValue:(id)value;      // nil or NSNull counts as NULL
+-(void)removeValue:(id)value;   // only adjusts the NULL count
+
+@end
+
+
+/// Incrementally maintained statistics for a collection: the row count (exact) and per column statistics (approximate.) Also
+/// tracks how much has changed since the table was last analyzed. Must only be accessed on the collection queue.
+@interface NTJsonStatistics : NSObject
+
+@property (nonatomic) int64_t rowCount;                 // -1 if unknown
+@property (nonatomic) int64_t changeCount;              // rows inserted, updated or removed since the last ANALYZE
+@property (nonatomic) int64_t analyzedRowCount;         // the row count at the last ANALYZE, -1 if never analyzed
+@property (nonatomic) NSDate *analyzedDate;
+@property (nonatomic) BOOL isExact;                     // NO when changes were made that the column statistics couldn't track precisely
+@property (nonatomic) BOOL isChanged;                   // changed since the last save
+@property (nonatomic,readonly) NSDictionary *columns;   // column name -> NTJsonColumnStatistics
+
+-(id)init;
+-(id)initWithState:(NSDictionary *)state;   // nil if the state is invalid
+
+-(NSDictionary *)state;     // for persistence
+-(NSDictionary *)snapshot;  // for the public API
+
+-(void)addRowWithValues:(NSArray *)values columns:(NSArray *)columns;      // columns are NTJsonColumns, values may be nil
+-(void)removeRowWithValues:(NSArray *)values columns:(NSArray *)columns;   // values are nil if unknown
+-(void)updateRowWithOldValues:(NSArray *)oldValues newValues:(NSArray *)newValues columns:(NSArray *)columns;  // oldValues are nil if unknown
+-(void)updateRowsWithCount:(int64_t)count columns:(NSArray *)columns;     // rows updated without knowing their values, columns are the ones that may have changed
+-(void)removeRowsWithCount:(int64_t)count;      // rows removed without knowing their values
+-(void)removeAllRows;
+
+-(void)replaceColumns:(NSArray *)columns;       // NTJsonColumnStatistics from a rebuild, replaces all existing column statistics
+
+-(BOOL)needsAnalyze;
+-(void)didAnalyze;
+
+@end
@@ -0,0 +1,452 @@
+//
+//  NTJsonStatistics.m
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import "NTJsonStore+Private.h"
+
+
+static const int REGISTER_BITS = 8;
+static const int REGISTER_COUNT = 1 << REGISTER_BITS;     // ~6.5% standard error
+
+static const int64_t ANALYZE_MIN_CHANGES = 1000;
+static const double ANALYZE_CHANGE_RATIO = 0.25;
+
+
+#pragma mark - NTJsonColumnStatistics
+
+
+@interface NTJsonColumnStatistics ()
+{
+    uint8_t _registers[REGISTER_COUNT];
+}
+
+-(id)initWithName:(NSString *)name state:(NSDictionary *)state;  // nil if the state is invalid
+-(NSDictionary *)state;
+
+@end
+
+
+@implementation NTJsonColumnStatistics
+
+
+-(id)initWithName:(NSString *)name
+{
+    self = [super init];
+    
+    if ( self )
+    {
+        _name = name;
+    }
+    
+    return self;
+}
+
+
+-(id)initWithName:(NSString *)name state:(NSDictionary *)state
+{
+    self = [self initWithName:name];
+    
+    if ( self )
+    {
+        NSString *registers = state[@"registers"];
+        
+        if ( ![state[@"nullCount"] isKindOfClass:[NSNumber class]] || ![registers isKindOfClass:[NSString class]] || registers.length != REGISTER_COUNT * 2 )
+            return nil;
+        
+        _nullCount = [state[@"nullCount"] longLongValue];
+        
+        const char *hex = registers.UTF8String;
+        
+        for(int index=0; index<REGISTER_COUNT; index++)
+        {
+            unsigned int value = 0;
+            
+            if ( sscanf(hex + index*2, "%2x", &value) != 1 )
+                return nil;
+            
+            _registers[index] = (uint8_t)value;
+        }
+    }
+    
+    return self;
+}
+
+
+-(NSDictionary *)state
+{
+    NSMutableString *registers = [NSMutableString stringWithCapacity:REGISTER_COUNT * 2];
+    
+    for(int index=0; index<REGISTER_COUNT; index++)
+        [registers appendFormat:@"%02x", _registers[index]];
+    
+    return @{
+             @"nullCount": @(_nullCount),
+             @"registers": registers,
+             };
+}
+
+
++(uint64_t)hashBytes:(const void *)bytes length:(NSUInteger)length seed:(uint64_t)seed
+{
+    // FNV-1a followed by a finalizer so every bit is well mixed (HyperLogLog depends on it)...
+    
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    
+    for(NSUInteger index=0; index<length; index++)
+    {
+        hash ^= ((const uint8_t *)bytes)[index];
+        hash *= 1099511628211ULL;
+    }
+    
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    
+    return hash;
+}
+
+
++(uint64_t)hashValue:(id)value
+{
+    // Values that SQLITE considers equal (1 and 1.0 for instance) hash the same...
+    
+    if ( [value isKindOfClass:[NSString class]] )
+    {
+        const char *utf8 = [value UTF8String];
+        return [self hashBytes:utf8 length:strlen(utf8) seed:'s'];
+    }
+    
+    if ( [value isKindOfClass:[NSNumber class]] )
+    {
+        const char *type = [value objCType];
+        
+        if ( type[0] == 'f' || type[0] == 'd' )
+        {
+            double doubleValue = [value doubleValue];
+            
+            if ( doubleValue != (double)(int64_t)doubleValue )
+                return [self hashBytes:&doubleValue length:sizeof(doubleValue) seed:'d'];
+        }
+        
+        int64_t intValue = [value longLongValue];
+        return [self hashBytes:&intValue length:sizeof(intValue) seed:'i'];
+    }
+    
+    NSData *data = [[value description] dataUsingEncoding:NSUTF8StringEncoding];
+    
+    return [self hashBytes:data.bytes length:data.length seed:'o'];
+}
+
+
+-(void)addValue:(id)value
+{
+    if ( !value || value == [NSNull null] )
+    {
+        ++_nullCount;
+        return ;
+    }
+    
+    uint64_t hash = [self.class hashValue:value];
+    int index = (int)(hash >> (64 - REGISTER_BITS));
+    uint64_t remaining = hash << REGISTER_BITS;
+    uint8_t rank = (remaining) ? (uint8_t)(__builtin_clzll(remaining) + 1) : (uint8_t)(64 - REGISTER_BITS + 1);
+    
+    if ( rank > _registers[index] )
+        _registers[index] = rank;
+}
+
+
+-(void)removeValue:(id)value
+{
+    if ( (!value || value == [NSNull null]) && _nullCount > 0 )
+        --_nullCount;
+}
+
+
+-(int64_t)distinctCount
+{
+    double sum = 0;
+    int zeros = 0;
+    
+    for(int index=0; index<REGISTER_COUNT; index++)
+    {
+        sum += ldexp(1.0, -_registers[index]);
+        
+        if ( !_registers[index] )
+            ++zeros;
+    }
+    
+    double alpha = 0.7213 / (1.0 + 1.079 / REGISTER_COUNT);
+    double estimate = alpha * REGISTER_COUNT * REGISTER_COUNT / sum;
+    
+    // linear counting is much more accurate for small sets...
+    
+    if ( estimate <= 2.5 * REGISTER_COUNT && zeros )
+        estimate = REGISTER_COUNT * log((double)REGISTER_COUNT / zeros);
+    
+    return (int64_t)llround(estimate);
+}
+
+
+@end
+
+
+#pragma mark - NTJsonStatistics
+
+
+@interface NTJsonStatistics ()
+{
+    NSMutableDictionary *_columns;
+}
+
+@end
+
+
+@implementation NTJsonStatistics
+
+
+-(id)init
+{
+    self = [super init];
+    
+    if ( self )
+    {
+        _rowCount = -1;
+        _analyzedRowCount = -1;
+        _isExact = YES;
+        _columns = [NSMutableDictionary dictionary];
+    }
+    
+    return self;
+}
+
+
+-(id)initWithState:(NSDictionary *)state
+{
+    self = [self init];
+    
+    if ( self )
+    {
+        if ( ![state isKindOfClass:[NSDictionary class]] || ![state[@"rowCount"] isKindOfClass:[NSNumber class]] )
+            return nil;
+        
+        _rowCount = [state[@"rowCount"] longLongValue];
+        _changeCount = [state[@"changeCount"] longLongValue];
+        _analyzedRowCount = (state[@"analyzedRowCount"]) ? [state[@"analyzedRowCount"] longLongValue] : -1;
+        _analyzedDate = (state[@"analyzedDate"]) ? [NSDate dateWithTimeIntervalSince1970:[state[@"analyzedDate"] doubleValue]] : nil;
+        _isExact = [state[@"isExact"] boolValue];
+        
+        NSDictionary *columns = state[@"columns"];
+        
+        if ( [columns isKindOfClass:[NSDictionary class]] )
+        {
+            for(NSString *name in columns)
+            {
+                NTJsonColumnStatistics *column = [[NTJsonColumnStatistics alloc] initWithName:name state:columns[name]];
+                
+                if ( column )
+                    _columns[name] = column;
+            }
+        }
+    }
+    
+    return self;
+}
+
+
+-(NSDictionary *)state
+{
+    NSMutableDictionary *columns = [NSMutableDictionary dictionary];
+    
+    for(NTJsonColumnStatistics *column in _columns.allValues)
+        columns[column.name] = [column state];
+    
+    NSMutableDictionary *state = [NSMutableDictionary dictionary];
+    
+    state[@"rowCount"] = @(_rowCount);
+    state[@"changeCount"] = @(_changeCount);
+    state[@"analyzedRowCount"] = @(_analyzedRowCount);
+    state[@"isExact"] = @(_isExact);
+    state[@"columns"] = columns;
+    
+    if ( _analyzedDate )
+        state[@"analyzedDate"] = @([_analyzedDate timeIntervalSince1970]);
+    
+    return state;
+}
+
+
+-(NSDictionary *)snapshot
+{
+    NSMutableDictionary *columns = [NSMutableDictionary dictionary];
+    
+    for(NTJsonColumnStatistics *column in _columns.allValues)
+    {
+        columns[column.name] = @{
+                                 @"nullCount": @(column.nullCount),
+                                 @"distinctCount": @(MIN(column.distinctCount, MAX(_rowCount - column.nullCount, 0))),
+                                 };
+    }
+    
+    NSMutableDictionary *snapshot = [NSMutableDictionary dictionary];
+    
+    snapshot[@"rowCount"] = @(_rowCount);
+    snapshot[@"changesSinceAnalyze"] = @(_changeCount);
+    snapshot[@"isExact"] = @(_isExact);
+    snapshot[@"columns"] = columns;
+    
+    if ( _analyzedDate )
+        snapshot[@"analyzedDate"] = _analyzedDate;
+    
+    return [snapshot copy];
+}
+
+
+-(NSDictionary *)columns
+{
+    return [_columns copy];
+}
+
+
+-(void)didChangeRows:(int64_t)count
+{
+    _changeCount += count;
+    _isChanged = YES;
+}
+
+
+-(void)addRowWithValues:(NSArray *)values columns:(NSArray *)columns
+{
+    // Columns we don't know about yet are only tracked if the table is empty, otherwise we need a rebuild to
+    // know about the existing rows...
+    
+    for(NSUInteger index=0; index<columns.count; index++)
+    {
+        NSString *name = [columns[index] name];
+        NTJsonColumnStatistics *column = _columns[name];
+        
+        if ( !column && _rowCount == 0 )
+            column = _columns[name] = [[NTJsonColumnStatistics alloc] initWithName:name];
+        
+        [column addValue:values[index]];
+    }
+    
+    if ( _rowCount >= 0 )
+        ++_rowCount;
+    
+    [self didChangeRows:1];
+}
+
+
+-(void)removeRowWithValues:(NSArray *)values columns:(NSArray *)columns
+{
+    if ( values )
+    {
+        for(NSUInteger index=0; index<columns.count; index++)
+            [_columns[[columns[index] name]] removeValue:values[index]];
+    }
+    
+    else
+        _isExact = NO;
+    
+    if ( _rowCount > 0 )
+        --_rowCount;
+    
+    [self didChangeRows:1];
+}
+
+
+-(void)updateRowWithOldValues:(NSArray *)oldValues newValues:(NSArray *)newValues columns:(NSArray *)columns
+{
+    for(NSUInteger index=0; index<columns.count; index++)
+    {
+        NTJsonColumnStatistics *column = _columns[[columns[index] name]];
+        
+        if ( oldValues )
+            [column removeValue:oldValues[index]];
+        
+        [column addValue:newValues[index]];
+    }
+    
+    if ( !oldValues )
+        _isExact = NO;  // we counted the new NULLs without removing the old ones
+    
+    [self didChangeRows:1];
+}
+
+
+-(void)updateRowsWithCount:(int64_t)count columns:(NSArray *)columns
+{
+    if ( count <= 0 )
+        return ;
+    
+    if ( columns.count )
+        _isExact = NO;  // the new values were never counted
+    
+    [self didChangeRows:count];
+}
+
+
+-(void)removeRowsWithCount:(int64_t)count
+{
+    if ( count <= 0 )
+        return ;
+    
+    if ( _rowCount >= 0 )
+        _rowCount = MAX(_rowCount - count, 0);
+    
+    _isExact = NO;
+    
+    [self didChangeRows:count];
+}
+
+
+-(void)removeAllRows
+{
+    [self didChangeRows:MAX(_rowCount, 0)];
+    
+    _rowCount = 0;
+    _isExact = YES;
+    [_columns removeAllObjects];
+}
+
+
+-(void)replaceColumns:(NSArray *)columns
+{
+    [_columns removeAllObjects];
+    
+    for(NTJsonColumnStatistics *column in columns)
+        _columns[column.name] = column;
+    
+    _isExact = YES;
+    _isChanged = YES;
+}
+
+
+-(BOOL)needsAnalyze
+{
+    if ( _rowCount < 0 )
+        return NO;
+    
+    int64_t threshold = MAX(ANALYZE_MIN_CHANGES, (int64_t)(MAX(_analyzedRowCount, 0) * ANALYZE_CHANGE_RATIO));
+    
+    return (_changeCount >= threshold) ? YES : NO;
+}
+
+
+-(void)didAnalyze
+{
+    _changeCount = 0;
+    _analyzedRowCount = _rowCount;
+    _analyzedDate = [NSDate date];
+    _isChanged = YES;
+}
+
+
+@end
@@ -18,8 +18,17 @@
 #import "NTJsonColumn+Private.h"
 #import "NTJsonIndex+Private.h"
 #import "NTJsonObjectCache+Private.h"
+#import "NTJsonQueryCache+Private.h"
+#import "NTJsonUniqueKeyMap+Private.h"
+#import "NTJsonCursor+Private.h"
+#import "NTJsonChanges+Private.h"
+#import "NTJsonLiveQuery+Private.h"
+#import "NTJsonMetrics+Private.h"
+#import "NTJsonStatistics+Private.h"
 #import "NTJsonSqlConnection+Private.h"
 #import "NTJsonDictionary+Private.h"
+#import "NTJsonKeyDictionary+Private.h"
+#import "NTJsonBinaryCoder+Private.h"
 
 
 #define LOG(format, ...)            NSLog(format, ##__VA_ARGS__)
@@ -28,11 +37,19 @@
 
 
 extern NSString *NTJsonStore_MetadataTableName;
+extern NSString *NTJsonStore_ChangeLogTableName;
 
 
 @interface NTJsonStore (Private)
 
 @property (nonatomic,readonly) NTJsonSqlConnection *connection;
 
+-(NSString *)filenameForCollectionName:(NSString *)collectionName;  // the store file unless collectionFiles is enabled
+
+-(BOOL)saveMetadataWithKey:(NSString *)key value:(NSDictionary *)value connection:(NTJsonSqlConnection *)connection;  // on a connection to the store file, on its queue
+
+-(NTJsonSqlConnection *)checkoutReadConnectionWithFilename:(NSString *)filename;     // nil if read connections are disabled
+-(void)checkinReadConnection:(NTJsonSqlConnection *)readConnection;
+
 @end
 
@@ -24,6 +24,21 @@
 /// an exception will be thrown.
 @property (nonatomic,readwrite)      NSString *storeName;
 
+/// When YES, each collection is stored in its own SQLITE file next to the store file ("NTJsonStore.db" keeps the metadata and a collection
+/// named "users" is stored in "NTJsonStore.users.db".) Collections then write in parallel instead of waiting on a single write lock.
+/// Transactions attach the collection files to the store connection, they are atomic for each file but not across files. Collections
+/// cannot be created inside a transaction (collectionWithName: returns nil.) This must be set the same way each time the store is opened.
+/// It may be set until the first database access has been made, after that an exception will be thrown. Default: NO.
+@property (nonatomic,readwrite)      BOOL collectionFiles;
+
+/// Set to YES when other processes (app extensions for instance) write to the same store. Every write is then recorded in a change
+/// log and each collection checks PRAGMA data_version before using its caches. When another process has committed, only the rows it
+/// changed are evicted from the object cache (the query cache, unique key maps and statistics are reset) and they are reported to
+/// change observers and live queries. The check is one cached statement, each write adds a row to the log. Every process sharing the
+/// store should enable this. It may be set until the first database access has been made, after that an exception will be thrown.
+/// Default: NO.
+@property (nonatomic,readwrite)      BOOL detectExternalChanges;
+
 /// the full filename of the JsonStore file, storePath + storeName
 @property (nonatomic,readonly)      NSString *storeFilename;
 
@@ -33,6 +48,37 @@
 /// An array of all NTJsonCollections that exist in this store. The first time this is accessed, it will read the list of stores from the db.
 @property (nonatomic,readonly)      NSArray *collections;
 
+/// The number of read only connections used to run finds and counts in parallel. Each query is planned on its collection's queue
+/// (so it sees every write requested before it) and then run on one of these connections, so reads from different threads no
+/// longer wait on each other or on writes. 0 (the default) runs everything on the collection's own connection.
+@property (nonatomic,readwrite)     int readConnectionCount;
+
+/// When YES, every collection records performance metrics (see metrics.) May be changed at any time. When NO the overhead
+/// is a flag check per operation. Default: NO.
+@property (nonatomic,readwrite)     BOOL metricsEnabled;
+
+/// Queries slower than this (in seconds) are added to each collection's slow query log, along with the expanded SQL and
+/// EXPLAIN QUERY PLAN output, while metrics are enabled. 0 disables the log. Default: 0.1.
+@property (nonatomic,readwrite)     double slowQueryThreshold;
+
+/// Enables group commit when greater than 0. Asynchronous writes (beginInsert, beginUpdate, beginUpdateFields, beginUpdateWhere,
+/// beginRemove, beginRemoveWhere, beginInsertBatch and beginUpsertBatch) are then made in a transaction per collection that commits after
+/// this many seconds or groupCommitMaxWrites writes, whichever comes first. Their completion handlers are called once the shared commit completes (with the
+/// commit error if it fails.) Synchronous writes, sync/syncWait: and performTransaction: commit any waiting writes first. Keep this well
+/// under a second, other connections wait for the commit to write. May be changed at any time. Default: 0 (each write commits on its own.)
+@property (nonatomic,readwrite)     NSTimeInterval groupCommitInterval;
+
+/// The number of asynchronous writes that triggers a group commit before groupCommitInterval expires. Default: 1000.
+@property (nonatomic,readwrite)     int groupCommitMaxWrites;
+
+/// How hard SQLITE works to make commits durable, see NTJsonSynchronous. NTJsonSynchronousNormal is much faster and
+/// is safe from application crashes, a power loss may lose the most recent commits. May be changed at any time.
+/// Default: NTJsonSynchronousDefault.
+@property (nonatomic,readwrite)     NTJsonSynchronous synchronous;
+
+/// The metrics of each collection that has been opened, keyed by collection name. See -[NTJsonCollection metrics].
+@property (nonatomic,readonly)      NSDictionary *metrics;
+
 -(id)init;
 -(id)initWithName:(NSString *)storeName;
 -(id)initWithPath:(NSString *)storePath name:(NSString *)storeName;
@@ -44,6 +90,9 @@
 /// Close the underlying store and any underlying collections. Once explicitly closed, the store instance cannot be re-opened.
 -(void)close;
 
+/// Clears the metrics of all collections.
+-(void)resetMetrics;
+
 -(NSDictionary *)metadataWithKey:(NSString *)key;
 -(BOOL)saveMetadataWithKey:(NSString *)key value:(NSDictionary *)value;
 
@@ -84,6 +133,32 @@
 /// changed. If the NSDIctionary has been copied, the method will return NO. If caching has been disabled for the underlying collection (NTJsonCollection.cacheSize = -1), this methos will always return NO.
 +(BOOL)isJsonCurrent:(NSDictionary *)json;
 
+/// Runs transactionBlock with every operation it performs, across all collections, in a single SQLITE transaction. The transaction commits
+/// if the block returns YES and is rolled back if it returns NO. Collections switch to the store's connection for the duration, so all
+/// operations queued before the transaction complete first and other threads wait until it finishes. Object caches and change
+/// notifications are only updated if the transaction commits.
+/// @param transactionBlock the operations to perform. Use the synchronous collection methods here, asynchronous (begin...) calls made
+/// inside the block run after the transaction has completed and are not part of it. Transactions may be nested, the inner transaction
+/// becomes a savepoint.
+/// @param error receives the error if the transaction could not be started or committed. nil if the block returned NO.
+/// @returns YES if the transaction was committed.
+/// @note Transactions cannot be started from a collection or store queue (including completion handlers running on NTJsonStoreSerialQueue),
+/// NTJsonStoreErrorInvalidTransaction is returned. Schema changes made inside a transaction that is rolled back are lost.
+-(BOOL)performTransaction:(BOOL (^)())transactionBlock error:(NSError **)error;
+
+/// Runs transactionBlock in a single SQLITE transaction, see performTransaction:error:.
+-(BOOL)performTransaction:(BOOL (^)())transactionBlock;
+
+/// Runs transactionBlock in a single SQLITE transaction on a background thread, see performTransaction:error:.
+/// @param completionQueue the queue to execute the completion handler in. Passing nil will cause a default to be selected for you.
+/// @param completionHandler called with YES if the transaction was committed. May be nil.
+-(void)beginTransaction:(BOOL (^)())transactionBlock completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(BOOL success, NSError *error))completionHandler;
+
+/// Runs transactionBlock in a single SQLITE transaction on a background thread, see performTransaction:error:.
+/// @param completionHandler called with YES if the transaction was committed. May be nil. The completionHandler is run on the UI thread if the
+/// call is made from the UI thread, otherwise the call is made from a background thread.
+-(void)beginTransaction:(BOOL (^)())transactionBlock completionHandler:(void (^)(BOOL success, NSError *error))completionHandler;
+
 /// Executes the completionHandler once all pending operations for the passed collections have been completed. This is a convenient way to perform an
 /// operation that requires several operations across collections to be completed first.
 /// @param collections an array of collections to synchronize. Pass nil to sync all collections.
@@ -17,6 +17,25 @@
     NSMutableDictionary *_internalCollections;
     BOOL _isClosing;
     BOOL _isClosed;
+    
+    NSCondition *_readConnectionsCondition;  // protects everything below
+    int _readConnectionCount;
+    int _readConnectionsOpen;
+    int _nextReadConnectionId;
+    NSMutableArray *_idleReadConnections;
+    
+    BOOL _metricsEnabled;
+    double _slowQueryThreshold;
+    
+    NSTimeInterval _groupCommitInterval;
+    int _groupCommitMaxWrites;
+    NTJsonSynchronous _synchronous;
+    
+    NSMutableArray *_transactionCollections;    // the collections in the current transaction, only accessed on our queue
+    NSMutableArray *_attachedCollectionNames;   // collection files attached for the current transaction
+    
+    BOOL _collectionFiles;
+    BOOL _detectExternalChanges;
 }
 
 @property (nonatomic,readonly) NSMutableDictionary *internalCollections;
@@ -25,6 +44,11 @@
 
 
 NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
+NSString *NTJsonStore_ChangeLogTableName = @"NTJsonStore_changes";
+
+
+static const double DEFAULT_SLOW_QUERY_THRESHOLD = 0.1;
+static const int DEFAULT_GROUP_COMMIT_MAX_WRITES = 1000;
 
 
 @implementation NTJsonStore
@@ -38,6 +62,14 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
     {
         _storeName = storeName;
         _storePath = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) lastObject]; // default to Caches
+        
+        _readConnectionsCondition = [[NSCondition alloc] init];
+        _idleReadConnections = [NSMutableArray array];
+        
+        _slowQueryThreshold = DEFAULT_SLOW_QUERY_THRESHOLD;
+        
+        _groupCommitMaxWrites = DEFAULT_GROUP_COMMIT_MAX_WRITES;
+        _synchronous = NTJsonSynchronousDefault;
     }
     
     return self;
@@ -67,6 +99,11 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
         return ;    // never initialized
     }
     
+    // statistics are saved to our metadata, which can't happen once we are closing on the store queue...
+    
+    for(NTJsonCollection *collection in [self loadedCollections])
+        [collection saveStatistics];
+    
     _isClosing = YES;
     
     [self.connection dispatchSync:^
@@ -79,6 +116,8 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
         
         [self.connection close];
         
+        [self closeReadConnections];
+        
         _connection = nil;
         _internalCollections = nil;
         
@@ -112,11 +151,87 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
 }
 
 
+-(BOOL)collectionFiles
+{
+    return _collectionFiles;
+}
+
+
+-(void)setCollectionFiles:(BOOL)collectionFiles
+{
+    if ( _connection )
+        @throw [NSException exceptionWithName:@"StoreOpen" reason:@"Cannot set collectionFiles when store is already open." userInfo:nil];
+    
+    _collectionFiles = collectionFiles;
+}
+
+
+-(BOOL)detectExternalChanges
+{
+    return _detectExternalChanges;
+}
+
+
+-(void)setDetectExternalChanges:(BOOL)detectExternalChanges
+{
+    if ( _connection )
+        @throw [NSException exceptionWithName:@"StoreOpen" reason:@"Cannot set detectExternalChanges when store is already open." userInfo:nil];
+    
+    _detectExternalChanges = detectExternalChanges;
+}
+
+
+-(NSString *)collectionFilenamePrefix
+{
+    return [[self.storeName stringByDeletingPathExtension] stringByAppendingString:@"."];
+}
+
+
+-(NSString *)collectionFilenameSuffix
+{
+    return (self.storeName.pathExtension.length) ? [@"." stringByAppendingString:self.storeName.pathExtension] : @"";
+}
+
+
+-(NSString *)filenameForCollectionName:(NSString *)collectionName
+{
+    // NTJsonStore.db -> NTJsonStore.collection.db
+    
+    if ( !_collectionFiles )
+        return self.storeFilename;
+    
+    NSString *filename = [NSString stringWithFormat:@"%@%@%@", [self collectionFilenamePrefix], collectionName, [self collectionFilenameSuffix]];
+    
+    return [self.storePath stringByAppendingPathComponent:filename];
+}
+
+
+-(NSArray *)collectionNamesInCollectionFiles
+{
+    NSString *prefix = [self collectionFilenamePrefix];
+    NSString *suffix = [self collectionFilenameSuffix];
+    NSMutableArray *collectionNames = [NSMutableArray array];
+    
+    for(NSString *filename in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:self.storePath error:nil])
+    {
+        if ( filename.length <= prefix.length + suffix.length || ![filename hasPrefix:prefix] || ![filename hasSuffix:suffix] )
+            continue;
+        
+        NSString *collectionName = [filename substringWithRange:NSMakeRange(prefix.length, filename.length - prefix.length - suffix.length)];
+        
+        [collectionNames addObject:[collectionName lowercaseString]];
+    }
+    
+    return [collectionNames sortedArrayUsingSelector:@selector(compare:)];
+}
+
+
 -(NTJsonSqlConnection *)connection
 {
     if ( !_connection )
     {
         _connection = [[NTJsonSqlConnection alloc] initWithFilename:self.storeFilename connectionName:@"__store__"];
+        _connection.synchronous = _synchronous;
     }
     
     return _connection;
@@ -139,8 +254,17 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
             if ( [self validateEnvironment] )
             {
                 _internalCollections = [NSMutableDictionary dictionary];
-
-                sqlite3_stmt *statement = [self.connection statementWithSql:@"SELECT name FROM sqlite_master WHERE type = 'table' AND name NOT LIKE 'sqlite_%'  AND name <> ? ORDER BY 1;" args:@[NTJsonStore_MetadataTableName]];
+                
+                if ( _collectionFiles )
+                {
+                    for(NSString *collectionName in [self collectionNamesInCollectionFiles])
+                        _internalCollections[collectionName] = [[NTJsonCollection alloc] initWithStore:self name:collectionName];
+                    
+                    internalCollections = _internalCollections;
+                    return ;
+                }
+                
+                sqlite3_stmt *statement = [self.connection statementWithSql:@"SELECT name FROM sqlite_master WHERE type = 'table' AND name NOT LIKE 'sqlite_%'  AND name <> ? AND name <> ? ORDER BY 1;" args:@[NTJsonStore_MetadataTableName, NTJsonStore_ChangeLogTableName]];
                     
                 int status;
                 
@@ -179,6 +303,14 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
         
         collection = self.internalCollections[name];
         
+        if ( !collection && _transactionCollections && _collectionFiles )
+        {
+            // the new collection's file can't be attached once the transaction has started...
+            
+            LOG_ERROR(@"Collections cannot be created in a transaction when collectionFiles is enabled - %@", name);
+            return ;
+        }
+        
         if ( !collection )
         {
             // If collection was not found, create it...
@@ -188,6 +320,14 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
             collection = [[NTJsonCollection alloc] initNewCollectionWithStore:self name:name];
             
             self.internalCollections[name] = collection;
+            
+            // collections created in a transaction are part of it...
+            
+            if ( _transactionCollections )
+            {
+                [collection beginStoreTransaction];
+                [_transactionCollections addObject:collection];
+            }
         }
     }];
     
@@ -231,6 +371,245 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
 }
 
 
+#pragma mark - read connections
+
+
+-(int)readConnectionCount
+{
+    [_readConnectionsCondition lock];
+    int readConnectionCount = _readConnectionCount;
+    [_readConnectionsCondition unlock];
+    
+    return readConnectionCount;
+}
+
+
+-(void)setReadConnectionCount:(int)readConnectionCount
+{
+    [_readConnectionsCondition lock];
+    
+    _readConnectionCount = MAX(readConnectionCount, 0);
+    
+    // extra connections are closed as they are checked back in...
+    
+    while ( _readConnectionsOpen > _readConnectionCount && _idleReadConnections.count )
+    {
+        [self closeReadConnection:[_idleReadConnections lastObject]];
+        [_idleReadConnections removeLastObject];
+    }
+    
+    [_readConnectionsCondition broadcast];  // anyone waiting may be able to go now (or give up)
+    [_readConnectionsCondition unlock];
+}
+
+
+-(void)closeReadConnection:(NTJsonSqlConnection *)readConnection
+{
+    // must be called with the lock held...
+    
+    [readConnection dispatchSync:^{
+        [readConnection close];
+    }];
+    
+    --_readConnectionsOpen;
+}
+
+
+-(void)closeReadConnections
+{
+    [_readConnectionsCondition lock];
+    
+    for(NTJsonSqlConnection *readConnection in _idleReadConnections)
+        [self closeReadConnection:readConnection];
+    
+    [_idleReadConnections removeAllObjects];
+    _readConnectionCount = 0;
+    
+    [_readConnectionsCondition broadcast];
+    [_readConnectionsCondition unlock];
+}
+
+
+-(NTJsonSqlConnection *)checkoutReadConnectionWithFilename:(NSString *)filename
+{
+    // Returns an idle read only connection, waiting for one if they are all in use. Returns nil if read connections are
+    // disabled, in which case the caller should use the collection's own connection.
+    
+    NTJsonSqlConnection *readConnection = nil;
+    
+    [_readConnectionsCondition lock];
+    
+    while ( _readConnectionCount > 0 && !_idleReadConnections.count && _readConnectionsOpen >= _readConnectionCount )
+        [_readConnectionsCondition wait];
+    
+    if ( _readConnectionCount > 0 && [self validateEnvironment] )
+    {
+        // with collection files, idle connections may be open on another collection's file...
+        
+        for(NSInteger index=_idleReadConnections.count-1; index>=0 && !readConnection; index--)
+        {
+            if ( [[_idleReadConnections[index] filename] isEqualToString:filename] )
+            {
+                readConnection = _idleReadConnections[index];
+                [_idleReadConnections removeObjectAtIndex:index];
+            }
+        }
+        
+        if ( !readConnection && _readConnectionsOpen >= _readConnectionCount )
+        {
+            [self closeReadConnection:[_idleReadConnections firstObject]];  // the least recently used
+            [_idleReadConnections removeObjectAtIndex:0];
+        }
+        
+        if ( !readConnection )
+        {
+            NSString *connectionName = [NSString stringWithFormat:@"__read%d__", _nextReadConnectionId++];
+            
+            readConnection = [[NTJsonSqlConnection alloc] initWithFilename:filename connectionName:connectionName isReadOnly:YES];
+            ++_readConnectionsOpen;
+        }
+    }
+    
+    [_readConnectionsCondition unlock];
+    
+    return readConnection;
+}
+
+
+-(void)checkinReadConnection:(NTJsonSqlConnection *)readConnection
+{
+    if ( !readConnection )
+        return ;
+    
+    [_readConnectionsCondition lock];
+    
+    if ( _readConnectionsOpen > _readConnectionCount || ![self validateEnvironment] )
+        [self closeReadConnection:readConnection];
+    else
+        [_idleReadConnections addObject:readConnection];
+    
+    [_readConnectionsCondition signal];
+    [_readConnectionsCondition unlock];
+}
+
+
+#pragma mark - metrics
+
+
+-(NSArray *)loadedCollections
+{
+    // only the collections that already exist, we don't want to open the store just to configure metrics...
+    
+    if ( !_connection )
+        return @[];
+    
+    __block NSArray *collections;
+    
+    [self.connection dispatchSync:^{
+        collections = (_internalCollections) ? _internalCollections.allValues : @[];
+    }];
+    
+    return collections;
+}
+
+
+-(BOOL)metricsEnabled
+{
+    return _metricsEnabled;
+}
+
+
+-(void)setMetricsEnabled:(BOOL)metricsEnabled
+{
+    _metricsEnabled = metricsEnabled;
+    
+    for(NTJsonCollection *collection in [self loadedCollections])
+        collection.metricsEnabled = metricsEnabled;
+}
+
+
+-(double)slowQueryThreshold
+{
+    return _slowQueryThreshold;
+}
+
+
+-(void)setSlowQueryThreshold:(double)slowQueryThreshold
+{
+    _slowQueryThreshold = slowQueryThreshold;
+    
+    for(NTJsonCollection *collection in [self loadedCollections])
+        collection.slowQueryThreshold = slowQueryThreshold;
+}
+
+
+-(NSDictionary *)metrics
+{
+    NSMutableDictionary *metrics = [NSMutableDictionary dictionary];
+    
+    for(NTJsonCollection *collection in [self loadedCollections])
+        metrics[collection.name] = collection.metrics;
+    
+    return [metrics copy];
+}
+
+
+-(void)resetMetrics
+{
+    for(NTJsonCollection *collection in [self loadedCollections])
+        [collection resetMetrics];
+}
+
+
+#pragma mark - durability
+
+
+-(NSTimeInterval)groupCommitInterval
+{
+    return _groupCommitInterval;
+}
+
+
+-(void)setGroupCommitInterval:(NSTimeInterval)groupCommitInterval
+{
+    _groupCommitInterval = MAX(groupCommitInterval, 0);
+}
+
+
+-(int)groupCommitMaxWrites
+{
+    return _groupCommitMaxWrites;
+}
+
+
+-(void)setGroupCommitMaxWrites:(int)groupCommitMaxWrites
+{
+    _groupCommitMaxWrites = MAX(groupCommitMaxWrites, 1);
+}
+
+
+-(NTJsonSynchronous)synchronous
+{
+    return _synchronous;
+}
+
+
+-(void)setSynchronous:(NTJsonSynchronous)synchronous
+{
+    _synchronous = synchronous;
+    
+    if ( _connection )
+    {
+        [_connection dispatchAsync:^{
+            _connection.synchronous = synchronous;
+        }];
+    }
+    
+    for(NTJsonCollection *collection in [self loadedCollections])
+        [collection applySynchronous:synchronous];
+}
+
+
 #pragma mark - metadata
 
 
@@ -277,48 +656,61 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
 }
 
 
--(BOOL)saveMetadataWithKey:(NSString *)key value:(NSDictionary *)value
+-(BOOL)saveMetadataWithKey:(NSString *)key value:(NSDictionary *)value connection:(NTJsonSqlConnection *)connection
 {
-    __block BOOL success = NO;
+    // Must be called on the connection's queue. Only the store connection creates the table, anyone else would be
+    // waiting on their own write lock...
     
-    [self.connection dispatchSync:^{
+    BOOL success = NO;
+    
+    if ( value ) // insert or update
+    {
+        NSString *sql = [NSString stringWithFormat:@"UPDATE [%@] SET [value] = ? WHERE [key] = ?;", NTJsonStore_MetadataTableName];
         
-        if ( value ) // insert or update
+        NSString *json = (value) ? [[NSString alloc] initWithData:[NSJSONSerialization dataWithJSONObject:value options:0 error:nil] encoding:NSUTF8StringEncoding] : @"{}";
+        
+        if ( ![connection execSql:sql args:@[json, key] cached:YES] )
         {
-            NSString *sql = [NSString stringWithFormat:@"UPDATE [%@] SET [value] = ? WHERE [key] = ?;", NTJsonStore_MetadataTableName];
-            
-            NSString *json = (value) ? [[NSString alloc] initWithData:[NSJSONSerialization dataWithJSONObject:value options:0 error:nil] encoding:NSUTF8StringEncoding] : @"{}";
+            // Hmm, this is most likely to happen because the table doesn't exist, so let's make sure that's all set.
             
-            if ( ![self.connection execSql:sql args:@[json, key]] )
-            {
-                // Hmm, this is most likely to happen because the table doesn't exist, so let's make sure that's all set.
-                
+            if ( connection == self.connection )
                 [self createMetadataTable];
-                
-                success = NO; // now try an insert
-            }
-            else
-            {
-                success = (sqlite3_changes(self.connection.db) == 1) ? YES : NO; // try insert if
-            }
             
-            if ( !success )
-            {
-                sql = [NSString stringWithFormat:@"INSERT INTO [%@] ([key], [value]) VALUES (?, ?);", NTJsonStore_MetadataTableName];
-                
-                success = [self.connection execSql:sql args:@[key, json]];
-            }
+            success = NO; // now try an insert
+        }
+        else
+        {
+            success = (sqlite3_changes(connection.db) == 1) ? YES : NO; // try insert if
         }
         
-        else // delete
+        if ( !success )
         {
-            [self.connection execSql:[NSString stringWithFormat:@"DELETE FROM [%@] WHERE [key] = ?;", NTJsonStore_MetadataTableName] args:@[key]];
+            sql = [NSString stringWithFormat:@"INSERT INTO [%@] ([key], [value]) VALUES (?, ?);", NTJsonStore_MetadataTableName];
             
-            success = YES;  // pretty much always consider this successful
+            success = [connection execSql:sql args:@[key, json] cached:YES];
         }
+    }
+    
+    else // delete
+    {
+        [connection execSql:[NSString stringWithFormat:@"DELETE FROM [%@] WHERE [key] = ?;", NTJsonStore_MetadataTableName] args:@[key] cached:YES];
         
-        if ( !success )
-            LOG_ERROR(@"Failed to update metadata for key %@: %@", key, self.connection.lastError.localizedDescription);
+        success = YES;  // pretty much always consider this successful
+    }
+    
+    if ( !success )
+        LOG_ERROR(@"Failed to update metadata for key %@: %@", key, connection.lastError.localizedDescription);
+    
+    return success;
+}
+
+
+-(BOOL)saveMetadataWithKey:(NSString *)key value:(NSDictionary *)value
+{
+    __block BOOL success = NO;
+    
+    [self.connection dispatchSync:^{
+        success = [self saveMetadataWithKey:key value:value connection:self.connection];
     }];
     
     return success;
@@ -369,6 +761,14 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
     
     NSString *storePath = config[@"storePath"];
     NSString *storeName = config[@"storeName"];
+    NSNumber *collectionFiles = config[@"collectionFiles"];
+    NSNumber *detectExternalChanges = config[@"detectExternalChanges"];
+    NSNumber *readConnectionCount = config[@"readConnectionCount"];
+    NSNumber *metricsEnabled = config[@"metricsEnabled"];
+    NSNumber *slowQueryThreshold = config[@"slowQueryThreshold"];
+    NSNumber *groupCommitInterval = config[@"groupCommitInterval"];
+    NSNumber *groupCommitMaxWrites = config[@"groupCommitMaxWrites"];
+    NSString *synchronous = config[@"synchronous"];
     NSDictionary *collections = config[@"collections"];
     
     if ( [storePath isKindOfClass:[NSString class]] && storePath.length )
@@ -390,6 +790,62 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
         self.storeName = storeName;
     }
     
+    if ( [collectionFiles isKindOfClass:[NSNumber class]] )
+    {
+        self.collectionFiles = [collectionFiles boolValue];
+    }
+    
+    if ( [detectExternalChanges isKindOfClass:[NSNumber class]] )
+    {
+        self.detectExternalChanges = [detectExternalChanges boolValue];
+    }
+    
+    if ( [readConnectionCount isKindOfClass:[NSNumber class]] )
+    {
+        self.readConnectionCount = [readConnectionCount intValue];
+    }
+    
+    if ( [metricsEnabled isKindOfClass:[NSNumber class]] )
+    {
+        self.metricsEnabled = [metricsEnabled boolValue];
+    }
+    
+    if ( [slowQueryThreshold isKindOfClass:[NSNumber class]] )
+    {
+        self.slowQueryThreshold = [slowQueryThreshold doubleValue];
+    }
+    
+    if ( [groupCommitInterval isKindOfClass:[NSNumber class]] )
+    {
+        self.groupCommitInterval = [groupCommitInterval doubleValue];
+    }
+    
+    if ( [groupCommitMaxWrites isKindOfClass:[NSNumber class]] )
+    {
+        self.groupCommitMaxWrites = [groupCommitMaxWrites intValue];
+    }
+    
+    if ( [synchronous isKindOfClass:[NSString class]] )
+    {
+        if ( [synchronous isEqualToString:@"default"] )
+            self.synchronous = NTJsonSynchronousDefault;
+        
+        else if ( [synchronous isEqualToString:@"off"] )
+            self.synchronous = NTJsonSynchronousOff;
+        
+        else if ( [synchronous isEqualToString:@"normal"] )
+            self.synchronous = NTJsonSynchronousNormal;
+        
+        else if ( [synchronous isEqualToString:@"full"] )
+            self.synchronous = NTJsonSynchronousFull;
+        
+        else if ( [synchronous isEqualToString:@"extra"] )
+            self.synchronous = NTJsonSynchronousExtra;
+        
+        else
+            LOG_ERROR(@"Unknown synchronous: %@", synchronous);
+    }
+    
     if ( [collections isKindOfClass:[NSDictionary class]] )
     {
         for(NSString *collectionName in collections.allKeys)
@@ -479,6 +935,216 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
 }
 
 
+#pragma mark - transactions
+
+
+-(BOOL)attachCollectionFiles:(NSArray *)collections
+{
+    // With collection files, each collection's file is attached to our connection for the transaction. Table names are unique
+    // across the files so the collections' SQL works unchanged...
+    
+    if ( !_collectionFiles )
+        return YES;
+    
+    // anything we couldn't detach after the last transaction would make ATTACH fail...
+    
+    if ( ![self detachCollectionFiles] )
+        return NO;
+    
+    _attachedCollectionNames = [NSMutableArray array];
+    
+    for(NTJsonCollection *collection in collections)
+    {
+        NSString *sql = [NSString stringWithFormat:@"ATTACH DATABASE ? AS [%@_db];", collection.name];
+        
+        if ( ![self.connection execSql:sql args:@[[self filenameForCollectionName:collection.name]]] )
+        {
+            LOG_ERROR(@"Unable to attach collection %@ - %@", collection.name, self.connection.lastError.localizedDescription);
+            return NO;
+        }
+        
+        [_attachedCollectionNames addObject:collection.name];
+    }
+    
+    return YES;
+}
+
+
+-(BOOL)detachCollectionFiles
+{
+    // SQLITE refuses to DETACH inside a transaction (or with statements still running), anything that fails stays in
+    // the list and is retried before the next attach. lastError is set on failure...
+    
+    if ( !_attachedCollectionNames.count )
+        return YES;
+    
+    [self.connection flushStatementCache];
+    
+    NSMutableArray *failedCollectionNames = [NSMutableArray array];
+    
+    for(NSString *collectionName in _attachedCollectionNames)
+    {
+        if ( ![self.connection execSql:[NSString stringWithFormat:@"DETACH DATABASE [%@_db];", collectionName] args:nil] )
+        {
+            LOG_ERROR(@"Unable to detach collection %@ - %@", collectionName, self.connection.lastError.localizedDescription);
+            [failedCollectionNames addObject:collectionName];
+        }
+    }
+    
+    _attachedCollectionNames = (failedCollectionNames.count) ? failedCollectionNames : nil;
+    
+    return (failedCollectionNames.count) ? NO : YES;
+}
+
+
+-(BOOL)performNestedTransaction:(BOOL (^)())transactionBlock error:(NSError **)error
+{
+    // we are already in a transaction on our queue, this becomes a savepoint within it...
+    
+    NSString *transactionId = [self.connection beginTransaction];
+    
+    if ( !transactionId )
+    {
+        if ( error )
+            *error = self.connection.lastError;
+        
+        return NO;
+    }
+    
+    NSError *transactionError = nil;
+    BOOL success = transactionBlock();
+    
+    if ( success && ![self.connection commitTransation:transactionId] )
+    {
+        transactionError = self.connection.lastError;
+        success = NO;
+    }
+    
+    if ( !success )
+    {
+        [self.connection rollbackTransation:transactionId];
+        
+        for(NTJsonCollection *collection in _transactionCollections)
+            [collection storeTransactionDidRollbackSavepoint];
+    }
+    
+    if ( error )
+        *error = transactionError;
+    
+    return success;
+}
+
+
+-(BOOL)performTransaction:(BOOL (^)())transactionBlock error:(NSError **)error
+{
+    if ( error )
+        *error = nil;
+    
+    if ( [self.connection isCurrentQueue] )
+    {
+        if ( _transactionCollections )
+            return [self performNestedTransaction:transactionBlock error:error];
+        
+        if ( error )
+            *error = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidTransaction];
+        
+        return NO;
+    }
+    
+    NSArray *collections = self.collections;
+    
+    for(NTJsonCollection *collection in collections)
+    {
+        if ( [collection.connection isCurrentQueue] )
+        {
+            if ( error )
+                *error = [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorInvalidTransaction];
+            
+            return NO;
+        }
+    }
+    
+    // Each collection finishes what's already queued, then suspends its queue and runs on our connection until the
+    // transaction completes. Everything in the transaction block runs on our queue in a single SQLITE transaction...
+    
+    for(NTJsonCollection *collection in collections)
+        [collection beginStoreTransaction];
+    
+    __block BOOL success = NO;
+    __block NSError *transactionError = nil;
+    
+    [self.connection dispatchSync:^{
+        _transactionCollections = [collections mutableCopy];
+        
+        BOOL isAttached = ( [self validateEnvironment] && [self attachCollectionFiles:collections] );
+        NSString *transactionId = (isAttached) ? [self.connection beginTransaction] : nil;
+        
+        if ( !transactionId )
+            transactionError = ([self validateEnvironment]) ? self.connection.lastError : [NSError NTJsonStore_errorWithCode:NTJsonStoreErrorClosed];
+        
+        else
+        {
+            success = transactionBlock();
+            
+            if ( success && ![self.connection commitTransation:transactionId] )
+            {
+                transactionError = self.connection.lastError;
+                success = NO;
+            }
+            
+            if ( !success )
+                [self.connection rollbackTransation:transactionId];
+        }
+        
+        // caches and change notifications are only updated once we know the outcome...
+        
+        for(NTJsonCollection *collection in _transactionCollections)
+            [collection endStoreTransactionWithCommit:success];
+        
+        _transactionCollections = nil;
+        
+        [self detachCollectionFiles];   // failures are logged and retried before the next attach
+    }];
+    
+    if ( error )
+        *error = transactionError;
+    
+    return success;
+}
+
+
+-(BOOL)performTransaction:(BOOL (^)())transactionBlock
+{
+    return [self performTransaction:transactionBlock error:nil];
+}
+
+
+-(void)beginTransaction:(BOOL (^)())transactionBlock completionQueue:(dispatch_queue_t)completionQueue completionHandler:(void (^)(BOOL success, NSError *error))completionHandler
+{
+    completionQueue = [self getCompletionQueue:completionQueue];
+    
+    // the transaction waits for each collection's queue, so it can't start from any of them...
+    
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSError *error;
+        BOOL success = [self performTransaction:transactionBlock error:&error];
+        
+        if ( completionHandler )
+        {
+            dispatch_async(completionQueue, ^{
+                completionHandler(success, error);
+            });
+        }
+    });
+}
+
+
+-(void)beginTransaction:(BOOL (^)())transactionBlock completionHandler:(void (^)(BOOL success, NSError *error))completionHandler
+{
+    [self beginTransaction:transactionBlock completionQueue:nil completionHandler:completionHandler];
+}
+
+
 #pragma mark - sync
 
 
@@ -493,11 +1159,7 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
     });
     
     for (NTJsonCollection *collection in collections)
-    {
-        dispatch_group_async(group, collection.connection.queue, ^{
-            // we don't actually need to do anything here specific...
-        });
-    }
+        [collection addPendingOperationsToGroup:group];
     
     dispatch_group_notify(group, completionQueue, completionHandler);
 }
@@ -524,11 +1186,7 @@ NSString *NTJsonStore_MetadataTableName = @"NTJsonStore_metadata";
     });
     
     for (NTJsonCollection *collection in collections)
-    {
-        dispatch_group_async(group, collection.connection.queue, ^{
-            // we don't actually need to do anything here specific...
-        });
-    }
+        [collection addPendingOperationsToGroup:group];
     
     dispatch_group_wait(group, timeout);
 }
@@ -25,11 +25,42 @@ extern NSString *NTJsonStoreErrorDomain;        // code = NTJsonStoreErrorCode
 extern NSString *NTJsonStoreSqliteErrorDomain;  // code = SQLITE_??? error
 
 
+/// How queryable fields are stored in SQLITE.
+typedef enum
+{
+    NTJsonColumnModeMaterialized = 0,   // values are copied into real columns on every insert/update. Fastest queries. (Default)
+    NTJsonColumnModeVirtual = 1,        // VIRTUAL generated columns computed from the JSON. Free to add, nothing extra to write. Requires SQLITE 3.31.
+    NTJsonColumnModeExpression = 2,     // no columns at all, queries and indexes use json_extract() expressions directly.
+} NTJsonColumnMode;
+
+
+/// How JSON documents are stored in SQLITE.
+typedef enum
+{
+    NTJsonDocumentFormatText = 0,       // standard JSON text. (Default)
+    NTJsonDocumentFormatBinary = 1,     // compact binary encoding with a per-collection key dictionary. Much faster to decode. Requires NTJsonColumnModeMaterialized.
+} NTJsonDocumentFormat;
+
+
+/// How hard SQLITE works to make each commit durable (PRAGMA synchronous.)
+typedef enum
+{
+    NTJsonSynchronousDefault = -1,      // SQLITE's compiled in default, usually FULL. (Default)
+    NTJsonSynchronousOff = 0,           // never syncs. Fastest, but an OS crash or power loss may corrupt the database.
+    NTJsonSynchronousNormal = 1,        // commits aren't synced in WAL mode. A power loss may lose recent commits but won't corrupt the database.
+    NTJsonSynchronousFull = 2,          // every commit is synced.
+    NTJsonSynchronousExtra = 3,         // FULL, plus the directory is synced when the journal is removed.
+} NTJsonSynchronous;
+
+
 typedef enum
 {
     NTJsonStoreErrorInvalidSqlArgument = 1,
     NTJsonStoreErrorInvalidSqlResult = 2,
     NTJsonStoreErrorClosed = 3,     // connection or store closed
+    NTJsonStoreErrorInvalidDocumentFormat = 4,  // stored document could not be encoded or decoded
+    NTJsonStoreErrorInvalidTransaction = 5,     // transaction started from a collection or store queue
+    NTJsonStoreErrorNotFound = 6,               // the item to update does not exist
 } NTJsonStoreErrorCode;
 
 
@@ -0,0 +1,30 @@
+//
+//  NTJsonUniqueKeyMap+Private.h
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "NTJsonStoreTypes.h"
+
+
+/// An in-memory map from the values of a single column unique index to their rowids. Maps are loaded in the background and
+/// can only answer lookups once isLoaded is set. Must only be accessed on the collection queue.
+@interface NTJsonUniqueKeyMap : NSObject
+
+@property (nonatomic,readonly) NSString *columnName;
+@property (nonatomic) BOOL isLoaded;
+@property (nonatomic,readonly) NSUInteger count;
+
+-(id)initWithColumnName:(NSString *)columnName;
+
+-(NSNumber *)rowidForValue:(id)value;   // nil if the value isn't present
+
+-(void)setValue:(id)value forRowId:(NTJsonRowId)rowid;  // nil or NSNull removes the rowid
+-(void)removeRowId:(NTJsonRowId)rowid;
+-(void)removeAll;
+
+@end
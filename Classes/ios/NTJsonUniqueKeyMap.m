@@ -0,0 +1,96 @@
+//
+//  NTJsonUniqueKeyMap.m
+//  NTJsonStoreSample
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 NagelTech. All rights reserved.
+//
+
+#import "NTJsonStore+Private.h"
+
+
+@interface NTJsonUniqueKeyMap ()
+{
+    NSMutableDictionary *_rowids;   // value -> rowid
+    NSMutableDictionary *_values;   // rowid -> value, so updates can remove the old value
+}
+
+@end
+
+
+@implementation NTJsonUniqueKeyMap
+
+
+-(id)initWithColumnName:(NSString *)columnName
+{
+    self = [super init];
+    
+    if ( self )
+    {
+        _columnName = columnName;
+        _rowids = [NSMutableDictionary dictionary];
+        _values = [NSMutableDictionary dictionary];
+    }
+    
+    return self;
+}
+
+
+-(NSUInteger)count
+{
+    return _rowids.count;
+}
+
+
+-(NSNumber *)rowidForValue:(id)value
+{
+    if ( !value )
+        return nil;
+    
+    return _rowids[value];
+}
+
+
+-(void)setValue:(id)value forRowId:(NTJsonRowId)rowid
+{
+    NSNumber *rowidNumber = @(rowid);
+    id oldValue = _values[rowidNumber];
+    
+    if ( oldValue )
+    {
+        if ( [oldValue isEqual:value] )
+            return ;
+        
+        // only remove the old mapping if it's still ours...
+        
+        if ( [_rowids[oldValue] isEqualToNumber:rowidNumber] )
+            [_rowids removeObjectForKey:oldValue];
+        
+        [_values removeObjectForKey:rowidNumber];
+    }
+    
+    // NULLs are never equal in SQL (and may repeat in a unique index) so they are never mapped. Only strings and
+    // numbers can be compared the way SQLite does...
+    
+    if ( ![value isKindOfClass:[NSString class]] && ![value isKindOfClass:[NSNumber class]] )
+        return ;
+    
+    _rowids[value] = rowidNumber;
+    _values[rowidNumber] = value;
+}
+
+
+-(void)removeRowId:(NTJsonRowId)rowid
+{
+    [self setValue:nil forRowId:rowid];
+}
+
+
+-(void)removeAll
+{
+    [_rowids removeAllObjects];
+    [_values removeAllObjects];
+}
+
+
+@end
@@ -7,6 +7,7 @@
 //
 
 #import <XCTest/XCTest.h>
+#import <sqlite3.h>
 
 @interface NTJsonStoreTests : BaseTestCase
 
@@ -170,6 +171,425 @@
 }
 
 
+-(void)testStatementCache
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    for(int uid=1; uid<=50; uid++)
+        [collection1 insert:@{@"uid": @(uid)}];
+    
+    // the same query with different args reuses its statement...
+    
+    int hits = [collection1.metrics[@"statementCache"][@"hits"] intValue];
+    
+    for(int uid=1; uid<=10; uid++)
+        XCTAssertEqual([collection1 findWhere:@"[uid] = ?" args:@[@(uid)] orderBy:nil].count, 1, @"find failed");
+    
+    XCTAssertGreaterThanOrEqual([collection1.metrics[@"statementCache"][@"hits"] intValue] - hits, 9, @"statement not reused");
+    
+    // ...and queries with their values in the SQL are evicted once the cache is full (32 by default)...
+    
+    for(int uid=1; uid<=50; uid++)
+        XCTAssertEqual([collection1 findWhere:[NSString stringWithFormat:@"[uid] = %d", uid] args:nil orderBy:nil].count, 1, @"find failed");
+    
+    XCTAssertLessThanOrEqual([collection1.metrics[@"statementCache"][@"cachedCount"] intValue], 32, @"statements not evicted");
+    
+    // every statement is finalized on close, otherwise the database stays open and keeps its WAL file...
+    
+    NSString *walFilename = [self.store.storeFilename stringByAppendingString:@"-wal"];
+    
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:walFilename], @"WAL file missing");
+    
+    [self.store close];
+    
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:walFilename], @"database not closed");
+}
+
+
+-(void)testBulkInsert
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    collection1.serializationChunkSize = 7; // make sure we get several chunks
+    
+    [collection1 addUniqueIndexWithKeys:@"[uid]"];
+    [collection1 addQueryableFields:@"[name]"];
+    
+    NSMutableArray *items = [NSMutableArray array];
+    
+    for(int uid=1; uid<=100; uid++)
+        [items addObject:@{@"uid": @(uid), @"name": [NSString stringWithFormat:@"Item %d", uid]}];
+    
+    NSError *error;
+    NSArray *rowids = [collection1 bulkInsert:items error:&error];
+    
+    XCTAssertNotNil(rowids, @"bulkInsert failed - %@", error);
+    XCTAssert(rowids.count == items.count, @"bulkInsert returned the wrong number of rowids");
+    
+    NSArray *actualItems = [collection1 findWhere:nil args:nil orderBy:@"[uid]"];
+    
+    [self compareExpectedItems:items actualItems:actualItems operation:@"find after bulkInsert"];
+    
+    for(int index=0; index<MIN(rowids.count, actualItems.count); index++)
+        XCTAssert([actualItems[index][NTJsonRowIdKey] isEqualToNumber:rowids[index]], @"bulkInsert rowid mismatch at index %d", index);
+    
+    // A duplicate key anywhere in the batch should roll back the whole thing...
+    
+    NSArray *badItems = @[@{@"uid": @(1000), @"name": @"New"}, @{@"uid": @(1), @"name": @"Duplicate"}];
+    
+    XCTAssertNil([collection1 bulkInsert:badItems error:&error], @"bulkInsert allowed a duplicate key");
+    XCTAssert([collection1 countWhere:@"[uid] = 1000" args:nil] == 0, @"bulkInsert did not roll back");
+}
+
+
+-(void)testMaterialization
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    collection1.materializationBatchSize = 10;
+    
+    NSMutableArray *items = [NSMutableArray array];
+    
+    for(int uid=1; uid<=100; uid++)
+        [items addObject:@{@"uid": @(uid), @"name": [NSString stringWithFormat:@"Name %d", uid], @"code": @(uid % 50)}];
+    
+    [collection1 insertBatch:items];
+    
+    // progress is reported on the main thread, so we keep its run loop going while we wait...
+    
+    __block NSMutableArray *progress = [NSMutableArray array];
+    
+    collection1.materializationProgressHandler = ^(NSArray *columnNames, float value) {
+        [progress addObject:@(value)];
+    };
+    
+    BOOL (^waitForMaterialization)() = ^BOOL{
+        NSDate *timeout = [NSDate dateWithTimeIntervalSinceNow:10];
+        
+        while ( ![progress.lastObject isEqual:@1] && [timeout timeIntervalSinceNow] > 0 )
+            [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+        
+        return [progress.lastObject isEqual:@1];
+    };
+    
+    // queries on a new field work while it's being materialized, column names inside quotes are left alone...
+    
+    [collection1 addQueryableFields:@"[name]"];
+    
+    XCTAssertEqualObjects([collection1 findOneWhere:@"[name] = ?" args:@[@"Name 75"]][@"uid"], @75, @"find while materializing failed");
+    XCTAssertEqual([collection1 countWhere:@"[name] <> '[name]'" args:nil], 100, @"quoted column name was resolved");
+    
+    XCTAssertTrue(waitForMaterialization(), @"materialization didn't complete");
+    XCTAssertGreaterThan(progress.count, 1, @"progress not reported for each batch");
+    XCTAssertEqualObjects(progress, [progress sortedArrayUsingSelector:@selector(compare:)], @"progress went backwards");
+    
+    XCTAssertEqualObjects([collection1 findOneWhere:@"[name] = ?" args:@[@"Name 75"]][@"uid"], @75, @"find after materializing failed");
+    
+    [self.store close];
+    
+    // pretend the app exited half way through, materialization picks up where it left off...
+    
+    sqlite3 *db;
+    
+    XCTAssertEqual(sqlite3_open(self.store.storeFilename.UTF8String, &db), SQLITE_OK, @"open failed");
+    XCTAssertEqual(sqlite3_exec(db, "UPDATE [collection1] SET [name] = NULL WHERE [__rowid__] > 50;", NULL, NULL, NULL), SQLITE_OK, @"update failed");
+    XCTAssertEqual(sqlite3_exec(db, "INSERT INTO [NTJsonStore_metadata] ([key], [value]) VALUES ('collection1/materialization', '{\"columns\":[\"name\"],\"lastRowId\":50,\"maxRowId\":100}');", NULL, NULL, NULL), SQLITE_OK, @"insert failed");
+    sqlite3_close(db);
+    
+    NTJsonStore *store = [[NTJsonStore alloc] initWithPath:self.store.storePath name:self.store.storeName];
+    NTJsonCollection *collection = [store collectionWithName:@"collection1"];
+    
+    [progress removeAllObjects];
+    collection.materializationProgressHandler = collection1.materializationProgressHandler;
+    
+    XCTAssertEqualObjects([collection findOneWhere:@"[name] = ?" args:@[@"Name 75"]][@"uid"], @75, @"find while resuming failed");
+    XCTAssertTrue(waitForMaterialization(), @"materialization didn't resume");
+    XCTAssertGreaterThanOrEqual([progress.firstObject floatValue], 0.5, @"materialization started over");
+    
+    XCTAssertEqual([collection countWhere:@"[name] IS NULL" args:nil], 0, @"rows not materialized");
+    
+    // a unique index on a field that is still being materialized fails like any other duplicate...
+    
+    collection.materializationBatchSize = 1000;
+    [collection addUniqueIndexWithKeys:@"[code]"];
+    
+    NSError *error;
+    
+    XCTAssertFalse([collection ensureSchemaWithError:&error], @"unique index with duplicates created");
+    XCTAssertNotNil(error, @"no error for duplicates");
+    
+    [store close];
+}
+
+
+-(void)testColumnModes
+{
+    // finds rows by [code], reporting whether SQLITE used an index to do it...
+    
+    NSArray *(^findCode)(NTJsonCollection *, id, BOOL *) = ^NSArray *(NTJsonCollection *collection, id code, BOOL *usedIndex) {
+        collection.metricsEnabled = YES;
+        collection.slowQueryThreshold = 0.000001;   // everything is slow, so every query plan is logged
+        [collection resetMetrics];
+        
+        NSArray *items = [collection findWhere:@"[code] = ?" args:@[code] orderBy:nil];
+        NSArray *queryPlan = [collection.metrics[@"slowQueries"] lastObject][@"queryPlan"];
+        
+        *usedIndex = [[queryPlan componentsJoinedByString:@"\n"] rangeOfString:@"INDEX"].location != NSNotFound;
+        
+        return items;
+    };
+    
+    NSMutableArray *items = [NSMutableArray array];
+    
+    for(int uid=1; uid<=100; uid++)
+        [items addObject:(uid % 10) ? @{@"uid": @(uid), @"code": @(uid % 10)} : @{@"uid": @(uid)}];  // every 10th row gets the default
+    
+    NSDictionary *collectionModes = @{@"expression": @(NTJsonColumnModeExpression), @"virtual": @(NTJsonColumnModeVirtual)};
+    BOOL usedIndex;
+    NSError *error;
+    
+    for(NSString *name in collectionModes)
+    {
+        NTJsonCollection *collection = [self.store collectionWithName:name];
+        
+        collection.columnMode = [collectionModes[name] intValue];
+        collection.defaultJson = @{@"code": @0};
+        [collection addIndexWithKeys:@"[code]"];
+        [collection insertBatch:items];
+        
+        XCTAssertTrue([collection ensureSchemaWithError:&error], @"%@ schema failed - %@", name, error);
+        XCTAssertEqual(findCode(collection, @0, &usedIndex).count, 10, @"%@ find with default failed", name);
+        XCTAssertTrue(usedIndex, @"%@ index not used", name);
+    }
+    
+    // an existing collection is migrated when the mode changes...
+    
+    NTJsonCollection *migrated = [self.store collectionWithName:@"migrated"];
+    
+    [migrated addIndexWithKeys:@"[code]"];
+    [migrated insertBatch:items];
+    XCTAssertTrue([migrated ensureSchemaWithError:&error], @"materialized schema failed - %@", error);
+    
+    migrated.columnMode = NTJsonColumnModeExpression;
+    migrated.defaultJson = @{@"code": @0};
+    
+    XCTAssertEqual(findCode(migrated, @0, &usedIndex).count, 10, @"find after migration failed");
+    XCTAssertTrue(usedIndex, @"index not used after migration");
+    XCTAssertEqual([migrated count], 100, @"rows lost in migration");
+    
+    // a mode change that hasn't been applied yet must still be migrated after a reopen...
+    
+    NTJsonCollection *pending = [self.store collectionWithName:@"pending"];
+    
+    [pending addIndexWithKeys:@"[code]"];
+    [pending insertBatch:items];
+    XCTAssertTrue([pending ensureSchemaWithError:&error], @"materialized schema failed - %@", error);
+    
+    pending.columnMode = NTJsonColumnModeVirtual;
+    [pending sync];
+    
+    [self.store close];
+    
+    // expression columns and the indexes on them must survive a reopen...
+    
+    NTJsonStore *store = [[NTJsonStore alloc] initWithPath:self.store.storePath name:self.store.storeName];
+    
+    NSMutableDictionary *reopenModes = [collectionModes mutableCopy];
+    
+    reopenModes[@"migrated"] = @(NTJsonColumnModeExpression);
+    reopenModes[@"pending"] = @(NTJsonColumnModeVirtual);
+    
+    for(NSString *name in reopenModes)
+    {
+        NTJsonCollection *collection = [store collectionWithName:name];
+        
+        XCTAssertEqual((int)collection.columnMode, [reopenModes[name] intValue], @"%@ columnMode not saved", name);
+        XCTAssertEqual(findCode(collection, @3, &usedIndex).count, 10, @"%@ find after reopen failed", name);
+        XCTAssertTrue(usedIndex, @"%@ index not used after reopen", name);
+        
+        // indexes include the default, so they are rebuilt when it changes...
+        
+        collection.defaultJson = @{@"code": @-1};
+        
+        XCTAssertEqual(findCode(collection, @-1, &usedIndex).count, 10, @"%@ find with new default failed", name);
+        XCTAssertTrue(usedIndex, @"%@ index not used with new default", name);
+        XCTAssertEqual(findCode(collection, @0, &usedIndex).count, 0, @"%@ old default still used", name);
+    }
+    
+    [store close];
+    
+    sqlite3 *db;
+    sqlite3_stmt *statement;
+    
+    XCTAssertEqual(sqlite3_open(self.store.storeFilename.UTF8String, &db), SQLITE_OK, @"open failed");
+    XCTAssertEqual(sqlite3_prepare_v2(db, "SELECT [hidden] FROM pragma_table_xinfo('pending') WHERE [name] = 'code';", -1, &statement, NULL), SQLITE_OK, @"prepare failed");
+    XCTAssertEqual(sqlite3_step(statement), SQLITE_ROW, @"pending column missing");
+    XCTAssertEqual(sqlite3_column_int(statement, 0), 2, @"pending mode change was not migrated");   // 2 = VIRTUAL generated column
+    sqlite3_finalize(statement);
+    sqlite3_close(db);
+}
+
+
+-(void)testBinaryDocumentFormat
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+
+    NSDictionary *data1 = @{@"uid": @(1), @"name": @"One", @"is_odd": @(YES), @"score": @(-12.5), @"tags": @[@"a", @"b"], @"address": @{@"city": @"Seattle"}};
+    NSDictionary *data2 = @{@"uid": @(2), @"name": @"Two é", @"is_odd": @(NO), @"score": @(-7), @"tags": @[], @"address": [NSNull null]};
+
+    // start with a text row, then switch formats so we have a mix...
+
+    [collection1 insert:data1];
+
+    collection1.documentFormat = NTJsonDocumentFormatBinary;
+    XCTAssert(collection1.documentFormat == NTJsonDocumentFormatBinary, @"documentFormat not set");
+
+    NSError *error;
+    XCTAssert([collection1 insert:data2 error:&error], @"binary insert failed - %@", error);
+
+    [collection1 sync];
+    [collection1 flushCache];   // make sure we decode from the store
+
+    [self compareExpectedItems:@[data1, data2] actualItems:[collection1 findWhere:nil args:nil orderBy:@"[uid]"] operation:@"find binary"];
+    [self compareExpectedItems:@[data2] actualItems:[collection1 findWhere:@"[score] = -7" args:nil orderBy:nil] operation:@"query binary"];
+    [self compareExpectedItems:@[data1] actualItems:[collection1 findWhere:@"[address.city] = 'Seattle'" args:nil orderBy:nil] operation:@"query nested binary"];
+
+    // decoded items are shared through the cache, so nothing in them may be mutable. The document itself is wrapped by the
+    // cache, so check the containers the binary decoder created (uid 3 is only ever stored as binary)...
+
+    XCTAssert([collection1 insert:@{@"uid": @(3), @"tags": @[@"c", @[@(1)]], @"address": @{@"city": @"Tacoma", @"geo": @{@"lat": @(47)}}}], @"binary insert failed");
+
+    [collection1 sync];
+    [collection1 flushCache];
+
+    NSDictionary *decoded = [collection1 findOneWhere:@"[uid] = 3" args:nil];
+
+    XCTAssertEqualObjects(decoded[@"address"][@"geo"][@"lat"], @(47), @"decoded nested object incorrect");
+    XCTAssertFalse([decoded[@"tags"] isKindOfClass:[NSMutableArray class]], @"decoded array is mutable");
+    XCTAssertFalse([decoded[@"tags"][1] isKindOfClass:[NSMutableArray class]], @"decoded nested array is mutable");
+    XCTAssertFalse([decoded[@"address"] isKindOfClass:[NSMutableDictionary class]], @"decoded object is mutable");
+    XCTAssertFalse([decoded[@"address"][@"geo"] isKindOfClass:[NSMutableDictionary class]], @"decoded nested object is mutable");
+
+    // binary documents require materialized columns...
+
+    collection1.columnMode = NTJsonColumnModeExpression;
+    XCTAssert(collection1.columnMode == NTJsonColumnModeMaterialized, @"columnMode changed with binary documents");
+}
+
+
+-(void)testLazyDecoding
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+
+    collection1.lazyDecoding = YES;
+
+    NSDictionary *data1 = @{@"uid": @(1), @"name": @"One", @"is_odd": @(YES), @"address": @{@"city": @"Seattle"}};
+    NSDictionary *data2 = @{@"uid": @(2), @"name": @"Two", @"is_odd": @(NO), @"address": @{@"city": @"Portland"}};
+
+    [collection1 insertBatch:@[data1, data2]];
+    [collection1 flushCache];
+
+    // [uid] is materialized by the query, so it can be answered from the row...
+
+    NSArray *items = [collection1 findWhere:@"[uid] > 0" args:nil orderBy:@"[uid]"];
+
+    XCTAssert([items[0][@"uid"] isEqual:@(1)], @"lazy scalar field incorrect");
+    XCTAssert([items[1][@"address"][@"city"] isEqualToString:@"Portland"], @"lazy nested field incorrect");
+
+    [self compareExpectedItems:@[data1, data2] actualItems:items operation:@"find lazy"];
+    XCTAssert([items[0] isEqualToDictionary:[items[0] mutableCopy]], @"lazy item enumeration failed");
+}
+
+
+-(void)testQueryCache
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+
+    collection1.queryCacheSize = 10;
+
+    [collection1 insertBatch:@[@{@"uid": @(1), @"name": @"One"}, @{@"uid": @(2), @"name": @"Two"}]];
+
+    NSArray *items = [collection1 findWhere:@"[uid] > ?" args:@[@(0)] orderBy:@"[uid]"];
+    XCTAssert(items.count == 2, @"find failed");
+
+    int hits = collection1.queryCacheHits;
+    XCTAssert([[collection1 findWhere:@"[uid] > ?" args:@[@(0)] orderBy:@"[uid]"] isEqualToArray:items], @"cached find returned different results");
+    XCTAssert(collection1.queryCacheHits == hits + 1, @"find was not cached");
+
+    // an update to a field the query doesn't use keeps the cached result...
+
+    NSMutableDictionary *item = [items[0] mutableCopy];
+    item[@"name"] = @"Uno";
+    [collection1 update:item];
+
+    [collection1 findWhere:@"[uid] > ?" args:@[@(0)] orderBy:@"[uid]"];
+    XCTAssert(collection1.queryCacheHits == hits + 2, @"unrelated update evicted the query");
+
+    // ...but one that changes a field it does use doesn't...
+
+    item[@"uid"] = @(-1);
+    [collection1 update:item];
+
+    XCTAssert([collection1 findWhere:@"[uid] > ?" args:@[@(0)] orderBy:@"[uid]"].count == 1, @"stale result after update");
+    XCTAssert([collection1 countWhere:@"[uid] > ?" args:@[@(0)]] == 1, @"count failed");
+
+    [collection1 insert:@{@"uid": @(3), @"name": @"Three"}];
+
+    XCTAssert([collection1 countWhere:@"[uid] > ?" args:@[@(0)]] == 2, @"stale count after insert");
+}
+
+
+-(void)testUniqueKeyLookup
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+
+    collection1.uniqueKeyLookup = YES;
+    [collection1 addUniqueIndexWithKeys:@"[uid]"];
+
+    [collection1 insertBatch:@[@{@"uid": @(1), @"name": @"One"}, @{@"uid": @(2), @"name": @"Two"}, @{@"uid": @"three", @"name": @"Three"}]];
+
+    // the first lookup starts loading the map in the background...
+
+    XCTAssert([[collection1 findOneWhere:@"[uid] = ?" args:@[@(2)]][@"name"] isEqualToString:@"Two"], @"lookup failed");
+
+    [collection1 sync];
+
+    XCTAssert([[collection1 findOneWhere:@"[uid] = ?" args:@[@(2)]][@"name"] isEqualToString:@"Two"], @"mapped lookup failed");
+    XCTAssert([[collection1 findOneWhere:@"[uid]=?" args:@[@"three"]][@"name"] isEqualToString:@"Three"], @"mapped string lookup failed");
+    XCTAssert(![collection1 findOneWhere:@"[uid] = ?" args:@[@"2"]], @"string matched a number");
+    XCTAssert(![collection1 findOneWhere:@"[uid] = ?" args:@[@(4)]], @"found a missing key");
+
+    // the map follows inserts, updates and removes...
+
+    [collection1 insert:@{@"uid": @(4), @"name": @"Four"}];
+    XCTAssert([[collection1 findOneWhere:@"[uid] = ?" args:@[@(4)]][@"name"] isEqualToString:@"Four"], @"lookup after insert failed");
+
+    NSMutableDictionary *item = [[collection1 findOneWhere:@"[uid] = ?" args:@[@(1)]] mutableCopy];
+    item[@"uid"] = @(10);
+    [collection1 update:item];
+
+    XCTAssert(![collection1 findOneWhere:@"[uid] = ?" args:@[@(1)]], @"old key found after update");
+    XCTAssert([[collection1 findOneWhere:@"[uid] = ?" args:@[@(10)]][@"name"] isEqualToString:@"One"], @"new key not found after update");
+
+    [collection1 remove:[collection1 findOneWhere:@"[uid] = ?" args:@[@(10)]]];
+    XCTAssert(![collection1 findOneWhere:@"[uid] = ?" args:@[@(10)]], @"found a removed item");
+
+    [collection1 removeWhere:@"[name] = ?" args:@[@"Two"]];
+    XCTAssert(![collection1 findOneWhere:@"[uid] = ?" args:@[@(2)]], @"found an item removed by removeWhere");
+    XCTAssert([collection1 findOneWhere:@"[uid] = ?" args:@[@(4)]], @"removeWhere removed too much");
+
+    // keys from a batch that failed (and was rolled back) must not be found...
+
+    XCTAssertFalse([collection1 insertBatch:@[@{@"uid": @(20), @"name": @"Twenty"}, @{@"uid": @(4), @"name": @"Duplicate"}]], @"duplicate key inserted");
+    XCTAssert(![collection1 findOneWhere:@"[uid] = ?" args:@[@(20)]], @"found a key from a failed batch");
+
+    [collection1 sync];
+
+    XCTAssert(![collection1 findOneWhere:@"[uid] = ?" args:@[@(20)]], @"mapped lookup found a key from a failed batch");
+    XCTAssert([[collection1 findOneWhere:@"[uid] = ?" args:@[@(4)]][@"name"] isEqualToString:@"Four"], @"lookup after failed batch failed");
+}
+
+
 -(void)testAliases
 {
     NSDictionary *tests =
@@ -198,4 +618,819 @@
 }
 
 
+-(void)testCompiledSqlFollowsAliases
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+
+    collection1.aliases = @{@"key": @"[uid]"};
+
+    [collection1 insertBatch:@[@{@"uid": @(1), @"code": @(2)}, @{@"uid": @(2), @"code": @(1)}]];
+
+    XCTAssert([[collection1 findOneWhere:@"key = ?" args:@[@(1)]][@"uid"] isEqual:@(1)], @"find with alias failed");
+    XCTAssert([[collection1 findOneWhere:@"key = ?" args:@[@(1)]][@"uid"] isEqual:@(1)], @"repeated find with alias failed");
+
+    // changing an alias must not reuse the previously compiled query...
+
+    collection1.aliases = @{@"key": @"[code]"};
+
+    XCTAssert([[collection1 findOneWhere:@"key = ?" args:@[@(1)]][@"uid"] isEqual:@(2)], @"find used a stale alias");
+}
+
+
+-(void)testReadConnections
+{
+    self.store.readConnectionCount = 4;
+    
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    [collection1 addQueryableFields:@"[uid]"];
+    
+    NSMutableArray *items = [NSMutableArray array];
+    
+    for(int uid=0; uid<100; uid++)
+        [items addObject:@{@"uid": @(uid), @"even": @(uid % 2 == 0)}];
+    
+    [collection1 insertBatch:items];
+    
+    NSMutableArray *failures = [NSMutableArray array];
+    
+    dispatch_apply(16, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t index) {
+        NSArray *found = [collection1 findWhere:@"[uid] >= ?" args:@[@(index)] orderBy:@"[uid]"];
+        int count = [collection1 countWhere:@"[even] = ?" args:@[@YES]];
+        
+        if ( found.count != 100 - index || ![found.firstObject[@"uid"] isEqual:@(index)] || count != 50 )
+        {
+            @synchronized(failures)
+            {
+                [failures addObject:@(index)];
+            }
+        }
+    });
+    
+    XCTAssertEqual(failures.count, 0, @"parallel finds returned incorrect results");
+    
+    // reads must see writes that were requested before them...
+    
+    [collection1 beginInsert:@{@"uid": @(1000)} completionHandler:^(NTJsonRowId rowid, NSError *error) {}];
+    
+    XCTAssertNotNil([collection1 findOneWhere:@"[uid] = ?" args:@[@(1000)]], @"read did not see a pending insert");
+    XCTAssertEqual([collection1 countWhere:@"[uid] >= ?" args:@[@(100)]], 1, @"count did not see a pending insert");
+}
+
+
+-(void)testCursor
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    NSMutableArray *items = [NSMutableArray array];
+    
+    for(int uid=0; uid<250; uid++)
+        [items addObject:(uid % 10) ? @{@"uid": @(uid), @"group": @(uid % 3)} : @{@"uid": @(uid)}];    // some have no group (NULL)
+    
+    [collection1 insertBatch:items];
+    
+    NSArray *expected = [[collection1 findWhere:nil args:nil orderBy:@"[group] DESC, [__rowid__]"] valueForKey:@"uid"];
+    
+    // enumerate everything...
+    
+    NTJsonCursor *cursor = [collection1 cursorWhere:nil args:nil orderBy:@"[group] DESC" batchSize:40];
+    NSMutableArray *uids = [NSMutableArray array];
+    
+    for(NSDictionary *item in cursor)
+        [uids addObject:item[@"uid"]];
+    
+    XCTAssertNil(cursor.error, @"cursor failed");
+    XCTAssertEqualObjects(uids, expected, @"cursor returned incorrect items");
+    
+    // stop part way through and resume with the continuation...
+    
+    cursor = [collection1 cursorWhere:nil args:nil orderBy:@"[group] DESC" batchSize:40];
+    
+    [uids removeAllObjects];
+    
+    for(int batch=0; batch<3; batch++)
+        [uids addObjectsFromArray:[[cursor nextBatch] valueForKey:@"uid"]];
+    
+    NSArray *continuation = [NSJSONSerialization JSONObjectWithData:[NSJSONSerialization dataWithJSONObject:cursor.continuation options:0 error:nil] options:0 error:nil];
+    
+    cursor = [collection1 cursorWhere:nil args:nil orderBy:@"[group] DESC" batchSize:40 continuation:continuation];
+    
+    NSArray *batch;
+    
+    while ( (batch=[cursor nextBatch]) )
+        [uids addObjectsFromArray:[batch valueForKey:@"uid"]];
+    
+    XCTAssertEqualObjects(uids, expected, @"resumed cursor returned incorrect items");
+}
+
+
+-(void)testObjectCacheConsistency
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    collection1.cacheSize = 1000;
+    collection1.cacheByteLimit = 4096;    // small enough to force evictions
+    
+    NSMutableArray *items = [NSMutableArray array];
+    
+    for(int uid=0; uid<500; uid++)
+        [items addObject:@{@"uid": @(uid), @"value": @(uid)}];
+    
+    [collection1 insertBatch:items];
+    
+    // read everything (growing the cache), change some and remove some...
+    
+    NSArray *found = [collection1 findWhere:nil args:nil orderBy:@"[uid]"];
+    
+    XCTAssertEqual(found.count, 500, @"find failed");
+    
+    for(NSDictionary *item in found)
+    {
+        int uid = [item[@"uid"] intValue];
+        
+        if ( uid % 3 == 0 )
+            [collection1 remove:item];
+        
+        else if ( uid % 3 == 1 )
+        {
+            NSMutableDictionary *mutableItem = [item mutableCopy];
+            mutableItem[@"value"] = @(uid * 10);
+            [collection1 update:mutableItem];
+        }
+    }
+    
+    found = nil;
+    
+    [collection1 sync];
+    
+    found = [collection1 findWhere:nil args:nil orderBy:@"[uid]"];
+    
+    XCTAssertEqual(found.count, 500 - 167, @"remove failed");
+    
+    for(NSDictionary *item in found)
+    {
+        int uid = [item[@"uid"] intValue];
+        int expectedValue = (uid % 3 == 1) ? uid * 10 : uid;
+        
+        XCTAssertEqual([item[@"value"] intValue], expectedValue, @"cache returned a stale item for %d", uid);
+    }
+}
+
+
+-(void)testMetrics
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    self.store.metricsEnabled = YES;
+    self.store.slowQueryThreshold = 0.000001;   // everything is slow
+    
+    for(int uid=1; uid<=100; uid++)
+        [collection1 insert:@{@"uid": @(uid), @"value": @(uid % 10)}];
+    
+    NSArray *found = [collection1 findWhere:@"[value] = ?" args:@[@5] orderBy:nil];
+    
+    XCTAssertEqual(found.count, 10, @"find failed");
+    XCTAssertEqual([collection1 countWhere:@"[value] = ?" args:@[@5]], 10, @"count failed");
+    
+    NSDictionary *metrics = self.store.metrics[@"collection1"];
+    
+    XCTAssertEqualObjects(metrics[@"enabled"], @YES, @"metrics not enabled");
+    XCTAssertEqual([metrics[@"operations"][@"insert"][@"count"] intValue], 100, @"insert not recorded");
+    XCTAssertGreaterThanOrEqual([metrics[@"operations"][@"find"][@"count"] intValue], 1, @"find not recorded");
+    XCTAssertGreaterThanOrEqual([metrics[@"rowsReturned"] intValue], 10, @"rowsReturned not recorded");
+    
+    NSArray *slowQueries = metrics[@"slowQueries"];
+    
+    XCTAssertGreaterThan(slowQueries.count, 0, @"slow query not logged");
+    XCTAssertGreaterThan([slowQueries.lastObject[@"queryPlan"] count], 0, @"query plan missing");
+    
+    [self.store resetMetrics];
+    self.store.metricsEnabled = NO;
+    
+    [collection1 findWhere:@"[value] = ?" args:@[@6] orderBy:nil];
+    
+    metrics = collection1.metrics;
+    
+    XCTAssertEqual([metrics[@"operations"][@"find"][@"count"] intValue], 0, @"metrics recorded while disabled");
+    XCTAssertEqual([metrics[@"slowQueries"] count], 0, @"reset failed");
+}
+
+
+-(void)testAggregate
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    for(int uid=1; uid<=30; uid++)
+        [collection1 insert:@{@"uid": @(uid), @"amount": @(uid * 10), @"customer": @{@"id": @(uid % 4)}, @"region": (uid % 3 == 0) ? @"east" : @"west"}];
+    
+    NSArray *totals = [collection1 aggregate:@{@"total": @"SUM([amount])", @"largest": @"MAX([amount])"} where:nil args:nil groupBy:nil];
+    
+    XCTAssertEqual(totals.count, 1, @"ungrouped aggregate should return one row");
+    XCTAssertEqual([totals[0][@"total"] intValue], 4650, @"SUM failed");
+    XCTAssertEqual([totals[0][@"largest"] intValue], 300, @"MAX failed");
+    
+    NSArray *groups = [collection1 aggregate:@{@"count": @"COUNT(*)", @"customers": @"COUNT(DISTINCT [customer.id])", @"average": @"AVG([amount])"}
+                                       where:@"[uid] > ?" args:@[@0] groupBy:@"[region]"];
+    
+    XCTAssertEqual(groups.count, 2, @"group by failed");
+    XCTAssertEqualObjects(groups[0][@"region"], @"east", @"groups should be ordered");
+    XCTAssertEqual([groups[0][@"count"] intValue], 10, @"COUNT failed");
+    XCTAssertEqual([groups[0][@"customers"] intValue], 4, @"COUNT DISTINCT failed");
+    XCTAssertEqualWithAccuracy([groups[0][@"average"] doubleValue], 165.0, 0.001, @"AVG failed");
+    XCTAssertEqual([groups[1][@"count"] intValue], 20, @"COUNT failed");
+    
+    // groups are keyed by the name the caller used, even when it's an alias...
+    
+    collection1.aliases = @{@"customerId": @"[customer.id]"};
+    
+    NSArray *customers = [collection1 aggregate:@{@"count": @"COUNT(*)"} where:nil args:nil groupBy:@"customerId"];
+    
+    XCTAssertEqual(customers.count, 4, @"group by alias failed");
+    XCTAssertEqualObjects(customers[0][@"customerId"], @0, @"alias group key missing");
+    XCTAssertNil(customers[0][@"customer.id"], @"group keyed by the aliased field");
+    
+    NSArray *empty = [collection1 aggregate:@{@"total": @"SUM([amount])"} where:@"[uid] > ?" args:@[@1000] groupBy:nil];
+    
+    XCTAssertEqual(empty.count, 1, @"empty aggregate should still return a row");
+    XCTAssertNil(empty[0][@"total"], @"NULL results should be left out");
+    
+    NSError *error;
+    
+    XCTAssertNil([collection1 aggregate:@{} where:nil args:nil groupBy:nil error:&error], @"empty aggregates should fail");
+    XCTAssertNotNil(error, @"error not set");
+}
+
+
+-(void)testFindFields
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    [collection1 addQueryableFields:@"[uid],[title],[active]"];
+    
+    for(int uid=1; uid<=20; uid++)
+        [collection1 insert:@{@"uid": @(uid), @"title": [NSString stringWithFormat:@"title %d", uid], @"author": @{@"name": @"ann"}, @"body": @"a long body", @"active": @(uid % 2 == 0), @"tags": @[@"a", @(uid)]}];
+    
+    NSArray *rows = [collection1 findFields:@"[uid], [title], [author.name]" where:@"[uid] > ?" args:@[@15] orderBy:@"[uid]" limit:3];
+    
+    XCTAssertEqual(rows.count, 3, @"findFields failed");
+    XCTAssertEqual([rows[0][@"uid"] intValue], 16, @"order failed");
+    XCTAssertEqualObjects(rows[0][@"title"], @"title 16", @"column field failed");
+    XCTAssertEqualObjects(rows[0][@"author.name"], @"ann", @"document field failed");
+    XCTAssertNotNil(rows[0][NTJsonRowIdKey], @"__rowid__ missing");
+    XCTAssertNil(rows[0][@"body"], @"unrequested field returned");
+    
+    NSDictionary *item = [collection1 findOneWhere:@"[uid] = ?" args:@[@16]];
+    
+    XCTAssertEqualObjects(rows[0][NTJsonRowIdKey], item[NTJsonRowIdKey], @"__rowid__ mismatch");
+    XCTAssertNotEqual((__bridge void *)rows[0], (__bridge void *)item, @"rows should not come from the item cache");
+    
+    // objects, arrays and booleans come back as they are in the document, whether read from a column or the document...
+    
+    NSDictionary *row = [collection1 findFields:@"[author], [tags], [active], [uid]" where:@"[uid] = ?" args:@[@16] orderBy:nil limit:1].firstObject;
+    
+    XCTAssertEqualObjects(row[@"author"], item[@"author"], @"object field failed");
+    XCTAssertEqualObjects(row[@"tags"], item[@"tags"], @"array field failed");
+    XCTAssertEqualObjects(row[@"active"], @YES, @"boolean column field failed");
+    XCTAssertEqual(CFGetTypeID((__bridge CFTypeRef)row[@"active"]), CFBooleanGetTypeID(), @"boolean column field failed");
+    XCTAssertEqual(CFGetTypeID((__bridge CFTypeRef)row[@"uid"]), CFGetTypeID((__bridge CFTypeRef)@16), @"number field failed");
+    
+    NTJsonCollection *collection2 = [self.store collectionWithName:@"collection2"];
+    
+    collection2.documentFormat = NTJsonDocumentFormatBinary;
+    [collection2 insert:@{@"uid": @1, @"flag": @NO, @"author": @{@"name": @"ann"}}];
+    
+    row = [collection2 findFields:@"[flag], [author]" where:nil args:nil orderBy:nil limit:0].firstObject;
+    
+    XCTAssertEqualObjects(row[@"flag"], @NO, @"binary boolean field failed");
+    XCTAssertEqual(CFGetTypeID((__bridge CFTypeRef)row[@"flag"]), CFBooleanGetTypeID(), @"binary boolean field failed");
+    XCTAssertEqualObjects(row[@"author"], @{@"name": @"ann"}, @"binary object field failed");
+    
+    NSError *error;
+    
+    XCTAssertNil([collection1 findFields:@"" where:nil args:nil orderBy:nil limit:0 error:&error], @"empty fields should fail");
+    XCTAssertNotNil(error, @"error not set");
+}
+
+
+-(void)testStatistics
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    [collection1 addQueryableFields:@"[uid],[group],[note]"];
+    
+    NSMutableArray *items = [NSMutableArray array];
+    
+    for(int uid=1; uid<=1500; uid++)
+        [items addObject:@{@"uid": @(uid), @"group": @(uid % 10), @"note": (uid % 3) ? [NSNull null] : @"note"}];
+    
+    XCTAssertTrue([collection1 insertBatch:items], @"insertBatch failed");
+    
+    [collection1 sync];
+    
+    NSDictionary *statistics = collection1.statistics;
+    
+    XCTAssertEqual([statistics[@"rowCount"] intValue], 1500, @"rowCount failed");
+    XCTAssertEqual([collection1 countWhere:nil args:nil], 1500, @"count failed");
+    XCTAssertEqual([collection1 countWhere:@"[group] = ?" args:@[@3]], 150, @"count with where failed");  // must not come from the statistics
+    XCTAssertEqual([statistics[@"columns"][@"note"][@"nullCount"] intValue], 1000, @"nullCount failed");
+    XCTAssertEqualWithAccuracy([statistics[@"columns"][@"uid"][@"distinctCount"] doubleValue], 1500, 300, @"distinctCount failed");
+    XCTAssertEqualWithAccuracy([statistics[@"columns"][@"group"][@"distinctCount"] doubleValue], 10, 1, @"distinctCount failed");
+    XCTAssertNotNil(statistics[@"analyzedDate"], @"collection should have been analyzed");
+    
+    [collection1 removeWhere:@"[uid] <= ?" args:@[@500]];
+    
+    XCTAssertEqual([collection1 countWhere:nil args:nil], 1000, @"count after remove failed");
+    XCTAssertEqual([collection1 countWhere:@"[uid] > ?" args:@[@1000]], 500, @"count with where after remove failed");
+    XCTAssertEqual([collection1.statistics[@"rowCount"] intValue], 1000, @"rowCount after remove failed");
+}
+
+
+-(void)testLiveQuery
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    collection1.changeDeliveryInterval = 0;
+    
+    for(int uid=1; uid<=10; uid++)
+        [collection1 insert:@{@"uid": @(uid), @"score": @(uid * 10)}];
+    
+    dispatch_queue_t queue = dispatch_queue_create("testLiveQuery", DISPATCH_QUEUE_SERIAL);
+    
+    __block NSArray *liveItems = nil;
+    __block NTJsonChanges *liveChanges = nil;
+    __block NSMutableArray *allChanges = [NSMutableArray array];
+    
+    id observer = [collection1 addChangeObserverWithQueue:queue handler:^(NTJsonChanges *changes) {
+        [allChanges addObject:changes];
+    }];
+    
+    NTJsonLiveQuery *liveQuery = [collection1 liveQueryWhere:@"[score] >= ?" args:@[@50] orderBy:@"[score] DESC" limit:3 completionQueue:queue handler:^(NSArray *items, NTJsonChanges *changes, NSError *error) {
+        liveItems = items;
+        liveChanges = changes;
+    }];
+    
+    void (^waitForChanges)() = ^{
+        [collection1 sync];
+        dispatch_sync(queue, ^{ });
+    };
+    
+    waitForChanges();
+    
+    XCTAssertEqualObjects([liveItems valueForKey:@"uid"], (@[@10, @9, @8]), @"initial results failed");
+    XCTAssertNil(liveChanges, @"initial results should not have changes");
+    
+    [collection1 insert:@{@"uid": @11, @"score": @95}];
+    
+    waitForChanges();
+    
+    XCTAssertEqualObjects([liveItems valueForKey:@"uid"], (@[@10, @11, @9]), @"insert failed");
+    XCTAssertEqual(liveChanges.insertedRowIds.count, 1, @"inserted rowids failed");
+    XCTAssertEqual(liveChanges.removedRowIds.count, 1, @"removed rowids failed");
+    
+    NSDictionary *item = [collection1 findOneWhere:@"[uid] = ?" args:@[@10]];
+    [collection1 remove:item];
+    
+    NSMutableDictionary *mutableItem = [[collection1 findOneWhere:@"[uid] = ?" args:@[@9]] mutableCopy];
+    mutableItem[@"score"] = @5;
+    [collection1 update:mutableItem];
+    
+    waitForChanges();
+    
+    XCTAssertEqualObjects([liveItems valueForKey:@"uid"], (@[@11, @8, @7]), @"remove and update failed");
+    
+    NSMutableSet *updatedRowIds = [NSMutableSet set];
+    NSMutableSet *removedRowIds = [NSMutableSet set];
+    
+    for(NTJsonChanges *changes in allChanges)
+    {
+        [updatedRowIds unionSet:changes.updatedRowIds];
+        [removedRowIds unionSet:changes.removedRowIds];
+    }
+    
+    XCTAssertEqualObjects(updatedRowIds, [NSSet setWithObject:mutableItem[NTJsonRowIdKey]], @"updated rowids failed");
+    XCTAssertEqualObjects(removedRowIds, [NSSet setWithObject:item[NTJsonRowIdKey]], @"removed rowids failed");
+    
+    [liveQuery stop];
+    [collection1 removeChangeObserver:observer];
+}
+
+
+-(void)testTransaction
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    NTJsonCollection *collection2 = [self.store collectionWithName:@"collection2"];
+    
+    [collection1 insert:@{@"uid": @1, @"name": @"original"}];
+    
+    NSDictionary *item = [collection1 findOneWhere:@"[uid] = ?" args:@[@1]];
+    
+    BOOL success = [self.store performTransaction:^BOOL{
+        NSMutableDictionary *mutableItem = [item mutableCopy];
+        mutableItem[@"name"] = @"committed";
+        
+        [collection1 update:mutableItem];
+        [collection2 insert:@{@"uid": @1, @"ref": @1}];
+        
+        return YES;
+    }];
+    
+    XCTAssertTrue(success, @"commit failed");
+    XCTAssertEqualObjects([collection1 findOneWhere:@"[uid] = ?" args:@[@1]][@"name"], @"committed", @"update not committed");
+    XCTAssertEqual([collection2 countWhere:nil args:nil], 1, @"insert not committed");
+    
+    NSDictionary *committedItem = [collection1 findOneWhere:@"[uid] = ?" args:@[@1]];
+    
+    NSError *error = nil;
+    
+    success = [self.store performTransaction:^BOOL{
+        NSMutableDictionary *mutableItem = [committedItem mutableCopy];
+        mutableItem[@"name"] = @"rolled back";
+        
+        [collection1 update:mutableItem];
+        [collection2 insert:@{@"uid": @2, @"ref": @1}];
+        [collection2 removeWhere:@"[uid] = ?" args:@[@1]];
+        
+        XCTAssertEqual([collection2 countWhere:nil args:nil], 1, @"changes not visible in the transaction");
+        
+        return NO;
+    } error:&error];
+    
+    XCTAssertFalse(success, @"rollback failed");
+    XCTAssertNil(error, @"rollback should not return an error");
+    XCTAssertEqualObjects([collection1 findOneWhere:@"[uid] = ?" args:@[@1]][@"name"], @"committed", @"update not rolled back");
+    XCTAssertEqual([collection2 countWhere:nil args:nil], 1, @"insert not rolled back");
+    XCTAssertEqual([collection2 countWhere:@"[uid] = ?" args:@[@1]], 1, @"remove not rolled back");
+    
+    // the rollback must end the transaction, otherwise later writes are never committed...
+    
+    [collection2 insert:@{@"uid": @3, @"ref": @1}];
+    
+    [self.store close];
+    
+    NTJsonStore *store = [[NTJsonStore alloc] initWithPath:self.store.storePath name:self.store.storeName];
+    
+    XCTAssertEqual([[store collectionWithName:@"collection2"] countWhere:nil args:nil], 2, @"write after rollback not committed");
+    
+    [store close];
+}
+
+
+-(void)testGroupCommit
+{
+    self.store.groupCommitInterval = 10.0;  // long enough that only the write limit and sync commit
+    self.store.groupCommitMaxWrites = 50;
+    self.store.synchronous = NTJsonSynchronousNormal;
+    
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    dispatch_queue_t queue = dispatch_queue_create("testGroupCommit", DISPATCH_QUEUE_SERIAL);
+    dispatch_group_t group = dispatch_group_create();
+    __block int completedCount = 0;
+    __block int errorCount = 0;
+    
+    for(int uid=1; uid<=120; uid++)
+    {
+        dispatch_group_enter(group);
+        
+        [collection1 beginInsert:@{@"uid": @(uid)} completionQueue:queue completionHandler:^(NTJsonRowId rowid, NSError *error) {
+            ++completedCount;
+            
+            if ( error )
+                ++errorCount;
+            
+            dispatch_group_leave(group);
+        }];
+    }
+    
+    [collection1 sync];    // commits the last 20
+    
+    XCTAssertEqual(dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC)), 0, @"group commit completions failed");
+    
+    dispatch_sync(queue, ^{
+        XCTAssertEqual(completedCount, 120, @"completion count failed");
+        XCTAssertEqual(errorCount, 0, @"group commit errors");
+    });
+    
+    XCTAssertEqual([collection1 countWhere:nil args:nil], 120, @"count failed");
+    
+    // synchronous writes commit right away...
+    
+    [collection1 beginInsert:@{@"uid": @121} completionHandler:^(NTJsonRowId rowid, NSError *error) { }];
+    [collection1 insert:@{@"uid": @122}];
+    
+    XCTAssertEqual([collection1 countWhere:nil args:nil], 122, @"count after insert failed");
+}
+
+
+-(void)testGroupCommitFailure
+{
+    self.store.groupCommitInterval = 10.0;
+    self.store.groupCommitMaxWrites = 50;
+    
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    [collection1 insert:@{@"uid": @0}];
+    
+    // a trigger that rolls back the whole transaction makes the group commit fail...
+    
+    sqlite3 *db;
+    
+    XCTAssertEqual(sqlite3_open(self.store.storeFilename.UTF8String, &db), SQLITE_OK, @"open failed");
+    XCTAssertEqual(sqlite3_exec(db, "CREATE TRIGGER [fail] BEFORE INSERT ON [collection1] WHEN json_extract(CAST(NEW.[__json__] AS TEXT), '$.fail') IS NOT NULL BEGIN SELECT RAISE(ROLLBACK, 'fail'); END;", NULL, NULL, NULL), SQLITE_OK, @"trigger failed");
+    sqlite3_close(db);
+    
+    dispatch_queue_t queue = dispatch_queue_create("testGroupCommitFailure", DISPATCH_QUEUE_SERIAL);
+    dispatch_group_t group = dispatch_group_create();
+    __block int errorCount = 0;
+    
+    for(NSDictionary *item in @[@{@"uid": @1}, @{@"uid": @2, @"fail": @YES}])
+    {
+        dispatch_group_enter(group);
+        
+        [collection1 beginInsert:item completionQueue:queue completionHandler:^(NTJsonRowId rowid, NSError *error) {
+            if ( error )
+                ++errorCount;
+            
+            dispatch_group_leave(group);
+        }];
+    }
+    
+    [collection1 sync];
+    
+    XCTAssertEqual(dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC)), 0, @"group commit completions failed");
+    
+    dispatch_sync(queue, ^{
+        XCTAssertEqual(errorCount, 2, @"the whole group should fail");
+    });
+    
+    // ...and later writes must not be left in an open transaction...
+    
+    [collection1 insert:@{@"uid": @3}];
+    
+    [self.store close];
+    
+    NTJsonStore *store = [[NTJsonStore alloc] initWithPath:self.store.storePath name:self.store.storeName];
+    
+    XCTAssertEqual([[store collectionWithName:@"collection1"] countWhere:nil args:nil], 2, @"writes after a failed group commit not committed");
+    
+    [store close];
+}
+
+
+-(void)testCollectionFiles
+{
+    self.store.collectionFiles = YES;
+    
+    NSString *prefix = [[self.store.storeFilename stringByDeletingPathExtension] stringByAppendingString:@"."];
+    NSString *collection1Filename = [NSString stringWithFormat:@"%@collection1.%@", prefix, self.store.storeFilename.pathExtension];
+    NSString *collection2Filename = [NSString stringWithFormat:@"%@collection2.%@", prefix, self.store.storeFilename.pathExtension];
+    
+    for(NSString *filename in @[collection1Filename, collection2Filename])
+    {
+        for(NSString *suffix in @[@"", @"-wal", @"-shm"])
+            [[NSFileManager defaultManager] removeItemAtPath:[filename stringByAppendingString:suffix] error:nil];
+    }
+    
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    NTJsonCollection *collection2 = [self.store collectionWithName:@"collection2"];
+    
+    for(int uid=1; uid<=100; uid++)
+    {
+        [collection1 beginInsert:@{@"uid": @(uid)} completionHandler:^(NTJsonRowId rowid, NSError *error) { }];
+        [collection2 beginInsert:@{@"uid": @(uid)} completionHandler:^(NTJsonRowId rowid, NSError *error) { }];
+    }
+    
+    [self.store sync];
+    
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:collection1Filename], @"collection1 file not created");
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:collection2Filename], @"collection2 file not created");
+    XCTAssertEqual([collection1 countWhere:nil args:nil], 100, @"collection1 count failed");
+    XCTAssertEqual([collection2 countWhere:@"[uid] > ?" args:@[@50]], 50, @"collection2 count failed");
+    
+    BOOL success = [self.store performTransaction:^BOOL{
+        [collection1 insert:@{@"uid": @101}];
+        [collection2 removeWhere:@"[uid] > ?" args:@[@50]];
+        
+        return YES;
+    }];
+    
+    XCTAssertTrue(success, @"transaction failed");
+    
+    // a rolled back transaction must leave the collection files detached for the next one...
+    
+    success = [self.store performTransaction:^BOOL{
+        [collection1 insert:@{@"uid": @102}];
+        
+        return NO;
+    }];
+    
+    XCTAssertFalse(success, @"rollback failed");
+    
+    NSError *error = nil;
+    
+    success = [self.store performTransaction:^BOOL{
+        [collection2 insert:@{@"uid": @51}];
+        
+        return YES;
+    } error:&error];
+    
+    XCTAssertTrue(success, @"transaction after rollback failed: %@", error);
+    
+    [self.store close];
+    
+    NTJsonStore *store = [[NTJsonStore alloc] initWithPath:self.store.storePath name:self.store.storeName];
+    store.collectionFiles = YES;
+    
+    XCTAssertEqualObjects([[store.collections valueForKey:@"name"] sortedArrayUsingSelector:@selector(compare:)], (@[@"collection1", @"collection2"]), @"collections not found");
+    XCTAssertEqual([[store collectionWithName:@"collection1"] countWhere:nil args:nil], 101, @"collection1 count after reopen failed");
+    XCTAssertEqual([[store collectionWithName:@"collection2"] countWhere:nil args:nil], 51, @"collection2 count after reopen failed");
+    
+    [store close];
+}
+
+
+-(void)testExternalChanges
+{
+    self.store.detectExternalChanges = YES;
+    
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    [collection1 insertBatch:@[@{@"uid": @(1), @"name": @"One"}, @{@"uid": @(2), @"name": @"Two"}]];
+    
+    XCTAssertEqualObjects([collection1 findOneWhere:@"[uid] = ?" args:@[@(1)]][@"name"], @"One", @"find failed");
+    XCTAssertEqual([collection1 countWhere:nil args:nil], 2, @"count failed");
+    
+    // A second store on the same file has its own connections and caches, just like another process...
+    
+    NTJsonStore *otherStore = [[NTJsonStore alloc] initWithPath:self.store.storePath name:self.store.storeName];
+    otherStore.detectExternalChanges = YES;
+    
+    NTJsonCollection *otherCollection = [otherStore collectionWithName:@"collection1"];
+    
+    NSMutableDictionary *item = [[otherCollection findOneWhere:@"[uid] = ?" args:@[@(1)]] mutableCopy];
+    item[@"name"] = @"Uno";
+    
+    XCTAssertTrue([otherCollection update:item], @"external update failed");
+    XCTAssertTrue([otherCollection insert:@{@"uid": @(3), @"name": @"Three"}], @"external insert failed");
+    
+    [otherStore close];
+    
+    XCTAssertEqualObjects([collection1 findOneWhere:@"[uid] = ?" args:@[@(1)]][@"name"], @"Uno", @"stale item after external update");
+    XCTAssertEqual([collection1 countWhere:nil args:nil], 3, @"stale count after external insert");
+    
+    // ...and our own writes are still counted as usual...
+    
+    [collection1 insert:@{@"uid": @(4), @"name": @"Four"}];
+    
+    XCTAssertEqual([collection1 countWhere:nil args:nil], 4, @"count after insert failed");
+    
+    // ...and the statistics are recounted after an external change instead of loading what the other store saved...
+    
+    otherStore = [[NTJsonStore alloc] initWithPath:self.store.storePath name:self.store.storeName];
+    otherStore.detectExternalChanges = YES;
+    
+    XCTAssertTrue([[otherStore collectionWithName:@"collection1"] insert:@{@"uid": @(5), @"name": @"Five"}], @"external insert failed");
+    
+    XCTAssertEqual([collection1.statistics[@"rowCount"] longLongValue], 5, @"statistics not recounted after external insert");
+    XCTAssertEqual([collection1 countWhere:nil args:nil], 5, @"stale count after external insert");
+    
+    [otherStore close];
+}
+
+
+-(void)testUpdateFields
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    [collection1 addIndexWithKeys:@"[uid]"];
+    
+    NTJsonRowId rowid = [collection1 insert:@{@"uid": @(1), @"name": @"One", @"address": @{@"city": @"Boston", @"zip": @"02101"}}];
+    
+    XCTAssertTrue([collection1 updateFields:@{@"name": @"Uno", @"address": @{@"zip": [NSNull null]}} forRowId:rowid], @"updateFields failed");
+    
+    [collection1 flushCache];   // make sure we read what was written
+    
+    NSDictionary *item = [collection1 findOneWhere:@"[uid] = ?" args:@[@(1)]];
+    
+    XCTAssertEqualObjects(item[@"name"], @"Uno", @"field not updated");
+    XCTAssertEqualObjects(item[@"address"], @{@"city": @"Boston"}, @"field not merged");
+    
+    // changing a queryable field updates its column...
+    
+    XCTAssertTrue([collection1 updateFields:@{@"uid": @(2)} forRowId:rowid], @"updateFields failed");
+    XCTAssertEqual([collection1 countWhere:@"[uid] = ?" args:@[@(2)]], 1, @"column not updated");
+    
+    // ...and an update that changes nothing doesn't write at all...
+    
+    int64_t changes = [collection1.statistics[@"changesSinceAnalyze"] longLongValue];
+    
+    XCTAssertTrue([collection1 updateFields:@{@"name": @"Uno"} forRowId:rowid], @"updateFields failed");
+    XCTAssertEqual([collection1.statistics[@"changesSinceAnalyze"] longLongValue], changes, @"unchanged item was written");
+    
+    NSError *error;
+    
+    XCTAssertFalse([collection1 updateFields:@{@"name": @"None"} forRowId:rowid + 100 error:&error], @"missing item updated");
+    XCTAssertEqual(error.code, (NSInteger)NTJsonStoreErrorNotFound, @"wrong error for missing item");
+}
+
+
+-(void)testUpsertBatch
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    [collection1 addUniqueIndexWithKeys:@"[uid]"];
+    
+    NTJsonRowId rowid = [collection1 insert:@{@"uid": @(1), @"name": @"One"}];
+    
+    int insertedCount = 0, updatedCount = 0;
+    NSError *error;
+    
+    XCTAssertTrue([collection1 upsertBatch:@[@{@"uid": @(1), @"name": @"Uno"}, @{@"uid": @(2), @"name": @"Two"}] onKeys:@"[uid]" insertedCount:&insertedCount updatedCount:&updatedCount error:&error], @"upsertBatch failed: %@", error);
+    
+    XCTAssertEqual(insertedCount, 1, @"wrong inserted count");
+    XCTAssertEqual(updatedCount, 1, @"wrong updated count");
+    
+    // the existing item keeps its rowid...
+    
+    NSDictionary *item = [collection1 findOneWhere:@"[uid] = ?" args:@[@(1)]];
+    
+    XCTAssertEqualObjects(item[@"name"], @"Uno", @"item not updated");
+    XCTAssertEqual([item[@"__rowid__"] longLongValue], rowid, @"rowid changed");
+    XCTAssertEqual([collection1 countWhere:nil args:nil], 2, @"wrong item count");
+    
+    XCTAssertFalse([collection1 upsertBatch:@[@{@"uid": @(3)}] onKeys:@"[name]" insertedCount:NULL updatedCount:NULL error:&error], @"upsert without a unique index succeeded");
+    XCTAssertEqual(error.code, (NSInteger)NTJsonStoreErrorInvalidSqlArgument, @"wrong error for missing unique index");
+}
+
+
+-(void)testUpdateWhere
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    [collection1 addIndexWithKeys:@"[isRead]"];
+    
+    [collection1 insertBatch:@[@{@"uid": @(1), @"folder": @"inbox", @"isRead": @NO, @"flags": @{@"starred": @YES}},
+                               @{@"uid": @(2), @"folder": @"inbox", @"isRead": @NO},
+                               @{@"uid": @(3), @"folder": @"sent", @"isRead": @NO}]];
+    
+    [collection1 findOneWhere:@"[uid] = ?" args:@[@(1)]];   // cached
+    
+    XCTAssertEqual([collection1 updateWhere:@"[folder] = ?" args:@[@"inbox"] set:@{@"isRead": @YES, @"flags": @{@"seen": @YES}}], 2, @"updateWhere failed");
+    
+    // the queryable field is updated and the cached item is replaced...
+    
+    XCTAssertEqual([collection1 countWhere:@"[isRead] = ?" args:@[@YES]], 2, @"column not updated");
+    
+    NSDictionary *item = [collection1 findOneWhere:@"[uid] = ?" args:@[@(1)]];
+    
+    XCTAssertEqualObjects(item[@"isRead"], @YES, @"stale item returned from cache");
+    XCTAssertEqualObjects(item[@"flags"], (@{@"starred": @YES, @"seen": @YES}), @"fields not merged");
+    
+    XCTAssertEqual([collection1 updateWhere:@"[folder] = ?" args:@[@"drafts"] set:@{@"isRead": @YES}], 0, @"updated missing items");
+}
+
+
+-(void)testUpdateWhereBinaryRollback
+{
+    NTJsonCollection *collection1 = [self.store collectionWithName:@"collection1"];
+    
+    collection1.documentFormat = NTJsonDocumentFormatBinary;    // patched one row at a time
+    collection1.changeDeliveryInterval = 0;
+    
+    [collection1 addUniqueIndexWithKeys:@"[code]"];
+    
+    [collection1 insertBatch:@[@{@"uid": @(1), @"code": @(1)},
+                               @{@"uid": @(2), @"code": @(2)},
+                               @{@"uid": @(3), @"code": @(3)}]];
+    
+    [collection1 findOneWhere:@"[uid] = ?" args:@[@(1)]];   // cached
+    XCTAssertNotNil([collection1 findOneWhere:@"[code] = ?" args:@[@(1)]], @"unique key lookup failed");
+    
+    dispatch_queue_t queue = dispatch_queue_create("testUpdateWhereBinaryRollback", DISPATCH_QUEUE_SERIAL);
+    __block NSMutableArray *allChanges = [NSMutableArray array];
+    
+    id observer = [collection1 addChangeObserverWithQueue:queue handler:^(NTJsonChanges *changes) {
+        [allChanges addObject:changes];
+    }];
+    
+    // the first row is written, the second conflicts with it...
+    
+    NSError *error;
+    
+    XCTAssertEqual([collection1 updateWhere:@"[uid] > ?" args:@[@0] set:@{@"code": @(10)} error:&error], -1, @"conflicting updateWhere succeeded");
+    XCTAssertNotNil(error, @"error not set");
+    
+    [collection1 sync];
+    dispatch_sync(queue, ^{ });
+    
+    XCTAssertEqualObjects([collection1 findOneWhere:@"[uid] = ?" args:@[@(1)]][@"code"], @(1), @"rolled back item returned from the cache");
+    XCTAssertNil([collection1 findOneWhere:@"[code] = ?" args:@[@(10)]], @"rolled back unique key found");
+    XCTAssertEqualObjects([collection1 findOneWhere:@"[code] = ?" args:@[@(1)]][@"uid"], @(1), @"unique key lost in the rollback");
+    XCTAssertEqual([collection1 countWhere:@"[code] = ?" args:@[@(10)]], 0, @"rolled back count returned");
+    XCTAssertEqual(allChanges.count, 0, @"rolled back changes delivered");
+    
+    [collection1 removeChangeObserver:observer];
+}
+
+
 @end